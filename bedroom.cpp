@@ -14,1460 +14,7634 @@
 // This line silences deprecation warnings for OpenGL, as some functions may be deprecated in newer versions
 #define GL_SILENCE_DEPRECATION
 
+// Declare the buffer object entry points (OpenGL 1.5+) along with the core ones
+#define GL_GLEXT_PROTOTYPES
+
 // Include the appropriate header file for GLUT based on the platform
 #ifdef __APPLE_CC__
 #include <GLUT/glut.h> // For macOS
 #else
 #include <GL/glut.h> // For other platforms
+#ifdef FREEGLUT
+#include <GL/freeglut_ext.h> // glutSetOption, to choose the number of samples
+#endif
 #endif
 
 #include <stdlib.h> // Standard C library
 #include "SOIL.h" // SOIL image loading library
 #include <stdio.h> // Standard C I/O library
 #include <iostream> // Standard C++ I/O library
+#include <math.h> // Standard C math library
+#include <vector> // Standard C++ dynamic arrays
+#include <algorithm> // Standard C++ sorting
+#include <string.h> // memcmp, memcpy
+#include <stddef.h> // offsetof
+#include <random> // Seeded generator for the building layouts
+#include <chrono> // Frame timing for the benchmark
+#include <time.h> // Wall-clock time for the clock hands
+#include <sys/stat.h> // File modification times for the scene edit file
+#include <thread> // Worker threads of the job system
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <new> // Replaceable operator new, counted for the benchmark
+#include <map> // Live GPU objects by name
+#include "render_server.h" // --serve: render requests from a local socket
+#ifndef __APPLE_CC__
+#include <EGL/egl.h> // GL context of the render server, made without a display
+#include <EGL/eglext.h>
+#endif
 
 // Global variables for flagging various states and window dimensions
-GLboolean redFlag = true, switchOne = false, switchTwo = false, switchLamp = false,
+GLboolean switchOne = false, switchTwo = false, switchLamp = false,
     amb1 = true, diff1 = true, spec1 = true, amb2 = true, diff2 = true, spec2 = true,
     amb3 = true, diff3 = true, spec3 = true;
 double windowHeight = 800, windowWidth = 600;
 double eyeX = 7.0, eyeY = 2.0, eyeZ = 15.0, refX = 0, refY = 0, refZ = 0;
-double theta = 180.0, y = 1.36, z = 7.97888;
+GLboolean useBakedGeometry = true; // Draw the preprocessed meshes (true) or the immediate-mode reference path
+
+// Matrix library ***********************************************************
+//
+// Small vector/matrix helpers used to compute object placements on the CPU.
+// Matrices are column-major, exactly as glLoadMatrixf expects them. The hot
+// operations use SSE when the compiler targets it (every x86-64 build does),
+// with a plain scalar fallback for other targets.
+
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define BEDROOM_SSE 1
+#include <xmmintrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BEDROOM_SSE2 1
+#include <emmintrin.h>
+#endif
 
-// Function to load an image file as an OpenGL texture
-GLuint loadTexture(const char* filename)
+struct Vec3
 {
-    // Use SOIL to load the image into an OpenGL texture
-    GLuint texture = SOIL_load_OGL_texture(filename, SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_INVERT_Y);
-    
-    // Check if loading was successful
-    if (texture == 0)
-        std::cerr << "SOIL loading error: " << SOIL_last_result() << std::endl;
-    // std::cout << texture << std::endl; // Output the texture ID for debugging
-    return texture; // Return the texture ID
-}
-
+    GLfloat x, y, z;
+};
 
-static GLfloat v_cube[8][3] =
+struct Mat4
 {
-    {0.0, 0.0, 0.0}, // Vertex 0
-    {0.0, 0.0, 3.0}, // Vertex 1
-    {3.0, 0.0, 3.0}, // Vertex 2
-    {3.0, 0.0, 0.0}, // Vertex 3
-    {0.0, 3.0, 0.0}, // Vertex 4
-    {0.0, 3.0, 3.0}, // Vertex 5
-    {3.0, 3.0, 3.0}, // Vertex 6
-    {3.0, 3.0, 0.0}  // Vertex 7
+    GLfloat m[16];
 };
 
-static GLubyte quadIndices[6][4] =
+Vec3 vec3(GLfloat x, GLfloat y, GLfloat z)
 {
-    {0, 1, 2, 3}, // Bottom face indices
-    {4, 5, 6, 7}, // Top face indices
-    {5, 1, 2, 6}, // Front face indices
-    {0, 4, 7, 3}, // Back face indices (specified in clockwise order)
-    {2, 3, 7, 6}, // Right face indices
-    {1, 5, 4, 0}  // Left face indices (specified in clockwise order)
-};
+    Vec3 v = { x, y, z };
+    return v;
+}
 
-// Function to calculate and set the normal vector for a triangle given three points
-static void getNormal3p
-(GLfloat x1, GLfloat y1, GLfloat z1, GLfloat x2, GLfloat y2, GLfloat z2, GLfloat x3, GLfloat y3, GLfloat z3)
+Mat4 mat4Identity()
 {
-    // Calculate vectors U and V
-    GLfloat Ux, Uy, Uz, Vx, Vy, Vz, Nx, Ny, Nz;
-    Ux = x2 - x1;
-    Uy = y2 - y1;
-    Uz = z2 - z1;
-    Vx = x3 - x1;
-    Vy = y3 - y1;
-    Vz = z3 - z1;
+    Mat4 r = { { 1, 0, 0, 0,  0, 1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1 } };
+    return r;
+}
 
-    // Calculate the cross product of U and V to get the normal vector
-    Nx = Uy * Vz - Uz * Vy;
-    Ny = Uz * Vx - Ux * Vz;
-    Nz = Ux * Vy - Uy * Vx;
+// Same matrix as glTranslatef
+Mat4 mat4Translate(GLfloat x, GLfloat y, GLfloat z)
+{
+    Mat4 r = mat4Identity();
+    r.m[12] = x; r.m[13] = y; r.m[14] = z;
+    return r;
+}
 
-    // Set the normal vector
-    glNormal3f(Nx, Ny, Nz);
+// Same matrix as glScalef
+Mat4 mat4Scale(GLfloat x, GLfloat y, GLfloat z)
+{
+    Mat4 r = mat4Identity();
+    r.m[0] = x; r.m[5] = y; r.m[10] = z;
+    return r;
 }
 
-// Function to draw a cube using GL_QUADS
-void drawCube()
+// Same matrix as glRotatef: angle in degrees about the axis (x, y, z)
+Mat4 mat4Rotate(GLfloat angle, GLfloat x, GLfloat y, GLfloat z)
 {
-    glBegin(GL_QUADS);
-    for (GLint i = 0; i < 6; i++)
+    GLfloat len = sqrtf(x * x + y * y + z * z);
+    if (len == 0)
+        return mat4Identity();
+    x /= len; y /= len; z /= len;
+
+    GLfloat rad = angle * 3.14159265f / 180.0f;
+    GLfloat c = cosf(rad), s = sinf(rad), t = 1 - c;
+
+    Mat4 r = mat4Identity();
+    r.m[0] = x * x * t + c;     r.m[4] = x * y * t - z * s; r.m[8]  = x * z * t + y * s;
+    r.m[1] = y * x * t + z * s; r.m[5] = y * y * t + c;     r.m[9]  = y * z * t - x * s;
+    r.m[2] = x * z * t - y * s; r.m[6] = y * z * t + x * s; r.m[10] = z * z * t + c;
+    return r;
+}
+
+// Function to multiply two matrices (a * b), four columns at a time
+Mat4 mat4Mul(const Mat4& a, const Mat4& b)
+{
+    Mat4 r;
+#ifdef BEDROOM_SSE
+    __m128 a0 = _mm_loadu_ps(&a.m[0]);
+    __m128 a1 = _mm_loadu_ps(&a.m[4]);
+    __m128 a2 = _mm_loadu_ps(&a.m[8]);
+    __m128 a3 = _mm_loadu_ps(&a.m[12]);
+    for (int j = 0; j < 4; j++)
     {
-        // Calculate the normal vector for the current quad face
-        getNormal3p(v_cube[quadIndices[i][0]][0], v_cube[quadIndices[i][0]][1], v_cube[quadIndices[i][0]][2],
-                    v_cube[quadIndices[i][1]][0], v_cube[quadIndices[i][1]][1], v_cube[quadIndices[i][1]][2],
-                    v_cube[quadIndices[i][2]][0], v_cube[quadIndices[i][2]][1], v_cube[quadIndices[i][2]][2]);
-        
-        // Specify vertices of the quad face
-        glVertex3fv(&v_cube[quadIndices[i][0]][0]);
-        glVertex3fv(&v_cube[quadIndices[i][1]][0]);
-        glVertex3fv(&v_cube[quadIndices[i][2]][0]);
-        glVertex3fv(&v_cube[quadIndices[i][3]][0]);
+        __m128 col = _mm_mul_ps(a0, _mm_set1_ps(b.m[j * 4 + 0]));
+        col = _mm_add_ps(col, _mm_mul_ps(a1, _mm_set1_ps(b.m[j * 4 + 1])));
+        col = _mm_add_ps(col, _mm_mul_ps(a2, _mm_set1_ps(b.m[j * 4 + 2])));
+        col = _mm_add_ps(col, _mm_mul_ps(a3, _mm_set1_ps(b.m[j * 4 + 3])));
+        _mm_storeu_ps(&r.m[j * 4], col);
     }
-    glEnd();
+#else
+    for (int j = 0; j < 4; j++)
+        for (int i = 0; i < 4; i++)
+            r.m[j * 4 + i] = a.m[i] * b.m[j * 4] + a.m[4 + i] * b.m[j * 4 + 1]
+                           + a.m[8 + i] * b.m[j * 4 + 2] + a.m[12 + i] * b.m[j * 4 + 3];
+#endif
+    return r;
 }
 
+// Function to transform a point (w = 1) by a matrix
+Vec3 mat4TransformPoint(const Mat4& a, const Vec3& p)
+{
+#ifdef BEDROOM_SSE
+    __m128 r = _mm_loadu_ps(&a.m[12]);
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&a.m[0]), _mm_set1_ps(p.x)));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&a.m[4]), _mm_set1_ps(p.y)));
+    r = _mm_add_ps(r, _mm_mul_ps(_mm_loadu_ps(&a.m[8]), _mm_set1_ps(p.z)));
+    GLfloat out[4];
+    _mm_storeu_ps(out, r);
+    return vec3(out[0], out[1], out[2]);
+#else
+    return vec3(a.m[0] * p.x + a.m[4] * p.y + a.m[8] * p.z + a.m[12],
+                a.m[1] * p.x + a.m[5] * p.y + a.m[9] * p.z + a.m[13],
+                a.m[2] * p.x + a.m[6] * p.y + a.m[10] * p.z + a.m[14]);
+#endif
+}
 
-// Function to draw a cube with customizable material properties
-void drawCube1(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX = 0, GLfloat ambY = 0, GLfloat ambZ = 0, GLfloat shine = 50)
+// Function to transform a direction (w = 0) by a matrix
+Vec3 mat4TransformVector(const Mat4& a, const Vec3& v)
 {
-    // Define material properties for the cube
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_shininess[] = { shine };
+    return vec3(a.m[0] * v.x + a.m[4] * v.y + a.m[8] * v.z,
+                a.m[1] * v.x + a.m[5] * v.y + a.m[9] * v.z,
+                a.m[2] * v.x + a.m[6] * v.y + a.m[10] * v.z);
+}
 
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-    glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+// Function to invert a general matrix by cofactors; singular matrices give the identity
+Mat4 mat4Inverse(const Mat4& a)
+{
+    const GLfloat* m = a.m;
+    GLfloat inv[16];
+    inv[0] = m[5] * m[10] * m[15] - m[5] * m[11] * m[14] - m[9] * m[6] * m[15] + m[9] * m[7] * m[14] + m[13] * m[6] * m[11] - m[13] * m[7] * m[10];
+    inv[4] = -m[4] * m[10] * m[15] + m[4] * m[11] * m[14] + m[8] * m[6] * m[15] - m[8] * m[7] * m[14] - m[12] * m[6] * m[11] + m[12] * m[7] * m[10];
+    inv[8] = m[4] * m[9] * m[15] - m[4] * m[11] * m[13] - m[8] * m[5] * m[15] + m[8] * m[7] * m[13] + m[12] * m[5] * m[11] - m[12] * m[7] * m[9];
+    inv[12] = -m[4] * m[9] * m[14] + m[4] * m[10] * m[13] + m[8] * m[5] * m[14] - m[8] * m[6] * m[13] - m[12] * m[5] * m[10] + m[12] * m[6] * m[9];
+    inv[1] = -m[1] * m[10] * m[15] + m[1] * m[11] * m[14] + m[9] * m[2] * m[15] - m[9] * m[3] * m[14] - m[13] * m[2] * m[11] + m[13] * m[3] * m[10];
+    inv[5] = m[0] * m[10] * m[15] - m[0] * m[11] * m[14] - m[8] * m[2] * m[15] + m[8] * m[3] * m[14] + m[12] * m[2] * m[11] - m[12] * m[3] * m[10];
+    inv[9] = -m[0] * m[9] * m[15] + m[0] * m[11] * m[13] + m[8] * m[1] * m[15] - m[8] * m[3] * m[13] - m[12] * m[1] * m[11] + m[12] * m[3] * m[9];
+    inv[13] = m[0] * m[9] * m[14] - m[0] * m[10] * m[13] - m[8] * m[1] * m[14] + m[8] * m[2] * m[13] + m[12] * m[1] * m[10] - m[12] * m[2] * m[9];
+    inv[2] = m[1] * m[6] * m[15] - m[1] * m[7] * m[14] - m[5] * m[2] * m[15] + m[5] * m[3] * m[14] + m[13] * m[2] * m[7] - m[13] * m[3] * m[6];
+    inv[6] = -m[0] * m[6] * m[15] + m[0] * m[7] * m[14] + m[4] * m[2] * m[15] - m[4] * m[3] * m[14] - m[12] * m[2] * m[7] + m[12] * m[3] * m[6];
+    inv[10] = m[0] * m[5] * m[15] - m[0] * m[7] * m[13] - m[4] * m[1] * m[15] + m[4] * m[3] * m[13] + m[12] * m[1] * m[7] - m[12] * m[3] * m[5];
+    inv[14] = -m[0] * m[5] * m[14] + m[0] * m[6] * m[13] + m[4] * m[1] * m[14] - m[4] * m[2] * m[13] - m[12] * m[1] * m[6] + m[12] * m[2] * m[5];
+    inv[3] = -m[1] * m[6] * m[11] + m[1] * m[7] * m[10] + m[5] * m[2] * m[11] - m[5] * m[3] * m[10] - m[9] * m[2] * m[7] + m[9] * m[3] * m[6];
+    inv[7] = m[0] * m[6] * m[11] - m[0] * m[7] * m[10] - m[4] * m[2] * m[11] + m[4] * m[3] * m[10] + m[8] * m[2] * m[7] - m[8] * m[3] * m[6];
+    inv[11] = -m[0] * m[5] * m[11] + m[0] * m[7] * m[9] + m[4] * m[1] * m[11] - m[4] * m[3] * m[9] - m[8] * m[1] * m[7] + m[8] * m[3] * m[5];
+    inv[15] = m[0] * m[5] * m[10] - m[0] * m[6] * m[9] - m[4] * m[1] * m[10] + m[4] * m[2] * m[9] + m[8] * m[1] * m[6] - m[8] * m[2] * m[5];
+
+    GLfloat det = m[0] * inv[0] + m[1] * inv[4] + m[2] * inv[8] + m[3] * inv[12];
+    if (det == 0)
+        return mat4Identity();
+    Mat4 r;
+    for (int i = 0; i < 16; i++)
+        r.m[i] = inv[i] / det;
+    return r;
+}
 
-    // Draw the cube using GL_QUADS
-    glBegin(GL_QUADS);
-    for (GLint i = 0; i < 6; i++)
-    {
-        // Calculate and set the normal vector for the current quad face
-        getNormal3p(v_cube[quadIndices[i][0]][0], v_cube[quadIndices[i][0]][1], v_cube[quadIndices[i][0]][2],
-            v_cube[quadIndices[i][1]][0], v_cube[quadIndices[i][1]][1], v_cube[quadIndices[i][1]][2],
-            v_cube[quadIndices[i][2]][0], v_cube[quadIndices[i][2]][1], v_cube[quadIndices[i][2]][2]);
+// Function to transform a normal: multiplies by the cofactor matrix of the upper 3x3,
+// which is the inverse transpose up to a positive scale for the placements used here
+Vec3 mat4TransformNormal(const Mat4& a, const Vec3& n)
+{
+    const GLfloat* m = a.m;
+    GLfloat c00 = m[5] * m[10] - m[6] * m[9], c01 = m[6] * m[8] - m[4] * m[10], c02 = m[4] * m[9] - m[5] * m[8];
+    GLfloat c10 = m[9] * m[2] - m[10] * m[1], c11 = m[10] * m[0] - m[8] * m[2], c12 = m[8] * m[1] - m[9] * m[0];
+    GLfloat c20 = m[1] * m[6] - m[2] * m[5], c21 = m[2] * m[4] - m[0] * m[6], c22 = m[0] * m[5] - m[1] * m[4];
+    return vec3(c00 * n.x + c01 * n.y + c02 * n.z,
+                c10 * n.x + c11 * n.y + c12 * n.z,
+                c20 * n.x + c21 * n.y + c22 * n.z);
+}
 
-        // Specify vertices of the quad face
-        glVertex3fv(&v_cube[quadIndices[i][0]][0]);
-        glVertex3fv(&v_cube[quadIndices[i][1]][0]);
-        glVertex3fv(&v_cube[quadIndices[i][2]][0]);
-        glVertex3fv(&v_cube[quadIndices[i][3]][0]);
-    }
-    glEnd();
+// Function to scale a vector to unit length (zero vectors are returned unchanged)
+Vec3 vec3Normalize(const Vec3& v)
+{
+    GLfloat len = sqrtf(v.x * v.x + v.y * v.y + v.z * v.z);
+    if (len == 0)
+        return v;
+    return vec3(v.x / len, v.y / len, v.z / len);
 }
 
-// Function to draw a carpet with customizable material properties and texture
-void drawCarpet(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX = 0, GLfloat ambY = 0, GLfloat ambZ = 0, GLfloat shine = 50)
+Vec3 vec3Sub(const Vec3& a, const Vec3& b)
 {
-    // Push the current matrix onto the stack and save current state
-    glPushMatrix();
-    glPushAttrib(GL_ALL_ATTRIB_BITS);
+    return vec3(a.x - b.x, a.y - b.y, a.z - b.z);
+}
 
-    // Load and enable the texture for the carpet
-    GLuint texture = loadTexture("image.png");
-    glEnable(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, texture);
+GLfloat vec3Dot(const Vec3& a, const Vec3& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
 
-    // Define material properties for the carpet
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_shininess[] = { shine };
+Vec3 vec3Cross(const Vec3& a, const Vec3& b)
+{
+    return vec3(a.y * b.z - a.z * b.y, a.z * b.x - a.x * b.z, a.x * b.y - a.y * b.x);
+}
 
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-    glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+// Same matrix as gluPerspective
+Mat4 mat4Perspective(GLfloat fovy, GLfloat aspect, GLfloat zNear, GLfloat zFar)
+{
+    GLfloat f = 1.0f / tanf(fovy * 0.5f * 3.14159265f / 180.0f);
+    Mat4 r = mat4Identity();
+    r.m[0] = f / aspect;
+    r.m[5] = f;
+    r.m[10] = (zFar + zNear) / (zNear - zFar);
+    r.m[11] = -1;
+    r.m[14] = 2 * zFar * zNear / (zNear - zFar);
+    r.m[15] = 0;
+    return r;
+}
 
-    // Draw the carpet using GL_QUADS
-    glBegin(GL_QUADS);
-    for (GLint i = 0; i < 6; i++)
-    {
-        // Calculate and set the normal vector for the current quad face
-        getNormal3p(v_cube[quadIndices[i][0]][0], v_cube[quadIndices[i][0]][1], v_cube[quadIndices[i][0]][2],
-            v_cube[quadIndices[i][1]][0], v_cube[quadIndices[i][1]][1], v_cube[quadIndices[i][1]][2],
-            v_cube[quadIndices[i][2]][0], v_cube[quadIndices[i][2]][1], v_cube[quadIndices[i][2]][2]);
+// Same matrix as gluLookAt
+Mat4 mat4LookAt(GLfloat eyeX, GLfloat eyeY, GLfloat eyeZ, GLfloat refX, GLfloat refY, GLfloat refZ,
+                GLfloat upX, GLfloat upY, GLfloat upZ)
+{
+    GLfloat fx = refX - eyeX, fy = refY - eyeY, fz = refZ - eyeZ;
+    GLfloat fl = sqrtf(fx * fx + fy * fy + fz * fz);
+    if (fl == 0)
+        fl = 1;
+    fx /= fl; fy /= fl; fz /= fl;
+
+    // side = forward x up
+    GLfloat sx = fy * upZ - fz * upY, sy = fz * upX - fx * upZ, sz = fx * upY - fy * upX;
+    GLfloat sl = sqrtf(sx * sx + sy * sy + sz * sz);
+    if (sl == 0)
+        sl = 1;
+    sx /= sl; sy /= sl; sz /= sl;
+
+    // recomputed up = side x forward
+    GLfloat ux = sy * fz - sz * fy, uy = sz * fx - sx * fz, uz = sx * fy - sy * fx;
+
+    Mat4 r = mat4Identity();
+    r.m[0] = sx; r.m[4] = sy; r.m[8]  = sz;
+    r.m[1] = ux; r.m[5] = uy; r.m[9]  = uz;
+    r.m[2] = -fx; r.m[6] = -fy; r.m[10] = -fz;
+    return mat4Mul(r, mat4Translate(-eyeX, -eyeY, -eyeZ));
+}
 
-        // Specify vertices of the quad face with texture coordinates
-        glTexCoord2f(0.0f, 0.0f); glVertex3fv(&v_cube[quadIndices[i][0]][0]);
-        glTexCoord2f(1.0f, 0.0f); glVertex3fv(&v_cube[quadIndices[i][1]][0]);
-        glTexCoord2f(1.0f, 1.0f); glVertex3fv(&v_cube[quadIndices[i][2]][0]);
-        glTexCoord2f(0.0f, 1.0f); glVertex3fv(&v_cube[quadIndices[i][3]][0]);
-    }
-    glEnd();
+// Placement of an object: translate, then scale (the glTranslatef/glScalef pair used throughout)
+Mat4 place(GLfloat tx, GLfloat ty, GLfloat tz, GLfloat sx, GLfloat sy, GLfloat sz)
+{
+    Mat4 r = mat4Scale(sx, sy, sz);
+    r.m[12] = tx; r.m[13] = ty; r.m[14] = tz;
+    return r;
+}
 
-    // Disable texture and restore previous state
-    glDisable(GL_TEXTURE_2D);
-    glPopAttrib();
-    glPopMatrix();
+// Placement of an object with a rotation between the translation and the scale
+Mat4 placeRotated(GLfloat tx, GLfloat ty, GLfloat tz, GLfloat angle, GLfloat ax, GLfloat ay, GLfloat az,
+                  GLfloat sx, GLfloat sy, GLfloat sz)
+{
+    return mat4Mul(mat4Translate(tx, ty, tz), mat4Mul(mat4Rotate(angle, ax, ay, az), mat4Scale(sx, sy, sz)));
 }
 
-// Definition of vertices for a trapezoid
-static GLfloat v_trapezoid[8][3] =
+// Job system ***************************************************************
+//
+// A small work-stealing scheduler. Every thread, the GLUT thread included,
+// owns a deque of ready jobs: it pushes and pops its own work at the back and,
+// when that runs dry, steals the oldest job from another thread's deque. Each
+// job counts the dependencies it still waits for, and finishing a job releases
+// the dependants whose count reaches zero. A task graph is built completely
+// (jobCreate, jobDependsOn) before any of it is submitted. Jobs come from a
+// pool that grows in chunks as graphs need more and is recycled once all of
+// them have finished.
+
+static const int MAX_JOB_THREADS = 8;
+static const int JOB_POOL_CHUNK = 256;
+static const int MAX_JOB_DEPENDANTS = 32;
+
+struct Job
 {
-    {0.0, 0.0, 0.0}, //0
-    {0.0, 0.0, 3.0}, //1
-    {3.0, 0.0, 3.0}, //2
-    {3.0, 0.0, 0.0}, //3
-    {0.5, 3.0, 0.5}, //4
-    {0.5, 3.0, 2.5}, //5
-    {2.5, 3.0, 2.5}, //6
-    {2.5, 3.0, 0.5}  //7
+    void (*run)(int index);
+    int index;                          // Passed to run, e.g. which group or image to work on
+    std::atomic<int> pending;           // Unfinished dependencies, plus one until submitted
+    std::atomic<bool> done;
+    struct Job* dependants[MAX_JOB_DEPENDANTS];
+    int dependantCount;
 };
 
-// Definition of quad indices for a trapezoid
-static GLubyte TquadIndices[6][4] =
+// Ring of ready jobs, grown when full; the owner uses the back, thieves the front
+struct JobQueue
 {
-    {0, 1, 2, 3}, // Bottom face indices
-    {4, 5, 6, 7}, // Top face indices
-    {5, 1, 2, 6}, // Front face indices
-    {0, 4, 7, 3}, // Back face indices (specified in clockwise order)
-    {2, 3, 7, 6}, // Right face indices
-    {1, 5, 4, 0}  // Left face indices (specified in clockwise order)
+    std::mutex lock;
+    std::vector<Job*> jobs;
+    int head, count;
 };
 
-// Function to draw a trapezoid with customizable material properties
-void drawTrapezoid(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine = 50)
+std::vector<Job*> jobPoolChunks;    // Chunks of JOB_POOL_CHUNK jobs; they never move once allocated
+int jobsCreated = 0;
+std::atomic<int> jobsInFlight(0);   // Created and not yet finished
+JobQueue jobQueues[MAX_JOB_THREADS + 1];
+int jobThreadCount = -1;            // Workers besides the GLUT thread; -1 picks one per spare core
+std::vector<std::thread> jobThreads;
+int jobQueueCount = 1;              // Threads taking part, the GLUT thread included
+std::mutex jobSleepLock;
+std::condition_variable jobWake;
+std::atomic<int> jobsQueued(0);
+std::atomic<bool> jobStop(false);
+thread_local int jobThreadIndex = 0; // 0 is the GLUT thread
+
+// Function to take a job from the pool; it runs once submitted and its dependencies are done
+Job* jobCreate(void (*run)(int), int index)
 {
-    // Define material properties for the trapezoid
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_emission[] = { difX, difY, difZ, 0.0 };
-    GLfloat mat_shininess[] = { shine };
+    if (jobsCreated == (int)jobPoolChunks.size() * JOB_POOL_CHUNK)
+        jobPoolChunks.push_back(new Job[JOB_POOL_CHUNK]);
+    Job* job = &jobPoolChunks[jobsCreated / JOB_POOL_CHUNK][jobsCreated % JOB_POOL_CHUNK];
+    jobsCreated++;
+    job->run = run;
+    job->index = index;
+    job->pending = 1;
+    job->done = false;
+    job->dependantCount = 0;
+    jobsInFlight++;
+    return job;
+}
 
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+static void jobRelay(int)
+{
+}
 
-    // If the switchLamp flag is true, set emission material property
-    if (switchLamp == true) {
-        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
+// Function to make job wait for dependency; both must still be unsubmitted. A dependency whose
+// dependants no longer fit hands the rest on through a job that does nothing.
+void jobDependsOn(Job* job, Job* dependency)
+{
+    if (dependency->dependantCount == MAX_JOB_DEPENDANTS - 1)
+    {
+        // The relay is never submitted: the one count it starts with is released by dependency
+        Job* relay = jobCreate(jobRelay, 0);
+        dependency->dependants[dependency->dependantCount++] = relay;
     }
-    else {
-        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    if (dependency->dependantCount == MAX_JOB_DEPENDANTS)
+    {
+        jobDependsOn(job, dependency->dependants[MAX_JOB_DEPENDANTS - 1]);
+        return;
     }
+    job->pending++;
+    dependency->dependants[dependency->dependantCount++] = job;
+}
 
-    // Draw the trapezoid using GL_QUADS
-    glBegin(GL_QUADS);
-    for (GLint i = 0; i < 6; i++)
+static void jobPush(Job* job)
+{
+    JobQueue& q = jobQueues[jobThreadIndex];
     {
-        // Calculate and set the normal vector for the current quad face
-        getNormal3p(v_trapezoid[TquadIndices[i][0]][0], v_trapezoid[TquadIndices[i][0]][1], v_trapezoid[TquadIndices[i][0]][2],
-            v_trapezoid[TquadIndices[i][1]][0], v_trapezoid[TquadIndices[i][1]][1], v_trapezoid[TquadIndices[i][1]][2],
-            v_trapezoid[TquadIndices[i][2]][0], v_trapezoid[TquadIndices[i][2]][1], v_trapezoid[TquadIndices[i][2]][2]);
-
-        // Specify vertices of the quad face
-        glVertex3fv(&v_trapezoid[TquadIndices[i][0]][0]);
-        glVertex3fv(&v_trapezoid[TquadIndices[i][1]][0]);
-        glVertex3fv(&v_trapezoid[TquadIndices[i][2]][0]);
-        glVertex3fv(&v_trapezoid[TquadIndices[i][3]][0]);
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.count == (int)q.jobs.size())
+        {
+            std::vector<Job*> grown(std::max<size_t>(64, q.jobs.size() * 2));
+            for (int i = 0; i < q.count; i++)
+                grown[i] = q.jobs[(q.head + i) % q.jobs.size()];
+            q.jobs.swap(grown);
+            q.head = 0;
+        }
+        q.jobs[(q.head + q.count) % q.jobs.size()] = job;
+        q.count++;
     }
-    glEnd();
+    jobsQueued++;
+    std::lock_guard<std::mutex> guard(jobSleepLock);
+    jobWake.notify_one();
 }
 
+// Function to take a ready job: the newest of this thread's own, else the oldest of another's
+static Job* jobTake()
+{
+    for (int i = 0; i < jobQueueCount; i++)
+    {
+        int victim = (jobThreadIndex + i) % jobQueueCount;
+        JobQueue& q = jobQueues[victim];
+        std::lock_guard<std::mutex> guard(q.lock);
+        if (q.count == 0)
+            continue;
+        Job* job;
+        if (i == 0)
+            job = q.jobs[(q.head + q.count - 1) % q.jobs.size()];
+        else
+        {
+            job = q.jobs[q.head];
+            q.head = (q.head + 1) % q.jobs.size();
+        }
+        q.count--;
+        jobsQueued--;
+        return job;
+    }
+    return NULL;
+}
 
-
-// Definition of vertices for a pyramid
-static GLfloat v_pyramid[5][3] =
+static void jobRun(Job* job)
 {
-    {0.0, 0.0, 0.0}, // Vertex 0
-    {0.0, 0.0, 2.0}, // Vertex 1
-    {2.0, 0.0, 2.0}, // Vertex 2
-    {2.0, 0.0, 0.0}, // Vertex 3
-    {1.0, 4.0, 1.0}  // Vertex 4 (apex)
-};
+    job->run(job->index);
+    for (int i = 0; i < job->dependantCount; i++)
+        if (--job->dependants[i]->pending == 0)
+            jobPush(job->dependants[i]);
+    job->done = true;
+    jobsInFlight--;
+}
 
-// Definition of triangle indices for the pyramid's faces
-static GLubyte p_Indices[4][3] =
+// Function to release a job to the scheduler
+void jobSubmit(Job* job)
 {
-    {4, 1, 2}, // Front face indices
-    {4, 2, 3}, // Right face indices
-    {4, 3, 0}, // Back face indices
-    {4, 0, 1}  // Left face indices
-};
+    if (--job->pending == 0)
+        jobPush(job);
+}
 
-// Definition of quad indices for the base of the pyramid
-static GLubyte PquadIndices[1][4] =
+// Function to run jobs on this thread until the given one has finished
+void jobWait(Job* job)
 {
-    {0, 3, 2, 1} // Base indices
-};
+    while (!job->done)
+    {
+        Job* next = jobTake();
+        if (next)
+            jobRun(next);
+        else
+            std::this_thread::yield();
+    }
+}
 
-// Function to draw a pyramid with customizable material properties
-void drawpyramid(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+// Function to run jobs until every created job has finished, then recycle the pool
+void jobWaitAll()
 {
-    // Define material properties for the pyramid
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_shininess[] = { shine };
-
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-
-    // Draw the triangular faces of the pyramid
-    glBegin(GL_TRIANGLES);
-    for (GLint i = 0; i < 4; i++)
+    while (jobsInFlight > 0)
     {
-        // Calculate and set the normal vector for the current triangle face
-        getNormal3p(v_pyramid[p_Indices[i][0]][0], v_pyramid[p_Indices[i][0]][1], v_pyramid[p_Indices[i][0]][2],
-            v_pyramid[p_Indices[i][1]][0], v_pyramid[p_Indices[i][1]][1], v_pyramid[p_Indices[i][1]][2],
-            v_pyramid[p_Indices[i][2]][0], v_pyramid[p_Indices[i][2]][1], v_pyramid[p_Indices[i][2]][2]);
-
-        // Specify vertices of the current triangle face
-        glVertex3fv(&v_pyramid[p_Indices[i][0]][0]);
-        glVertex3fv(&v_pyramid[p_Indices[i][1]][0]);
-        glVertex3fv(&v_pyramid[p_Indices[i][2]][0]);
+        Job* next = jobTake();
+        if (next)
+            jobRun(next);
+        else
+            std::this_thread::yield();
     }
-    glEnd();
+    jobsCreated = 0;
+}
 
-    // Draw the base of the pyramid
-    glBegin(GL_QUADS);
-    for (GLint i = 0; i < 1; i++)
+static void jobWorker(int index)
+{
+    jobThreadIndex = index;
+    while (!jobStop)
     {
-        // Calculate and set the normal vector for the base quad
-        getNormal3p(v_pyramid[PquadIndices[i][0]][0], v_pyramid[PquadIndices[i][0]][1], v_pyramid[PquadIndices[i][0]][2],
-            v_pyramid[PquadIndices[i][1]][0], v_pyramid[PquadIndices[i][1]][1], v_pyramid[PquadIndices[i][1]][2],
-            v_pyramid[PquadIndices[i][2]][0], v_pyramid[PquadIndices[i][2]][1], v_pyramid[PquadIndices[i][2]][2]);
-
-        // Specify vertices of the base quad
-        glVertex3fv(&v_pyramid[PquadIndices[i][0]][0]);
-        glVertex3fv(&v_pyramid[PquadIndices[i][1]][0]);
-        glVertex3fv(&v_pyramid[PquadIndices[i][2]][0]);
-        glVertex3fv(&v_pyramid[PquadIndices[i][3]][0]);
+        Job* job = jobTake();
+        if (job)
+        {
+            jobRun(job);
+            continue;
+        }
+        std::unique_lock<std::mutex> guard(jobSleepLock);
+        jobWake.wait(guard, [] { return jobStop || jobsQueued > 0; });
     }
-    glEnd();
 }
 
-// Function to draw a custom polygon with customizable material properties
-void polygon(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+void stopJobThreads()
 {
-    // Define material properties for the polygon
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_shininess[] = { shine };
-
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
-
-    // Draw the polygon using GL_POLYGON
-    glBegin(GL_POLYGON);
-    glVertex2f(0, 0);
-    glVertex2f(6, 0);
-    glVertex2f(5.8, 1);
-    glVertex2f(5.2, 2);
-    glVertex2f(5, 2.2);
-    glVertex2f(4, 2.8);
-    glVertex2f(3, 3);
-    glVertex2f(2, 2.8);
-    glVertex2f(1, 2.2);
-    glVertex2f(0.8, 2);
-    glVertex2f(0.2, 1);
-    glEnd();
+    {
+        std::lock_guard<std::mutex> guard(jobSleepLock);
+        jobStop = true;
+    }
+    jobWake.notify_all();
+    for (size_t i = 0; i < jobThreads.size(); i++)
+        jobThreads[i].join();
+    jobThreads.clear();
 }
 
-// Function to draw a polygon with lines
-void polygonLine(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+// Function to start the worker threads; they are joined at exit
+void startJobThreads()
 {
-    // Define material properties for the polygon
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_shininess[] = { shine };
+    int count = jobThreadCount;
+    if (count < 0)
+        count = (int)std::thread::hardware_concurrency() - 1;
+    count = std::max(0, std::min(count, MAX_JOB_THREADS));
+    jobQueueCount = count + 1;
+    for (int i = 0; i < count; i++)
+        jobThreads.push_back(std::thread(jobWorker, i + 1));
+    atexit(stopJobThreads);
+    std::cout << "Job system: " << count + 1 << " threads" << std::endl;
+}
 
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+// Frame trace **************************************************************
+//
+// With --trace FILE the renderer records spans (frame phases, jobs, input,
+// texture loads) and writes them at exit as trace-event JSON for
+// chrome://tracing or Perfetto. Each thread appends to its own ring of events,
+// so recording takes no lock; when a ring is full the oldest spans are
+// overwritten, and the file holds the most recent stretch of the run.
 
-    // Begin drawing lines for the polygon
-    glBegin(GL_LINE_STRIP);
-    glVertex2f(6, 0);
-    glVertex2f(5.8, 1);
-    glVertex2f(5.2, 2);
-    glVertex2f(5, 2.2);
-    glVertex2f(4, 2.8);
-    glVertex2f(3, 3);
-    glVertex2f(2, 2.8);
-    glVertex2f(1, 2.2);
-    glVertex2f(0.8, 2);
-    glVertex2f(0.2, 1);
-    glVertex2f(0, 0);
-    glEnd();
-}
+static const int TRACE_RING_EVENTS = 1 << 16;
 
-// Function to draw a sphere with customizable material properties
-void drawSphere(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+struct TraceEvent
 {
-    // Define material properties for the sphere
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
-    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat mat_shininess[] = { shine };
+    const char* name;                   // Always a string literal
+    int arg;                            // Shown as args.index; -1 for none
+    long long start, duration;          // Microseconds since tracing started
+};
 
-    // Set the material properties
-    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
-    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
-    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+// Ring of one thread's events; only the owning thread writes to it
+struct TraceRing
+{
+    TraceEvent* events;
+    std::atomic<unsigned> written;
+};
 
-    // Draw a solid sphere
-    glutSolidSphere(3.0, 20, 16);
-}
+const char* traceFile = NULL;
+bool tracing = false;
+TraceRing traceRings[MAX_JOB_THREADS + 1];
+std::chrono::steady_clock::time_point traceStart;
 
-// Function to draw a cupboard
-void cupboard()
+static long long traceNow()
 {
-    // Cupboard/Almari ************************************************************
-
-    // Cupboard
-    glPushMatrix();
-    glTranslatef(4, 0, 4.4);
-    glScalef(0.5, 1, 0.5);
-    drawCube1(0.5, 0.2, 0.2, 0.25, 0.1, 0.1);
-    glPopMatrix();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - traceStart).count();
+}
 
-    // Cupboard's vertical striplines
-    glPushMatrix();
-    glTranslatef(4, 1, 5.9);
-    glScalef(0.5, 0.01, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+// Records the lifetime of a scope as one span on the current thread's ring
+struct TraceSpan
+{
+    const char* name;
+    int arg;
+    long long start;
 
-    glPushMatrix();
-    glTranslatef(4, 0.5, 5.9);
-    glScalef(0.5, 0.01, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    TraceSpan(const char* spanName, int spanArg = -1)
+        : name(spanName), arg(spanArg), start(tracing ? traceNow() : 0)
+    {
+    }
+    ~TraceSpan()
+    {
+        if (!tracing)
+            return;
+        TraceRing& ring = traceRings[jobThreadIndex];
+        unsigned n = ring.written.load(std::memory_order_relaxed);
+        TraceEvent& e = ring.events[n % TRACE_RING_EVENTS];
+        e.name = name;
+        e.arg = arg;
+        e.start = start;
+        e.duration = traceNow() - start;
+        ring.written.store(n + 1, std::memory_order_release);
+    }
+};
 
-    glPushMatrix();
-    glTranslatef(4, 0, 5.9);
-    glScalef(0.5, 0.01, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+// Function to write every ring to the trace file; runs at exit, after the workers have been joined
+void writeTrace()
+{
+    FILE* f = fopen(traceFile, "w");
+    if (f == NULL)
+    {
+        std::cerr << "Cannot write trace " << traceFile << std::endl;
+        return;
+    }
+    fprintf(f, "{\"traceEvents\":[\n");
+    const char* separator = "";
+    size_t total = 0;
+    for (int t = 0; t < jobQueueCount; t++)
+    {
+        fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"%s %d\"}}",
+                separator, t, t == 0 ? "GLUT" : "worker", t);
+        separator = ",\n";
+        TraceRing& ring = traceRings[t];
+        unsigned written = ring.written.load(std::memory_order_acquire);
+        unsigned first = written > (unsigned)TRACE_RING_EVENTS ? written - TRACE_RING_EVENTS : 0;
+        for (unsigned i = first; i < written; i++)
+        {
+            const TraceEvent& e = ring.events[i % TRACE_RING_EVENTS];
+            fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld",
+                    separator, e.name, t, e.start, e.duration);
+            if (e.arg >= 0)
+                fprintf(f, ",\"args\":{\"index\":%d}", e.arg);
+            fprintf(f, "}");
+        }
+        total += written - first;
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+    std::cout << "Trace: " << total << " spans written to " << traceFile << std::endl;
+}
 
-    // Cupboard's horizontal striplines
-    glPushMatrix();
-    glTranslatef(5.5, 0, 5.9);
-    glScalef(0.01, 1, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+// Function to start recording spans; call before the worker threads start so the file is written after they stop
+void startTracing()
+{
+    for (int t = 0; t <= MAX_JOB_THREADS; t++)
+    {
+        traceRings[t].events = (TraceEvent*)malloc(TRACE_RING_EVENTS * sizeof(TraceEvent));
+        traceRings[t].written = 0;
+    }
+    traceStart = std::chrono::steady_clock::now();
+    tracing = true;
+    atexit(writeTrace);
+}
 
-    glPushMatrix();
-    glTranslatef(4.75, 1, 5.9);
-    glScalef(0.01, 0.67, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+// Frame arena **************************************************************
+//
+// Data that lives for one frame (visible rooms, draw commands) is bump-allocated
+// from a frame arena instead of the heap. There are two arenas, so a frame's data
+// is still valid while the next one is being built; at the end of display() the
+// older one is reset in one step. An arena that overflows serves the rest of the
+// frame from the heap and is enlarged when it is next reset, so steady-state
+// frames make no heap allocations at all. Every operator new is counted so the
+// benchmark can check that.
 
-    glPushMatrix();
-    glTranslatef(4, 0, 5.9);
-    glScalef(0.01, 1, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+static const size_t FRAME_ARENA_BYTES = 1 << 20;
+static const size_t FRAME_ALIGNMENT = 16;
 
-    // Cupboard's handles
-    glPushMatrix();
-    glTranslatef(5, 1.4, 5.9);
-    glScalef(0.02, 0.18, 0.01);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+struct FrameArena
+{
+    unsigned char* memory;
+    size_t capacity;
+    std::atomic<size_t> used;           // May run past capacity; the excess came from the heap
+    size_t peak;
+    std::mutex overflowLock;
+    std::vector<void*> overflow;        // Heap blocks to free at the next reset
+};
 
-    // Sphere for the cupboard's handle
-    glPushMatrix();
-    glTranslatef(5.02, 1.9, 5.91);
-    glScalef(0.02, 0.02, 0.01);
-    drawSphere(0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 10);
-    glPopMatrix();
+FrameArena frameArenas[2];
+int frameArenaIndex = 0;
+std::atomic<size_t> heapAllocations(0);
 
-    // Left handle
-    glPushMatrix();
-    glTranslatef(4.5, 1.4, 5.9);
-    glScalef(0.02, 0.18, 0.01);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    heapAllocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
 
-    // Sphere for the left handle
-    glPushMatrix();
-    glTranslatef(4.52, 1.9, 5.91);
-    glScalef(0.02, 0.02, 0.01);
-    drawSphere(0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 10);
-    glPopMatrix();
+__attribute__((noinline)) void* operator new[](size_t size)
+{
+    heapAllocations++;
+    void* p = malloc(size ? size : 1);
+    if (p == NULL)
+        throw std::bad_alloc();
+    return p;
+}
 
-    // Drawer handles
-    glPushMatrix();
-    glTranslatef(4.5, 0.7, 5.9);
-    glScalef(0.16, 0.02, 0.01);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+// The nothrow forms are counted and freed the same way, so every form of new pairs with every delete
+__attribute__((noinline)) void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    heapAllocations++;
+    return malloc(size ? size : 1);
+}
 
-    glPushMatrix();
-    glTranslatef(4.5, 0.25, 5.9);
-    glScalef(0.16, 0.02, 0.01);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+__attribute__((noinline)) void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    heapAllocations++;
+    return malloc(size ? size : 1);
 }
 
+// Every form of delete stays out of line too, so the compiler does not pair its free with a new it can see
+__attribute__((noinline)) void operator delete(void* p) noexcept
+{
+    free(p);
+}
 
-// Function to draw the room
-void room()
+__attribute__((noinline)) void operator delete[](void* p) noexcept
 {
-    // Carpet
-    glPushMatrix();
-    glTranslatef(3, -0.2, 7);
-    glScalef(1.3, 0.01, 1.7);
-    drawCarpet(0.4, 0.1, 0.0, 0.20, 0.05, 0.0);
-    glPopMatrix();
-    
-    // Right wall
-    glPushMatrix();
-    glTranslatef(-1.5, -1, 0.5);
-    glScalef(5, 2, 0.1);
-    drawCube1(1, 0.8, 0.7, 0.5, 0.4, 0.35);
-    glPopMatrix();
-    
-    // Left wall
-    glPushMatrix();
-    glTranslatef(-4.5, -1, 0);
-    glScalef(1, 2, 5);
-    drawCube1(1, 0.8, 0.7, 0.5, 0.4, 0.35);
-    glPopMatrix();
-    
-    // Wall besides the right wall
-    glPushMatrix();
-    glTranslatef(8, -1, 0);
-    glScalef(0.2, 2, 5);
-    drawCube1(1, 0.8, 0.7, 0.5, 0.4, 0.35);
-    glPopMatrix();
-    
-    // Ceiling
-    glPushMatrix();
-    glTranslatef(-2, 5.1, 0);
-    glScalef(5, 0.1, 7);
-    drawCube1(1.0, 0.9, 0.8, 0.5, 0.45, 0.4);
-    glPopMatrix();
-    
-    // Floor
-    glPushMatrix();
-    glTranslatef(-1, -5, 0);
-    glScalef(5, 0.1, 7);
-    drawCube1(0.5, 0.1, 0.0, 0.25, 0.05, 0);
-    glPopMatrix();
+    free(p);
 }
 
-// Function to draw the bed
-void bed()
+__attribute__((noinline)) void operator delete(void* p, size_t) noexcept
 {
-    // Bed headboard
-    glPushMatrix();
-    glTranslatef(-2, -0.5, 6.2);
-    glScalef(0.1, 0.5, 0.9);
-    drawCube1(0.5, 0.2, 0.2, 0.25, 0.1, 0.1);
-    glPopMatrix();
-    
-    // Bed body
-    glPushMatrix();
-    glTranslatef(0, -0.5, 6.2);
-    glScalef(1, 0.2, 0.9);
-    drawCube1(0.824, 0.706, 0.549, 0.412, 0.353, 0.2745);
-    glPopMatrix();
-    
-    // Pillows
-    glPushMatrix();
-    glTranslatef(0.5, 0.5, 6);
-    glRotatef(20, 0, 0, 1);
-    glScalef(0.1, 0.15, 0.28);
-    drawCube1(0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
-    glPopMatrix();
-    
-    glPushMatrix();
-    glTranslatef(0.5, 0.5, 7.2);
-    glRotatef(22, 0, 0, 1);
-    glScalef(0.1, 0.15, 0.28);
-    drawCube1(0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
-    glPopMatrix();
-    
-    // Blanket
-    glPushMatrix();
-    glTranslatef(1.4, 0.45, 5.5);
-    glScalef(0.5, 0.05, 0.95);
-    drawCube1(0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
-    glPopMatrix();
-    
-    // Blanket side left part
-    glPushMatrix();
-    glTranslatef(1.4, -0.3, 8.16);
-    glScalef(0.5, 0.25, 0.05);
-    drawCube1(0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
-    glPopMatrix();
+    free(p);
 }
 
-// Function to draw the bedside drawer
-void bedsideDrawer()
+__attribute__((noinline)) void operator delete[](void* p, size_t) noexcept
 {
-    // Bedside drawer
-    glPushMatrix();
-    glTranslatef(0.5, -0.1, 8.7);
-    glScalef(0.12, 0.2, 0.23);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
-    
-    // Side drawer's drawer
-    glPushMatrix();
-    glTranslatef(0.88, 0, 8.8);
-    glScalef(0.0001, 0.11, 0.18);
-    drawCube1(0.3, 0.2, 0.2, 0.15, 0.1, 0.1);
-    glPopMatrix();
-    
-    // Side drawer's knob
-    glPushMatrix();
-    glTranslatef(0.9, 0.15, 9.05);
-    glScalef(0.01, 0.02, 0.02);
-    drawSphere(0.3, 0.1, 0.0, 0.15, 0.05, 0.0);
-    glPopMatrix();
+    free(p);
 }
 
+__attribute__((noinline)) void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
 
-// Function to draw the lamp
-void lamp()
+__attribute__((noinline)) void operator delete[](void* p, const std::nothrow_t&) noexcept
 {
-    // Lamp base
-    glPushMatrix();
-    glTranslatef(0.6, 0.5, 8.95);
-    glScalef(0.07, 0.02, 0.07);
-    drawCube1(0, 0, 1, 0, 0, 0.5);
-    glPopMatrix();
-    
-    // Lamp stand
-    glColor3f(1, 0, 0);
-    glPushMatrix();
-    glTranslatef(0.7, 0.35, 9.05);
-    glScalef(0.01, 0.2, 0.01);
-    drawCube1(1, 0, 0, 0.5, 0.0, 0.0);
-    glPopMatrix();
-        
-    // Lamp shade
-    glColor3f(0.000, 0.000, 0.545);
-    glPushMatrix();
-    glTranslatef(0.6, 0.9, 8.9);
-    glScalef(0.08, 0.09, 0.08);
-    drawTrapezoid(0.000, 0.000, 0.545, 0, 0, 0.2725);
-    glPopMatrix();
+    free(p);
 }
 
-// Function to draw the Linkin Park poster
-void LinkinParkPoster()
+// Function to allocate from the current frame's arena; safe to call from any job
+void* frameAlloc(size_t bytes)
 {
-    // Poster black background
-    glColor3f(0.0, 0.0, 0.0);
-    glPushMatrix();
-    glTranslatef(-1, 1.4, 4.6);
-    glScalef(0.0001, 0.65, 0.8);
-    drawCube1(0, 0, 0, 0, 0, 0, 10);
-    glPopMatrix();
-    
-    // Linkin Park logo components
-    glColor3f(1.0, 1.0, 1.0);
-    
-    // First component
-    glPushMatrix();
-    glTranslatef(-0.9, 2.1, 5.5);
-    glScalef(0.0001, 0.02, 0.25);
-    drawCube1(1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
-    glPopMatrix();
+    FrameArena& a = frameArenas[frameArenaIndex];
+    bytes = (bytes + FRAME_ALIGNMENT - 1) & ~(FRAME_ALIGNMENT - 1);
+    size_t offset = a.used.fetch_add(bytes);
+    if (offset + bytes <= a.capacity)
+        return a.memory + offset;
+    std::lock_guard<std::mutex> guard(a.overflowLock);
+    heapAllocations++;
+    void* p = malloc(bytes);
+    a.overflow.push_back(p);
+    return p;
+}
+
+// Function to finish a frame: the other arena, whose frame is two frames old, becomes current
+void frameArenaNextFrame()
+{
+    FrameArena& done = frameArenas[frameArenaIndex];
+    done.peak = std::max(done.peak, (size_t)done.used);
+
+    frameArenaIndex ^= 1;
+    FrameArena& a = frameArenas[frameArenaIndex];
+    for (size_t i = 0; i < a.overflow.size(); i++)
+        free(a.overflow[i]);
+    a.overflow.clear();
+    size_t wanted = std::max(FRAME_ARENA_BYTES, std::max(a.peak, done.peak));
+    if (a.capacity < wanted)
+    {
+        free(a.memory);
+        a.capacity = wanted + wanted / 2;
+        a.memory = (unsigned char*)malloc(a.capacity);
+    }
+    a.used = 0;
+}
+
+// Growable array of plain data in the frame arena; it is emptied, never freed
+template <typename T>
+struct FrameArray
+{
+    T* items;
+    size_t count, capacity;
+
+    void clear()
+    {
+        items = NULL;
+        count = capacity = 0;
+    }
+    void reserve(size_t n)
+    {
+        if (n <= capacity)
+            return;
+        T* grown = (T*)frameAlloc(n * sizeof(T));
+        if (count)
+            memcpy(grown, items, count * sizeof(T));
+        items = grown;
+        capacity = n;
+    }
+    void push_back(const T& v)
+    {
+        if (count == capacity)
+            reserve(capacity ? capacity * 2 : 16);
+        items[count++] = v;
+    }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    T& operator[](size_t i) { return items[i]; }
+    const T& operator[](size_t i) const { return items[i]; }
+};
+
+// GPU resources ************************************************************
+//
+// Every GL object the renderer creates goes through these wrappers, which keep
+// a record of the live objects and their bytes per category. 'g' prints the
+// current totals, a watchdog warns when a category keeps growing across
+// frames, and shutdown releases everything the renderer owns and reports what
+// is left as leaks. GL objects are only made on the GLUT thread, so the
+// records take no lock.
+
+enum GpuCategory { GPU_TEXTURE, GPU_BUFFER, GPU_FRAMEBUFFER, GPU_RENDERBUFFER, GPU_PROGRAM, GPU_CATEGORY_COUNT };
+
+static const char* gpuCategoryNames[GPU_CATEGORY_COUNT] = { "textures", "buffers", "framebuffers", "renderbuffers",
+                                                             "programs" };
+
+// One live GL object
+struct GpuResource
+{
+    const char* label;                  // Who made it; always a string literal
+    size_t bytes;
+    unsigned serial;                    // Creation order, to list the newest first
+};
+
+std::map<GLuint, GpuResource> gpuResources[GPU_CATEGORY_COUNT];
+size_t gpuBytes[GPU_CATEGORY_COUNT];
+unsigned gpuSerial = 0;
+
+// Growth watchdog: live bytes and objects are sampled every GPU_CHECK_FRAMES frames
+static const int GPU_CHECK_FRAMES = 120;
+static const int GPU_GROWTH_SAMPLES = 4;    // Consecutive growing samples that count as a leak
+int gpuCheckFrame = 0;
+size_t gpuLastBytes[GPU_CATEGORY_COUNT], gpuLastCount[GPU_CATEGORY_COUNT];
+int gpuGrowthStreak[GPU_CATEGORY_COUNT];
+
+// Function to start tracking a GL object that was just created
+void gpuTrack(GpuCategory category, GLuint name, const char* label, size_t bytes = 0)
+{
+    GpuResource r = { label, bytes, ++gpuSerial };
+    gpuResources[category][name] = r;
+    gpuBytes[category] += bytes;
+}
+
+// Function to record the storage of a tracked object after (re)specifying it
+void gpuSetBytes(GpuCategory category, GLuint name, size_t bytes)
+{
+    std::map<GLuint, GpuResource>::iterator it = gpuResources[category].find(name);
+    if (it == gpuResources[category].end())
+    {
+        std::cerr << "GPU: storage for untracked " << gpuCategoryNames[category] << " " << name << std::endl;
+        return;
+    }
+    gpuBytes[category] += bytes - it->second.bytes;
+    it->second.bytes = bytes;
+}
+
+// Function to stop tracking a GL object that is about to be deleted
+void gpuUntrack(GpuCategory category, GLuint name)
+{
+    std::map<GLuint, GpuResource>::iterator it = gpuResources[category].find(name);
+    if (it == gpuResources[category].end())
+    {
+        std::cerr << "GPU: deleting untracked " << gpuCategoryNames[category] << " " << name << std::endl;
+        return;
+    }
+    gpuBytes[category] -= it->second.bytes;
+    gpuResources[category].erase(it);
+}
+
+GLuint gpuCreateTexture(const char* label)
+{
+    GLuint name;
+    glGenTextures(1, &name);
+    gpuTrack(GPU_TEXTURE, name, label);
+    return name;
+}
+
+void gpuDeleteTexture(GLuint& name)
+{
+    if (name == 0)
+        return;
+    gpuUntrack(GPU_TEXTURE, name);
+    glDeleteTextures(1, &name);
+    name = 0;
+}
+
+GLuint gpuCreateBuffer(const char* label)
+{
+    GLuint name;
+    glGenBuffers(1, &name);
+    gpuTrack(GPU_BUFFER, name, label);
+    return name;
+}
+
+// Function to fill the buffer bound to target and record its size
+void gpuBufferData(GLenum target, GLuint name, size_t bytes, const void* data, GLenum usage)
+{
+    glBufferData(target, bytes, data, usage);
+    gpuSetBytes(GPU_BUFFER, name, bytes);
+}
+
+void gpuDeleteBuffer(GLuint& name)
+{
+    if (name == 0)
+        return;
+    gpuUntrack(GPU_BUFFER, name);
+    glDeleteBuffers(1, &name);
+    name = 0;
+}
+
+// Framebuffers own no storage; their attachments are counted as textures or renderbuffers
+GLuint gpuCreateFramebuffer(const char* label)
+{
+    GLuint name;
+    glGenFramebuffers(1, &name);
+    gpuTrack(GPU_FRAMEBUFFER, name, label);
+    return name;
+}
+
+void gpuDeleteFramebuffer(GLuint& name)
+{
+    if (name == 0)
+        return;
+    gpuUntrack(GPU_FRAMEBUFFER, name);
+    glDeleteFramebuffers(1, &name);
+    name = 0;
+}
+
+GLuint gpuCreateRenderbuffer(const char* label)
+{
+    GLuint name;
+    glGenRenderbuffers(1, &name);
+    gpuTrack(GPU_RENDERBUFFER, name, label);
+    return name;
+}
+
+void gpuDeleteRenderbuffer(GLuint& name)
+{
+    if (name == 0)
+        return;
+    gpuUntrack(GPU_RENDERBUFFER, name);
+    glDeleteRenderbuffers(1, &name);
+    name = 0;
+}
+
+GLuint gpuCreateProgram(const char* label)
+{
+    GLuint name = glCreateProgram();
+    gpuTrack(GPU_PROGRAM, name, label);
+    return name;
+}
+
+void gpuDeleteProgram(GLuint& name)
+{
+    if (name == 0)
+        return;
+    gpuUntrack(GPU_PROGRAM, name);
+    glDeleteProgram(name);
+    name = 0;
+}
+
+// Function to print the live objects and bytes of every category
+void printGpuResources()
+{
+    size_t total = 0;
+    for (int c = 0; c < GPU_CATEGORY_COUNT; c++)
+    {
+        printf("GPU %-13s %6d live, %9.1f KB\n", gpuCategoryNames[c], (int)gpuResources[c].size(), gpuBytes[c] / 1024.0);
+        total += gpuBytes[c];
+    }
+    printf("GPU total         %9.1f KB\n", total / 1024.0);
+}
+
+// Function to list the newest live objects of a category, grouped by label
+static void printNewestResources(int category, int count)
+{
+    std::vector<std::pair<unsigned, const char*> > newest;
+    for (std::map<GLuint, GpuResource>::const_iterator it = gpuResources[category].begin();
+         it != gpuResources[category].end(); ++it)
+        newest.push_back(std::make_pair(it->second.serial, it->second.label));
+    std::sort(newest.rbegin(), newest.rend());
+    std::map<const char*, int> labels;
+    for (int i = 0; i < count && i < (int)newest.size(); i++)
+        labels[newest[i].second]++;
+    for (std::map<const char*, int>::const_iterator it = labels.begin(); it != labels.end(); ++it)
+        std::cerr << "    " << it->second << " x " << it->first << std::endl;
+}
+
+// Function to sample live bytes once per check interval and warn when a category keeps growing
+void checkGpuGrowth()
+{
+    if (++gpuCheckFrame < GPU_CHECK_FRAMES)
+        return;
+    gpuCheckFrame = 0;
+    for (int c = 0; c < GPU_CATEGORY_COUNT; c++)
+    {
+        size_t count = gpuResources[c].size();
+        if (gpuBytes[c] > gpuLastBytes[c] || (gpuBytes[c] == gpuLastBytes[c] && count > gpuLastCount[c]))
+            gpuGrowthStreak[c]++;
+        else
+            gpuGrowthStreak[c] = 0;
+        gpuLastBytes[c] = gpuBytes[c];
+        gpuLastCount[c] = count;
+        if (gpuGrowthStreak[c] == GPU_GROWTH_SAMPLES)
+        {
+            std::cerr << "GPU: " << gpuCategoryNames[c] << " grew for " << GPU_GROWTH_SAMPLES * GPU_CHECK_FRAMES
+                      << " frames, now " << gpuResources[c].size() << " live (" << gpuBytes[c] / 1024
+                      << " KB); newest:" << std::endl;
+            printNewestResources(c, 16);
+        }
+    }
+}
+
+// Function to report GL objects still alive at shutdown, after their owners have released theirs
+void reportGpuLeaks()
+{
+    bool leaks = false;
+    for (int c = 0; c < GPU_CATEGORY_COUNT; c++)
+        if (!gpuResources[c].empty())
+        {
+            std::cerr << "GPU leak: " << gpuResources[c].size() << " " << gpuCategoryNames[c] << ", "
+                      << gpuBytes[c] / 1024 << " KB:" << std::endl;
+            printNewestResources(c, (int)gpuResources[c].size());
+            leaks = true;
+        }
+    if (!leaks)
+        std::cout << "GPU: no leaked objects" << std::endl;
+}
+
+// Function to load an image file as an OpenGL texture
+GLuint loadTexture(const char* filename)
+{
+    TraceSpan span("loadTexture");
+
+    // Use SOIL to load the image into an OpenGL texture
+    GLuint texture = SOIL_load_OGL_texture(filename, SOIL_LOAD_AUTO, SOIL_CREATE_NEW_ID, SOIL_FLAG_INVERT_Y);
     
-    // Second component
+    // Check if loading was successful
+    if (texture == 0)
+        std::cerr << "SOIL loading error: " << SOIL_last_result() << std::endl;
+    else
+    {
+        GLint width = 0, height = 0;
+        glBindTexture(GL_TEXTURE_2D, texture);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+        gpuTrack(GPU_TEXTURE, texture, "loadTexture", (size_t)width * height * 4);
+    }
+    // std::cout << texture << std::endl; // Output the texture ID for debugging
+    return texture; // Return the texture ID
+}
+
+// Texture atlas ***********************************************************
+//
+// Every scene texture is packed into one mipmapped atlas at startup, so the
+// whole room is drawn with a single texture bind. Each object remaps its
+// 0..1 texture coordinates into its own region of the atlas.
+
+// Indices of the scene textures inside the atlas
+enum SceneTexture { TEX_CARPET, TEX_COUNT };
+
+// Image files for each scene texture, in SceneTexture order
+static const char* sceneTextureFiles[TEX_COUNT] = { "image.png" };
+
+// Sub-rectangle of the atlas owned by one texture, in texture coordinates
+struct AtlasRegion
+{
+    GLfloat u0, v0, u1, v1;
+};
+
+AtlasRegion atlasRegions[TEX_COUNT];
+GLuint atlasTexture = 0;
+
+// Texels of edge padding around every image so mip levels do not bleed neighbours in
+static const int ATLAS_PADDING = 8;
+
+// Function to map a texture coordinate of one scene texture into the atlas
+void atlasTexCoord(SceneTexture tex, GLfloat s, GLfloat t)
+{
+    const AtlasRegion& r = atlasRegions[tex];
+    glTexCoord2f(r.u0 + s * (r.u1 - r.u0), r.v0 + t * (r.v1 - r.v0));
+}
+
+// Function to pack images into rows of an atlas of the given size; returns false if they do not fit
+static bool packAtlasShelves(const int* widths, const int* heights, const int* order, int count,
+                             int atlasSize, int padding, int* outX, int* outY)
+{
+    int shelfX = 0, shelfY = 0, shelfHeight = 0;
+    for (int i = 0; i < count; i++)
+    {
+        int id = order[i];
+        int w = widths[id] + 2 * padding;
+        int h = heights[id] + 2 * padding;
+        if (shelfX + w > atlasSize)
+        {
+            // Start a new shelf below the current one
+            shelfY += shelfHeight;
+            shelfX = 0;
+            shelfHeight = 0;
+        }
+        if (w > atlasSize || shelfY + h > atlasSize)
+            return false;
+        outX[id] = shelfX + padding;
+        outY[id] = shelfY + padding;
+        shelfX += w;
+        if (h > shelfHeight)
+            shelfHeight = h;
+    }
+    return true;
+}
+
+// Images decoded for the atlas
+static unsigned char* decodedPixels[TEX_COUNT];
+static int decodedWidths[TEX_COUNT], decodedHeights[TEX_COUNT];
+
+// SOIL keeps its last result, and stb_image under it the reason of its last failure, in globals, so
+// only one image decodes at a time
+static std::mutex soilLock;
+
+// Function to read one image file and decode it as RGB (a job, so the files are read in parallel)
+static void decodeSceneTexture(int i)
+{
+    TraceSpan span("decodeSceneTexture", i);
+    decodedPixels[i] = NULL;
+    decodedWidths[i] = decodedHeights[i] = 1;
+    std::vector<unsigned char> bytes;
+    FILE* file = fopen(sceneTextureFiles[i], "rb");
+    if (file)
+    {
+        unsigned char buffer[65536];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+            bytes.insert(bytes.end(), buffer, buffer + n);
+        fclose(file);
+    }
+    if (bytes.empty())
+    {
+        std::cerr << "SOIL loading error: " << sceneTextureFiles[i] << ": cannot read the file" << std::endl;
+        return;
+    }
+
+    // The error is printed under the lock too, so it is this image's and not another job's
+    std::lock_guard<std::mutex> guard(soilLock);
+    int width, height, channels;
+    decodedPixels[i] = SOIL_load_image_from_memory(&bytes[0], (int)bytes.size(), &width, &height, &channels,
+                                                   SOIL_LOAD_RGB);
+    if (decodedPixels[i] == NULL)
+    {
+        std::cerr << "SOIL loading error: " << sceneTextureFiles[i] << ": " << SOIL_last_result() << std::endl;
+        return;
+    }
+    decodedWidths[i] = width;
+    decodedHeights[i] = height;
+}
+
+// Function to halve an RGB image in place with a box filter; false if it is a single texel already
+static bool halveImage(unsigned char* pixels, int& width, int& height)
+{
+    if (pixels == NULL || (width == 1 && height == 1))
+        return false;
+    int w = std::max(1, width / 2), h = std::max(1, height / 2);
+    // Every texel written lies at or before the texels it reads, so the image shrinks in place
+    for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+        {
+            int x0 = std::min(2 * x, width - 1), x1 = std::min(2 * x + 1, width - 1);
+            int y0 = std::min(2 * y, height - 1), y1 = std::min(2 * y + 1, height - 1);
+            for (int c = 0; c < 3; c++)
+                pixels[(y * w + x) * 3 + c] = (unsigned char)((pixels[(y0 * width + x0) * 3 + c]
+                    + pixels[(y0 * width + x1) * 3 + c] + pixels[(y1 * width + x0) * 3 + c]
+                    + pixels[(y1 * width + x1) * 3 + c] + 2) / 4);
+        }
+    width = w;
+    height = h;
+    return true;
+}
+
+// Function to load every scene texture and build the mipmapped atlas
+void buildTextureAtlas()
+{
+    TraceSpan span("buildTextureAtlas");
+    unsigned char** pixels = decodedPixels;
+    int* widths = decodedWidths;
+    int* heights = decodedHeights;
+    int order[TEX_COUNT];
+
+    // Load every image, substituting a white texel when a file is missing
+    static unsigned char white[3] = { 255, 255, 255 };
+    for (int i = 0; i < TEX_COUNT; i++)
+    {
+        jobSubmit(jobCreate(decodeSceneTexture, i));
+        order[i] = i;
+    }
+    jobWaitAll();
+
+    // Tallest images first keeps the shelves tight
+    for (int i = 1; i < TEX_COUNT; i++)
+        for (int j = i; j > 0 && heights[order[j]] > heights[order[j - 1]]; j--)
+        {
+            int tmp = order[j]; order[j] = order[j - 1]; order[j - 1] = tmp;
+        }
+
+    // Grow the power-of-two atlas until everything fits; past the largest texture the GL allows,
+    // halve the images instead
+    GLint maxSize = 2048;
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+    int atlasSize = 64, xs[TEX_COUNT] = { 0 }, ys[TEX_COUNT] = { 0 };
+    while (!packAtlasShelves(widths, heights, order, TEX_COUNT, atlasSize, ATLAS_PADDING, xs, ys))
+    {
+        if (atlasSize < maxSize)
+        {
+            atlasSize *= 2;
+            continue;
+        }
+        bool halved = false;
+        for (int i = 0; i < TEX_COUNT; i++)
+            halved = halveImage(pixels[i], widths[i], heights[i]) || halved;
+        if (!halved)
+        {
+            std::cerr << "Texture atlas: the scene textures do not fit a " << maxSize << "x" << maxSize
+                      << " texture" << std::endl;
+            exit(1);
+        }
+        std::cout << "Texture atlas: halving the scene textures to fit " << maxSize << "x" << maxSize << std::endl;
+    }
+
+    unsigned char* atlas = new unsigned char[atlasSize * atlasSize * 3]();
+    for (int i = 0; i < TEX_COUNT; i++)
+    {
+        // Copy the image flipped vertically, replicating its border into the padding
+        for (int y = -ATLAS_PADDING; y < heights[i] + ATLAS_PADDING; y++)
+        {
+            int sy = y < 0 ? 0 : (y >= heights[i] ? heights[i] - 1 : y);
+            int dy = ys[i] + y;
+            if (dy < 0 || dy >= atlasSize)
+                continue;
+            for (int x = -ATLAS_PADDING; x < widths[i] + ATLAS_PADDING; x++)
+            {
+                int sx = x < 0 ? 0 : (x >= widths[i] ? widths[i] - 1 : x);
+                int dx = xs[i] + x;
+                if (dx < 0 || dx >= atlasSize)
+                    continue;
+                const unsigned char* src = pixels[i] ? &pixels[i][((heights[i] - 1 - sy) * widths[i] + sx) * 3] : white;
+                unsigned char* dst = &atlas[(dy * atlasSize + dx) * 3];
+                dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2];
+            }
+        }
+
+        // Inset by half a texel so bilinear filtering stays inside the region
+        atlasRegions[i].u0 = (xs[i] + 0.5f) / atlasSize;
+        atlasRegions[i].v0 = (ys[i] + 0.5f) / atlasSize;
+        atlasRegions[i].u1 = (xs[i] + widths[i] - 0.5f) / atlasSize;
+        atlasRegions[i].v1 = (ys[i] + heights[i] - 0.5f) / atlasSize;
+
+        if (pixels[i])
+            SOIL_free_image_data(pixels[i]);
+    }
+
+    // Upload the atlas with a full mip chain and trilinear filtering
+    gpuDeleteTexture(atlasTexture);
+    atlasTexture = gpuCreateTexture("texture atlas");
+    glBindTexture(GL_TEXTURE_2D, atlasTexture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    gluBuild2DMipmaps(GL_TEXTURE_2D, GL_RGB, atlasSize, atlasSize, GL_RGB, GL_UNSIGNED_BYTE, atlas);
+    gpuSetBytes(GPU_TEXTURE, atlasTexture, (size_t)atlasSize * atlasSize * 3 * 4 / 3);
+    delete[] atlas;
+
+    std::cout << "Texture atlas: " << TEX_COUNT << " texture(s) packed into "
+              << atlasSize << "x" << atlasSize << std::endl;
+}
+
+
+static GLfloat v_cube[8][3] =
+{
+    {0.0, 0.0, 0.0}, // Vertex 0
+    {0.0, 0.0, 3.0}, // Vertex 1
+    {3.0, 0.0, 3.0}, // Vertex 2
+    {3.0, 0.0, 0.0}, // Vertex 3
+    {0.0, 3.0, 0.0}, // Vertex 4
+    {0.0, 3.0, 3.0}, // Vertex 5
+    {3.0, 3.0, 3.0}, // Vertex 6
+    {3.0, 3.0, 0.0}  // Vertex 7
+};
+
+static GLubyte quadIndices[6][4] =
+{
+    {0, 1, 2, 3}, // Bottom face indices
+    {4, 5, 6, 7}, // Top face indices
+    {5, 1, 2, 6}, // Front face indices
+    {0, 4, 7, 3}, // Back face indices (specified in clockwise order)
+    {2, 3, 7, 6}, // Right face indices
+    {1, 5, 4, 0}  // Left face indices (specified in clockwise order)
+};
+
+// Function to calculate and set the normal vector for a triangle given three points
+static void getNormal3p
+(GLfloat x1, GLfloat y1, GLfloat z1, GLfloat x2, GLfloat y2, GLfloat z2, GLfloat x3, GLfloat y3, GLfloat z3)
+{
+    // Calculate vectors U and V
+    GLfloat Ux, Uy, Uz, Vx, Vy, Vz, Nx, Ny, Nz;
+    Ux = x2 - x1;
+    Uy = y2 - y1;
+    Uz = z2 - z1;
+    Vx = x3 - x1;
+    Vy = y3 - y1;
+    Vz = z3 - z1;
+
+    // Calculate the cross product of U and V to get the normal vector
+    Nx = Uy * Vz - Uz * Vy;
+    Ny = Uz * Vx - Ux * Vz;
+    Nz = Ux * Vy - Uy * Vx;
+
+    // Set the normal vector
+    glNormal3f(Nx, Ny, Nz);
+}
+
+// Function to draw a cube using GL_QUADS
+void drawCube()
+{
+    glBegin(GL_QUADS);
+    for (GLint i = 0; i < 6; i++)
+    {
+        // Calculate the normal vector for the current quad face
+        getNormal3p(v_cube[quadIndices[i][0]][0], v_cube[quadIndices[i][0]][1], v_cube[quadIndices[i][0]][2],
+                    v_cube[quadIndices[i][1]][0], v_cube[quadIndices[i][1]][1], v_cube[quadIndices[i][1]][2],
+                    v_cube[quadIndices[i][2]][0], v_cube[quadIndices[i][2]][1], v_cube[quadIndices[i][2]][2]);
+        
+        // Specify vertices of the quad face
+        glVertex3fv(&v_cube[quadIndices[i][0]][0]);
+        glVertex3fv(&v_cube[quadIndices[i][1]][0]);
+        glVertex3fv(&v_cube[quadIndices[i][2]][0]);
+        glVertex3fv(&v_cube[quadIndices[i][3]][0]);
+    }
+    glEnd();
+}
+
+
+// Function to draw a cube with customizable material properties
+void drawCube1(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX = 0, GLfloat ambY = 0, GLfloat ambZ = 0, GLfloat shine = 50)
+{
+    // Define material properties for the cube
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+    glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+
+    // Draw the cube using GL_QUADS
+    glBegin(GL_QUADS);
+    for (GLint i = 0; i < 6; i++)
+    {
+        // Calculate and set the normal vector for the current quad face
+        getNormal3p(v_cube[quadIndices[i][0]][0], v_cube[quadIndices[i][0]][1], v_cube[quadIndices[i][0]][2],
+            v_cube[quadIndices[i][1]][0], v_cube[quadIndices[i][1]][1], v_cube[quadIndices[i][1]][2],
+            v_cube[quadIndices[i][2]][0], v_cube[quadIndices[i][2]][1], v_cube[quadIndices[i][2]][2]);
+
+        // Specify vertices of the quad face
+        glVertex3fv(&v_cube[quadIndices[i][0]][0]);
+        glVertex3fv(&v_cube[quadIndices[i][1]][0]);
+        glVertex3fv(&v_cube[quadIndices[i][2]][0]);
+        glVertex3fv(&v_cube[quadIndices[i][3]][0]);
+    }
+    glEnd();
+}
+
+// Function to draw a carpet with customizable material properties and texture
+void drawCarpet(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX = 0, GLfloat ambY = 0, GLfloat ambZ = 0, GLfloat shine = 50)
+{
+    // Push the current matrix onto the stack and save current state
+    glPushMatrix();
+    glPushAttrib(GL_ALL_ATTRIB_BITS);
+
+    // Enable texturing; the atlas holding the carpet image is bound once per frame in display()
+    glEnable(GL_TEXTURE_2D);
+
+    // Define material properties for the carpet
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+    glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+
+    // Draw the carpet using GL_QUADS
+    glBegin(GL_QUADS);
+    for (GLint i = 0; i < 6; i++)
+    {
+        // Calculate and set the normal vector for the current quad face
+        getNormal3p(v_cube[quadIndices[i][0]][0], v_cube[quadIndices[i][0]][1], v_cube[quadIndices[i][0]][2],
+            v_cube[quadIndices[i][1]][0], v_cube[quadIndices[i][1]][1], v_cube[quadIndices[i][1]][2],
+            v_cube[quadIndices[i][2]][0], v_cube[quadIndices[i][2]][1], v_cube[quadIndices[i][2]][2]);
+
+        // Specify vertices of the quad face with texture coordinates remapped into the atlas
+        atlasTexCoord(TEX_CARPET, 0.0f, 0.0f); glVertex3fv(&v_cube[quadIndices[i][0]][0]);
+        atlasTexCoord(TEX_CARPET, 1.0f, 0.0f); glVertex3fv(&v_cube[quadIndices[i][1]][0]);
+        atlasTexCoord(TEX_CARPET, 1.0f, 1.0f); glVertex3fv(&v_cube[quadIndices[i][2]][0]);
+        atlasTexCoord(TEX_CARPET, 0.0f, 1.0f); glVertex3fv(&v_cube[quadIndices[i][3]][0]);
+    }
+    glEnd();
+
+    // Disable texture and restore previous state
+    glDisable(GL_TEXTURE_2D);
+    glPopAttrib();
+    glPopMatrix();
+}
+
+// Definition of vertices for a trapezoid
+static GLfloat v_trapezoid[8][3] =
+{
+    {0.0, 0.0, 0.0}, //0
+    {0.0, 0.0, 3.0}, //1
+    {3.0, 0.0, 3.0}, //2
+    {3.0, 0.0, 0.0}, //3
+    {0.5, 3.0, 0.5}, //4
+    {0.5, 3.0, 2.5}, //5
+    {2.5, 3.0, 2.5}, //6
+    {2.5, 3.0, 0.5}  //7
+};
+
+// Definition of quad indices for a trapezoid
+static GLubyte TquadIndices[6][4] =
+{
+    {0, 1, 2, 3}, // Bottom face indices
+    {4, 5, 6, 7}, // Top face indices
+    {5, 1, 2, 6}, // Front face indices
+    {0, 4, 7, 3}, // Back face indices (specified in clockwise order)
+    {2, 3, 7, 6}, // Right face indices
+    {1, 5, 4, 0}  // Left face indices (specified in clockwise order)
+};
+
+// Function to draw a trapezoid with customizable material properties
+void drawTrapezoid(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine = 50)
+{
+    // Define material properties for the trapezoid
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_emission[] = { difX, difY, difZ, 0.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    // If the switchLamp flag is true, set emission material property
+    if (switchLamp == true) {
+        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
+    }
+    else {
+        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    }
+
+    // Draw the trapezoid using GL_QUADS
+    glBegin(GL_QUADS);
+    for (GLint i = 0; i < 6; i++)
+    {
+        // Calculate and set the normal vector for the current quad face
+        getNormal3p(v_trapezoid[TquadIndices[i][0]][0], v_trapezoid[TquadIndices[i][0]][1], v_trapezoid[TquadIndices[i][0]][2],
+            v_trapezoid[TquadIndices[i][1]][0], v_trapezoid[TquadIndices[i][1]][1], v_trapezoid[TquadIndices[i][1]][2],
+            v_trapezoid[TquadIndices[i][2]][0], v_trapezoid[TquadIndices[i][2]][1], v_trapezoid[TquadIndices[i][2]][2]);
+
+        // Specify vertices of the quad face
+        glVertex3fv(&v_trapezoid[TquadIndices[i][0]][0]);
+        glVertex3fv(&v_trapezoid[TquadIndices[i][1]][0]);
+        glVertex3fv(&v_trapezoid[TquadIndices[i][2]][0]);
+        glVertex3fv(&v_trapezoid[TquadIndices[i][3]][0]);
+    }
+    glEnd();
+}
+
+
+
+// Definition of vertices for a pyramid
+static GLfloat v_pyramid[5][3] =
+{
+    {0.0, 0.0, 0.0}, // Vertex 0
+    {0.0, 0.0, 2.0}, // Vertex 1
+    {2.0, 0.0, 2.0}, // Vertex 2
+    {2.0, 0.0, 0.0}, // Vertex 3
+    {1.0, 4.0, 1.0}  // Vertex 4 (apex)
+};
+
+// Definition of triangle indices for the pyramid's faces
+static GLubyte p_Indices[4][3] =
+{
+    {4, 1, 2}, // Front face indices
+    {4, 2, 3}, // Right face indices
+    {4, 3, 0}, // Back face indices
+    {4, 0, 1}  // Left face indices
+};
+
+// Definition of quad indices for the base of the pyramid
+static GLubyte PquadIndices[1][4] =
+{
+    {0, 3, 2, 1} // Base indices
+};
+
+// Function to draw a pyramid with customizable material properties
+void drawpyramid(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    // Define material properties for the pyramid
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    // Draw the triangular faces of the pyramid
+    glBegin(GL_TRIANGLES);
+    for (GLint i = 0; i < 4; i++)
+    {
+        // Calculate and set the normal vector for the current triangle face
+        getNormal3p(v_pyramid[p_Indices[i][0]][0], v_pyramid[p_Indices[i][0]][1], v_pyramid[p_Indices[i][0]][2],
+            v_pyramid[p_Indices[i][1]][0], v_pyramid[p_Indices[i][1]][1], v_pyramid[p_Indices[i][1]][2],
+            v_pyramid[p_Indices[i][2]][0], v_pyramid[p_Indices[i][2]][1], v_pyramid[p_Indices[i][2]][2]);
+
+        // Specify vertices of the current triangle face
+        glVertex3fv(&v_pyramid[p_Indices[i][0]][0]);
+        glVertex3fv(&v_pyramid[p_Indices[i][1]][0]);
+        glVertex3fv(&v_pyramid[p_Indices[i][2]][0]);
+    }
+    glEnd();
+
+    // Draw the base of the pyramid
+    glBegin(GL_QUADS);
+    for (GLint i = 0; i < 1; i++)
+    {
+        // Calculate and set the normal vector for the base quad
+        getNormal3p(v_pyramid[PquadIndices[i][0]][0], v_pyramid[PquadIndices[i][0]][1], v_pyramid[PquadIndices[i][0]][2],
+            v_pyramid[PquadIndices[i][1]][0], v_pyramid[PquadIndices[i][1]][1], v_pyramid[PquadIndices[i][1]][2],
+            v_pyramid[PquadIndices[i][2]][0], v_pyramid[PquadIndices[i][2]][1], v_pyramid[PquadIndices[i][2]][2]);
+
+        // Specify vertices of the base quad
+        glVertex3fv(&v_pyramid[PquadIndices[i][0]][0]);
+        glVertex3fv(&v_pyramid[PquadIndices[i][1]][0]);
+        glVertex3fv(&v_pyramid[PquadIndices[i][2]][0]);
+        glVertex3fv(&v_pyramid[PquadIndices[i][3]][0]);
+    }
+    glEnd();
+}
+
+// Function to draw a custom polygon with customizable material properties
+void polygon(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    // Define material properties for the polygon
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    // Draw the polygon using GL_POLYGON
+    glBegin(GL_POLYGON);
+    glVertex2f(0, 0);
+    glVertex2f(6, 0);
+    glVertex2f(5.8, 1);
+    glVertex2f(5.2, 2);
+    glVertex2f(5, 2.2);
+    glVertex2f(4, 2.8);
+    glVertex2f(3, 3);
+    glVertex2f(2, 2.8);
+    glVertex2f(1, 2.2);
+    glVertex2f(0.8, 2);
+    glVertex2f(0.2, 1);
+    glEnd();
+}
+
+// Function to draw a polygon with lines
+void polygonLine(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    // Define material properties for the polygon
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    // Begin drawing lines for the polygon
+    glBegin(GL_LINE_STRIP);
+    glVertex2f(6, 0);
+    glVertex2f(5.8, 1);
+    glVertex2f(5.2, 2);
+    glVertex2f(5, 2.2);
+    glVertex2f(4, 2.8);
+    glVertex2f(3, 3);
+    glVertex2f(2, 2.8);
+    glVertex2f(1, 2.2);
+    glVertex2f(0.8, 2);
+    glVertex2f(0.2, 1);
+    glVertex2f(0, 0);
+    glEnd();
+}
+
+// Function to draw a sphere with customizable material properties
+void drawSphere(GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    // Define material properties for the sphere
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { ambX, ambY, ambZ, 1.0 };
+    GLfloat mat_diffuse[] = { difX, difY, difZ, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { shine };
+
+    // Set the material properties
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+
+    // Draw a solid sphere
+    glutSolidSphere(3.0, 20, 16);
+}
+
+// Scene graph **************************************************************
+//
+// Every piece of furniture is a SceneNode with a transform relative to its
+// parent, and its parts are SceneObjects placed relative to that node. The
+// furniture functions below run once at startup to build the graph. World
+// matrices are cached on the CPU and only recomputed for nodes marked dirty
+// (and their descendants), so moving a whole cupboard is one setNodeTransform
+// call, and per frame only the animated subtrees are recomputed. display() hands
+// the cached matrices straight to glLoadMatrixf.
+
+// Primitive shapes, one per draw function above
+enum Shape { SHAPE_CUBE, SHAPE_CARPET, SHAPE_TRAPEZOID, SHAPE_PYRAMID, SHAPE_SPHERE, SHAPE_POLYGON, SHAPE_POLYLINE };
+
+// Material arguments shared by every draw function
+struct Material
+{
+    GLfloat dif[3], amb[3], shine;
+};
+
+struct SceneObject
+{
+    Shape shape;
+    Material material;
+    int node;   // Node the object is attached to
+    Mat4 local; // Placement relative to the node
+    Mat4 world; // Cached node world * local
+    bool hidden; // Left out of drawing by a scene edit
+    bool mirror; // Shows the room's reflection (see Mirror reflections)
+};
+
+struct SceneNode
+{
+    const char* name;
+    int parent;                  // -1 for a root
+    Mat4 local;                  // Transform relative to the parent
+    Mat4 world;                  // Cached parent world * local
+    bool dirty;                  // local changed since world was computed
+    bool dynamic;                // Moves after load, so it is drawn every frame instead of baked
+    int layout;                  // Room layout the node belongs to (see the building generator)
+    int group;                   // Furniture group the node belongs to (see the building generator)
+    std::vector<int> children;   // Child node indices
+    std::vector<int> objects;    // Attached object indices
+};
+
+std::vector<SceneObject> sceneObjects;
+std::vector<SceneNode> sceneNodes;
+std::vector<int> dirtyNodes;
+
+// Function to create a node under parent (-1 for a root); returns its index
+int addNode(int parent, const char* name, const Mat4& local)
+{
+    SceneNode n;
+    n.name = name;
+    n.parent = parent;
+    n.local = local;
+    n.world = parent < 0 ? local : mat4Mul(sceneNodes[parent].world, local);
+    n.dirty = false;
+    n.dynamic = parent >= 0 && sceneNodes[parent].dynamic;
+    n.layout = parent >= 0 ? sceneNodes[parent].layout : 0;
+    n.group = parent >= 0 ? sceneNodes[parent].group : 0;
+    sceneNodes.push_back(n);
+    int index = (int)sceneNodes.size() - 1;
+    if (parent >= 0)
+        sceneNodes[parent].children.push_back(index);
+    return index;
+}
+
+// Function to change a node's transform; its subtree is refreshed by updateTransforms()
+void setNodeTransform(int node, const Mat4& local)
+{
+    sceneNodes[node].local = local;
+    if (!sceneNodes[node].dirty)
+    {
+        sceneNodes[node].dirty = true;
+        dirtyNodes.push_back(node);
+    }
+}
+
+// Function to recompute the world matrices of a node, its objects and all its descendants
+static void updateSubtree(int node)
+{
+    SceneNode& n = sceneNodes[node];
+    n.world = n.parent < 0 ? n.local : mat4Mul(sceneNodes[n.parent].world, n.local);
+    n.dirty = false;
+    for (size_t i = 0; i < n.objects.size(); i++)
+    {
+        SceneObject& o = sceneObjects[n.objects[i]];
+        o.world = mat4Mul(n.world, o.local);
+    }
+    for (size_t i = 0; i < n.children.size(); i++)
+        updateSubtree(n.children[i]);
+}
+
+// Function to bring every cached world matrix up to date after setNodeTransform() calls
+void updateTransforms()
+{
+    for (size_t i = 0; i < dirtyNodes.size(); i++)
+    {
+        int node = dirtyNodes[i];
+        if (!sceneNodes[node].dirty)
+            continue; // Already refreshed as part of a dirty ancestor
+
+        // Start from the top-most dirty ancestor so each subtree is refreshed once
+        int top = node;
+        for (int p = sceneNodes[node].parent; p >= 0; p = sceneNodes[p].parent)
+            if (sceneNodes[p].dirty)
+                top = p;
+        updateSubtree(top);
+    }
+    dirtyNodes.clear();
+}
+
+// Animation channels *******************************************************
+//
+// Everything that moves is a channel: a curve over time that rotates a node
+// about one of its axes or slides it along one. Every curve has the same form,
+//
+//     value = base + rate * t + amplitude * clamp(gain * sin(frequency * t + phase), -1, 1)
+//
+// so a pendulum is a plain sine, a clock hand a steady rate, and a drawer or a
+// door a sine clipped into open and closed plateaus by a gain above 1. The
+// channels are stored as structure-of-arrays and evaluated four at a time with
+// SSE, without a branch per channel; the results are then written over the
+// nodes' rest transforms. Channels belong to the layouts, so their number does
+// not grow with the number of rooms.
+
+struct AnimationChannels
+{
+    // Curve parameters; t is in seconds, rotations are in degrees
+    std::vector<GLfloat> base, rate, amplitude, frequency, phase, gain;
+
+    // Target of each channel: the node, the axis (0 = x, 1 = y, 2 = z) and the node's transform at rest
+    std::vector<int> node, axis;
+    std::vector<Mat4> rest;
+
+    // Results of the last evaluation; sine and cosine of the value in radians for rotations
+    std::vector<GLfloat> value, sine, cosine;
+};
+
+// Curve of one channel, in the terms of the formula above
+struct AnimationCurve
+{
+    GLfloat base, rate, amplitude, frequency, phase, gain;
+};
+
+AnimationChannels rotationChannels, translationChannels;
+std::chrono::steady_clock::time_point animationStart;   // t = 0 of every curve
+GLfloat fixedAnimationTime = -1;     // When set (by a replay), the t every curve is evaluated at instead of the clock
+GLfloat frameAnimationTime = 0;      // The t of the last evaluation
+
+// Function to animate a node by a curve; the node's current transform becomes its rest transform
+void addChannel(AnimationChannels& c, int node, int axis, const AnimationCurve& curve)
+{
+    c.base.push_back(curve.base);
+    c.rate.push_back(curve.rate);
+    c.amplitude.push_back(curve.amplitude);
+    c.frequency.push_back(curve.frequency);
+    c.phase.push_back(curve.phase);
+    c.gain.push_back(curve.gain);
+    c.node.push_back(node);
+    c.axis.push_back(axis);
+    c.rest.push_back(sceneNodes[node].local);
+    c.value.push_back(0);
+    c.sine.push_back(0);
+    c.cosine.push_back(1);
+    sceneNodes[node].dynamic = true;
+}
+
+#ifdef BEDROOM_SSE
+// Function to compute four sines at once: reduce to [-pi, pi], fold to [-pi/2, pi/2], then a Taylor polynomial
+static inline __m128 sin4(__m128 x)
+{
+    const __m128 round = _mm_set1_ps(12582912.0f);      // 1.5 * 2^23: adding it rounds to an integer
+    __m128 turns = _mm_sub_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(0.159154943f)), round), round);
+    x = _mm_sub_ps(x, _mm_mul_ps(turns, _mm_set1_ps(6.28318531f)));
+    const __m128 pi = _mm_set1_ps(3.14159265f);
+    x = _mm_min_ps(x, _mm_sub_ps(pi, x));
+    x = _mm_max_ps(x, _mm_sub_ps(_mm_sub_ps(_mm_setzero_ps(), pi), x));
+
+    __m128 x2 = _mm_mul_ps(x, x);
+    __m128 p = _mm_set1_ps(1.0f / 362880.0f);
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 5040.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f / 120.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(-1.0f / 6.0f));
+    p = _mm_add_ps(_mm_mul_ps(p, x2), _mm_set1_ps(1.0f));
+    return _mm_mul_ps(p, x);
+}
+#endif
+
+// Function to evaluate every curve of a channel set at time t, four channels at a time
+static void evaluateChannels(AnimationChannels& c, GLfloat t)
+{
+    size_t count = c.node.size(), i = 0;
+    const GLfloat toRadians = 3.14159265f / 180.0f;
+#ifdef BEDROOM_SSE
+    const __m128 time = _mm_set1_ps(t);
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 wave = sin4(_mm_add_ps(_mm_mul_ps(_mm_loadu_ps(&c.frequency[i]), time), _mm_loadu_ps(&c.phase[i])));
+        wave = _mm_mul_ps(wave, _mm_loadu_ps(&c.gain[i]));
+        wave = _mm_min_ps(_mm_max_ps(wave, _mm_set1_ps(-1.0f)), _mm_set1_ps(1.0f));
+        __m128 v = _mm_add_ps(_mm_loadu_ps(&c.base[i]), _mm_mul_ps(_mm_loadu_ps(&c.rate[i]), time));
+        v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(&c.amplitude[i]), wave));
+        _mm_storeu_ps(&c.value[i], v);
+
+        __m128 radians = _mm_mul_ps(v, _mm_set1_ps(toRadians));
+        _mm_storeu_ps(&c.sine[i], sin4(radians));
+        _mm_storeu_ps(&c.cosine[i], sin4(_mm_add_ps(radians, _mm_set1_ps(1.57079633f))));
+    }
+#endif
+    // The channels left over (all of them without SSE)
+    for (; i < count; i++)
+    {
+        GLfloat wave = std::min(1.0f, std::max(-1.0f, c.gain[i] * sinf(c.frequency[i] * t + c.phase[i])));
+        c.value[i] = c.base[i] + c.rate[i] * t + c.amplitude[i] * wave;
+        c.sine[i] = sinf(c.value[i] * toRadians);
+        c.cosine[i] = cosf(c.value[i] * toRadians);
+    }
+}
+
+// Function to set each rotated node to its rest transform times the rotation about its axis
+static void applyRotations(const AnimationChannels& c)
+{
+    for (size_t i = 0; i < c.node.size(); i++)
+    {
+        // Only the two columns across the axis change
+        Mat4 m = c.rest[i];
+        const GLfloat* r = c.rest[i].m;
+        int b = (c.axis[i] + 1) % 3 * 4, d = (c.axis[i] + 2) % 3 * 4;
+        for (int k = 0; k < 4; k++)
+        {
+            m.m[b + k] = r[b + k] * c.cosine[i] + r[d + k] * c.sine[i];
+            m.m[d + k] = r[d + k] * c.cosine[i] - r[b + k] * c.sine[i];
+        }
+        setNodeTransform(c.node[i], m);
+    }
+}
+
+// Function to set each translated node to its rest transform moved along its axis
+static void applyTranslations(const AnimationChannels& c)
+{
+    for (size_t i = 0; i < c.node.size(); i++)
+    {
+        Mat4 m = c.rest[i];
+        int a = c.axis[i] * 4;
+        for (int k = 0; k < 4; k++)
+            m.m[12 + k] += m.m[a + k] * c.value[i];
+        setNodeTransform(c.node[i], m);
+    }
+}
+
+// Function to pose every animated node for the current time
+void evaluateAnimation()
+{
+    GLfloat t = fixedAnimationTime >= 0
+                ? fixedAnimationTime
+                : std::chrono::duration<GLfloat>(std::chrono::steady_clock::now() - animationStart).count();
+    frameAnimationTime = t;
+    evaluateChannels(rotationChannels, t);
+    evaluateChannels(translationChannels, t);
+    applyRotations(rotationChannels);
+    applyTranslations(translationChannels);
+}
+
+// Phase of a layout's periodic motion, so rooms of different layouts do not move in step
+static GLfloat layoutPhase(int node, GLfloat spread)
+{
+    return sceneNodes[node].layout * spread;
+}
+
+// Function to record an object under a node; returns its index
+int addObject(int node, Shape shape, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ,
+              GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    SceneObject o;
+    o.shape = shape;
+    o.node = node;
+    o.local = local;
+    o.world = mat4Mul(sceneNodes[node].world, local);
+    o.hidden = false;
+    o.mirror = false;
+    o.material.dif[0] = difX; o.material.dif[1] = difY; o.material.dif[2] = difZ;
+    o.material.amb[0] = ambX; o.material.amb[1] = ambY; o.material.amb[2] = ambZ;
+    o.material.shine = shine;
+    sceneObjects.push_back(o);
+    int index = (int)sceneObjects.size() - 1;
+    sceneNodes[node].objects.push_back(index);
+    return index;
+}
+
+int addCube(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX = 0, GLfloat ambY = 0, GLfloat ambZ = 0, GLfloat shine = 50)
+{
+    return addObject(node, SHAPE_CUBE, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+int addCarpet(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX = 0, GLfloat ambY = 0, GLfloat ambZ = 0, GLfloat shine = 50)
+{
+    return addObject(node, SHAPE_CARPET, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+int addTrapezoid(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine = 50)
+{
+    return addObject(node, SHAPE_TRAPEZOID, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+int addPyramid(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    return addObject(node, SHAPE_PYRAMID, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+int addSphere(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine = 50)
+{
+    return addObject(node, SHAPE_SPHERE, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+int addPolygon(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    return addObject(node, SHAPE_POLYGON, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+int addPolygonLine(int node, const Mat4& local, GLfloat difX, GLfloat difY, GLfloat difZ, GLfloat ambX, GLfloat ambY, GLfloat ambZ, GLfloat shine)
+{
+    return addObject(node, SHAPE_POLYLINE, local, difX, difY, difZ, ambX, ambY, ambZ, shine);
+}
+
+// Function to draw one recorded object with the current modelview matrix
+void drawObject(const SceneObject& o, const GLfloat tint[3])
+{
+    Material m = o.material;
+    for (int k = 0; k < 3; k++)
+    {
+        m.dif[k] *= tint[k];
+        m.amb[k] *= tint[k];
+    }
+    switch (o.shape)
+    {
+        case SHAPE_CUBE:
+            drawCube1(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+        case SHAPE_CARPET:
+            drawCarpet(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+        case SHAPE_TRAPEZOID:
+            drawTrapezoid(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+        case SHAPE_PYRAMID:
+            drawpyramid(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+        case SHAPE_SPHERE:
+            drawSphere(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+        case SHAPE_POLYGON:
+            polygon(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+        case SHAPE_POLYLINE:
+            polygonLine(m.dif[0], m.dif[1], m.dif[2], m.amb[0], m.amb[1], m.amb[2], m.shine);
+            break;
+    }
+}
+
+// Function to add the cupboard's parts to the scene; returns its node
+int cupboard(int parent)
+{
+    // Cupboard/Almari ************************************************************
+    int node = addNode(parent, "cupboard", mat4Translate(4, 0, 4.4));
+
+    // Cupboard
+    addCube(node, place(0, 0, 0, 0.5, 1, 0.5), 0.5, 0.2, 0.2, 0.25, 0.1, 0.1);
+
+    // Cupboard's vertical striplines
+    addCube(node, place(0, 1, 1.5, 0.5, 0.01, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    addCube(node, place(0, 0.5, 1.5, 0.5, 0.01, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    addCube(node, place(0, 0, 1.5, 0.5, 0.01, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Cupboard's horizontal striplines
+    addCube(node, place(1.5, 0, 1.5, 0.01, 1, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    addCube(node, place(0.75, 1, 1.5, 0.01, 0.67, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    addCube(node, place(0, 0, 1.5, 0.01, 1, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Cupboard's handles
+    addCube(node, place(1, 1.4, 1.5, 0.02, 0.18, 0.01), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Sphere for the cupboard's handle
+    addSphere(node, place(1.02, 1.9, 1.51, 0.02, 0.02, 0.01), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 10);
+
+    // Left handle
+    addCube(node, place(0.5, 1.4, 1.5, 0.02, 0.18, 0.01), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Sphere for the left handle
+    addSphere(node, place(0.52, 1.9, 1.51, 0.02, 0.02, 0.01), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 10);
+
+    // Drawer handles
+    addCube(node, place(0.5, 0.7, 1.5, 0.16, 0.02, 0.01), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    addCube(node, place(0.5, 0.25, 1.5, 0.16, 0.02, 0.01), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    return node;
+}
+
+
+// A rectangular hole in a wall; u runs along the wall and v is the height
+struct Opening
+{
+    GLfloat u0, u1, v0, v1;
+};
+
+// Holes every room of a building shares, in room coordinates. Doors lead under the
+// neighbouring room's floating walls, the window hole into the next room's side.
+static const Opening SIDE_DOOR = { 16.5f, 18.5f, -4.7f, -1.2f };  // Partition at x = 14, u along z
+static const Opening WINDOW_HOLE = { 8.9f, 9.8f, 1.0f, 2.8f };    // Behind the window frame, u along z
+static const Opening FRONT_DOOR = { 10.5f, 12.5f, -4.7f, -1.2f }; // Front wall at z = 21, u along x
+
+// Function to add a wall normal to axis (0 = x, 2 = z) between t0 and t1, built from
+// cubes that leave the given openings free
+static void addWallWithOpenings(int node, int axis, GLfloat t0, GLfloat t1, GLfloat u0, GLfloat u1,
+                                GLfloat v0, GLfloat v1, const Opening* holes, int holeCount)
+{
+    // Split the wall into strips along u at every opening edge
+    std::vector<GLfloat> cuts;
+    cuts.push_back(u0);
+    cuts.push_back(u1);
+    for (int i = 0; i < holeCount; i++)
+    {
+        cuts.push_back(std::max(u0, std::min(u1, holes[i].u0)));
+        cuts.push_back(std::max(u0, std::min(u1, holes[i].u1)));
+    }
+    std::sort(cuts.begin(), cuts.end());
+    cuts.erase(std::unique(cuts.begin(), cuts.end()), cuts.end());
+
+    for (size_t c = 0; c + 1 < cuts.size(); c++)
+    {
+        GLfloat a = cuts[c], b = cuts[c + 1], mid = 0.5f * (a + b);
+
+        // Fill the strip from the bottom, skipping the openings it crosses
+        std::vector<Opening> crossing;
+        for (int i = 0; i < holeCount; i++)
+            if (holes[i].u0 < mid && mid < holes[i].u1)
+                crossing.push_back(holes[i]);
+        std::sort(crossing.begin(), crossing.end(), [](const Opening& p, const Opening& q) { return p.v0 < q.v0; });
+        crossing.push_back(Opening{ a, b, v1, v1 });
+
+        GLfloat bottom = v0;
+        for (size_t i = 0; i < crossing.size(); i++)
+        {
+            GLfloat top = std::max(v0, std::min(v1, crossing[i].v0));
+            if (top > bottom)
+            {
+                if (axis == 0)
+                    addCube(node, place(t0, bottom, a, (t1 - t0) / 3, (top - bottom) / 3, (b - a) / 3),
+                            1, 0.8, 0.7, 0.5, 0.4, 0.35);
+                else
+                    addCube(node, place(a, bottom, t0, (b - a) / 3, (top - bottom) / 3, (t1 - t0) / 3),
+                            1, 0.8, 0.7, 0.5, 0.4, 0.35);
+            }
+            bottom = std::max(bottom, crossing[i].v1);
+        }
+    }
+}
+
+// Function to add the room to the scene; returns its node. In a building the room is
+// closed off by a partition and a front wall whose doors, with the window hole, are
+// the portals to the neighbouring rooms.
+int room(int parent, bool partitioned = false)
+{
+    int node = addNode(parent, "room", mat4Identity());
+
+    // Carpet
+    addCarpet(node, place(3, -0.2, 7, 1.3, 0.01, 1.7), 0.4, 0.1, 0.0, 0.20, 0.05, 0.0);
+    
+    // Right wall
+    addCube(node, place(-1.5, -1, 0.5, 5, 2, 0.1), 1, 0.8, 0.7, 0.5, 0.4, 0.35);
+    
+    // Left wall
+    if (partitioned)
+        addWallWithOpenings(node, 0, -4.5, -1.5, 0, 15, -1, 5, &WINDOW_HOLE, 1);
+    else
+        addCube(node, place(-4.5, -1, 0, 1, 2, 5), 1, 0.8, 0.7, 0.5, 0.4, 0.35);
+    
+    // Wall besides the right wall
+    addCube(node, place(8, -1, 0, 0.2, 2, 5), 1, 0.8, 0.7, 0.5, 0.4, 0.35);
+    
+    // Ceiling
+    addCube(node, place(-2, 5.1, 0, 5, 0.1, 7), 1.0, 0.9, 0.8, 0.5, 0.45, 0.4);
+    
+    // Floor
+    addCube(node, place(-1, -5, 0, 5, 0.1, 7), 0.5, 0.1, 0.0, 0.25, 0.05, 0);
+
+    if (partitioned)
+    {
+        // Partition towards the next room along x, and the front wall towards the next row
+        Opening sideOpenings[2] = { SIDE_DOOR, WINDOW_HOLE };
+        addWallWithOpenings(node, 0, 13.7, 14, 0, 21, -4.7, 5.1, sideOpenings, 2);
+        addWallWithOpenings(node, 2, 20.7, 21, -4.5, 13.7, -4.7, 5.1, &FRONT_DOOR, 1);
+
+        // Door leaves hinged at one edge of each doorway, swinging into the room and back
+        int sideDoor = addNode(node, "sideDoor", mat4Translate(13.85, SIDE_DOOR.v0, SIDE_DOOR.u0));
+        AnimationCurve sideSwing = { -40, 0, 40, 2 * 3.14159265f / 12, layoutPhase(node, 0.9f), 3 };
+        addChannel(rotationChannels, sideDoor, 1, sideSwing);
+        addCube(sideDoor, place(-0.05, 0, 0, 0.1 / 3, (SIDE_DOOR.v1 - SIDE_DOOR.v0) / 3,
+                                (SIDE_DOOR.u1 - SIDE_DOOR.u0) / 3), 0.5, 0.25, 0.1, 0.25, 0.12, 0.05);
+
+        int frontDoor = addNode(node, "frontDoor", mat4Translate(FRONT_DOOR.u0, FRONT_DOOR.v0, 20.85));
+        AnimationCurve frontSwing = { 40, 0, 40, 2 * 3.14159265f / 15, layoutPhase(node, 1.1f) + 2, 3 };
+        addChannel(rotationChannels, frontDoor, 1, frontSwing);
+        addCube(frontDoor, place(0, 0, -0.05, (FRONT_DOOR.u1 - FRONT_DOOR.u0) / 3,
+                                 (FRONT_DOOR.v1 - FRONT_DOOR.v0) / 3, 0.1 / 3), 0.5, 0.25, 0.1, 0.25, 0.12, 0.05);
+    }
+
+    return node;
+}
+
+// Function to add the bed to the scene; returns its node
+int bed(int parent)
+{
+    int node = addNode(parent, "bed", mat4Translate(-2, -0.5, 6.2));
+
+    // Bed headboard
+    addCube(node, place(0, 0, 0, 0.1, 0.5, 0.9), 0.5, 0.2, 0.2, 0.25, 0.1, 0.1);
+    
+    // Bed body
+    addCube(node, place(2, 0, 0, 1, 0.2, 0.9), 0.824, 0.706, 0.549, 0.412, 0.353, 0.2745);
+    
+    // Pillows
+    addCube(node, placeRotated(2.5, 1, -0.2, 20, 0, 0, 1, 0.1, 0.15, 0.28), 0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
+    
+    addCube(node, placeRotated(2.5, 1, 1, 22, 0, 0, 1, 0.1, 0.15, 0.28), 0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
+    
+    // Blanket
+    addCube(node, place(3.4, 0.95, -0.7, 0.5, 0.05, 0.95), 0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
+    
+    // Blanket side left part
+    addCube(node, place(3.4, 0.2, 1.96, 0.5, 0.25, 0.05), 0.627, 0.322, 0.176, 0.3135, 0.161, 0.088);
+
+    return node;
+}
+
+// Function to add the bedside drawer to the scene; returns its node
+int bedsideDrawer(int parent)
+{
+    int node = addNode(parent, "bedsideDrawer", mat4Translate(0.5, -0.1, 8.7));
+
+    // Bedside drawer
+    addCube(node, place(0, 0, 0, 0.12, 0.2, 0.23), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Side drawer's drawer, sliding open and shut every ten seconds
+    int drawer = addNode(node, "drawer", mat4Identity());
+    AnimationCurve slide = { 0.1, 0, 0.1, 2 * 3.14159265f / 10, layoutPhase(node, 1.3f), 3 };
+    addChannel(translationChannels, drawer, 0, slide);
+    addCube(drawer, place(0.38, 0.1, 0.1, 0.0001, 0.11, 0.18), 0.3, 0.2, 0.2, 0.15, 0.1, 0.1);
+    
+    // Side drawer's knob
+    addSphere(drawer, place(0.4, 0.25, 0.35, 0.01, 0.02, 0.02), 0.3, 0.1, 0.0, 0.15, 0.05, 0.0);
+
+    return node;
+}
+
+
+// Function to add the lamp to the scene; returns its node
+int lamp(int parent)
+{
+    int node = addNode(parent, "lamp", mat4Translate(0.6, 0.5, 8.95));
+
+    // Lamp base
+    addCube(node, place(0, 0, 0, 0.07, 0.02, 0.07), 0, 0, 1, 0, 0, 0.5);
+    
+    // Lamp stand
+    addCube(node, place(0.1, -0.15, 0.1, 0.01, 0.2, 0.01), 1, 0, 0, 0.5, 0.0, 0.0);
+        
+    // Lamp shade
+    addTrapezoid(node, place(0, 0.4, -0.05, 0.08, 0.09, 0.08), 0.000, 0.000, 0.545, 0, 0, 0.2725);
+
+    return node;
+}
+
+// Function to add the Linkin Park poster to the scene; returns its node
+int LinkinParkPoster(int parent)
+{
+    int node = addNode(parent, "poster", mat4Translate(-1, 1.4, 4.6));
+
+    // Poster black background
+    addCube(node, place(0, 0, 0, 0.0001, 0.65, 0.8), 0, 0, 0, 0, 0, 0, 10);
+    
+    // Linkin Park logo components
+    
+    // First component
+    addCube(node, place(0.1, 0.7, 0.9, 0.0001, 0.02, 0.25), 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
+    
+    // Second component
+    addCube(node, placeRotated(0.1, 0.7, 1.6, -14, 1, 0, 0, 0.0001, 0.28, 0.02), 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
+    
+    // Third component
+    addCube(node, placeRotated(0.1, 0.4, 1.4, -14, 1, 0, 0, 0.0001, 0.29, 0.02), 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
+    
+    // Fourth component
+    addCube(node, placeRotated(0.1, 0.7, 0.9, 23, 1, 0, 0, 0.0001, 0.25, 0.02), 1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
+
+    return node;
+}
+
+// Function to add the wardrobe to the scene; returns its node
+int wardrobe(int parent)
+{
+    int node = addNode(parent, "wardrobe", mat4Translate(0, 0, 4));
+
+    // Wardrobe
+    addCube(node, place(0, 0, 0, 0.12, 0.6, 0.4), 0.3, 0.1, 0, 0.15, 0.05, 0);
+    
+    // Wardrobe's drawers with their handles, each opening and shutting on its own schedule
+    int index = 0;
+    for (float yPos = 1.4; yPos >= 0.2; yPos -= 0.4, index++)
+    {
+        int drawer = addNode(node, "wardrobeDrawer", mat4Identity());
+        AnimationCurve slide = { 0.125f, 0, 0.125f, 2 * 3.14159265f / (14 + 3 * index),
+                                 layoutPhase(node, 2.1f) + index * 1.9f, 4 };
+        addChannel(translationChannels, drawer, 0, slide);
+        addCube(drawer, place(0.36, yPos, 0.05, 0.0001, 0.11, 0.38), 0.5, 0.2, 0.2, 0.25, 0.1, 0.1);
+        addCube(drawer, place(0.37, yPos + 0.1, 0.3, 0.01, 0.03, 0.2), 0.3, 0.1, 0, 0.15, 0.05, 0.0);
+    }
+    return node;
+}
+
+// Function to add the dressing table to the scene; returns its node
+int dressingTable(int parent)
+{
+    // Dressing table main body ************************************************
+    int node = addNode(parent, "dressingTable", mat4Translate(5.9, 0, 4.6));
+
+    
+    // Dressing table left body
+    addCube(node, place(0, 0, 0, 0.2, 0.2, 0.2), 0.545, 0.271, 0.075, 0.2725, 0.1355, 0.0375);
+    
+    /* Commented out code for stripes on the left body
+    // Dressing table left body left stripe
+    glColor3f(0.2, 0.1, 0.1);
+    glPushMatrix();
+    glTranslatef(5.9, 0, 5.2);
+    glScalef(0.01, 0.3, 0.0001);
+    drawCube();
+    glPopMatrix();
+    
+    // Dressing table left body right stripe
+    glColor3f(0.2, 0.1, 0.1);
+    glPushMatrix();
+    glTranslatef(6.5, 0, 5.2);
+    glScalef(0.01, 0.2, 0.0001);
+    drawCube();
+    glPopMatrix();
+    
+    // Dressing table left body bottom stripe
+    glColor3f(0.2, 0.1, 0.1);
+    glPushMatrix();
+    glTranslatef(5.9, 0, 5.2);
+    glScalef(0.2, 0.01, 0.0001);
+    drawCube();
+    glPopMatrix();
+    */
+    
+    // Dressing table right body
+    addCube(node, place(1.1, 0, 0, 0.2, 0.2, 0.2), 0.545, 0.271, 0.075, 0.2725, 0.1355, 0.0375);
+    
+    /* Commented out code for stripes on the right body
+    // Dressing table right body left stripe
+    glColor3f(0.2, 0.1, 0.1);
+    glPushMatrix();
+    glTranslatef(7, 0, 5.2);
+    glScalef(0.01, 0.2, 0.0001);
+    drawCube();
+    glPopMatrix();
+    
+    // Dressing table right body right stripe
+    glColor3f(0.2, 0.1, 0.1);
+    glPushMatrix();
+    glTranslatef(7.6, 0, 5.2);
+    glScalef(0.01, 0.3, 0.0001);
+    drawCube();
+    glPopMatrix();
+    
+    // Dressing table right body bottom stripe
+    glColor3f(0.2, 0.1, 0.1);
+    glPushMatrix();
+    glTranslatef(7, 0, 5.2);
+    glScalef(0.2, 0.01, 0.0001);
+    drawCube();
+    glPopMatrix();
+    */
+    
+    // Dressing table upper body
+    addCube(node, place(0, 0.6, 0, 0.57, 0.1, 0.2), 0.545, 0.271, 0.075, 0.2725, 0.1355, 0.0375);
+    
+    // Dressing table upper body bottom stripe
+    addCube(node, place(0, 0.6, 0.6, 0.57, 0.01, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table upper body upper stripe
+    addCube(node, place(0, 0.9, 0.6, 0.57, 0.01, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table upper body handle
+    addCube(node, place(0.6, 0.75, 0.6, 0.16, 0.02, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table left body handle
+    addCube(node, place(0.5, 0.1, 0.6, 0.02, 0.13, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table right body handle
+    addCube(node, place(1.2, 0.1, 0.6, 0.02, 0.13, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table mirrors ************************************************
+    int mirrors = addNode(node, "mirrors", mat4Translate(0.3, 0.9, 0.1));
+    
+    // Dressing table main mirror
+    sceneObjects[addCube(mirrors, place(0, 0, 0, 0.36, 0.5, 0.0001), 0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10)].mirror = true;
+    
+    // Dressing table left mirror
+    sceneObjects[addCube(mirrors, place(-0.28, 0, 0, 0.1, 0.48, 0.0001), 0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10)].mirror = true;
+    
+    // Commented out code for stripes on the left mirror
+    // Dressing table left mirror left stripe
+    addCube(mirrors, place(-0.28, 0, 0.01, 0.019, 0.48, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table left mirror right stripe
+    addCube(mirrors, place(-0.03, 0, 0.01, 0.019, 0.48, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table mirror stripe
+    addCube(mirrors, place(-0.28, 0, 0.01, 0.55, 0.019, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table left mirror upper stripe
+    addCube(mirrors, place(-0.28, 1.4, 0.01, 0.1, 0.019, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table right mirror
+    sceneObjects[addCube(mirrors, place(1.05, 0, 0, 0.1, 0.48, 0.0001), 0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10)].mirror = true;
+    
+    // Dressing table left mirror upper stripe
+    addCube(mirrors, place(1.05, 1.4, 0.01, 0.1, 0.019, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table right mirror left stripe
+    addCube(mirrors, place(1.05, 0, 0.01, 0.019, 0.48, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table right mirror right stripe
+    addCube(mirrors, place(1.3, 0, 0.01, 0.019, 0.48, 0.0001), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Dressing table main mirror polygon part
+    sceneObjects[addPolygon(mirrors, place(0, 1.5, 0, 0.18, 0.18, 2), 0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10)].mirror = true;
+    
+    // Dressing table upper round stripe
+    addPolygonLine(mirrors, place(0, 1.5, 0.01, 0.18, 0.18, 1), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 50);
+
+    return node;
+}
+
+// Function to add the wall shelves and showpieces to the scene; returns its node
+int wallshelf(int parent)
+{
+    // Wall Shelf ******************************************************
+    int node = addNode(parent, "wallshelf", mat4Translate(1.5, 2.7, 3));
+
+    // Wall shelf one
+    addCube(node, place(0, 0, 0, 0.4, 0.03, 0.2), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Wall shelf two
+    addCube(node, place(-0.5, -0.4, 0, 0.4, 0.03, 0.2), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Wall shelf three
+    addCube(node, place(-1, -0.8, 0, 0.4, 0.03, 0.2), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Wall shelf four
+    addCube(node, place(-0.5, -1.2, 0, 0.4, 0.03, 0.2), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Wall shelf five
+    addCube(node, place(0, -1.6, 0, 0.4, 0.03, 0.2), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Showpiece on the bottom shelf from left 1
+    addCube(node, place(0, -1.5, 0, 0.04, 0.06, 0.2), 0.698, 0.133, 0.133, 0.349, 0.0665, 0.0665);
+
+    // Showpiece on the bottom shelf from left 2
+    addCube(node, place(0.5, -1.5, 0, 0.04, 0.06, 0.2), 0.729, 0.333, 0.827, 0.3645, 0.1665, 0.4135);
+
+    // Showpiece on the bottom shelf from left 3 lower portion
+    addCube(node, place(1, -1.5, 0, 0.04, 0.06, 0.2), 0.098, 0.098, 0.439, 0.049, 0.049, 0.2195);
+
+    // Showpiece on the bottom shelf from left 3 upper portion
+    addCube(node, place(1.01, -1.35, 0, 0.01, 0.05, 0.2), 0.529, 0.808, 0.980, 0.2645, 0.404, 0.490);
+
+    // Showpiece on the top shelf left 2
+    addCube(node, place(1, 0.01, 0, 0.05, 0.16, 0.01), 0.502, 0.502, 0.000, 0.251, 0.251, 0);
+
+    // Showpiece on the top shelf left 1
+    addCube(node, place(0.3, 0.01, 0, 0.16, 0.1, 0.01), 0, 0, 0.9, 0, 0, 0.45);
+
+    // Showpiece on 2nd shelf
+    addCube(node, place(-0.2, -0.3, 0, 0.16, 0.08, 0.01), 0.416, 0.353, 0.804, 0.208, 0.1765, 0.402);
+
+    // Showpiece on 3rd shelf left 1
+    addCube(node, place(-1.1, -0.8, 0, 0.05, 0.16, 0.01), 0.863, 0.078, 0.235, 0.4315, 0.039, 0.1175);
+
+    // Showpiece on 3rd shelf left 2
+    addCube(node, place(-0.8, -0.8, 0, 0.05, 0.12, 0.01), 0.780, 0.082, 0.522, 0.39, 0.041, 0.261);
+
+    // Showpiece on 3rd shelf left 3
+    addCube(node, place(-0.5, -0.8, 0, 0.05, 0.09, 0.01), 0.6, 0.196, 0.8, 0.3, 0.098, 0.4);
+
+    // Showpiece on 4th shelf
+    addPyramid(node, place(0.3, -1.2, 0, 0.2, 0.1, 0.2), 0.282, 0.239, 0.545, 0.141, 0.1195, 0.2725, 50);
+
+    // Showpiece on 4th shelf
+    addPyramid(node, place(-0.1, -1.2, 0, 0.15, 0.1, 0.2), 0.251, 0.878, 0.816, 0.1255, 0.439, 0.408, 50);
+
+    return node;
+}
+
+// Function to add a clock hand turning about the face's center at its real-time rate; returns its node
+static int clockHand(int clock, const char* name, GLfloat clockwiseDegrees, GLfloat degreesPerSecond)
+{
+    // Seen from the room a turn about +x is anticlockwise, and the hand points at 12 at -90 degrees
+    int node = addNode(clock, name, mat4Translate(0.25, 0.38, 0.14));
+    AnimationCurve curve = { -90 - clockwiseDegrees, -degreesPerSecond, 0, 0, 0, 0 };
+    addChannel(rotationChannels, node, 0, curve);
+    return node;
+}
+
+int clockStartSeconds = -1;          // Time of day the clock hands start at, in seconds; -1 until the scene is built
+
+// Function to fix the time of day the clock shows at t = 0: the local time when first asked, unless set before
+int clockTimeOfDay()
+{
+    if (clockStartSeconds < 0)
+    {
+        time_t now = time(NULL);
+        struct tm local = *localtime(&now);
+        clockStartSeconds = local.tm_hour * 3600 + local.tm_min * 60 + local.tm_sec;
+    }
+    return clockStartSeconds;
+}
+
+// Function to add the wall clock to the scene; returns its node
+int Clock(int parent)
+{
+    // Clock ************************************************************
+    int node = addNode(parent, "clock", mat4Translate(-0.9, 1.8, 7.87));
+
+    // Clock body
+    addCube(node, place(0, 0, 0, 0.08, 0.25, 0.1), 0.545, 0.271, 0.075, 0.271, 0.1335, 0.0375, 50);
+
+    // Clock body white
+    addCube(node, place(0.07, 0.1, 0.03, 0.06, 0.2, 0.08), 1.000, 0.894, 0.710, 1.000, 0.894, 0.710);
+
+    // Clock hour and minute handles, showing the local time
+    int seconds = clockTimeOfDay();
+    GLfloat minutes = seconds / 60 % 60 + seconds % 60 / 60.0f;
+    int hourHand = clockHand(node, "hourHand", (seconds / 3600 % 12) * 30 + minutes * 0.5f, 30.0f / 3600);
+    addCube(hourHand, mat4Scale(0.0001, 0.01, 0.04), 0, 0, 0, 0, 0, 0);
+    int minuteHand = clockHand(node, "minuteHand", minutes * 6, 6.0f / 60);
+    addCube(minuteHand, mat4Scale(0.0001, 0.012, 0.08), 0, 0, 0, 0, 0, 0);
+
+    // Clock pendulum stick, swinging 30 degrees either side of straight down once a second
+    int pendulum = addNode(node, "pendulum", mat4Translate(0.2, 0.2, 0.23));
+    AnimationCurve swing = { 180, 0, 30, 2 * 3.14159265f, layoutPhase(node, 0.7f), 1 };
+    addChannel(rotationChannels, pendulum, 0, swing);
+    addCube(pendulum, mat4Scale(0.0001, 0.2, 0.03), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+
+    // Clock pendulum ball, hanging from the end of the stick
+    addSphere(pendulum, place(-0.02, 0.58, 0.12, 0.035, 0.035, 0.035), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 10);
+
+    // Clock top pyramid
+    addPyramid(node, place(0, 0.7, -0.06, 0.16, 0.1, 0.2), 0.5, 0.2, 0, 0.25, 0.1, 0, 50);
+
+    return node;
+}
+
+// Function to add the window to the scene; returns its node
+int window(int parent, bool open = false)
+{
+    // Window *******************************************************
+    int node = addNode(parent, "window", mat4Translate(-0.9, 1, 8.9));
+
+    // Window white open (left out when the wall behind has a hole to look through)
+    if (!open)
+        addCube(node, place(0, 0, 0, 0.0001, .6, .3), 1.0, 1.0, 1.0, 0.05, 0.05, 0.05);
+
+    // Window right side corner
+    addCube(node, place(0, 0, 0, 0.04, 0.6, 0.0001), 0.8, 0.6, 0.4, 0.4, 0.3, 0.2);
+
+    // Window left side corner
+    addCube(node, place(0, 0, 0.9, 0.04, 0.6, 0.0001), 0.8, 0.6, 0.4, 0.4, 0.3, 0.2);
+
+    // Window upper side corner
+    addCube(node, place(0.2, 1.7, 0, 0.0001, 0.05, 0.4), 0.7, 0.6, 0.5, 0.35, 0.3, 0.25);
+
+    // Window lower side corner
+    addCube(node, place(0.1, 0.02, 0, 0.0001, 0.02, 0.34), 0.7, 0.6, 0.5, 0.35, 0.3, 0.25);
+
+    // Window vertical bar 1
+    addCube(node, place(0.03, 1.1, 0, 0.0001, 0.02, 0.3), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 5);
+
+    // Window vertical bar 2
+    addCube(node, place(0.03, 0.6, 0, 0.0001, 0.02, 0.3), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 5);
+
+    // Window horizontal bar
+    addCube(node, place(0.03, 0, 0.4, 0.0001, 0.6, 0.02), 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 5);
+
+    return node;
+}
+
+// Function to add the round side table to the scene; returns its node
+int sphericalObject(int parent)
+{
+    int node = addNode(parent, "sideTable", mat4Translate(5, 0.2, 10));
+
+    // Table top part
+    addSphere(node, place(0, 0, 0, 0.1, 0.02, 0.1), 0.5, 0.2, 0, 0.25, 0.1, 0, 20);
+    
+    // Table leg
+    addCube(node, place(-0.02, -0.3, 0, 0.02, 0.1, 0.02), 0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    
+    // Base
+    addSphere(node, place(0, -0.3, 0, 0.05, 0.01, 0.05), 0.5, 0.2, 0, 0.25, 0.1, 0, 20);
+
+    return node;
+}
+
+// Building generator *******************************************************
+//
+// To measure culling, batching and memory at scale, the bedroom can be
+// repeated over an N x M grid of rooms (--rooms NxM, up to 10000 rooms). A
+// handful of room layouts are generated from a seed, each one omitting some of
+// the optional furniture and nudging the rest away from the walls. Every room
+// places one of those layouts and gets a tint from a small palette. The layouts
+// are the only scene-graph subtrees, so the baked geometry and the node count
+// stay the same size however many rooms the building has.
+
+static const int MAX_ROOMS = 10000;
+static const int BUILDING_LAYOUTS = 8;
+static const GLfloat ROOM_PITCH_X = 18.5f; // Room spacing along x: the floor spans -4.5 to 14
+static const GLfloat ROOM_PITCH_Z = 21.0f; // Room spacing along z: the floor spans 0 to 21
+static const GLfloat CELL_MIN_X = -4.5f;   // A room's cell runs from here to CELL_MIN_X + ROOM_PITCH_X
+static const GLfloat CELL_MIN_Y = -5.0f, CELL_MAX_Y = 5.4f;
+
+// One room of the building: which layout it shows, where, and in what tint
+struct RoomInstance
+{
+    int layout;
+    int column, row;
+    Mat4 world;
+    GLfloat tint[3];
+};
+
+int buildingColumns = 1, buildingRows = 1;
+unsigned buildingSeed = 1607063;
+std::vector<int> layoutNodes;       // Root node of each layout
+std::vector<RoomInstance> rooms;
+
+static const GLfloat roomTints[][3] =
+{
+    { 1.0, 1.0, 1.0 },
+    { 1.0, 0.92, 0.85 },
+    { 0.88, 0.95, 1.0 },
+    { 0.92, 1.0, 0.9 },
+    { 1.0, 0.9, 0.95 },
+};
+
+// Pieces of furniture, each drawn from its own batches and command list
+enum FurnitureGroup
+{
+    GROUP_ROOM, GROUP_BED, GROUP_BEDSIDE_DRAWER, GROUP_LAMP, GROUP_POSTER, GROUP_WALLSHELF, GROUP_WARDROBE,
+    GROUP_CUPBOARD, GROUP_DRESSING_TABLE, GROUP_CLOCK, GROUP_WINDOW, GROUP_SIDE_TABLE, GROUP_COUNT
+};
+
+// Function to tag a piece of furniture with its group, subtree included; returns the node
+static int setGroup(int node, int group)
+{
+    sceneNodes[node].group = group;
+    for (size_t i = 0; i < sceneNodes[node].children.size(); i++)
+        setGroup(sceneNodes[node].children[i], group);
+    return node;
+}
+
+// Function to add the furniture of one room layout; the first layout is the original room
+static int addRoomLayout(int layout, std::mt19937& rng)
+{
+    int bedroom = addNode(-1, "bedroom", mat4Identity());
+    sceneNodes[bedroom].layout = layout;
+    bool vary = layout > 0;
+    bool partitioned = buildingColumns * buildingRows > 1;
+    std::uniform_real_distribution<float> chance(0, 1), nudge(0, 0.3f);
+
+    setGroup(room(bedroom, partitioned), GROUP_ROOM);
+    setGroup(bed(bedroom), GROUP_BED);
+    setGroup(bedsideDrawer(bedroom), GROUP_BEDSIDE_DRAWER);
+    if (!vary || chance(rng) > 0.25f)
+        setGroup(lamp(bedroom), GROUP_LAMP);
+    if (!vary || chance(rng) > 0.4f)
+        setGroup(LinkinParkPoster(bedroom), GROUP_POSTER);
+    if (!vary || chance(rng) > 0.4f)
+        setGroup(wallshelf(bedroom), GROUP_WALLSHELF);
+
+    // The pieces standing against the back wall may stand a little further out
+    int backWall[3] = { setGroup(wardrobe(bedroom), GROUP_WARDROBE), setGroup(cupboard(bedroom), GROUP_CUPBOARD),
+                        setGroup(dressingTable(bedroom), GROUP_DRESSING_TABLE) };
+    if (vary)
+        for (int i = 0; i < 3; i++)
+            setNodeTransform(backWall[i], mat4Mul(mat4Translate(0, 0, nudge(rng)), sceneNodes[backWall[i]].local));
+
+    if (!vary || chance(rng) > 0.25f)
+        setGroup(Clock(bedroom), GROUP_CLOCK);
+    setGroup(window(bedroom, partitioned), GROUP_WINDOW);
+    if (!vary || chance(rng) > 0.3f)
+        setGroup(sphericalObject(bedroom), GROUP_SIDE_TABLE);
+    return bedroom;
+}
+
+// Function to build the layouts and lay the rooms out on the building grid
+void buildScene()
+{
+    sceneObjects.clear();
+    sceneNodes.clear();
+    dirtyNodes.clear();
+    rotationChannels = AnimationChannels();
+    translationChannels = AnimationChannels();
+    animationStart = std::chrono::steady_clock::now();
+    layoutNodes.clear();
+    rooms.clear();
+
+    std::mt19937 rng(buildingSeed);
+    int roomCount = buildingColumns * buildingRows;
+    int layoutCount = std::min(roomCount, BUILDING_LAYOUTS);
+    for (int l = 0; l < layoutCount; l++)
+        layoutNodes.push_back(addRoomLayout(l, rng));
+    updateTransforms();
+
+    // The room the camera starts in keeps the original layout and colours
+    std::uniform_int_distribution<int> pickLayout(0, layoutCount - 1);
+    std::uniform_int_distribution<int> pickTint(0, sizeof(roomTints) / sizeof(roomTints[0]) - 1);
+    for (int r = 0; r < buildingRows; r++)
+        for (int c = 0; c < buildingColumns; c++)
+        {
+            RoomInstance instance;
+            bool first = rooms.empty();
+            instance.layout = first ? 0 : pickLayout(rng);
+            instance.column = c;
+            instance.row = r;
+            instance.world = mat4Translate(c * ROOM_PITCH_X, 0, r * ROOM_PITCH_Z);
+            memcpy(instance.tint, roomTints[first ? 0 : pickTint(rng)], sizeof(instance.tint));
+            rooms.push_back(instance);
+        }
+}
+
+// Portal visibility ********************************************************
+//
+// Each room of the building is a cell, and its doors and window hole are the
+// portals to the neighbouring cells. Starting in the camera's cell with the view
+// frustum, every portal that faces away from the eye is clipped against the
+// current frustum. Whatever is left of it narrows the frustum for the cell
+// behind it; when several portals lead into one cell, the cell is visited
+// once, through the hull of all of them. Only the cells reached this way are
+// drawn. The far plane bounds
+// how far the recursion can go, so the cost per frame does not grow with the
+// size of the building. From outside the building, or with portals off, the
+// grid is searched as a tree of blocks instead, so a block the frustum misses
+// costs one test however many rooms it holds.
+
+// Points p with dot(n, p) + d >= 0 are on the inside
+struct Plane
+{
+    Vec3 n;
+    GLfloat d;
+};
+
+static const int MAX_FRUSTUM_PLANES = 16;
+static const int MAX_PORTAL_VERTICES = 4 + MAX_FRUSTUM_PLANES;
+static const int MAX_PORTAL_DEPTH = 12;
+static const int MAX_CELL_VIEW_VERTICES = 3 * MAX_PORTAL_VERTICES;    // At most three portals lead into a cell
+
+struct Frustum
+{
+    Plane planes[MAX_FRUSTUM_PLANES];
+    int count;
+};
+
+// A portal on a face of a room's cell, in room coordinates
+struct Portal
+{
+    int axis;              // 0: the face is normal to x (u along z); 2: normal to z (u along x)
+    GLfloat plane;         // Coordinate of the face along its axis
+    Opening hole;
+    int dColumn, dRow;     // Where the neighbouring cell is
+};
+
+static const Portal roomPortals[] =
+{
+    { 0, CELL_MIN_X + ROOM_PITCH_X, SIDE_DOOR, 1, 0 },
+    { 0, CELL_MIN_X + ROOM_PITCH_X, WINDOW_HOLE, 1, 0 },
+    { 0, CELL_MIN_X, SIDE_DOOR, -1, 0 },   // The door of the room along -x
+    { 0, CELL_MIN_X, WINDOW_HOLE, -1, 0 },
+    { 2, ROOM_PITCH_Z, FRONT_DOOR, 0, 1 },
+    { 2, 0, FRONT_DOOR, 0, -1 },           // The front door of the room along -z
+};
+
+// A cell reached this frame through one or more portals, with what is left of them
+struct CellView
+{
+    int column, row;
+    int count;
+    Vec3 points[MAX_CELL_VIEW_VERTICES];
+    int axis;              // Axis of the portals' face, or -1 when they lie on two faces
+    Plane portal;          // Plane of the first portal, facing into the cell
+};
+
+GLboolean usePortals = true;         // Portal culling (true) or the view frustum alone
+Frustum viewFrustum;                 // View frustum of the current frame
+FrameArray<int> visibleRooms;        // Rooms to draw this frame
+std::vector<unsigned> roomVisitFrame; // Frame in which each room was last marked visible
+unsigned visibilityFrame = 0;
+FrameArray<CellView> nextCells;      // Cells one step further from the camera's cell, to be visited next
+std::vector<unsigned> cellViewFrame; // Frame in which a portal last led into each cell
+std::vector<int> cellViewSlot;       // Where in nextCells that cell's view is
+
+static Plane makePlane(GLfloat a, GLfloat b, GLfloat c, GLfloat d)
+{
+    Plane p = { vec3(a, b, c), d };
+    return p;
+}
+
+// Function to extract the six frustum planes of a projection * view matrix; the far plane comes last
+static Frustum frustumFromMatrix(const Mat4& clip)
+{
+    const GLfloat* m = clip.m;
+    Frustum f;
+    f.count = 6;
+    for (int i = 0; i < 3; i++)
+    {
+        f.planes[2 * i] = makePlane(m[3] + m[i], m[7] + m[4 + i], m[11] + m[8 + i], m[15] + m[12 + i]);
+        f.planes[2 * i + 1] = makePlane(m[3] - m[i], m[7] - m[4 + i], m[11] - m[8 + i], m[15] - m[12 + i]);
+    }
+    return f;
+}
+
+static GLfloat planeDistance(const Plane& p, const Vec3& v)
+{
+    return vec3Dot(p.n, v) + p.d;
+}
+
+// Function to clip a convex polygon against every plane of a frustum; returns the new vertex count
+static int clipPolygon(Vec3* poly, int count, const Frustum& f)
+{
+    Vec3 out[MAX_PORTAL_VERTICES];
+    for (int p = 0; p < f.count && count >= 3; p++)
+    {
+        int n = 0;
+        for (int i = 0; i < count; i++)
+        {
+            const Vec3& a = poly[i];
+            const Vec3& b = poly[(i + 1) % count];
+            GLfloat da = planeDistance(f.planes[p], a), db = planeDistance(f.planes[p], b);
+            if (da >= 0 && n < MAX_PORTAL_VERTICES)
+                out[n++] = a;
+            if ((da >= 0) != (db >= 0) && n < MAX_PORTAL_VERTICES)
+            {
+                GLfloat t = da / (da - db);
+                out[n++] = vec3(a.x + (b.x - a.x) * t, a.y + (b.y - a.y) * t, a.z + (b.z - a.z) * t);
+            }
+        }
+        memcpy(poly, out, n * sizeof(Vec3));
+        count = n;
+    }
+    return count;
+}
+
+// Function to test a box against a frustum; false only when it is entirely outside one plane
+static bool boxInFrustum(const Frustum& f, const Vec3& lo, const Vec3& hi)
+{
+    for (int p = 0; p < f.count; p++)
+    {
+        const Vec3& n = f.planes[p].n;
+        Vec3 far = vec3(n.x >= 0 ? hi.x : lo.x, n.y >= 0 ? hi.y : lo.y, n.z >= 0 ? hi.z : lo.z);
+        if (planeDistance(f.planes[p], far) < 0)
+            return false;
+    }
+    return true;
+}
+
+static void markRoomVisible(int index)
+{
+    if (roomVisitFrame[index] == visibilityFrame)
+        return;
+    roomVisitFrame[index] = visibilityFrame;
+    visibleRooms.push_back(index);
+}
+
+// Function to clip the portals of a cell that lead away from the eye and hand what is left of each to
+// the view of the cell behind it
+static void gatherPortals(int column, int row, const Frustum& frustum, const Vec3& eye)
+{
+    GLfloat originX = column * ROOM_PITCH_X, originZ = row * ROOM_PITCH_Z;
+    for (size_t i = 0; i < sizeof(roomPortals) / sizeof(roomPortals[0]); i++)
+    {
+        const Portal& p = roomPortals[i];
+        int nextColumn = column + p.dColumn, nextRow = row + p.dRow;
+        if (nextColumn < 0 || nextColumn >= buildingColumns || nextRow < 0 || nextRow >= buildingRows)
+            continue;
+
+        // Only portals leading away from the eye; this also keeps the search from turning back
+        GLfloat face = p.plane + (p.axis == 0 ? originX : originZ);
+        GLfloat ahead = (face - (p.axis == 0 ? eye.x : eye.z)) * (p.dColumn + p.dRow);
+        if (ahead <= 0)
+            continue;
+
+        Vec3 poly[MAX_PORTAL_VERTICES];
+        const Opening& h = p.hole;
+        if (p.axis == 0)
+        {
+            poly[0] = vec3(face, h.v0, originZ + h.u0);
+            poly[1] = vec3(face, h.v0, originZ + h.u1);
+            poly[2] = vec3(face, h.v1, originZ + h.u1);
+            poly[3] = vec3(face, h.v1, originZ + h.u0);
+        }
+        else
+        {
+            poly[0] = vec3(originX + h.u0, h.v0, face);
+            poly[1] = vec3(originX + h.u1, h.v0, face);
+            poly[2] = vec3(originX + h.u1, h.v1, face);
+            poly[3] = vec3(originX + h.u0, h.v1, face);
+        }
+        int count = clipPolygon(poly, 4, frustum);
+        if (count < 3)
+            continue;
+
+        // The first portal into a cell this frame starts its view; later ones add their vertices
+        int index = nextRow * buildingColumns + nextColumn;
+        if (cellViewFrame[index] != visibilityFrame)
+        {
+            cellViewFrame[index] = visibilityFrame;
+            cellViewSlot[index] = (int)nextCells.size();
+            CellView view;
+            view.column = nextColumn;
+            view.row = nextRow;
+            view.count = 0;
+            view.axis = p.axis;
+            GLfloat sign = (GLfloat)(p.dColumn + p.dRow);
+            view.portal = p.axis == 0 ? makePlane(sign, 0, 0, -sign * face) : makePlane(0, 0, sign, -sign * face);
+            nextCells.push_back(view);
+        }
+        CellView& view = nextCells[cellViewSlot[index]];
+        if (view.axis != p.axis)
+            view.axis = -1;
+        for (int k = 0; k < count && view.count < MAX_CELL_VIEW_VERTICES; k++)
+            view.points[view.count++] = poly[k];
+    }
+}
+
+// Function to build the frustum a cell is seen through: one plane through the eye per edge of the
+// screen-space hull of the portal vertices that reached it, the portal as the near plane when they all
+// lie on one face, and the original far plane. False when nothing of the portals is left.
+static bool cellFrustum(const CellView& view, const Mat4& clip, const Vec3& eye, const Plane& farPlane, Frustum& out)
+{
+    // Project the vertices; they lie inside the view frustum, so in front of the eye
+    GLfloat sx[MAX_CELL_VIEW_VERTICES], sy[MAX_CELL_VIEW_VERTICES];
+    int order[MAX_CELL_VIEW_VERTICES];
+    const GLfloat* m = clip.m;
+    for (int k = 0; k < view.count; k++)
+    {
+        const Vec3& v = view.points[k];
+        GLfloat w = m[3] * v.x + m[7] * v.y + m[11] * v.z + m[15];
+        w = std::max(w, 1e-6f);
+        sx[k] = (m[0] * v.x + m[4] * v.y + m[8] * v.z + m[12]) / w;
+        sy[k] = (m[1] * v.x + m[5] * v.y + m[9] * v.z + m[13]) / w;
+        order[k] = k;
+    }
+    std::sort(order, order + view.count, [&sx, &sy](int a, int b)
+    {
+        return sx[a] != sx[b] ? sx[a] < sx[b] : sy[a] < sy[b];
+    });
+
+    // Monotone chain convex hull, counter-clockwise
+    int hull[2 * MAX_CELL_VIEW_VERTICES], n = 0;
+    for (int pass = 0; pass < 2; pass++)
+    {
+        int start = n;
+        for (int s = 0; s < view.count; s++)
+        {
+            int k = order[pass == 0 ? s : view.count - 1 - s];
+            while (n >= start + 2)
+            {
+                int a = hull[n - 2], b = hull[n - 1];
+                if ((sx[b] - sx[a]) * (sy[k] - sy[a]) - (sy[b] - sy[a]) * (sx[k] - sx[a]) > 0)
+                    break;
+                n--;
+            }
+            hull[n++] = k;
+        }
+        n--;    // The last point of each chain starts the other
+    }
+    if (n < 3)
+        return false;
+
+    Vec3 centroid = vec3(0, 0, 0);
+    for (int k = 0; k < n; k++)
+    {
+        const Vec3& v = view.points[hull[k]];
+        centroid = vec3(centroid.x + v.x / n, centroid.y + v.y / n, centroid.z + v.z / n);
+    }
+    out.count = 0;
+    for (int k = 0; k < n && out.count < MAX_FRUSTUM_PLANES - 2; k++)
+    {
+        Vec3 a = view.points[hull[k]], b = view.points[hull[(k + 1) % n]];
+        Vec3 normal = vec3Cross(vec3Sub(a, eye), vec3Sub(b, eye));
+        if (vec3Dot(normal, normal) < 1e-12f)
+            continue;
+        if (vec3Dot(normal, vec3Sub(centroid, eye)) < 0)
+            normal = vec3(-normal.x, -normal.y, -normal.z);
+        out.planes[out.count++] = makePlane(normal.x, normal.y, normal.z, -vec3Dot(normal, eye));
+    }
+    if (view.axis >= 0)
+        out.planes[out.count++] = view.portal;
+    out.planes[out.count++] = farPlane;
+    return true;
+}
+
+// Function to visit the cells the portals lead to, one step further from the camera's cell at a time.
+// A portal always leads one column or one row further from the eye, so every portal into a cell
+// comes from the step before it and the cell is visited once, through all of them.
+static void visitCells(int column, int row, const Frustum& frustum, const Mat4& clip, const Vec3& eye)
+{
+    if (cellViewFrame.size() != rooms.size())
+    {
+        cellViewFrame.assign(rooms.size(), 0);
+        cellViewSlot.assign(rooms.size(), 0);
+    }
+    markRoomVisible(row * buildingColumns + column);
+    nextCells.clear();
+    gatherPortals(column, row, frustum, eye);
+    const Plane& farPlane = frustum.planes[frustum.count - 1];
+    for (int depth = 1; depth <= MAX_PORTAL_DEPTH && !nextCells.empty(); depth++)
+    {
+        FrameArray<CellView> cells = nextCells;
+        nextCells.clear();
+        for (size_t i = 0; i < cells.size(); i++)
+        {
+            const CellView& view = cells[i];
+            markRoomVisible(view.row * buildingColumns + view.column);
+            Frustum next;
+            if (depth < MAX_PORTAL_DEPTH && cellFrustum(view, clip, eye, farPlane, next))
+                gatherPortals(view.column, view.row, next, eye);
+        }
+    }
+}
+
+// Function to mark the rooms of a block of the grid that the frustum sees; the block is halved along
+// its longer side until it is a single room or lies outside the frustum
+static void visitBlock(const Frustum& frustum, int column0, int row0, int column1, int row1)
+{
+    Vec3 lo = vec3(CELL_MIN_X + column0 * ROOM_PITCH_X, CELL_MIN_Y, row0 * ROOM_PITCH_Z);
+    Vec3 hi = vec3(CELL_MIN_X + column1 * ROOM_PITCH_X, CELL_MAX_Y, row1 * ROOM_PITCH_Z);
+    if (!boxInFrustum(frustum, lo, hi))
+        return;
+    if (column1 - column0 == 1 && row1 - row0 == 1)
+    {
+        markRoomVisible(row0 * buildingColumns + column0);
+        return;
+    }
+    if (column1 - column0 >= row1 - row0)
+    {
+        int middle = (column0 + column1) / 2;
+        visitBlock(frustum, column0, row0, middle, row1);
+        visitBlock(frustum, middle, row0, column1, row1);
+    }
+    else
+    {
+        int middle = (row0 + row1) / 2;
+        visitBlock(frustum, column0, row0, column1, middle);
+        visitBlock(frustum, column0, middle, column1, row1);
+    }
+}
+
+// Function to find the rooms to draw this frame
+void computeVisibleRooms(const Mat4& projection, const Mat4& view, const Vec3& eye)
+{
+    visibleRooms.clear();
+    if (roomVisitFrame.size() != rooms.size())
+        roomVisitFrame.assign(rooms.size(), 0);
+    visibilityFrame++;
+
+    Mat4 clip = mat4Mul(projection, view);
+    Frustum frustum = frustumFromMatrix(clip);
+    viewFrustum = frustum;
+    int column = (int)floorf((eye.x - CELL_MIN_X) / ROOM_PITCH_X);
+    int row = (int)floorf(eye.z / ROOM_PITCH_Z);
+    bool inside = column >= 0 && column < buildingColumns && row >= 0 && row < buildingRows
+                  && eye.y >= CELL_MIN_Y && eye.y <= CELL_MAX_Y;
+    if (usePortals && inside)
+    {
+        visitCells(column, row, frustum, clip, eye);
+        return;
+    }
+
+    // From outside the building the rooms are found by the view frustum alone
+    visitBlock(frustum, 0, 0, buildingColumns, buildingRows);
+}
+
+// Function to draw every visible room's objects in immediate mode, each with its cached world matrix.
+// This is the reference path the baked meshes can be compared against (key v).
+void drawImmediateScene(const Mat4& view)
+{
+    TraceSpan span("drawImmediateScene");
+    for (size_t r = 0; r < visibleRooms.size(); r++)
+    {
+        const RoomInstance& room = rooms[visibleRooms[r]];
+        Mat4 roomView = mat4Mul(view, room.world);
+        for (size_t i = 0; i < sceneObjects.size(); i++)
+        {
+            const SceneObject& o = sceneObjects[i];
+            if (sceneNodes[o.node].layout != room.layout || o.hidden)
+                continue;
+            Mat4 modelView = mat4Mul(roomView, o.world);
+            glLoadMatrixf(modelView.m);
+            drawObject(o, room.tint);
+        }
+    }
+    glLoadMatrixf(view.m);
+}
+
+// Mesh preprocessing *******************************************************
+//
+// Each primitive shape is expanded once into an indexed triangle mesh in
+// object space: quads, the crown polygon and the sphere are triangulated,
+// identical vertices are welded, and triangles are reordered for the
+// post-transform vertex cache with Tom Forsyth's linear-speed algorithm.
+// Nothing is left for the driver to triangulate per frame.
+
+struct BakedVertex
+{
+    GLfloat pos[3];
+    GLfloat normal[3];
+    GLfloat uv[2];
+};
+
+struct Mesh
+{
+    std::vector<BakedVertex> vertices;
+    std::vector<GLuint> indices;
+    GLenum primitive; // GL_TRIANGLES, or GL_LINES for the mirror outline
+};
+
+// Object-space mesh of every shape, built by buildShapeMeshes()
+Mesh shapeMeshes[SHAPE_POLYLINE + 1];
+
+// Size of the FIFO post-transform cache used to report ACMR
+static const int ACMR_CACHE_SIZE = 16;
+
+// Outline of the dressing-table mirror crown shared by polygon() and polygonLine()
+static const GLfloat crownOutline[11][2] =
+{
+    {0, 0}, {6, 0}, {5.8, 1}, {5.2, 2}, {5, 2.2}, {4, 2.8}, {3, 3}, {2, 2.8}, {1, 2.2}, {0.8, 2}, {0.2, 1}
+};
+
+static void meshVertex(Mesh& m, const Vec3& p, const Vec3& n, GLfloat s, GLfloat t)
+{
+    BakedVertex v;
+    v.pos[0] = p.x; v.pos[1] = p.y; v.pos[2] = p.z;
+    v.normal[0] = n.x; v.normal[1] = n.y; v.normal[2] = n.z;
+    v.uv[0] = s; v.uv[1] = t;
+    m.indices.push_back((GLuint)m.vertices.size());
+    m.vertices.push_back(v);
+}
+
+// Function to add one flat face given by its corners, split into a triangle fan.
+// The normal is taken from the first three corners, as getNormal3p() does for the immediate-mode shapes.
+static void meshFace(Mesh& m, const GLfloat (*corners)[3], int count, bool textured)
+{
+    static const GLfloat quadUV[4][2] = { {0, 0}, {1, 0}, {1, 1}, {0, 1} };
+    Vec3 p[4];
+    for (int i = 0; i < count; i++)
+        p[i] = vec3(corners[i][0], corners[i][1], corners[i][2]);
+
+    Vec3 u = vec3(p[1].x - p[0].x, p[1].y - p[0].y, p[1].z - p[0].z);
+    Vec3 v = vec3(p[2].x - p[0].x, p[2].y - p[0].y, p[2].z - p[0].z);
+    Vec3 n = vec3Normalize(vec3(u.y * v.z - u.z * v.y, u.z * v.x - u.x * v.z, u.x * v.y - u.y * v.x));
+
+    for (int i = 1; i + 1 < count; i++)
+    {
+        int tri[3] = { 0, i, i + 1 };
+        for (int k = 0; k < 3; k++)
+        {
+            GLfloat s = 0, t = 0;
+            if (textured)
+            {
+                const AtlasRegion& r = atlasRegions[TEX_CARPET];
+                s = r.u0 + quadUV[tri[k]][0] * (r.u1 - r.u0);
+                t = r.v0 + quadUV[tri[k]][1] * (r.v1 - r.v0);
+            }
+            meshVertex(m, p[tri[k]], n, s, t);
+        }
+    }
+}
+
+// Function to add a six-sided shape (cube or trapezoid) from its corner table and quad indices
+static void meshBox(Mesh& m, const GLfloat (*v)[3], const GLubyte (*quads)[4], bool textured)
+{
+    for (int i = 0; i < 6; i++)
+    {
+        GLfloat corners[4][3];
+        for (int k = 0; k < 4; k++)
+            memcpy(corners[k], v[quads[i][k]], sizeof(corners[k]));
+        meshFace(m, corners, 4, textured);
+    }
+}
+
+static void meshPyramid(Mesh& m)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        GLfloat corners[3][3];
+        for (int k = 0; k < 3; k++)
+            memcpy(corners[k], v_pyramid[p_Indices[i][k]], sizeof(corners[k]));
+        meshFace(m, corners, 3, false);
+    }
+    GLfloat base[4][3];
+    for (int k = 0; k < 4; k++)
+        memcpy(base[k], v_pyramid[PquadIndices[0][k]], sizeof(base[k]));
+    meshFace(m, base, 4, false);
+}
+
+// Function to add a sphere with the same radius and tessellation drawSphere() asks GLUT for
+static void meshSphere(Mesh& m)
+{
+    const GLfloat radius = 3.0f;
+    const int slices = 20, stacks = 16;
+    for (int i = 0; i < stacks; i++)
+    {
+        GLfloat phi0 = 3.14159265f * i / stacks, phi1 = 3.14159265f * (i + 1) / stacks;
+        for (int j = 0; j < slices; j++)
+        {
+            GLfloat th0 = 2 * 3.14159265f * j / slices, th1 = 2 * 3.14159265f * (j + 1) / slices;
+            Vec3 unit[4] =
+            {
+                vec3(sinf(phi0) * cosf(th0), cosf(phi0), sinf(phi0) * sinf(th0)),
+                vec3(sinf(phi0) * cosf(th1), cosf(phi0), sinf(phi0) * sinf(th1)),
+                vec3(sinf(phi1) * cosf(th1), cosf(phi1), sinf(phi1) * sinf(th1)),
+                vec3(sinf(phi1) * cosf(th0), cosf(phi1), sinf(phi1) * sinf(th0))
+            };
+            static const int tris[6] = { 0, 2, 1, 0, 3, 2 };
+            for (int k = 0; k < 6; k++)
+            {
+                const Vec3& u = unit[tris[k]];
+                meshVertex(m, vec3(u.x * radius, u.y * radius, u.z * radius), u, 0, 0);
+            }
+        }
+    }
+}
+
+// Function to add the mirror crown (filled) or its outline (line segments)
+static void meshCrown(Mesh& m, bool outline)
+{
+    Vec3 n = vec3(0, 0, 1);
+    if (outline)
+    {
+        // polygonLine() draws the outline from the second point round to the first
+        for (int i = 1; i <= 10; i++)
+        {
+            int j = (i + 1) % 11;
+            meshVertex(m, vec3(crownOutline[i][0], crownOutline[i][1], 0), n, 0, 0);
+            meshVertex(m, vec3(crownOutline[j][0], crownOutline[j][1], 0), n, 0, 0);
+        }
+        return;
+    }
+    for (int i = 1; i + 1 < 11; i++)
+    {
+        int tri[3] = { 0, i, i + 1 };
+        for (int k = 0; k < 3; k++)
+            meshVertex(m, vec3(crownOutline[tri[k]][0], crownOutline[tri[k]][1], 0), n, 0, 0);
+    }
+}
+
+// Function to merge bit-identical vertices and rewrite the indices to match
+static void weldMesh(Mesh& m)
+{
+    std::vector<GLuint> order(m.vertices.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = (GLuint)i;
+    const std::vector<BakedVertex>& v = m.vertices;
+    std::sort(order.begin(), order.end(), [&v](GLuint a, GLuint b)
+              { return memcmp(&v[a], &v[b], sizeof(BakedVertex)) < 0; });
+
+    std::vector<BakedVertex> welded;
+    std::vector<GLuint> remap(v.size());
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        if (i == 0 || memcmp(&v[order[i]], &v[order[i - 1]], sizeof(BakedVertex)) != 0)
+            welded.push_back(v[order[i]]);
+        remap[order[i]] = (GLuint)welded.size() - 1;
+    }
+    for (size_t i = 0; i < m.indices.size(); i++)
+        m.indices[i] = remap[m.indices[i]];
+    m.vertices.swap(welded);
+
+    // Triangles that collapsed onto a welded vertex (the sphere's poles) cover no pixels
+    if (m.primitive == GL_TRIANGLES)
+    {
+        size_t kept = 0;
+        for (size_t i = 0; i + 2 < m.indices.size(); i += 3)
+        {
+            GLuint a = m.indices[i], b = m.indices[i + 1], c = m.indices[i + 2];
+            if (a == b || b == c || a == c)
+                continue;
+            m.indices[kept++] = a;
+            m.indices[kept++] = b;
+            m.indices[kept++] = c;
+        }
+        m.indices.resize(kept);
+    }
+}
+
+// Function to compute the average cache miss ratio (vertex shader runs per triangle) of an index list
+float computeACMR(const std::vector<GLuint>& indices)
+{
+    if (indices.size() < 3)
+        return 0;
+    GLuint cache[ACMR_CACHE_SIZE];
+    int cached = 0, head = 0, misses = 0;
+    for (size_t i = 0; i < indices.size(); i++)
+    {
+        bool hit = false;
+        for (int k = 0; k < cached && !hit; k++)
+            hit = cache[k] == indices[i];
+        if (hit)
+            continue;
+        misses++;
+        cache[head] = indices[i];
+        head = (head + 1) % ACMR_CACHE_SIZE;
+        if (cached < ACMR_CACHE_SIZE)
+            cached++;
+    }
+    return (float)misses / (indices.size() / 3);
+}
+
+// Score of a vertex for Forsyth's algorithm from its LRU cache position and remaining triangles
+static float forsythScore(int cachePosition, int remainingTriangles)
+{
+    const int cacheSize = 32;
+    if (remainingTriangles == 0)
+        return -1.0f;
+    float score = 0;
+    if (cachePosition >= 0)
+    {
+        if (cachePosition < 3)
+            score = 0.75f; // Vertices of the last triangle get a fixed score
+        else
+            score = powf(1.0f - (float)(cachePosition - 3) / (cacheSize - 3), 1.5f);
+    }
+    return score + 2.0f * powf((float)remainingTriangles, -0.5f);
+}
+
+// Function to reorder the triangles of a mesh for post-transform cache locality (Forsyth)
+static void optimizeVertexCache(Mesh& m)
+{
+    const int cacheSize = 32;
+    size_t triangleCount = m.indices.size() / 3, vertexCount = m.vertices.size();
+    if (m.primitive != GL_TRIANGLES || triangleCount < 2)
+        return;
+
+    // Triangle adjacency per vertex
+    std::vector<int> remaining(vertexCount, 0), offsets(vertexCount + 1, 0), adjacency(m.indices.size());
+    for (size_t i = 0; i < m.indices.size(); i++)
+        remaining[m.indices[i]]++;
+    for (size_t v = 0; v < vertexCount; v++)
+        offsets[v + 1] = offsets[v] + remaining[v];
+    std::vector<int> fill(offsets.begin(), offsets.end() - 1);
+    for (size_t i = 0; i < m.indices.size(); i++)
+        adjacency[fill[m.indices[i]]++] = (int)(i / 3);
+
+    std::vector<int> cachePosition(vertexCount, -1);
+    std::vector<float> vertexScore(vertexCount), triangleScore(triangleCount, 0);
+    std::vector<bool> emitted(triangleCount, false);
+    for (size_t v = 0; v < vertexCount; v++)
+        vertexScore[v] = forsythScore(-1, remaining[v]);
+    for (size_t t = 0; t < triangleCount; t++)
+        for (int k = 0; k < 3; k++)
+            triangleScore[t] += vertexScore[m.indices[t * 3 + k]];
+
+    std::vector<GLuint> result;
+    result.reserve(m.indices.size());
+    std::vector<int> cache, nextCache;
+    size_t scanFrom = 0;
+    int best = -1;
+    while (result.size() < m.indices.size())
+    {
+        if (best < 0)
+        {
+            // Nothing useful in the cache: take the next unemitted triangle
+            while (emitted[scanFrom])
+                scanFrom++;
+            best = (int)scanFrom;
+        }
+
+        emitted[best] = true;
+        nextCache.clear();
+        for (int k = 0; k < 3; k++)
+        {
+            GLuint v = m.indices[best * 3 + k];
+            result.push_back(v);
+            nextCache.push_back((int)v);
+
+            // Remove the triangle from the vertex's adjacency
+            int* begin = &adjacency[offsets[v]];
+            int* end = begin + remaining[v];
+            *std::find(begin, end, best) = *(end - 1);
+            remaining[v]--;
+        }
+        for (size_t i = 0; i < cache.size(); i++)
+            if (std::find(nextCache.begin(), nextCache.end(), cache[i]) == nextCache.end())
+                nextCache.push_back(cache[i]);
+
+        // Rescore every vertex that was or is in the cache, and the triangles touching them
+        for (size_t i = 0; i < nextCache.size(); i++)
+            cachePosition[nextCache[i]] = i < (size_t)cacheSize ? (int)i : -1;
+        for (size_t i = 0; i < nextCache.size(); i++)
+        {
+            int v = nextCache[i];
+            float score = forsythScore(cachePosition[v], remaining[v]);
+            float delta = score - vertexScore[v];
+            vertexScore[v] = score;
+            for (int a = offsets[v]; a < offsets[v] + remaining[v]; a++)
+                triangleScore[adjacency[a]] += delta;
+        }
+        if (nextCache.size() > (size_t)cacheSize)
+            nextCache.resize(cacheSize);
+        cache.swap(nextCache);
+
+        // Best next triangle among those touching the cache
+        best = -1;
+        float bestScore = -1;
+        for (size_t i = 0; i < cache.size(); i++)
+        {
+            int v = cache[i];
+            for (int a = offsets[v]; a < offsets[v] + remaining[v]; a++)
+                if (triangleScore[adjacency[a]] > bestScore)
+                {
+                    bestScore = triangleScore[adjacency[a]];
+                    best = adjacency[a];
+                }
+        }
+    }
+    m.indices.swap(result);
+}
+
+// Function to renumber vertices in the order the indices first use them, for linear vertex fetches
+static void reorderVerticesByFirstUse(Mesh& m)
+{
+    std::vector<GLuint> remap(m.vertices.size(), (GLuint)-1);
+    std::vector<BakedVertex> ordered;
+    ordered.reserve(m.vertices.size());
+    for (size_t i = 0; i < m.indices.size(); i++)
+    {
+        GLuint& v = remap[m.indices[i]];
+        if (v == (GLuint)-1)
+        {
+            v = (GLuint)ordered.size();
+            ordered.push_back(m.vertices[m.indices[i]]);
+        }
+        m.indices[i] = v;
+    }
+    m.vertices.swap(ordered);
+}
+
+// Function to triangulate, weld and cache-optimize every shape once, reporting ACMR before and after
+void buildShapeMeshes()
+{
+    static const char* names[] = { "cube", "carpet", "trapezoid", "pyramid", "sphere", "crown", "crown outline" };
+    for (int s = SHAPE_CUBE; s <= SHAPE_POLYLINE; s++)
+    {
+        Mesh& m = shapeMeshes[s];
+        m.vertices.clear();
+        m.indices.clear();
+        m.primitive = s == SHAPE_POLYLINE ? GL_LINES : GL_TRIANGLES;
+        switch (s)
+        {
+            case SHAPE_CUBE:      meshBox(m, v_cube, quadIndices, false); break;
+            case SHAPE_CARPET:    meshBox(m, v_cube, quadIndices, true); break;
+            case SHAPE_TRAPEZOID: meshBox(m, v_trapezoid, TquadIndices, false); break;
+            case SHAPE_PYRAMID:   meshPyramid(m); break;
+            case SHAPE_SPHERE:    meshSphere(m); break;
+            case SHAPE_POLYGON:   meshCrown(m, false); break;
+            case SHAPE_POLYLINE:  meshCrown(m, true); break;
+        }
+
+        size_t soupVertices = m.vertices.size();
+        float before = computeACMR(m.indices);
+        weldMesh(m);
+        float welded = computeACMR(m.indices);
+        optimizeVertexCache(m);
+        reorderVerticesByFirstUse(m);
+        if (m.primitive == GL_TRIANGLES)
+            std::cout << "Mesh " << names[s] << ": " << soupVertices << " -> " << m.vertices.size()
+                      << " vertices, ACMR " << before << " -> " << welded << " (welded) -> "
+                      << computeACMR(m.indices) << " (optimized)" << std::endl;
+    }
+}
+
+// Static geometry baking ***************************************************
+//
+// Everything that is not under a dynamic node never moves, so at load time
+// the mesh of each static object is transformed into its layout's space and
+// appended to one vertex and index buffer per material. A whole static room
+// then draws in one glDrawElements call per material instead of one
+// glBegin/glEnd per object, and every room sharing the layout reuses the same
+// buffers. Dynamic objects (everything an animation channel moves) draw
+// their shape meshes with their cached world matrices.
+
+// Fixed-function state that differs between batches besides the material
+enum BatchFlags
+{
+    BATCH_TEXTURED = 1,      // Sampled from the texture atlas (the carpet)
+    BATCH_LAMP_EMISSION = 2, // Glows while the lamp is switched on (the lamp shade)
+    BATCH_LINES = 4,         // Drawn as lines rather than triangles (the mirror outline)
+    BATCH_MIRROR = 8         // Shows the room's reflection (the dressing-table mirrors)
+};
+
+// Compact vertex as uploaded to the GL: 16 bytes instead of the 32 of BakedVertex.
+// Positions are 16-bit and relative to the mesh's bounding box; the fixed-function
+// pipeline reads them as plain integers, so each mesh carries the matrix that maps
+// them back into place. Signed byte normals are normalized by the GL itself, and
+// texture coordinates are 16-bit fractions dequantized through the texture matrix.
+struct PackedVertex
+{
+    GLshort pos[4];    // Quantized position; w is padding to keep the normal 4-byte aligned
+    GLbyte normal[4];  // Unit normal * 127; the fourth byte is padding
+    GLshort uv[2];     // Texture coordinate * UV_QUANT_SCALE
+};
+
+static const GLfloat POS_QUANT_RANGE = 32767.0f;
+static const GLfloat UV_QUANT_SCALE = 32767.0f;
+
+// Vertex and index buffers of one mesh uploaded to the GL
+struct GpuMesh
+{
+    GLuint vbo, ibo;
+    GLsizei indexCount;
+    GLenum indexType; // GL_UNSIGNED_SHORT when every index fits, else GL_UNSIGNED_INT
+    GLenum primitive;
+    GLsizei vertexCount;
+    Mat4 dequantize;  // Maps quantized positions back to the mesh's own space
+    GLuint lightmapUvs; // Second texture coordinate stream into the layout's lightmap, 0 if not baked
+};
+
+// Bytes of vertex data uploaded, and what the same vertices would take as floats
+size_t packedVertexBytes = 0, floatVertexBytes = 0;
+
+struct StaticBatch
+{
+    Material material;
+    int flags;
+    int group;      // Furniture group whose objects the batch holds
+    GpuMesh gpu;
+    Vec3 lo, hi;    // Bounds in room space
+};
+
+// Baked geometry of one room layout
+struct BakedLayout
+{
+    std::vector<StaticBatch> batches;
+    std::vector<int> staticObjects;
+    std::vector<int> dynamicObjects;
+    Vec3 lo, hi;                       // Bounds of the static geometry in room space
+    std::vector<int> groupBatches[GROUP_COUNT];  // Batch indices of each furniture group
+    Vec3 groupLo[GROUP_COUNT], groupHi[GROUP_COUNT];
+    GLuint lightmap;                   // Baked lighting of the static batches (see Lightmaps), 0 if none
+    unsigned lightmapTerms;            // Bit mask of the light switch terms summed into it
+    Vec3 mirrorLo, mirrorHi;           // Bounds of the mirror batches; lo > hi when there are none
+};
+
+std::vector<BakedLayout> bakedLayouts;
+GpuMesh shapeGpuMeshes[SHAPE_POLYLINE + 1];
+
+// Baked state flags of an object's shape
+static int shapeFlags(Shape shape)
+{
+    if (shape == SHAPE_CARPET)
+        return BATCH_TEXTURED;
+    if (shape == SHAPE_TRAPEZOID)
+        return BATCH_LAMP_EMISSION;
+    if (shape == SHAPE_POLYLINE)
+        return BATCH_LINES;
+    return 0;
+}
+
+// Baked state flags of an object: its shape's, and whether it is a mirror
+static int objectFlags(const SceneObject& o)
+{
+    return shapeFlags(o.shape) | (o.mirror ? BATCH_MIRROR : 0);
+}
+
+// Function to find (or create) the batch for a furniture group, material and flag combination
+static StaticBatch& batchFor(std::vector<StaticBatch>& staticBatches, const Material& m, int flags, int group)
+{
+    for (size_t i = 0; i < staticBatches.size(); i++)
+    {
+        StaticBatch& b = staticBatches[i];
+        if (b.flags == flags && b.group == group && memcmp(&b.material, &m, sizeof(Material)) == 0)
+            return b;
+    }
+    StaticBatch b;
+    b.material = m;
+    b.flags = flags;
+    b.group = group;
+    b.gpu.vbo = b.gpu.ibo = b.gpu.lightmapUvs = 0;
+    b.gpu.indexCount = 0;
+    staticBatches.push_back(b);
+    return staticBatches.back();
+}
+
+// Function to append a shape mesh transformed into world space
+static void appendTransformed(Mesh& dst, const Mesh& src, const Mat4& world)
+{
+    GLuint base = (GLuint)dst.vertices.size();
+    for (size_t i = 0; i < src.vertices.size(); i++)
+    {
+        BakedVertex v = src.vertices[i];
+        Vec3 p = mat4TransformPoint(world, vec3(v.pos[0], v.pos[1], v.pos[2]));
+        Vec3 n = vec3Normalize(mat4TransformNormal(world, vec3(v.normal[0], v.normal[1], v.normal[2])));
+        v.pos[0] = p.x; v.pos[1] = p.y; v.pos[2] = p.z;
+        v.normal[0] = n.x; v.normal[1] = n.y; v.normal[2] = n.z;
+        dst.vertices.push_back(v);
+    }
+    for (size_t i = 0; i < src.indices.size(); i++)
+        dst.indices.push_back(base + src.indices[i]);
+}
+
+// Function to upload a mesh, with 16-bit indices whenever they fit
+static void uploadMesh(GpuMesh& gpu, const Mesh& m, const char* label)
+{
+    gpu.indexCount = (GLsizei)m.indices.size();
+    gpu.vertexCount = (GLsizei)m.vertices.size();
+    gpu.primitive = m.primitive;
+
+    // Bounding box of the mesh; quantized positions span it symmetrically about its center. The step is
+    // the same on every axis, set by the longest: the GL turns normals by the inverse transpose of the
+    // modelview, so a different scale per axis would tilt every normal that is not along an axis
+    GLfloat lo[3] = { 1e30f, 1e30f, 1e30f }, hi[3] = { -1e30f, -1e30f, -1e30f };
+    for (size_t i = 0; i < m.vertices.size(); i++)
+        for (int k = 0; k < 3; k++)
+        {
+            lo[k] = std::min(lo[k], m.vertices[i].pos[k]);
+            hi[k] = std::max(hi[k], m.vertices[i].pos[k]);
+        }
+    GLfloat center[3], step = 0;
+    for (int k = 0; k < 3; k++)
+    {
+        center[k] = 0.5f * (lo[k] + hi[k]);
+        step = std::max(step, 0.5f * (hi[k] - lo[k]) / POS_QUANT_RANGE);
+    }
+    if (step <= 0)
+        step = 1;
+    gpu.dequantize = place(center[0], center[1], center[2], step, step, step);
+
+    std::vector<PackedVertex> packed(m.vertices.size());
+    for (size_t i = 0; i < m.vertices.size(); i++)
+    {
+        const BakedVertex& v = m.vertices[i];
+        PackedVertex& p = packed[i];
+        for (int k = 0; k < 3; k++)
+        {
+            p.pos[k] = (GLshort)lrintf((v.pos[k] - center[k]) / step);
+            p.normal[k] = (GLbyte)lrintf(v.normal[k] * 127.0f);
+        }
+        p.pos[3] = 0;
+        p.normal[3] = 0;
+        p.uv[0] = (GLshort)lrintf(v.uv[0] * UV_QUANT_SCALE);
+        p.uv[1] = (GLshort)lrintf(v.uv[1] * UV_QUANT_SCALE);
+    }
+    packedVertexBytes += packed.size() * sizeof(PackedVertex);
+    floatVertexBytes += m.vertices.size() * sizeof(BakedVertex);
+
+    gpu.vbo = gpuCreateBuffer(label);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+    gpuBufferData(GL_ARRAY_BUFFER, gpu.vbo, packed.size() * sizeof(PackedVertex), &packed[0], GL_STATIC_DRAW);
+
+    gpu.ibo = gpuCreateBuffer(label);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.ibo);
+    if (m.vertices.size() <= 65536)
+    {
+        std::vector<GLushort> shortIndices(m.indices.begin(), m.indices.end());
+        gpu.indexType = GL_UNSIGNED_SHORT;
+        gpuBufferData(GL_ELEMENT_ARRAY_BUFFER, gpu.ibo, shortIndices.size() * sizeof(GLushort), &shortIndices[0],
+                      GL_STATIC_DRAW);
+    }
+    else
+    {
+        gpu.indexType = GL_UNSIGNED_INT;
+        gpuBufferData(GL_ELEMENT_ARRAY_BUFFER, gpu.ibo, m.indices.size() * sizeof(GLuint), &m.indices[0],
+                      GL_STATIC_DRAW);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+static void releaseMesh(GpuMesh& gpu)
+{
+    if (gpu.vbo)
+    {
+        packedVertexBytes -= gpu.vertexCount * sizeof(PackedVertex);
+        floatVertexBytes -= gpu.vertexCount * sizeof(BakedVertex);
+    }
+    gpuDeleteBuffer(gpu.vbo);
+    gpuDeleteBuffer(gpu.ibo);
+    gpuDeleteBuffer(gpu.lightmapUvs);
+}
+
+// Function to upload the shape meshes that dynamic objects draw with
+void uploadShapeMeshes()
+{
+    for (int s = SHAPE_CUBE; s <= SHAPE_POLYLINE; s++)
+    {
+        releaseMesh(shapeGpuMeshes[s]);
+        uploadMesh(shapeGpuMeshes[s], shapeMeshes[s], "shape mesh");
+    }
+}
+
+// Totals gathered while baking, for the console report
+struct BakeStats
+{
+    size_t vertices, indices, triangleIndices;
+    float weightedACMR;
+};
+
+// Function to gather the visible static objects of a layout that use a batch into one mesh in room space
+static void gatherBatchMesh(const StaticBatch& b, const BakedLayout& layout, Mesh& mesh)
+{
+    mesh.primitive = (b.flags & BATCH_LINES) ? GL_LINES : GL_TRIANGLES;
+    for (size_t i = 0; i < layout.staticObjects.size(); i++)
+    {
+        const SceneObject& o = sceneObjects[layout.staticObjects[i]];
+        if (!o.hidden && objectFlags(o) == b.flags && sceneNodes[o.node].group == b.group
+            && memcmp(&o.material, &b.material, sizeof(Material)) == 0)
+            appendTransformed(mesh, shapeMeshes[o.shape], o.world);
+    }
+}
+
+// Function to (re)build one batch from the visible static objects of its layout that use it
+static void fillBatch(StaticBatch& b, const BakedLayout& layout, BakeStats* stats)
+{
+    Mesh mesh;
+    gatherBatchMesh(b, layout, mesh);
+
+    releaseMesh(b.gpu);
+    b.gpu.indexCount = 0;
+    b.lo = vec3(1e30f, 1e30f, 1e30f);
+    b.hi = vec3(-1e30f, -1e30f, -1e30f);
+    if (mesh.indices.empty())
+        return;
+    uploadMesh(b.gpu, mesh, "static batch");
+    for (size_t v = 0; v < mesh.vertices.size(); v++)
+    {
+        const GLfloat* p = mesh.vertices[v].pos;
+        b.lo = vec3(std::min(b.lo.x, p[0]), std::min(b.lo.y, p[1]), std::min(b.lo.z, p[2]));
+        b.hi = vec3(std::max(b.hi.x, p[0]), std::max(b.hi.y, p[1]), std::max(b.hi.z, p[2]));
+    }
+    if (stats)
+    {
+        stats->vertices += mesh.vertices.size();
+        stats->indices += mesh.indices.size();
+        if (mesh.primitive == GL_TRIANGLES)
+        {
+            stats->weightedACMR += computeACMR(mesh.indices) * mesh.indices.size();
+            stats->triangleIndices += mesh.indices.size();
+        }
+    }
+}
+
+// Function to order a layout's batches for drawing and refresh its bounds
+static void finishLayout(BakedLayout& layout)
+{
+    // Textured and line batches last so the common state changes least often
+    std::stable_sort(layout.batches.begin(), layout.batches.end(),
+                     [](const StaticBatch& a, const StaticBatch& b) { return a.flags < b.flags; });
+
+    layout.lo = vec3(1e30f, 1e30f, 1e30f);
+    layout.hi = vec3(-1e30f, -1e30f, -1e30f);
+    layout.mirrorLo = vec3(1e30f, 1e30f, 1e30f);
+    layout.mirrorHi = vec3(-1e30f, -1e30f, -1e30f);
+    for (size_t i = 0; i < layout.batches.size(); i++)
+    {
+        const StaticBatch& b = layout.batches[i];
+        layout.lo = vec3(std::min(layout.lo.x, b.lo.x), std::min(layout.lo.y, b.lo.y), std::min(layout.lo.z, b.lo.z));
+        layout.hi = vec3(std::max(layout.hi.x, b.hi.x), std::max(layout.hi.y, b.hi.y), std::max(layout.hi.z, b.hi.z));
+        if (!(b.flags & BATCH_MIRROR))
+            continue;
+        Vec3& lo = layout.mirrorLo;
+        Vec3& hi = layout.mirrorHi;
+        lo = vec3(std::min(lo.x, b.lo.x), std::min(lo.y, b.lo.y), std::min(lo.z, b.lo.z));
+        hi = vec3(std::max(hi.x, b.hi.x), std::max(hi.y, b.hi.y), std::max(hi.z, b.hi.z));
+    }
+
+    for (int g = 0; g < GROUP_COUNT; g++)
+    {
+        layout.groupBatches[g].clear();
+        layout.groupLo[g] = vec3(1e30f, 1e30f, 1e30f);
+        layout.groupHi[g] = vec3(-1e30f, -1e30f, -1e30f);
+    }
+    for (size_t i = 0; i < layout.batches.size(); i++)
+    {
+        const StaticBatch& b = layout.batches[i];
+        Vec3& lo = layout.groupLo[b.group];
+        Vec3& hi = layout.groupHi[b.group];
+        layout.groupBatches[b.group].push_back((int)i);
+        lo = vec3(std::min(lo.x, b.lo.x), std::min(lo.y, b.lo.y), std::min(lo.z, b.lo.z));
+        hi = vec3(std::max(hi.x, b.hi.x), std::max(hi.y, b.hi.y), std::max(hi.z, b.hi.z));
+    }
+}
+
+// Function to sort the objects of every layout into static and dynamic ones and find the
+// batches the static ones need; touches no GL, so the lightmap baker can use it without a window
+void collectStaticBatches()
+{
+    bakedLayouts.assign(layoutNodes.size(), BakedLayout());
+    for (size_t i = 0; i < sceneObjects.size(); i++)
+    {
+        const SceneObject& o = sceneObjects[i];
+        BakedLayout& layout = bakedLayouts[sceneNodes[o.node].layout];
+        if (sceneNodes[o.node].dynamic)
+        {
+            layout.dynamicObjects.push_back((int)i);
+            continue;
+        }
+        layout.staticObjects.push_back((int)i);
+        if (!o.hidden)
+            batchFor(layout.batches, o.material, objectFlags(o), sceneNodes[o.node].group);
+    }
+}
+
+void releaseLightmaps();
+void releaseShadowMaps();
+
+// Function to merge every static object into per-material vertex and index buffers, one set per layout
+void bakeStaticGeometry()
+{
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+        for (size_t i = 0; i < bakedLayouts[l].batches.size(); i++)
+            releaseMesh(bakedLayouts[l].batches[i].gpu);
+    releaseLightmaps();
+    releaseShadowMaps();
+    collectStaticBatches();
+
+    BakeStats stats = { 0, 0, 0, 0 };
+    size_t batchCount = 0, staticCount = 0, dynamicCount = 0;
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+    {
+        BakedLayout& layout = bakedLayouts[l];
+        staticCount += layout.staticObjects.size();
+        dynamicCount += layout.dynamicObjects.size();
+        for (size_t i = 0; i < layout.batches.size(); i++)
+            fillBatch(layout.batches[i], layout, &stats);
+        finishLayout(layout);
+        batchCount += layout.batches.size();
+    }
+
+    std::cout << "Static geometry: " << staticCount << " objects baked into " << batchCount << " batches over "
+              << bakedLayouts.size() << " layouts (" << stats.vertices << " vertices, " << stats.indices
+              << " indices, ACMR " << (stats.triangleIndices ? stats.weightedACMR / stats.triangleIndices : 0)
+              << "), " << dynamicCount << " dynamic objects" << std::endl;
+    std::cout << "Vertex memory: " << packedVertexBytes / 1024 << " KB packed (" << floatVertexBytes / 1024
+              << " KB as floats)" << std::endl;
+}
+
+// Function to report the size of the building and what drawing all of it costs
+void printSceneStats()
+{
+    size_t drawCalls = 0, triangles = 0;
+    for (size_t r = 0; r < rooms.size(); r++)
+    {
+        const BakedLayout& layout = bakedLayouts[rooms[r].layout];
+        drawCalls += layout.batches.size() + layout.dynamicObjects.size();
+        for (size_t i = 0; i < layout.batches.size(); i++)
+            if (layout.batches[i].gpu.primitive == GL_TRIANGLES)
+                triangles += layout.batches[i].gpu.indexCount / 3;
+    }
+    size_t graphBytes = sceneNodes.size() * sizeof(SceneNode) + sceneObjects.size() * sizeof(SceneObject)
+                        + rooms.size() * sizeof(RoomInstance);
+    std::cout << "Building: " << buildingColumns << "x" << buildingRows << " rooms (seed " << buildingSeed << "), "
+              << layoutNodes.size() << " layouts, " << sceneNodes.size() << " nodes, " << sceneObjects.size()
+              << " objects, " << graphBytes / 1024 << " KB scene graph" << std::endl;
+    std::cout << "Whole building: " << drawCalls << " draw calls, " << triangles << " static triangles" << std::endl;
+    std::cout << "Animation: " << rotationChannels.node.size() << " rotation and " << translationChannels.node.size()
+              << " translation channels" << std::endl;
+}
+
+void releaseAntiAliasing();
+void releaseSceneTargets();
+void releaseReflection();
+void releaseServerTarget();
+
+// Function to release every GL object the renderer owns and report any that are left; runs at exit
+void shutdownGpuResources()
+{
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+        for (size_t i = 0; i < bakedLayouts[l].batches.size(); i++)
+            releaseMesh(bakedLayouts[l].batches[i].gpu);
+    releaseLightmaps();
+    releaseShadowMaps();
+    for (int s = SHAPE_CUBE; s <= SHAPE_POLYLINE; s++)
+        releaseMesh(shapeGpuMeshes[s]);
+    gpuDeleteTexture(atlasTexture);
+    releaseAntiAliasing();
+    releaseSceneTargets();
+    releaseReflection();
+    releaseServerTarget();
+    reportGpuLeaks();
+}
+
+// Function to set the fixed-function material, matching the immediate-mode draw functions
+static void applyMaterial(const Material& m, int flags, const GLfloat tint[3])
+{
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { m.amb[0] * tint[0], m.amb[1] * tint[1], m.amb[2] * tint[2], 1.0 };
+    GLfloat mat_diffuse[] = { m.dif[0] * tint[0], m.dif[1] * tint[1], m.dif[2] * tint[2], 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat mat_shininess[] = { m.shine };
+    GLfloat mat_emission[] = { m.dif[0], m.dif[1], m.dif[2], 0.0 };
+
+    glMaterialfv(GL_FRONT, GL_AMBIENT, mat_ambient);
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse);
+    glMaterialfv(GL_FRONT, GL_SPECULAR, mat_specular);
+    glMaterialfv(GL_FRONT, GL_SHININESS, mat_shininess);
+    if ((flags & BATCH_LAMP_EMISSION) && switchLamp == true)
+        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
+    else
+        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+}
+
+// Function to draw one uploaded mesh with the current material; modelView includes its dequantization
+static void drawGpuMesh(const GpuMesh& gpu, int flags, const Mat4& modelView)
+{
+    glLoadMatrixf(modelView.m);
+    glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.ibo);
+    glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), (const GLvoid*)offsetof(PackedVertex, pos));
+    glNormalPointer(GL_BYTE, sizeof(PackedVertex), (const GLvoid*)offsetof(PackedVertex, normal));
+    if (flags & BATCH_TEXTURED)
+    {
+        glEnable(GL_TEXTURE_2D);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexCoordPointer(2, GL_SHORT, sizeof(PackedVertex), (const GLvoid*)offsetof(PackedVertex, uv));
+    }
+    glDrawElements(gpu.primitive, gpu.indexCount, gpu.indexType, 0);
+    if (flags & BATCH_TEXTURED)
+    {
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisable(GL_TEXTURE_2D);
+    }
+}
+
+bool headlessContext = false;   // The render server's context, made without GLUT
+
+// Function to draw a light bulb's unit sphere: GLUT's, or without GLUT (whose shapes need glutInit) the
+// shape mesh of the sphere, scaled from its radius of 3
+static void bulbSphere()
+{
+    if (!headlessContext)
+    {
+        glutSolidSphere(1.0, 16, 16);
+        return;
+    }
+    const GpuMesh& sphere = shapeGpuMeshes[SHAPE_SPHERE];
+    Mat4 modelView;
+    glGetFloatv(GL_MODELVIEW_MATRIX, modelView.m);
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    drawGpuMesh(sphere, 0, mat4Mul(mat4Mul(modelView, mat4Scale(1 / 3.0f, 1 / 3.0f, 1 / 3.0f)), sphere.dequantize));
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glLoadMatrixf(modelView.m);
+}
+
+// Parallel recording *******************************************************
+//
+// The frame's draw calls are prepared per furniture group. In every visible
+// room each group is culled against the view frustum and recorded into the
+// group's own command list, which holds plain data (mesh, material, matrix)
+// rather than GL calls. Each group is a job of the frame's task graph; a final
+// job merges the lists in state order for the GL thread to submit.
+
+struct DrawCommand
+{
+    const GpuMesh* mesh;
+    const Material* material;
+    const GLfloat* tint;
+    int flags;
+    const GLuint* lightmap; // The layout's lightmap, read when drawing; NULL for lit drawing
+    const RoomInstance* room; // Room the command draws, for its shadow maps and reflection
+    Mat4 modelView;     // Includes the mesh's dequantization
+};
+
+FrameArray<DrawCommand> groupCommands[GROUP_COUNT];
+FrameArray<DrawCommand> frameCommands;   // All groups merged in submission order
+Mat4 recordView;
+bool recordLightmaps = false;            // Set per frame: baked batches take their light from the lightmaps
+bool recordShadows = false;              // Set per frame: lit commands take the shadow lookups
+bool recordReflections = false;          // Set per frame: mirrors are drawn lit, to blend with their reflection
+bool shadowsActive = false;              // Set per frame: a shadowed light is on and its maps are up to date
+
+void setShadowState(bool on);
+void loadShadowMatrices(const Mat4& view, const RoomInstance& room);
+bool reflectionShown(const RoomInstance* room);
+void setReflectionState(bool on, const Mat4& view);
+
+// Function to record one furniture group of one room as seen through a view and frustum; commands with
+// any of skipFlags are left out
+void recordRoomGroup(FrameArray<DrawCommand>& list, const RoomInstance& room, int group, const Mat4& view,
+                     const Frustum& frustum, int skipFlags)
+{
+    const BakedLayout& layout = bakedLayouts[room.layout];
+    const std::vector<int>& batches = layout.groupBatches[group];
+    Mat4 roomView = mat4Mul(view, room.world);
+    Vec3 offset = vec3(room.world.m[12], room.world.m[13], room.world.m[14]);
+
+    if (!batches.empty()
+        && boxInFrustum(frustum, vec3(layout.groupLo[group].x + offset.x, layout.groupLo[group].y + offset.y,
+                                      layout.groupLo[group].z + offset.z),
+                        vec3(layout.groupHi[group].x + offset.x, layout.groupHi[group].y + offset.y,
+                             layout.groupHi[group].z + offset.z)))
+    {
+        for (size_t i = 0; i < batches.size(); i++)
+        {
+            const StaticBatch& b = layout.batches[batches[i]];
+            if (b.flags & skipFlags)
+                continue;
+            const GLuint* lightmap = recordLightmaps && b.gpu.lightmapUvs && layout.lightmap
+                                     && !(recordReflections && (b.flags & BATCH_MIRROR)) ? &layout.lightmap : NULL;
+            DrawCommand c = { &b.gpu, &b.material, room.tint, b.flags, lightmap, &room,
+                              mat4Mul(roomView, b.gpu.dequantize) };
+            list.push_back(c);
+        }
+    }
+
+    // Moving objects are not in the group's bounds, so they are always recorded
+    for (size_t i = 0; i < layout.dynamicObjects.size(); i++)
+    {
+        const SceneObject& o = sceneObjects[layout.dynamicObjects[i]];
+        if (o.hidden || sceneNodes[o.node].group != group || (objectFlags(o) & skipFlags))
+            continue;
+        const GpuMesh& mesh = shapeGpuMeshes[o.shape];
+        DrawCommand c = { &mesh, &o.material, room.tint, objectFlags(o), NULL, &room,
+                          mat4Mul(mat4Mul(roomView, o.world), mesh.dequantize) };
+        list.push_back(c);
+    }
+}
+
+// Function to record one furniture group of every visible room (a job per group)
+void recordGroup(int group)
+{
+    TraceSpan span("recordGroup", group);
+    FrameArray<DrawCommand>& list = groupCommands[group];
+    list.clear();
+    for (size_t r = 0; r < visibleRooms.size(); r++)
+        recordRoomGroup(list, rooms[visibleRooms[r]], group, recordView, viewFrustum, 0);
+}
+
+// Function to merge the group lists: lightmapped batches first, then plain lit ones, then
+// textured, lamp, line and mirror ones
+void sortCommands(int)
+{
+    TraceSpan span("sortCommands");
+    static const int flagOrder[] = { 0, BATCH_TEXTURED, BATCH_LAMP_EMISSION, BATCH_LINES, BATCH_MIRROR };
+    static const int flagCount = sizeof(flagOrder) / sizeof(flagOrder[0]);
+    size_t total = 0;
+    for (int g = 0; g < GROUP_COUNT; g++)
+        total += groupCommands[g].size();
+    frameCommands.clear();
+    frameCommands.reserve(total);
+    for (int lit = 0; lit < 2; lit++)
+        for (int f = 0; f < flagCount; f++)
+            for (int g = 0; g < GROUP_COUNT; g++)
+                for (size_t i = 0; i < groupCommands[g].size(); i++)
+                {
+                    const DrawCommand& c = groupCommands[g][i];
+                    if (c.flags == flagOrder[f] && (c.lightmap == NULL) == (lit == 1))
+                        frameCommands.push_back(c);
+                }
+}
+
+// Function to switch between lit drawing and drawing from a lightmap on texture unit 1
+static void setLightmapState(bool on)
+{
+    glActiveTexture(GL_TEXTURE1);
+    glClientActiveTexture(GL_TEXTURE1);
+    if (on)
+    {
+        glDisable(GL_LIGHTING);
+        glEnable(GL_TEXTURE_2D);
+        glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+        glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        glMatrixMode(GL_TEXTURE);
+        glLoadIdentity();
+        glScalef(1.0f / UV_QUANT_SCALE, 1.0f / UV_QUANT_SCALE, 1);
+        glMatrixMode(GL_MODELVIEW);
+    }
+    else
+    {
+        glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+        glDisable(GL_TEXTURE_2D);
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glEnable(GL_LIGHTING);
+    }
+    glActiveTexture(GL_TEXTURE0);
+    glClientActiveTexture(GL_TEXTURE0);
+}
+
+// Function to draw a list of recorded commands; view is the one they were recorded with
+void drawCommands(const FrameArray<DrawCommand>& list, const Mat4& view)
+{
+    // Texture coordinates arrive as 16-bit fractions
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glScalef(1.0f / UV_QUANT_SCALE, 1.0f / UV_QUANT_SCALE, 1);
+    glMatrixMode(GL_MODELVIEW);
+
+    glEnableClientState(GL_VERTEX_ARRAY);
+    glEnableClientState(GL_NORMAL_ARRAY);
+    GLuint boundLightmap = 0;
+    const RoomInstance* shadowedRoom = NULL;
+    bool reflecting = false;
+    for (size_t i = 0; i < list.size(); i++)
+    {
+        const DrawCommand& c = list[i];
+        bool reflected = (c.flags & BATCH_MIRROR) && reflectionShown(c.room);
+        if (shadowsActive && !c.lightmap && !reflected && !(c.flags & BATCH_LINES))
+        {
+            if (shadowedRoom == NULL)
+                setShadowState(true);
+            if (c.room != shadowedRoom)
+                loadShadowMatrices(view, *c.room);
+            shadowedRoom = c.room;
+        }
+        else if (shadowedRoom != NULL)
+        {
+            setShadowState(false);
+            shadowedRoom = NULL;
+        }
+        if (reflected != reflecting)
+            setReflectionState(reflected, view);
+        reflecting = reflected;
+        if (c.lightmap)
+        {
+            // The lightmap holds the lit material colour; the room's tint comes in as the vertex colour
+            if (boundLightmap == 0)
+                setLightmapState(true);
+            glActiveTexture(GL_TEXTURE1);
+            glClientActiveTexture(GL_TEXTURE1);
+            if (*c.lightmap != boundLightmap)
+                glBindTexture(GL_TEXTURE_2D, *c.lightmap);
+            boundLightmap = *c.lightmap;
+            glBindBuffer(GL_ARRAY_BUFFER, c.mesh->lightmapUvs);
+            glTexCoordPointer(2, GL_SHORT, 0, 0);
+            glActiveTexture(GL_TEXTURE0);
+            glClientActiveTexture(GL_TEXTURE0);
+            glColor3fv(c.tint);
+        }
+        else
+        {
+            if (boundLightmap != 0)
+                setLightmapState(false);
+            boundLightmap = 0;
+            applyMaterial(*c.material, c.flags, c.tint);
+        }
+        drawGpuMesh(*c.mesh, c.flags, c.modelView);
+    }
+    if (boundLightmap != 0)
+        setLightmapState(false);
+    if (shadowedRoom != NULL)
+        setShadowState(false);
+    if (reflecting)
+        setReflectionState(false, view);
+    glLoadMatrixf(view.m);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    glDisableClientState(GL_NORMAL_ARRAY);
+    glDisableClientState(GL_VERTEX_ARRAY);
+
+    glMatrixMode(GL_TEXTURE);
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
+}
+
+// Function to draw the visible rooms from the recorded and merged command lists
+void drawBakedScene(const Mat4& view)
+{
+    TraceSpan span("drawBakedScene");
+    drawCommands(frameCommands, view);
+}
+
+// Picking ******************************************************************
+//
+// A left click casts a ray from the eye through the cursor. The ray walks the
+// building grid one cell at a time, so only the rooms it crosses are looked at.
+// Within a room it descends the layout's bounding volume hierarchy over object
+// boxes, and each object whose box it enters is tested exactly against the
+// triangles of its shape mesh. Every room's geometry stays inside its cell, so
+// the first cell with a hit holds the nearest one. Nothing is read back from
+// the GL.
+
+static const int BVH_LEAF_OBJECTS = 2;
+static const int BVH_STACK_SIZE = 64;
+
+struct BVHNode
+{
+    Vec3 lo, hi;
+    int first;  // Leaf: first entry in LayoutBVH::objects; inner: left child (the right one follows it)
+    int count;  // Objects in a leaf, 0 for an inner node
+};
+
+struct LayoutBVH
+{
+    std::vector<BVHNode> nodes;
+    std::vector<int> objects;   // Static objects, grouped by leaf
+};
+
+struct PickResult
+{
+    int room;           // -1 when nothing was hit
+    int object;         // Index into sceneObjects
+    GLfloat distance;   // Along the ray, in scene units
+};
+
+std::vector<LayoutBVH> layoutBVHs;
+PickResult selection = { -1, -1, 0 };
+Mat4 frameProjection, frameView;    // Camera of the last frame drawn, for unprojecting clicks
+
+// Function to find the box around an object's shape mesh placed by its world matrix
+static void objectBounds(const SceneObject& o, Vec3& lo, Vec3& hi)
+{
+    const Mesh& mesh = shapeMeshes[o.shape];
+    Vec3 mlo = vec3(1e30f, 1e30f, 1e30f), mhi = vec3(-1e30f, -1e30f, -1e30f);
+    for (size_t i = 0; i < mesh.vertices.size(); i++)
+    {
+        const GLfloat* p = mesh.vertices[i].pos;
+        mlo = vec3(std::min(mlo.x, p[0]), std::min(mlo.y, p[1]), std::min(mlo.z, p[2]));
+        mhi = vec3(std::max(mhi.x, p[0]), std::max(mhi.y, p[1]), std::max(mhi.z, p[2]));
+    }
+    lo = vec3(1e30f, 1e30f, 1e30f);
+    hi = vec3(-1e30f, -1e30f, -1e30f);
+    for (int c = 0; c < 8; c++)
+    {
+        Vec3 p = mat4TransformPoint(o.world, vec3(c & 1 ? mhi.x : mlo.x, c & 2 ? mhi.y : mlo.y, c & 4 ? mhi.z : mlo.z));
+        lo = vec3(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+        hi = vec3(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+    }
+}
+
+struct BoxRef
+{
+    int object;
+    Vec3 lo, hi;
+};
+
+// Function to build the subtree over refs[first, first + count) into node
+static void buildBVHNode(LayoutBVH& bvh, std::vector<BoxRef>& refs, int node, int first, int count)
+{
+    Vec3 lo = vec3(1e30f, 1e30f, 1e30f), hi = vec3(-1e30f, -1e30f, -1e30f);
+    Vec3 clo = lo, chi = hi;
+    for (int i = first; i < first + count; i++)
+    {
+        const BoxRef& r = refs[i];
+        lo = vec3(std::min(lo.x, r.lo.x), std::min(lo.y, r.lo.y), std::min(lo.z, r.lo.z));
+        hi = vec3(std::max(hi.x, r.hi.x), std::max(hi.y, r.hi.y), std::max(hi.z, r.hi.z));
+        Vec3 c = vec3(r.lo.x + r.hi.x, r.lo.y + r.hi.y, r.lo.z + r.hi.z);
+        clo = vec3(std::min(clo.x, c.x), std::min(clo.y, c.y), std::min(clo.z, c.z));
+        chi = vec3(std::max(chi.x, c.x), std::max(chi.y, c.y), std::max(chi.z, c.z));
+    }
+    bvh.nodes[node].lo = lo;
+    bvh.nodes[node].hi = hi;
+    if (count <= BVH_LEAF_OBJECTS)
+    {
+        bvh.nodes[node].first = first;
+        bvh.nodes[node].count = count;
+        return;
+    }
+
+    // Split at the median of the box centres along their widest axis
+    Vec3 extent = vec3Sub(chi, clo);
+    int axis = extent.x >= extent.y && extent.x >= extent.z ? 0 : (extent.y >= extent.z ? 1 : 2);
+    int half = count / 2;
+    std::nth_element(refs.begin() + first, refs.begin() + first + half, refs.begin() + first + count,
+                     [axis](const BoxRef& a, const BoxRef& b)
+                     {
+                         return (&a.lo.x)[axis] + (&a.hi.x)[axis] < (&b.lo.x)[axis] + (&b.hi.x)[axis];
+                     });
+    int left = (int)bvh.nodes.size();
+    bvh.nodes.resize(left + 2);
+    bvh.nodes[node].first = left;
+    bvh.nodes[node].count = 0;
+    buildBVHNode(bvh, refs, left, first, half);
+    buildBVHNode(bvh, refs, left + 1, first + half, count - half);
+}
+
+// Function to build the picking hierarchy of every layout over its static objects
+void buildPickingBVH()
+{
+    layoutBVHs.assign(bakedLayouts.size(), LayoutBVH());
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+    {
+        const std::vector<int>& objects = bakedLayouts[l].staticObjects;
+        LayoutBVH& bvh = layoutBVHs[l];
+        if (objects.empty())
+            continue;
+        std::vector<BoxRef> refs(objects.size());
+        for (size_t i = 0; i < objects.size(); i++)
+        {
+            refs[i].object = objects[i];
+            objectBounds(sceneObjects[objects[i]], refs[i].lo, refs[i].hi);
+        }
+        bvh.nodes.resize(1);
+        buildBVHNode(bvh, refs, 0, 0, (int)refs.size());
+        for (size_t i = 0; i < refs.size(); i++)
+            bvh.objects.push_back(refs[i].object);
+    }
+}
+
+// Function to intersect a ray with a box; tNear is where the ray enters it
+static bool rayBox(const Vec3& origin, const Vec3& invDir, const Vec3& lo, const Vec3& hi, GLfloat maxT, GLfloat& tNear)
+{
+    GLfloat t0 = 0, t1 = maxT;
+    for (int k = 0; k < 3; k++)
+    {
+        GLfloat a = ((&lo.x)[k] - (&origin.x)[k]) * (&invDir.x)[k];
+        GLfloat b = ((&hi.x)[k] - (&origin.x)[k]) * (&invDir.x)[k];
+        t0 = std::max(t0, std::min(a, b));
+        t1 = std::min(t1, std::max(a, b));
+    }
+    tNear = t0;
+    return t0 <= t1;
+}
+
+// Function to intersect a ray with a triangle (Moller-Trumbore), from either side
+static bool rayTriangle(const Vec3& origin, const Vec3& dir, const GLfloat* a, const GLfloat* b, const GLfloat* c,
+                        GLfloat& t)
+{
+    Vec3 e1 = vec3(b[0] - a[0], b[1] - a[1], b[2] - a[2]);
+    Vec3 e2 = vec3(c[0] - a[0], c[1] - a[1], c[2] - a[2]);
+    Vec3 p = vec3Cross(dir, e2);
+    GLfloat det = vec3Dot(e1, p);
+    if (fabsf(det) < 1e-12f)
+        return false;
+    GLfloat inv = 1.0f / det;
+    Vec3 s = vec3(origin.x - a[0], origin.y - a[1], origin.z - a[2]);
+    GLfloat u = vec3Dot(s, p) * inv;
+    if (u < 0 || u > 1)
+        return false;
+    Vec3 q = vec3Cross(s, e1);
+    GLfloat v = vec3Dot(dir, q) * inv;
+    if (v < 0 || u + v > 1)
+        return false;
+    t = vec3Dot(e2, q) * inv;
+    return t > 0;
+}
+
+// Function to intersect a ray with an object's exact triangles. The ray is moved into the
+// shape's own space unnormalized, so t there is still the distance along the world ray.
+static bool rayObject(const SceneObject& o, const Vec3& origin, const Vec3& dir, GLfloat& t)
+{
+    const Mesh& mesh = shapeMeshes[o.shape];
+    if (mesh.primitive != GL_TRIANGLES)
+        return false;
+    Mat4 inv = mat4Inverse(o.world);
+    Vec3 lo = mat4TransformPoint(inv, origin), ld = mat4TransformVector(inv, dir);
+    bool hit = false;
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+    {
+        GLfloat ti;
+        if (rayTriangle(lo, ld, mesh.vertices[mesh.indices[i]].pos, mesh.vertices[mesh.indices[i + 1]].pos,
+                        mesh.vertices[mesh.indices[i + 2]].pos, ti) && ti < t)
+        {
+            t = ti;
+            hit = true;
+        }
+    }
+    return hit;
+}
+
+// Function to test the objects of one room, keeping the nearest hit in best
+static void pickInRoom(int roomIndex, const Vec3& origin, const Vec3& dir, PickResult& best)
+{
+    const RoomInstance& room = rooms[roomIndex];
+    const LayoutBVH& bvh = layoutBVHs[room.layout];
+    Vec3 o = vec3(origin.x - room.world.m[12], origin.y - room.world.m[13], origin.z - room.world.m[14]);
+    Vec3 invDir = vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    GLfloat nearest = best.room >= 0 ? best.distance : 1e30f;
+
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    if (!bvh.nodes.empty())
+        stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode& node = bvh.nodes[stack[--top]];
+        GLfloat tNear;
+        if (!rayBox(o, invDir, node.lo, node.hi, nearest, tNear))
+            continue;
+        if (node.count == 0)
+        {
+            // Visit the nearer child first
+            GLfloat tLeft, tRight;
+            bool left = rayBox(o, invDir, bvh.nodes[node.first].lo, bvh.nodes[node.first].hi, nearest, tLeft);
+            bool right = rayBox(o, invDir, bvh.nodes[node.first + 1].lo, bvh.nodes[node.first + 1].hi, nearest, tRight);
+            if (left && right && tLeft < tRight)
+            {
+                stack[top++] = node.first + 1;
+                stack[top++] = node.first;
+            }
+            else
+            {
+                if (left)
+                    stack[top++] = node.first;
+                if (right)
+                    stack[top++] = node.first + 1;
+            }
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            const SceneObject& obj = sceneObjects[bvh.objects[i]];
+            if (!obj.hidden && rayObject(obj, o, dir, nearest))
+            {
+                best.room = roomIndex;
+                best.object = bvh.objects[i];
+                best.distance = nearest;
+            }
+        }
+    }
+
+    // The few moving objects are tested directly
+    const std::vector<int>& dynamicObjects = bakedLayouts[room.layout].dynamicObjects;
+    for (size_t i = 0; i < dynamicObjects.size(); i++)
+    {
+        const SceneObject& obj = sceneObjects[dynamicObjects[i]];
+        if (!obj.hidden && rayObject(obj, o, dir, nearest))
+        {
+            best.room = roomIndex;
+            best.object = dynamicObjects[i];
+            best.distance = nearest;
+        }
+    }
+}
+
+// Function to find the nearest object along a ray; dir must be unit length
+PickResult pickRay(const Vec3& origin, const Vec3& dir)
+{
+    PickResult best = { -1, -1, 0 };
+    Vec3 invDir = vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    Vec3 lo = vec3(CELL_MIN_X, CELL_MIN_Y, 0);
+    Vec3 hi = vec3(CELL_MIN_X + buildingColumns * ROOM_PITCH_X, CELL_MAX_Y, buildingRows * ROOM_PITCH_Z);
+    GLfloat tEnter;
+    if (!rayBox(origin, invDir, lo, hi, 1e30f, tEnter))
+        return best;
+
+    // Walk the cells the ray crosses, in order, from where it enters the building
+    GLfloat tExit = 1e30f;
+    for (int k = 0; k < 3; k++)
+        if ((&dir.x)[k] != 0)
+            tExit = std::min(tExit, std::max(((&lo.x)[k] - (&origin.x)[k]) * (&invDir.x)[k],
+                                              ((&hi.x)[k] - (&origin.x)[k]) * (&invDir.x)[k]));
+    Vec3 p = vec3(origin.x + dir.x * tEnter, origin.y + dir.y * tEnter, origin.z + dir.z * tEnter);
+    int column = std::max(0, std::min(buildingColumns - 1, (int)floorf((p.x - CELL_MIN_X) / ROOM_PITCH_X)));
+    int row = std::max(0, std::min(buildingRows - 1, (int)floorf(p.z / ROOM_PITCH_Z)));
+    int stepColumn = dir.x > 0 ? 1 : -1, stepRow = dir.z > 0 ? 1 : -1;
+    GLfloat nextX = dir.x == 0 ? 1e30f
+                    : (CELL_MIN_X + (column + (stepColumn > 0)) * ROOM_PITCH_X - origin.x) * invDir.x;
+    GLfloat nextZ = dir.z == 0 ? 1e30f : ((row + (stepRow > 0)) * ROOM_PITCH_Z - origin.z) * invDir.z;
+    GLfloat deltaX = dir.x == 0 ? 1e30f : ROOM_PITCH_X * fabsf(invDir.x);
+    GLfloat deltaZ = dir.z == 0 ? 1e30f : ROOM_PITCH_Z * fabsf(invDir.z);
+
+    while (column >= 0 && column < buildingColumns && row >= 0 && row < buildingRows)
+    {
+        pickInRoom(row * buildingColumns + column, origin, dir, best);
+        GLfloat cellExit = std::min(std::min(nextX, nextZ), tExit);
+        if ((best.room >= 0 && best.distance <= cellExit) || cellExit >= tExit)
+            break;
+        if (nextX < nextZ)
+        {
+            column += stepColumn;
+            nextX += deltaX;
+        }
+        else
+        {
+            row += stepRow;
+            nextZ += deltaZ;
+        }
+    }
+    return best;
+}
+
+// Function to pick the object under a window position with the camera of the last frame
+void mousePick(int button, int state, int x, int y)
+{
+    TraceSpan span("mousePick");
+    if (button != GLUT_LEFT_BUTTON || state != GLUT_DOWN)
+        return;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    // Unproject the cursor at the near and far planes
+    GLfloat ndcX = 2.0f * x / glutGet(GLUT_WINDOW_WIDTH) - 1;
+    GLfloat ndcY = 1 - 2.0f * y / glutGet(GLUT_WINDOW_HEIGHT);
+    Mat4 inv = mat4Inverse(mat4Mul(frameProjection, frameView));
+    Vec3 ends[2];
+    for (int i = 0; i < 2; i++)
+    {
+        GLfloat z = i == 0 ? -1.0f : 1.0f;
+        GLfloat w = inv.m[3] * ndcX + inv.m[7] * ndcY + inv.m[11] * z + inv.m[15];
+        Vec3 p = mat4TransformPoint(inv, vec3(ndcX, ndcY, z));
+        ends[i] = vec3(p.x / w, p.y / w, p.z / w);
+    }
+    Vec3 eye = vec3(eyeX, eyeY, eyeZ);
+    selection = pickRay(eye, vec3Normalize(vec3Sub(ends[1], ends[0])));
+
+    double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    if (selection.room < 0)
+    {
+        printf("Picked nothing (%.1f us)\n", us);
+        return;
+    }
+    const SceneObject& o = sceneObjects[selection.object];
+    printf("Picked %s object %d in room %d,%d at distance %.3f (%.1f us)\n", sceneNodes[o.node].name,
+           selection.object, rooms[selection.room].column, rooms[selection.room].row, selection.distance, us);
+}
+
+// Function to outline the box of the selected object
+void drawSelection(const Mat4& view)
+{
+    TraceSpan span("drawSelection");
+    if (selection.room < 0)
+        return;
+    Vec3 lo, hi;
+    objectBounds(sceneObjects[selection.object], lo, hi);
+    Mat4 modelView = mat4Mul(view, rooms[selection.room].world);
+    glLoadMatrixf(modelView.m);
+    glColor3f(1, 1, 0);
+    glBegin(GL_LINES);
+    for (int c = 0; c < 8; c++)
+        for (int axis = 1; axis < 8; axis <<= 1)
+            if (!(c & axis))
+            {
+                int d = c | axis;
+                glVertex3f(c & 1 ? hi.x : lo.x, c & 2 ? hi.y : lo.y, c & 4 ? hi.z : lo.z);
+                glVertex3f(d & 1 ? hi.x : lo.x, d & 2 ? hi.y : lo.y, d & 4 ? hi.z : lo.z);
+            }
+    glEnd();
+    glLoadMatrixf(view.m);
+}
+
+// Lightmaps ****************************************************************
+//
+// The static batches can take their lighting from a baked texture instead of
+// the fixed-function lights. The baker needs no GL, so it also runs on
+// machines without a display (--bake-lightmaps FILE). It splits every static
+// batch into planar charts of coplanar neighbouring triangles, packs the
+// charts of a layout into that layout's lightmap and ray traces each texel
+// against a hierarchy over the layout's triangles: direct light from the two
+// bulbs and the lamp spot, with shadows, plus one bounce of indirect light.
+// The bounce rays also give the ambient occlusion that darkens the ambient
+// light where furniture meets the floor and the walls, at no cost per frame.
+// The texels are baked as jobs, so the bake scales with the worker threads.
+// --lightmaps FILE loads a bake, baking and saving it first when the file is
+// missing or was made for different geometry. A static surface then costs one
+// lightmap fetch per pixel instead of three lights per vertex. Specular
+// highlights depend on the eye and are not baked. Every room is lit by its
+// own copy of the lights.
+//
+// Each texel is baked as separate terms: the global ambient, the lamp shade's
+// glow, and the ambient and the diffuse light (bounce included) of each
+// light. Every light switch turns whole terms on or off, so the lightmap for
+// any combination of switches is the saturating byte sum of the terms that
+// are on. It is summed, for the layouts on screen only, the first time a
+// combination is seen, and kept in a small cache so that flipping a switch
+// back only rebinds a texture.
+//
+// A scene edit that changes a layout's static furniture drops that layout's
+// lightmaps, since their shadows, bounce light and occlusion would still show
+// the old arrangement. The layout is lit by the lights again until the next
+// bake.
+
+static const GLfloat LIGHTMAP_DENSITY = 4;          // Texels per scene unit, halved until a layout fits
+static const int LIGHTMAP_PADDING = 1;              // Texels around a chart, filled from its nearest edge
+static const int LIGHTMAP_MAX_SIZE = 2048;
+static const int LIGHTMAP_BOUNCE_RAYS = 32;         // Indirect samples per texel, also the occlusion samples
+static const GLfloat LIGHTMAP_AO_DISTANCE = 1.0f;   // Surfaces nearer than this shade the ambient light
+static const int LIGHTMAP_JOBS_PER_LAYOUT = 16;
+static const GLfloat LIGHTMAP_COPLANAR = 0.999f;    // Normal agreement for neighbours to share a chart
+static const GLfloat LIGHTMAP_RAY_OFFSET = 1e-3f;   // Rays start this far off the surface
+static const unsigned LIGHTMAP_FILE_MAGIC = 0x324d4c42;   // "BLM2"
+static const GLfloat GLOBAL_AMBIENT = 0.2f;         // The GL's default light model ambient
+static const int LIGHTMAP_CACHE_SIZE = 8;           // Switch combinations kept summed per layout
+static const int LIGHTMAP_SUM_JOBS = 8;             // Jobs a layout's sum is split into
+
+// A light as the baker sees it, with the values lightOne(), lightTwo() and lampLight() set
+struct BakeLight
+{
+    Vec3 position, ambient, diffuse;
+    Vec3 spotDirection;         // Unit length
+    GLfloat spotCosCutoff;      // -1 for a point light
+};
+
+static const BakeLight bakeLights[] =
+{
+    { { 5.0f, 5.0f, 8.0f }, { 0.5f, 0.5f, 0.5f }, { 1.0f, 1.0f, 1.0f }, { 0, -1, 0 }, -1 },
+    { { 0.0f, 5.0f, 8.0f }, { 0.5f, 0.5f, 0.5f }, { 1.0f, 1.0f, 0.9f }, { 0, -1, 0 }, -1 },
+    // (0.3, -1, -0.8) normalized, with a 35 degree cutoff
+    { { 0.7f, 1.5f, 9.0f }, { 0.5f, 0.5f, 0.5f }, { 1.0f, 1.0f, 1.0f }, { 0.22809f, -0.76029f, -0.60823f },
+      0.81915f },
+};
+static const int BAKE_LIGHT_COUNT = sizeof(bakeLights) / sizeof(bakeLights[0]);
+
+// Baked terms of a texel, each switched as a whole by the light switches
+enum LightmapTerm
+{
+    TERM_GLOBAL_AMBIENT,            // Always on
+    TERM_EMISSION,                  // The lamp shade while the lamp is on
+    TERM_AMBIENT,                   // Ambient of light i is TERM_AMBIENT + i
+    TERM_DIFFUSE = TERM_AMBIENT + BAKE_LIGHT_COUNT,
+    LIGHTMAP_TERMS = TERM_DIFFUSE + BAKE_LIGHT_COUNT
+};
+
+// A planar patch of one batch with its own rectangle of the lightmap
+struct LightmapChart
+{
+    Vec3 u, v;                  // Unit axes of the chart's plane
+    GLfloat u0, v0;             // Low corner along u and v
+    GLfloat width, height;      // Extent along u and v in scene units
+    int x, y, w, h;             // Texel rectangle in the lightmap, padding excluded
+    std::vector<int> triangles; // Into LightmapBake::triangles
+};
+
+// A triangle of the layout, both for the texels it owns and for the rays it blocks
+struct BakeTriangle
+{
+    Vec3 p[3], n[3];            // Corners and vertex normals in room space
+    Vec3 normal;                // Average of the vertex normals, for shading bounce hits
+    Vec3 albedo, ambient;       // Diffuse and ambient material colour
+    bool emissive;              // The lamp shade, which glows while the lamp is on
+};
+
+// A static batch re-indexed so that no vertex is shared between two charts
+struct LightmapBatch
+{
+    int batch;                      // Index into the layout's batches
+    Mesh mesh;
+    std::vector<int> vertexCharts;  // Chart of every vertex
+};
+
+// Everything the bake of one layout works from, built without the GL
+struct LightmapBake
+{
+    std::vector<LightmapBatch> batches;
+    std::vector<LightmapChart> charts;
+    std::vector<BakeTriangle> triangles;
+    LayoutBVH bvh;                  // Over triangles
+    GLfloat density;
+    int size;                       // The lightmap is size x size texels
+    std::vector<GLubyte> terms;     // LIGHTMAP_TERMS planes of size x size RGBA texels
+    std::vector<GLubyte> texels;    // Scratch for summing the terms
+    unsigned long long hash;        // Of the geometry and the bake settings, to recognise a stale file
+};
+
+// Lightmaps already summed for recent switch combinations, the least recently used replaced first
+struct LightmapCache
+{
+    GLuint textures[LIGHTMAP_CACHE_SIZE];
+    unsigned terms[LIGHTMAP_CACHE_SIZE];
+    unsigned lastUse[LIGHTMAP_CACHE_SIZE];
+};
+
+std::vector<LightmapBake> lightmapBakes;
+std::vector<LightmapCache> lightmapCaches;  // Per layout
+unsigned lightmapClock = 0;
+const char* lightmapFile = NULL;        // --lightmaps: bake to load, or to write when missing
+const char* lightmapBakeFile = NULL;    // --bake-lightmaps: bake without a window, write and exit
+bool useLightmaps = true;               // 'h' goes back to the lights for comparison
+std::atomic<long long> lightmapRays(0);
+
+// Function to fold bytes into a 64-bit FNV-1a hash
+static void hashBytes(unsigned long long& hash, const void* data, size_t size)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+}
+
+static int findChartRoot(std::vector<int>& parent, int t)
+{
+    while (parent[t] != t)
+        t = parent[t] = parent[parent[t]];
+    return t;
+}
+
+// Function to split a batch into charts of coplanar neighbouring triangles, giving every chart
+// its own copies of the vertices it uses
+static void unwrapBatch(LightmapBake& bake, int batchIndex, const StaticBatch& b, const Mesh& mesh)
+{
+    int triangleCount = (int)mesh.indices.size() / 3;
+    std::vector<Vec3> faceNormals(triangleCount);
+    for (int t = 0; t < triangleCount; t++)
+    {
+        const GLfloat* a = mesh.vertices[mesh.indices[3 * t]].pos;
+        const GLfloat* p = mesh.vertices[mesh.indices[3 * t + 1]].pos;
+        const GLfloat* c = mesh.vertices[mesh.indices[3 * t + 2]].pos;
+        Vec3 n = vec3Cross(vec3(p[0] - a[0], p[1] - a[1], p[2] - a[2]), vec3(c[0] - a[0], c[1] - a[1], c[2] - a[2]));
+        faceNormals[t] = vec3Dot(n, n) > 1e-20f ? vec3Normalize(n) : vec3(0, 0, 0);
+    }
+
+    // Join triangles across a shared edge when their planes agree
+    std::vector<int> parent(triangleCount);
+    for (int t = 0; t < triangleCount; t++)
+        parent[t] = t;
+    std::map<std::pair<GLuint, GLuint>, int> edges;
+    for (int t = 0; t < triangleCount; t++)
+        for (int e = 0; e < 3; e++)
+        {
+            GLuint i0 = mesh.indices[3 * t + e], i1 = mesh.indices[3 * t + (e + 1) % 3];
+            std::pair<GLuint, GLuint> key(std::min(i0, i1), std::max(i0, i1));
+            std::map<std::pair<GLuint, GLuint>, int>::iterator it = edges.find(key);
+            if (it == edges.end())
+                edges[key] = t;
+            else if (vec3Dot(faceNormals[t], faceNormals[it->second]) > LIGHTMAP_COPLANAR)
+                parent[findChartRoot(parent, t)] = findChartRoot(parent, it->second);
+        }
+
+    // One chart per set, numbered in order of first triangle so the unwrap is deterministic
+    std::vector<int> chartOf(triangleCount, -1), rootChart(triangleCount, -1);
+    std::vector<std::vector<int> > chartTriangles;
+    for (int t = 0; t < triangleCount; t++)
+    {
+        int root = findChartRoot(parent, t);
+        if (rootChart[root] < 0)
+        {
+            rootChart[root] = (int)chartTriangles.size();
+            chartTriangles.push_back(std::vector<int>());
+        }
+        chartOf[t] = rootChart[root];
+        chartTriangles[chartOf[t]].push_back(t);
+    }
+
+    // Frame each chart along whichever edge of its first triangle gives the smallest rectangle
+    int firstChart = (int)bake.charts.size();
+    for (size_t c = 0; c < chartTriangles.size(); c++)
+    {
+        int first = chartTriangles[c][0];
+        Vec3 n = faceNormals[first];
+        LightmapChart chart = LightmapChart();
+        GLfloat bestArea = 1e30f;
+        for (int e = 0; e < 3; e++)
+        {
+            const GLfloat* a = mesh.vertices[mesh.indices[3 * first + e]].pos;
+            const GLfloat* p = mesh.vertices[mesh.indices[3 * first + (e + 1) % 3]].pos;
+            Vec3 edge = vec3(p[0] - a[0], p[1] - a[1], p[2] - a[2]);
+            GLfloat along = vec3Dot(edge, n);
+            edge = vec3(edge.x - n.x * along, edge.y - n.y * along, edge.z - n.z * along);
+            if (vec3Dot(edge, edge) < 1e-20f)
+                continue;
+            Vec3 u = vec3Normalize(edge), v = vec3Cross(n, u);
+            GLfloat lo[2] = { 1e30f, 1e30f }, hi[2] = { -1e30f, -1e30f };
+            for (size_t k = 0; k < chartTriangles[c].size(); k++)
+                for (int corner = 0; corner < 3; corner++)
+                {
+                    const GLfloat* q = mesh.vertices[mesh.indices[3 * chartTriangles[c][k] + corner]].pos;
+                    GLfloat s = u.x * q[0] + u.y * q[1] + u.z * q[2], t = v.x * q[0] + v.y * q[1] + v.z * q[2];
+                    lo[0] = std::min(lo[0], s);
+                    hi[0] = std::max(hi[0], s);
+                    lo[1] = std::min(lo[1], t);
+                    hi[1] = std::max(hi[1], t);
+                }
+            GLfloat area = (hi[0] - lo[0]) * (hi[1] - lo[1]);
+            if (area < bestArea)
+            {
+                bestArea = area;
+                chart.u = u;
+                chart.v = v;
+                chart.u0 = lo[0];
+                chart.v0 = lo[1];
+                chart.width = hi[0] - lo[0];
+                chart.height = hi[1] - lo[1];
+            }
+        }
+        if (bestArea == 1e30f)
+        {
+            // A degenerate triangle: any frame does
+            chart.u = vec3(1, 0, 0);
+            chart.v = vec3(0, 1, 0);
+            const GLfloat* q = mesh.vertices[mesh.indices[3 * first]].pos;
+            chart.u0 = q[0];
+            chart.v0 = q[1];
+            chart.width = chart.height = 0;
+        }
+        bake.charts.push_back(chart);
+    }
+
+    // Copy the vertices per chart and record the triangles for the bake
+    LightmapBatch lb;
+    lb.batch = batchIndex;
+    lb.mesh.primitive = mesh.primitive;
+    std::map<std::pair<GLuint, int>, GLuint> copies;
+    for (int t = 0; t < triangleCount; t++)
+    {
+        int chart = firstChart + chartOf[t];
+        BakeTriangle tri;
+        for (int corner = 0; corner < 3; corner++)
+        {
+            GLuint index = mesh.indices[3 * t + corner];
+            std::pair<std::map<std::pair<GLuint, int>, GLuint>::iterator, bool> copy =
+                copies.insert(std::make_pair(std::make_pair(index, chart), (GLuint)lb.mesh.vertices.size()));
+            if (copy.second)
+            {
+                lb.mesh.vertices.push_back(mesh.vertices[index]);
+                lb.vertexCharts.push_back(chart);
+            }
+            lb.mesh.indices.push_back(copy.first->second);
+            const BakedVertex& v = mesh.vertices[index];
+            tri.p[corner] = vec3(v.pos[0], v.pos[1], v.pos[2]);
+            tri.n[corner] = vec3(v.normal[0], v.normal[1], v.normal[2]);
+        }
+        Vec3 sum = vec3(tri.n[0].x + tri.n[1].x + tri.n[2].x, tri.n[0].y + tri.n[1].y + tri.n[2].y,
+                        tri.n[0].z + tri.n[1].z + tri.n[2].z);
+        tri.normal = vec3Dot(sum, sum) > 1e-20f ? vec3Normalize(sum) : faceNormals[t];
+        tri.albedo = vec3(b.material.dif[0], b.material.dif[1], b.material.dif[2]);
+        tri.ambient = vec3(b.material.amb[0], b.material.amb[1], b.material.amb[2]);
+        tri.emissive = (b.flags & BATCH_LAMP_EMISSION) != 0;
+        bake.charts[chart].triangles.push_back((int)bake.triangles.size());
+        bake.triangles.push_back(tri);
+    }
+    bake.batches.push_back(lb);
+}
+
+// Function to place every chart of a layout in its lightmap; returns false if they do not fit at this density
+static bool packLightmap(LightmapBake& bake, GLfloat density)
+{
+    int count = (int)bake.charts.size();
+    std::vector<int> widths(count), heights(count), order(count), xs(count), ys(count);
+    for (int i = 0; i < count; i++)
+    {
+        widths[i] = std::max(1, (int)ceilf(bake.charts[i].width * density));
+        heights[i] = std::max(1, (int)ceilf(bake.charts[i].height * density));
+        order[i] = i;
+    }
+    std::stable_sort(order.begin(), order.end(), [&heights](int a, int b) { return heights[a] > heights[b]; });
+    for (int size = 64; size <= LIGHTMAP_MAX_SIZE; size *= 2)
+        if (packAtlasShelves(&widths[0], &heights[0], &order[0], count, size, LIGHTMAP_PADDING, &xs[0], &ys[0]))
+        {
+            for (int i = 0; i < count; i++)
+            {
+                LightmapChart& c = bake.charts[i];
+                c.x = xs[i];
+                c.y = ys[i];
+                c.w = widths[i];
+                c.h = heights[i];
+            }
+            bake.density = density;
+            bake.size = size;
+            return true;
+        }
+    return false;
+}
+
+// Function to unwrap and pack a layout's static batches and build the hierarchy its rays are traced against
+static void prepareLightmapBake(LightmapBake& bake, const BakedLayout& layout)
+{
+    bake = LightmapBake();
+    bake.hash = 14695981039346656037ULL;
+    hashBytes(bake.hash, bakeLights, sizeof(bakeLights));
+    hashBytes(bake.hash, &LIGHTMAP_DENSITY, sizeof(LIGHTMAP_DENSITY));
+    hashBytes(bake.hash, &LIGHTMAP_BOUNCE_RAYS, sizeof(LIGHTMAP_BOUNCE_RAYS));
+    hashBytes(bake.hash, &LIGHTMAP_AO_DISTANCE, sizeof(LIGHTMAP_AO_DISTANCE));
+
+    // In drawing order, which is the same whether or not the batches have been uploaded yet
+    std::vector<int> order(layout.batches.size());
+    for (size_t i = 0; i < order.size(); i++)
+        order[i] = (int)i;
+    std::stable_sort(order.begin(), order.end(),
+                     [&layout](int a, int b) { return layout.batches[a].flags < layout.batches[b].flags; });
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const StaticBatch& b = layout.batches[order[i]];
+        if (b.flags & BATCH_LINES)
+            continue;
+        Mesh mesh;
+        gatherBatchMesh(b, layout, mesh);
+        if (mesh.indices.empty())
+            continue;
+        unwrapBatch(bake, order[i], b, mesh);
+        hashBytes(bake.hash, &b.material, sizeof(Material));
+        hashBytes(bake.hash, &b.flags, sizeof(b.flags));
+        for (size_t v = 0; v < mesh.vertices.size(); v++)
+        {
+            hashBytes(bake.hash, mesh.vertices[v].pos, sizeof(mesh.vertices[v].pos));
+            hashBytes(bake.hash, mesh.vertices[v].normal, sizeof(mesh.vertices[v].normal));
+        }
+        hashBytes(bake.hash, &mesh.indices[0], mesh.indices.size() * sizeof(GLuint));
+    }
+    if (bake.triangles.empty())
+        return;
+
+    std::vector<BoxRef> refs(bake.triangles.size());
+    for (size_t i = 0; i < refs.size(); i++)
+    {
+        const BakeTriangle& t = bake.triangles[i];
+        refs[i].object = (int)i;
+        refs[i].lo = vec3(std::min(t.p[0].x, std::min(t.p[1].x, t.p[2].x)),
+                          std::min(t.p[0].y, std::min(t.p[1].y, t.p[2].y)),
+                          std::min(t.p[0].z, std::min(t.p[1].z, t.p[2].z)));
+        refs[i].hi = vec3(std::max(t.p[0].x, std::max(t.p[1].x, t.p[2].x)),
+                          std::max(t.p[0].y, std::max(t.p[1].y, t.p[2].y)),
+                          std::max(t.p[0].z, std::max(t.p[1].z, t.p[2].z)));
+    }
+    bake.bvh.nodes.resize(1);
+    buildBVHNode(bake.bvh, refs, 0, 0, (int)refs.size());
+    for (size_t i = 0; i < refs.size(); i++)
+        bake.bvh.objects.push_back(refs[i].object);
+
+    GLfloat density = LIGHTMAP_DENSITY;
+    while (!packLightmap(bake, density))
+        density *= 0.5f;
+}
+
+// Function to find whether any triangle lies on a ray before maxT
+static bool traceOccluded(const LightmapBake& bake, const Vec3& origin, const Vec3& dir, GLfloat maxT)
+{
+    const LayoutBVH& bvh = bake.bvh;
+    Vec3 invDir = vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode& node = bvh.nodes[stack[--top]];
+        GLfloat tNear;
+        if (!rayBox(origin, invDir, node.lo, node.hi, maxT, tNear))
+            continue;
+        if (node.count == 0)
+        {
+            stack[top++] = node.first;
+            stack[top++] = node.first + 1;
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            const BakeTriangle& tri = bake.triangles[bvh.objects[i]];
+            GLfloat t;
+            if (rayTriangle(origin, dir, &tri.p[0].x, &tri.p[1].x, &tri.p[2].x, t) && t < maxT)
+                return true;
+        }
+    }
+    return false;
+}
+
+// Function to find the nearest triangle along a ray; returns its index, or -1 when the ray escapes
+static int traceNearest(const LightmapBake& bake, const Vec3& origin, const Vec3& dir, GLfloat& nearest)
+{
+    const LayoutBVH& bvh = bake.bvh;
+    Vec3 invDir = vec3(1.0f / dir.x, 1.0f / dir.y, 1.0f / dir.z);
+    int hit = -1;
+    nearest = 1e30f;
+    int stack[BVH_STACK_SIZE];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0)
+    {
+        const BVHNode& node = bvh.nodes[stack[--top]];
+        GLfloat tNear;
+        if (!rayBox(origin, invDir, node.lo, node.hi, nearest, tNear))
+            continue;
+        if (node.count == 0)
+        {
+            // Visit the nearer child first
+            GLfloat tLeft, tRight;
+            bool left = rayBox(origin, invDir, bvh.nodes[node.first].lo, bvh.nodes[node.first].hi, nearest, tLeft);
+            bool right = rayBox(origin, invDir, bvh.nodes[node.first + 1].lo, bvh.nodes[node.first + 1].hi, nearest,
+                                tRight);
+            if (left && right && tLeft < tRight)
+            {
+                stack[top++] = node.first + 1;
+                stack[top++] = node.first;
+            }
+            else
+            {
+                if (left)
+                    stack[top++] = node.first;
+                if (right)
+                    stack[top++] = node.first + 1;
+            }
+            continue;
+        }
+        for (int i = node.first; i < node.first + node.count; i++)
+        {
+            const BakeTriangle& tri = bake.triangles[bvh.objects[i]];
+            GLfloat t;
+            if (rayTriangle(origin, dir, &tri.p[0].x, &tri.p[1].x, &tri.p[2].x, t) && t < nearest)
+            {
+                nearest = t;
+                hit = bvh.objects[i];
+            }
+        }
+    }
+    return hit;
+}
+
+// Function to gather the light of each light reaching a point the way the fixed-function lights do,
+// with shadows: the diffuse part weighted by the angle of incidence, and the spot factor that scales
+// the ambient part
+static void directLight(const LightmapBake& bake, const Vec3& p, const Vec3& n, GLfloat diffuse[BAKE_LIGHT_COUNT],
+                        GLfloat spot[BAKE_LIGHT_COUNT], long long& rays)
+{
+    Vec3 origin = vec3(p.x + n.x * LIGHTMAP_RAY_OFFSET, p.y + n.y * LIGHTMAP_RAY_OFFSET, p.z + n.z * LIGHTMAP_RAY_OFFSET);
+    for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+    {
+        const BakeLight& light = bakeLights[i];
+        Vec3 toLight = vec3Sub(light.position, origin);
+        GLfloat distance = sqrtf(vec3Dot(toLight, toLight));
+        Vec3 l = vec3(toLight.x / distance, toLight.y / distance, toLight.z / distance);
+        diffuse[i] = spot[i] = 0;
+
+        // Outside the spot cone the GL drops every term of the light, ambient included
+        if (-vec3Dot(l, light.spotDirection) < light.spotCosCutoff)
+            continue;
+        spot[i] = 1;
+        GLfloat nDotL = vec3Dot(n, l);
+        if (nDotL <= 0)
+            continue;
+        rays++;
+        if (!traceOccluded(bake, origin, l, distance))
+            diffuse[i] = nDotL;
+    }
+}
+
+// Function to find the nearest point of a 2D triangle to (s, t), as barycentrics; returns its squared distance
+static GLfloat closestOnTriangle(const GLfloat a[2], const GLfloat b[2], const GLfloat c[2], GLfloat s, GLfloat t,
+                                 GLfloat bary[3])
+{
+    GLfloat area = (b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]);
+    if (fabsf(area) > 1e-12f)
+    {
+        GLfloat wa = ((b[0] - s) * (c[1] - t) - (b[1] - t) * (c[0] - s)) / area;
+        GLfloat wb = ((c[0] - s) * (a[1] - t) - (c[1] - t) * (a[0] - s)) / area;
+        GLfloat wc = 1 - wa - wb;
+        if (wa >= 0 && wb >= 0 && wc >= 0)
+        {
+            bary[0] = wa;
+            bary[1] = wb;
+            bary[2] = wc;
+            return 0;
+        }
+    }
+
+    // Outside: the nearest point lies on one of the edges
+    const GLfloat* corners[3] = { a, b, c };
+    GLfloat best = 1e30f;
+    for (int e = 0; e < 3; e++)
+    {
+        const GLfloat* p = corners[e];
+        const GLfloat* q = corners[(e + 1) % 3];
+        GLfloat dx = q[0] - p[0], dy = q[1] - p[1];
+        GLfloat length2 = dx * dx + dy * dy;
+        GLfloat k = length2 > 0 ? std::max(0.0f, std::min(1.0f, ((s - p[0]) * dx + (t - p[1]) * dy) / length2)) : 0;
+        GLfloat ex = p[0] + dx * k - s, ey = p[1] + dy * k - t;
+        GLfloat d = ex * ex + ey * ey;
+        if (d < best)
+        {
+            best = d;
+            bary[e] = 1 - k;
+            bary[(e + 1) % 3] = k;
+            bary[(e + 2) % 3] = 0;
+        }
+    }
+    return best;
+}
+
+// Function to bake the texels of one chart, padding included. Each texel centre is moved to the
+// nearest point of the chart, so the padding repeats the edge and filtering never reaches a neighbour.
+static void bakeChart(LightmapBake& bake, const LightmapChart& chart, long long& rays)
+{
+    for (int y = chart.y - LIGHTMAP_PADDING; y < chart.y + chart.h + LIGHTMAP_PADDING; y++)
+        for (int x = chart.x - LIGHTMAP_PADDING; x < chart.x + chart.w + LIGHTMAP_PADDING; x++)
+        {
+            GLfloat s = (x + 0.5f - chart.x) / bake.density, t = (y + 0.5f - chart.y) / bake.density;
+            int best = -1;
+            GLfloat bestDistance = 1e30f, bary[3] = { 1, 0, 0 };
+            for (size_t k = 0; k < chart.triangles.size() && bestDistance > 0; k++)
+            {
+                const BakeTriangle& tri = bake.triangles[chart.triangles[k]];
+                GLfloat corners[3][2], b[3] = { 1, 0, 0 };
+                for (int c = 0; c < 3; c++)
+                {
+                    corners[c][0] = vec3Dot(tri.p[c], chart.u) - chart.u0;
+                    corners[c][1] = vec3Dot(tri.p[c], chart.v) - chart.v0;
+                }
+                GLfloat d = closestOnTriangle(corners[0], corners[1], corners[2], s, t, b);
+                if (d < bestDistance)
+                {
+                    bestDistance = d;
+                    best = chart.triangles[k];
+                    memcpy(bary, b, sizeof(bary));
+                }
+            }
+            const BakeTriangle& tri = bake.triangles[best];
+            Vec3 p = vec3(0, 0, 0), n = vec3(0, 0, 0);
+            for (int c = 0; c < 3; c++)
+            {
+                p = vec3(p.x + tri.p[c].x * bary[c], p.y + tri.p[c].y * bary[c], p.z + tri.p[c].z * bary[c]);
+                n = vec3(n.x + tri.n[c].x * bary[c], n.y + tri.n[c].y * bary[c], n.z + tri.n[c].z * bary[c]);
+            }
+            n = vec3Dot(n, n) > 1e-20f ? vec3Normalize(n) : tri.normal;
+
+            GLfloat diffuse[BAKE_LIGHT_COUNT], spot[BAKE_LIGHT_COUNT];
+            directLight(bake, p, n, diffuse, spot, rays);
+
+            // One bounce: cosine-weighted rays, each bringing back the direct light of the surface it hits.
+            // The same rays measure the ambient occlusion, fading with the distance to what they hit.
+            unsigned seed = (unsigned)(y * bake.size + x) * 2654435761u + 1;
+            Vec3 tangent = vec3Normalize(fabsf(n.x) < 0.9f ? vec3Cross(n, vec3(1, 0, 0)) : vec3Cross(n, vec3(0, 1, 0)));
+            Vec3 bitangent = vec3Cross(n, tangent);
+            Vec3 origin = vec3(p.x + n.x * LIGHTMAP_RAY_OFFSET, p.y + n.y * LIGHTMAP_RAY_OFFSET,
+                               p.z + n.z * LIGHTMAP_RAY_OFFSET);
+            Vec3 indirect[BAKE_LIGHT_COUNT];
+            for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+                indirect[i] = vec3(0, 0, 0);
+            GLfloat occlusion = 0;
+            for (int r = 0; r < LIGHTMAP_BOUNCE_RAYS; r++)
+            {
+                seed ^= seed << 13;
+                seed ^= seed >> 17;
+                seed ^= seed << 5;
+                GLfloat r1 = (seed & 0xffff) / 65536.0f, r2 = (seed >> 16) / 65536.0f;
+                GLfloat phi = 6.2831853f * r1, radius = sqrtf(r2), up = sqrtf(1 - r2);
+                GLfloat a = radius * cosf(phi), b = radius * sinf(phi);
+                Vec3 dir = vec3(tangent.x * a + bitangent.x * b + n.x * up, tangent.y * a + bitangent.y * b + n.y * up,
+                                tangent.z * a + bitangent.z * b + n.z * up);
+                GLfloat distance;
+                rays++;
+                int hit = traceNearest(bake, origin, dir, distance);
+                if (hit >= 0 && distance < LIGHTMAP_AO_DISTANCE)
+                    occlusion += 1 - distance / LIGHTMAP_AO_DISTANCE;
+                if (hit < 0 || vec3Dot(bake.triangles[hit].normal, dir) >= 0)
+                    continue;
+                const BakeTriangle& h = bake.triangles[hit];
+                Vec3 hitPoint = vec3(origin.x + dir.x * distance, origin.y + dir.y * distance,
+                                     origin.z + dir.z * distance);
+                GLfloat hitDiffuse[BAKE_LIGHT_COUNT], hitSpot[BAKE_LIGHT_COUNT];
+                directLight(bake, hitPoint, h.normal, hitDiffuse, hitSpot, rays);
+                for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+                    indirect[i] = vec3(indirect[i].x + h.albedo.x * hitDiffuse[i],
+                                       indirect[i].y + h.albedo.y * hitDiffuse[i],
+                                       indirect[i].z + h.albedo.z * hitDiffuse[i]);
+            }
+
+            // The terms of the lit colour the GL would compute, without the specular part, and with the
+            // ambient parts occluded
+            GLfloat scale = 1.0f / LIGHTMAP_BOUNCE_RAYS;
+            GLfloat ambient = 1 - occlusion * scale;
+            Vec3 terms[LIGHTMAP_TERMS];
+            terms[TERM_GLOBAL_AMBIENT] = vec3(tri.ambient.x * GLOBAL_AMBIENT * ambient,
+                                              tri.ambient.y * GLOBAL_AMBIENT * ambient,
+                                              tri.ambient.z * GLOBAL_AMBIENT * ambient);
+            terms[TERM_EMISSION] = tri.emissive ? tri.albedo : vec3(0, 0, 0);
+            for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+            {
+                const BakeLight& light = bakeLights[i];
+                terms[TERM_AMBIENT + i] = vec3(tri.ambient.x * light.ambient.x * spot[i] * ambient,
+                                               tri.ambient.y * light.ambient.y * spot[i] * ambient,
+                                               tri.ambient.z * light.ambient.z * spot[i] * ambient);
+                terms[TERM_DIFFUSE + i] = vec3(tri.albedo.x * light.diffuse.x * (diffuse[i] + indirect[i].x * scale),
+                                               tri.albedo.y * light.diffuse.y * (diffuse[i] + indirect[i].y * scale),
+                                               tri.albedo.z * light.diffuse.z * (diffuse[i] + indirect[i].z * scale));
+            }
+            // Only the always-on term carries alpha, so every sum is opaque
+            size_t plane = 4 * (size_t)bake.size * bake.size;
+            for (int k = 0; k < LIGHTMAP_TERMS; k++)
+            {
+                GLubyte* texel = &bake.terms[k * plane + 4 * (y * bake.size + x)];
+                const GLfloat* c = &terms[k].x;
+                for (int j = 0; j < 3; j++)
+                    texel[j] = (GLubyte)lrintf(std::max(0.0f, std::min(1.0f, c[j])) * 255);
+                texel[3] = k == TERM_GLOBAL_AMBIENT ? 255 : 0;
+            }
+        }
+}
+
+// Function to bake every LIGHTMAP_JOBS_PER_LAYOUT-th chart of one layout (a job)
+static void bakeLightmapJob(int index)
+{
+    TraceSpan span("bakeLightmap", index);
+    LightmapBake& bake = lightmapBakes[index / LIGHTMAP_JOBS_PER_LAYOUT];
+    long long rays = 0;
+    for (size_t c = index % LIGHTMAP_JOBS_PER_LAYOUT; c < bake.charts.size(); c += LIGHTMAP_JOBS_PER_LAYOUT)
+        bakeChart(bake, bake.charts[c], rays);
+    lightmapRays += rays;
+}
+
+// Function to bake the lightmaps of every prepared layout on the job system
+void bakeLightmaps()
+{
+    TraceSpan span("bakeLightmaps");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    lightmapRays = 0;
+    size_t texels = 0;
+    for (size_t l = 0; l < lightmapBakes.size(); l++)
+    {
+        LightmapBake& bake = lightmapBakes[l];
+        if (bake.charts.empty())
+            continue;
+        bake.terms.assign(LIGHTMAP_TERMS * 4 * bake.size * bake.size, 0);
+        texels += bake.size * bake.size;
+        for (int j = 0; j < LIGHTMAP_JOBS_PER_LAYOUT; j++)
+            jobSubmit(jobCreate(bakeLightmapJob, (int)l * LIGHTMAP_JOBS_PER_LAYOUT + j));
+    }
+    jobWaitAll();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Lightmaps: baked %d layouts (%d KB of texels in %d terms, %.1f M rays) in %.0f ms on %d threads\n",
+           (int)lightmapBakes.size(), (int)(texels * 4 / 1024), LIGHTMAP_TERMS, lightmapRays / 1e6, ms, jobQueueCount);
+}
+
+// Function to prepare the bake of every layout
+void prepareLightmaps()
+{
+    lightmapBakes.assign(bakedLayouts.size(), LightmapBake());
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+        prepareLightmapBake(lightmapBakes[l], bakedLayouts[l]);
+}
+
+// Function to write the baked lightmaps; returns false if the file cannot be written
+bool writeLightmaps(const char* path)
+{
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return false;
+    unsigned header[2] = { LIGHTMAP_FILE_MAGIC, (unsigned)lightmapBakes.size() };
+    bool ok = fwrite(header, sizeof(header), 1, file) == 1;
+    for (size_t l = 0; l < lightmapBakes.size() && ok; l++)
+    {
+        const LightmapBake& bake = lightmapBakes[l];
+        int size = bake.terms.empty() ? 0 : bake.size;
+        ok = fwrite(&bake.hash, sizeof(bake.hash), 1, file) == 1 && fwrite(&size, sizeof(size), 1, file) == 1
+             && (size == 0 || fwrite(&bake.terms[0], bake.terms.size(), 1, file) == 1);
+    }
+    return fclose(file) == 0 && ok;
+}
+
+// Function to read the lightmaps of the prepared layouts; false if the file is missing or any layout is stale
+bool readLightmaps(const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+    unsigned header[2];
+    bool ok = fread(header, sizeof(header), 1, file) == 1 && header[0] == LIGHTMAP_FILE_MAGIC
+              && header[1] == lightmapBakes.size();
+    for (size_t l = 0; l < lightmapBakes.size() && ok; l++)
+    {
+        LightmapBake& bake = lightmapBakes[l];
+        unsigned long long hash;
+        int size;
+        ok = fread(&hash, sizeof(hash), 1, file) == 1 && fread(&size, sizeof(size), 1, file) == 1
+             && hash == bake.hash && size == (bake.charts.empty() ? 0 : bake.size);
+        if (ok && size > 0)
+        {
+            bake.terms.resize(LIGHTMAP_TERMS * 4 * size * size);
+            ok = fread(&bake.terms[0], bake.terms.size(), 1, file) == 1;
+        }
+    }
+    fclose(file);
+    return ok;
+}
+
+// Function to replace the static batches with their unwrapped copies and upload the lightmaps
+static void uploadLightmaps()
+{
+    releaseLightmaps();
+    LightmapCache empty = {};
+    lightmapCaches.assign(bakedLayouts.size(), empty);
+    size_t termBytes = 0;
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+    {
+        BakedLayout& layout = bakedLayouts[l];
+        LightmapBake& bake = lightmapBakes[l];
+        if (bake.terms.empty())
+            continue;
+        termBytes += bake.terms.size();
+        bake.texels.resize(4 * bake.size * bake.size);
+
+        for (size_t i = 0; i < bake.batches.size(); i++)
+        {
+            const LightmapBatch& lb = bake.batches[i];
+            StaticBatch& b = layout.batches[lb.batch];
+            releaseMesh(b.gpu);
+            uploadMesh(b.gpu, lb.mesh, "static batch");
+
+            std::vector<GLshort> uvs(2 * lb.mesh.vertices.size());
+            for (size_t v = 0; v < lb.mesh.vertices.size(); v++)
+            {
+                const LightmapChart& c = bake.charts[lb.vertexCharts[v]];
+                const GLfloat* p = lb.mesh.vertices[v].pos;
+                GLfloat s = c.x + (c.u.x * p[0] + c.u.y * p[1] + c.u.z * p[2] - c.u0) * bake.density;
+                GLfloat t = c.y + (c.v.x * p[0] + c.v.y * p[1] + c.v.z * p[2] - c.v0) * bake.density;
+                uvs[2 * v] = (GLshort)lrintf(s / bake.size * UV_QUANT_SCALE);
+                uvs[2 * v + 1] = (GLshort)lrintf(t / bake.size * UV_QUANT_SCALE);
+            }
+            b.gpu.lightmapUvs = gpuCreateBuffer("lightmap uvs");
+            glBindBuffer(GL_ARRAY_BUFFER, b.gpu.lightmapUvs);
+            gpuBufferData(GL_ARRAY_BUFFER, b.gpu.lightmapUvs, uvs.size() * sizeof(GLshort), &uvs[0], GL_STATIC_DRAW);
+        }
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    std::cout << "Lightmaps: " << termBytes / 1024 << " KB of terms over " << bakedLayouts.size() << " layouts"
+              << std::endl;
+}
+
+// Function to load the lightmaps named by --lightmaps, baking and saving them if the file does not match
+void loadLightmaps()
+{
+    prepareLightmaps();
+    if (!readLightmaps(lightmapFile))
+    {
+        std::cout << "Lightmaps: " << lightmapFile << " is missing or stale, baking" << std::endl;
+        bakeLightmaps();
+        if (!writeLightmaps(lightmapFile))
+            std::cerr << "Lightmaps: cannot write " << lightmapFile << std::endl;
+    }
+    uploadLightmaps();
+}
+
+// Function to bake the lightmaps for --bake-lightmaps without opening a window; returns the exit status
+int bakeLightmapsOffline()
+{
+    startJobThreads();
+    buildShapeMeshes();
+    buildScene();
+    collectStaticBatches();
+    prepareLightmaps();
+    bakeLightmaps();
+    if (!writeLightmaps(lightmapBakeFile))
+    {
+        std::cerr << "Lightmaps: cannot write " << lightmapBakeFile << std::endl;
+        return 1;
+    }
+    std::cout << "Lightmaps: wrote " << lightmapBakeFile << std::endl;
+    return 0;
+}
+
+// Function to find the terms the light switches leave on, as a bit mask
+unsigned lightmapTermMask()
+{
+    GLboolean on[BAKE_LIGHT_COUNT] = { switchOne, switchTwo, switchLamp };
+    GLboolean ambient[BAKE_LIGHT_COUNT] = { amb1, amb2, amb3 };
+    GLboolean diffuse[BAKE_LIGHT_COUNT] = { diff1, diff2, diff3 };
+    unsigned mask = 1u << TERM_GLOBAL_AMBIENT;
+    if (switchLamp)
+        mask |= 1u << TERM_EMISSION;
+    for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+    {
+        if (on[i] && ambient[i])
+            mask |= 1u << (TERM_AMBIENT + i);
+        if (on[i] && diffuse[i])
+            mask |= 1u << (TERM_DIFFUSE + i);
+    }
+    return mask;
+}
+
+LightmapBake* summingBake = NULL;
+unsigned summingTerms = 0;
+
+// Function to sum the terms in summingTerms into one slice of the texels, 16 bytes at a time (a job).
+// The adds saturate, which is the clamp the GL applies to a lit colour.
+static void sumLightmapTerms(int slice)
+{
+    LightmapBake& bake = *summingBake;
+    size_t bytes = bake.texels.size();
+    size_t i = bytes / LIGHTMAP_SUM_JOBS * slice & ~(size_t)15;
+    size_t end = slice == LIGHTMAP_SUM_JOBS - 1 ? bytes : bytes / LIGHTMAP_SUM_JOBS * (slice + 1) & ~(size_t)15;
+    const GLubyte* planes[LIGHTMAP_TERMS];
+    int count = 0;
+    for (int k = 0; k < LIGHTMAP_TERMS; k++)
+        if (summingTerms & (1u << k))
+            planes[count++] = &bake.terms[k * bytes];
+    GLubyte* out = &bake.texels[0];
+#ifdef BEDROOM_SSE2
+    for (; i + 16 <= end; i += 16)
+    {
+        __m128i sum = _mm_setzero_si128();
+        for (int k = 0; k < count; k++)
+            sum = _mm_adds_epu8(sum, _mm_loadu_si128((const __m128i*)(planes[k] + i)));
+        _mm_storeu_si128((__m128i*)(out + i), sum);
+    }
+#endif
+    // The bytes left over (all of them without SSE2)
+    for (; i < end; i++)
+    {
+        int sum = 0;
+        for (int k = 0; k < count; k++)
+            sum += planes[k][i];
+        out[i] = (GLubyte)std::min(sum, 255);
+    }
+}
+
+// Function to find a layout's lightmap for a switch combination, summing it into the least
+// recently used slot of the cache when it is not there
+static GLuint cachedLightmap(int layoutIndex, unsigned terms)
+{
+    LightmapCache& cache = lightmapCaches[layoutIndex];
+    int slot = 0;
+    for (int i = 0; i < LIGHTMAP_CACHE_SIZE; i++)
+    {
+        if (cache.textures[i] && cache.terms[i] == terms)
+        {
+            cache.lastUse[i] = ++lightmapClock;
+            return cache.textures[i];
+        }
+        if (cache.textures[slot] && (!cache.textures[i] || cache.lastUse[i] < cache.lastUse[slot]))
+            slot = i;
+    }
+
+    TraceSpan span("sumLightmap", layoutIndex);
+    LightmapBake& bake = lightmapBakes[layoutIndex];
+    summingBake = &bake;
+    summingTerms = terms;
+    for (int j = 0; j < LIGHTMAP_SUM_JOBS; j++)
+        jobSubmit(jobCreate(sumLightmapTerms, j));
+    jobWaitAll();
+
+    if (!cache.textures[slot])
+    {
+        cache.textures[slot] = gpuCreateTexture("lightmap");
+        glBindTexture(GL_TEXTURE_2D, cache.textures[slot]);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        // RGBA, the GL's own layout, so the upload needs no conversion
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, bake.size, bake.size, 0, GL_RGBA, GL_UNSIGNED_BYTE, &bake.texels[0]);
+        gpuSetBytes(GPU_TEXTURE, cache.textures[slot], bake.texels.size());
+    }
+    else
+    {
+        glBindTexture(GL_TEXTURE_2D, cache.textures[slot]);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, bake.size, bake.size, GL_RGBA, GL_UNSIGNED_BYTE, &bake.texels[0]);
+    }
+    cache.terms[slot] = terms;
+    cache.lastUse[slot] = ++lightmapClock;
+    return cache.textures[slot];
+}
+
+// Function to bring the lightmaps of the layouts on screen up to date with the light switches, after
+// the frame is recorded and before it is drawn. Layouts off screen catch up when they come into view.
+void relightLightmaps()
+{
+    if (!recordLightmaps || lightmapCaches.empty())
+        return;
+    unsigned terms = lightmapTermMask();
+    int changed = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t r = 0; r < visibleRooms.size(); r++)
+    {
+        int l = rooms[visibleRooms[r]].layout;
+        BakedLayout& layout = bakedLayouts[l];
+        if (layout.lightmapTerms == terms || lightmapBakes[l].terms.empty())
+            continue;
+        layout.lightmap = cachedLightmap(l, terms);
+        layout.lightmapTerms = terms;
+        changed++;
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+    if (changed > 0)
+        printf("Lightmaps: %d layouts relit for switch terms 0x%02x in %.3f ms\n", changed, terms,
+               std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+}
+
+// Function to release the cached lightmaps of every layout
+void releaseLightmaps()
+{
+    for (size_t l = 0; l < lightmapCaches.size(); l++)
+        for (int i = 0; i < LIGHTMAP_CACHE_SIZE; i++)
+            gpuDeleteTexture(lightmapCaches[l].textures[i]);
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+    {
+        bakedLayouts[l].lightmap = 0;
+        bakedLayouts[l].lightmapTerms = 0;
+    }
+}
+
+// Function to drop a layout's lightmaps once its static geometry no longer matches the bake
+void invalidateLightmaps(int layoutIndex)
+{
+    if (layoutIndex >= (int)lightmapBakes.size() || lightmapBakes[layoutIndex].terms.empty())
+        return;
+    LightmapBake& bake = lightmapBakes[layoutIndex];
+    std::vector<GLubyte>().swap(bake.terms);
+    std::vector<GLubyte>().swap(bake.texels);
+    LightmapCache& cache = lightmapCaches[layoutIndex];
+    for (int i = 0; i < LIGHTMAP_CACHE_SIZE; i++)
+    {
+        gpuDeleteTexture(cache.textures[i]);
+        cache.terms[i] = 0;
+        cache.lastUse[i] = 0;
+    }
+    BakedLayout& layout = bakedLayouts[layoutIndex];
+    layout.lightmap = 0;
+    layout.lightmapTerms = 0;
+    for (size_t i = 0; i < layout.batches.size(); i++)
+        gpuDeleteBuffer(layout.batches[i].gpu.lightmapUvs);
+    printf("Lightmaps: layout %d changed, lit by the lights until the next bake\n", layoutIndex);
+}
+
+// Shadow maps **************************************************************
+//
+// The lit surfaces take shadows from the two bulbs and the lamp spot through
+// depth maps rendered from each light, one set per layout since every room of
+// a layout is lit alike. The spot's map covers its cone; a bulb, a point
+// light, looks straight down with a frustum fitted to the room below it. A
+// map is kept in two parts: the static geometry, rendered once and redrawn
+// only when the light moves or the layout changes, and the map looked up
+// while drawing, which is a copy of the static part with the moving objects
+// inside the light's frustum drawn over it. The copy is remade only when one
+// of those objects has moved, so a frame draws a shadow pass only for the
+// lights a moving object is under. The lookups take texture units 1 to 7 in
+// the same pass as the lighting: each shadowed light takes away part of the
+// colour rather than its exact diffuse term, which the fixed-function
+// pipeline cannot single out, and a mask per light keeps the mirror image a
+// projection makes behind the light from darkening anything. Lightmapped
+// surfaces already have their shadows baked and skip the lookups, which on a
+// software rasteriser cost far more than the cached passes; shadows are off
+// unless --shadows is given or 'z' is pressed.
+
+static const int SHADOW_MAP_SIZE = 512;
+static const GLfloat SHADOW_DARKNESS = 0.4f;        // Share of the colour a shadowed light takes away
+static const GLfloat SHADOW_MAX_FOV = 150;          // Widest bulb frustum, in degrees
+static const GLfloat SHADOW_NEAR = 0.1f;
+static const GLenum SHADOW_UNIT = GL_TEXTURE1;      // First of the lookup units; lit drawing leaves the lightmap's free
+static const int SHADOW_UNITS = 2 * BAKE_LIGHT_COUNT + 1;
+
+// The depth maps of one light in one layout
+struct ShadowMap
+{
+    GLuint staticDepth;             // The static geometry alone
+    GLuint texture;                 // The static geometry and the moving objects, looked up while drawing
+    Mat4 view, projection;          // The light's camera in room space
+    unsigned long long lightKey;    // Hash of the camera staticDepth was drawn with; 0 when stale
+    unsigned long long casterKey;   // Hash of the moving objects drawn into texture; 0 when stale
+};
+
+struct LayoutShadows
+{
+    ShadowMap maps[BAKE_LIGHT_COUNT];
+};
+
+std::vector<LayoutShadows> layoutShadows;
+GLuint shadowFramebuffer = 0, shadowCopyFramebuffer = 0;
+GLuint shadowMask = 0;              // Alpha 0 then 1: a step, looked up across each light's plane
+bool useShadows = false;            // --shadows or 'z'
+GLfloat shadowDarkness[BAKE_LIGHT_COUNT];
+long long staticShadowRenders = 0, shadowCopies = 0;
+
+// Function to make one depth texture of a shadow map; depth 1 past its edges, so nothing there is shadowed
+static GLuint shadowTexture(const char* label)
+{
+    static const GLfloat border[] = { 1, 1, 1, 1 };
+    GLuint texture = gpuCreateTexture(label);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+    glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_R_TO_TEXTURE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+    glTexParameteri(GL_TEXTURE_2D, GL_DEPTH_TEXTURE_MODE, GL_INTENSITY);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT24, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0, GL_DEPTH_COMPONENT,
+                 GL_UNSIGNED_INT, NULL);
+    gpuSetBytes(GPU_TEXTURE, texture, 4 * SHADOW_MAP_SIZE * SHADOW_MAP_SIZE);
+    return texture;
+}
+
+// Function to make a framebuffer that draws depth only
+static GLuint shadowFramebufferFor(const char* label)
+{
+    GLuint framebuffer = gpuCreateFramebuffer(label);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    return framebuffer;
+}
+
+// Function to place a light's camera: the spot looks along its cone, a bulb straight down over the room
+static void shadowCamera(const BakeLight& light, const BakedLayout& layout, Mat4& view, Mat4& projection)
+{
+    Vec3 dir = light.spotCosCutoff > -1 ? light.spotDirection : vec3(0, -1, 0);
+    Vec3 up = fabsf(dir.y) > 0.99f ? vec3(0, 0, -1) : vec3(0, 1, 0);
+    view = mat4LookAt(light.position.x, light.position.y, light.position.z, light.position.x + dir.x,
+                      light.position.y + dir.y, light.position.z + dir.z, up.x, up.y, up.z);
+
+    GLfloat zFar = 1, widest = 0;
+    for (int c = 0; c < 8; c++)
+    {
+        Vec3 corner = vec3(c & 1 ? layout.hi.x : layout.lo.x, c & 2 ? layout.hi.y : layout.lo.y,
+                           c & 4 ? layout.hi.z : layout.lo.z);
+        Vec3 p = mat4TransformPoint(view, corner);
+        zFar = std::max(zFar, sqrtf(vec3Dot(p, p)) + 1);
+        if (-p.z > SHADOW_NEAR)
+            widest = std::max(widest, std::max(fabsf(p.x), fabsf(p.y)) / -p.z);
+    }
+    GLfloat fov = light.spotCosCutoff > -1 ? 2 * acosf(light.spotCosCutoff) * 180 / 3.14159265f
+                                           : std::min(SHADOW_MAX_FOV, 2 * atanf(widest) * 180 / 3.14159265f);
+    projection = mat4Perspective(fov, 1, SHADOW_NEAR, zFar);
+}
+
+// Function to draw a shadow map's casters: the layout's static batches and/or its moving objects in the frustum
+static void drawShadowCasters(const BakedLayout& layout, const ShadowMap& map, bool statics, bool moving)
+{
+    glMatrixMode(GL_PROJECTION);
+    glLoadMatrixf(map.projection.m);
+    glMatrixMode(GL_MODELVIEW);
+    if (statics)
+        for (size_t i = 0; i < layout.batches.size(); i++)
+        {
+            const GpuMesh& gpu = layout.batches[i].gpu;
+            if (layout.batches[i].flags & BATCH_LINES)
+                continue;
+            glLoadMatrixf(mat4Mul(map.view, gpu.dequantize).m);
+            glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+            glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.ibo);
+            glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), (const GLvoid*)offsetof(PackedVertex, pos));
+            glDrawElements(gpu.primitive, gpu.indexCount, gpu.indexType, 0);
+        }
+    if (!moving)
+        return;
+    Frustum frustum = frustumFromMatrix(mat4Mul(map.projection, map.view));
+    for (size_t i = 0; i < layout.dynamicObjects.size(); i++)
+    {
+        const SceneObject& o = sceneObjects[layout.dynamicObjects[i]];
+        Vec3 lo, hi;
+        if (o.hidden || (shapeFlags(o.shape) & BATCH_LINES))
+            continue;
+        objectBounds(o, lo, hi);
+        if (!boxInFrustum(frustum, lo, hi))
+            continue;
+        const GpuMesh& gpu = shapeGpuMeshes[o.shape];
+        glLoadMatrixf(mat4Mul(mat4Mul(map.view, o.world), gpu.dequantize).m);
+        glBindBuffer(GL_ARRAY_BUFFER, gpu.vbo);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gpu.ibo);
+        glVertexPointer(3, GL_SHORT, sizeof(PackedVertex), (const GLvoid*)offsetof(PackedVertex, pos));
+        glDrawElements(gpu.primitive, gpu.indexCount, gpu.indexType, 0);
+    }
+}
+
+// Function to hash the moving objects a shadow map's frustum holds, with where they are
+static unsigned long long shadowCasterKey(const BakedLayout& layout, const ShadowMap& map)
+{
+    Frustum frustum = frustumFromMatrix(mat4Mul(map.projection, map.view));
+    unsigned long long key = map.lightKey;
+    for (size_t i = 0; i < layout.dynamicObjects.size(); i++)
+    {
+        const SceneObject& o = sceneObjects[layout.dynamicObjects[i]];
+        Vec3 lo, hi;
+        if (o.hidden || (shapeFlags(o.shape) & BATCH_LINES))
+            continue;
+        objectBounds(o, lo, hi);
+        if (!boxInFrustum(frustum, lo, hi))
+            continue;
+        hashBytes(key, &layout.dynamicObjects[i], sizeof(int));
+        hashBytes(key, o.world.m, sizeof(o.world.m));
+    }
+    return key;
+}
+
+// Function to bring one shadow map up to date
+static void updateShadowMap(int layoutIndex, int light)
+{
+    const BakedLayout& layout = bakedLayouts[layoutIndex];
+    ShadowMap& map = layoutShadows[layoutIndex].maps[light];
+    shadowCamera(bakeLights[light], layout, map.view, map.projection);
+    unsigned long long lightKey = 14695981039346656037ULL;
+    hashBytes(lightKey, map.view.m, sizeof(map.view.m));
+    hashBytes(lightKey, map.projection.m, sizeof(map.projection.m));
+    if (lightKey != map.lightKey)
+    {
+        TraceSpan span("staticShadowMap", layoutIndex);
+        glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, map.staticDepth, 0);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        drawShadowCasters(layout, map, true, false);
+        map.lightKey = lightKey;
+        map.casterKey = 0;
+        staticShadowRenders++;
+    }
+    unsigned long long casterKey = shadowCasterKey(layout, map);
+    if (casterKey == map.casterKey)
+        return;
+
+    // Copy the static part, then draw the moving objects over it
+    TraceSpan span("shadowMap", layoutIndex);
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, shadowCopyFramebuffer);
+    glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, map.staticDepth, 0);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, shadowFramebuffer);
+    glFramebufferTexture2D(GL_DRAW_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, map.texture, 0);
+    glBlitFramebuffer(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE,
+                      GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadowFramebuffer);
+    drawShadowCasters(layout, map, false, true);
+    map.casterKey = casterKey;
+    shadowCopies++;
+}
+
+// Function to bring the shadow maps of the layouts on screen up to date, after the frame is recorded
+// and before it is drawn; maps of lights that are off wait until they are switched on
+void updateShadowMaps()
+{
+    GLboolean on[BAKE_LIGHT_COUNT] = { switchOne && diff1, switchTwo && diff2, switchLamp && diff3 };
+    shadowsActive = false;
+    for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+    {
+        shadowDarkness[i] = on[i] ? SHADOW_DARKNESS : 0;
+        shadowsActive = shadowsActive || on[i];
+    }
+    shadowsActive = shadowsActive && recordShadows;
+    if (!shadowsActive)
+        return;
+    GLint framebuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    if (!shadowFramebuffer)
+    {
+        GLint units = 0;
+        int needed = SHADOW_UNIT - GL_TEXTURE0 + SHADOW_UNITS;
+        glGetIntegerv(GL_MAX_TEXTURE_UNITS, &units);
+        if (units < needed)
+        {
+            std::cerr << "Shadows need " << needed << " texture units, the GL has " << units << std::endl;
+            useShadows = shadowsActive = false;
+            return;
+        }
+        shadowFramebuffer = shadowFramebufferFor("shadow map target");
+        shadowCopyFramebuffer = shadowFramebufferFor("shadow map copy source");
+        glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+        static const GLubyte step[] = { 0, 255 };
+        shadowMask = gpuCreateTexture("shadow mask");
+        glBindTexture(GL_TEXTURE_2D, shadowMask);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_ALPHA8, 2, 1, 0, GL_ALPHA, GL_UNSIGNED_BYTE, step);
+        gpuSetBytes(GPU_TEXTURE, shadowMask, sizeof(step));
+        glBindTexture(GL_TEXTURE_2D, 0);
+    }
+    LayoutShadows empty = {};
+    layoutShadows.resize(bakedLayouts.size(), empty);
+
+    TraceSpan span("updateShadowMaps");
+    glPushAttrib(GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_COLOR_BUFFER_BIT | GL_POLYGON_BIT | GL_TRANSFORM_BIT);
+    glMatrixMode(GL_PROJECTION);
     glPushMatrix();
-    glTranslatef(-0.9, 2.1, 6.2);
-    glRotatef(-14, 1, 0, 0);
-    glScalef(0.0001, 0.28, 0.02);
-    drawCube1(1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
-    glPopMatrix();
-    
-    // Third component
+    glMatrixMode(GL_MODELVIEW);
     glPushMatrix();
-    glTranslatef(-0.9, 1.8, 6);
-    glRotatef(-14, 1, 0, 0);
-    glScalef(0.0001, 0.29, 0.02);
-    drawCube1(1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
+    bool drawing = false;
+    unsigned done = 0;      // Layouts already updated this frame, as bits; rooms share layouts
+    for (size_t r = 0; r < visibleRooms.size(); r++)
+    {
+        int l = rooms[visibleRooms[r]].layout;
+        if (l < 32 && (done & (1u << l)))
+            continue;
+        done |= l < 32 ? 1u << l : 0;
+        // Every unit needs a texture, the units of lights that are off included
+        for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+        {
+            ShadowMap& map = layoutShadows[l].maps[i];
+            if (!map.staticDepth)
+            {
+                map.staticDepth = shadowTexture("shadow map, static");
+                map.texture = shadowTexture("shadow map");
+            }
+        }
+        for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+        {
+            if (!on[i])
+                continue;
+            if (!drawing)
+            {
+                // Depth only, pushed back a little so lit surfaces do not shadow themselves
+                glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+                glDisable(GL_LIGHTING);
+                glDisable(GL_TEXTURE_2D);
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                glEnable(GL_POLYGON_OFFSET_FILL);
+                glPolygonOffset(2, 4);
+                glEnableClientState(GL_VERTEX_ARRAY);
+                drawing = true;
+            }
+            updateShadowMap(l, i);
+        }
+    }
+    if (drawing)
+    {
+        glDisableClientState(GL_VERTEX_ARRAY);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glMatrixMode(GL_PROJECTION);
     glPopMatrix();
-    
-    // Fourth component
-    glPushMatrix();
-    glTranslatef(-0.9, 2.1, 5.5);
-    glRotatef(23, 1, 0, 0);
-    glScalef(0.0001, 0.25, 0.02);
-    drawCube1(1.0, 1.0, 1.0, 1.0, 1.0, 1.0, 10);
+    glMatrixMode(GL_MODELVIEW);
     glPopMatrix();
+    glPopAttrib();
 }
 
-// Function to draw the wardrobe
-void wardrobe()
+// Function to mark a layout's shadow maps stale after its static geometry changed
+void invalidateShadowMaps(int layout)
 {
-    // Wardrobe
-    glPushMatrix();
-    glTranslatef(0, 0, 4);
-    glScalef(0.12, 0.6, 0.4);
-    drawCube1(0.3, 0.1, 0, 0.15, 0.05, 0);
-    glPopMatrix();
-    
-    // Wardrobe's drawers
-    for (float yPos = 1.4; yPos >= 0.2; yPos -= 0.4)
+    if (layout < (int)layoutShadows.size())
+        for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+            layoutShadows[layout].maps[i].lightKey = 0;
+}
+
+// Function to switch the shadow lookups on or off. Each light takes two units: the first looks up its
+// depth map and leaves darkness * (1 - lit) in the alpha, the second multiplies that by the light's mask,
+// and the next light's first unit takes it off the colour. The last unit applies the last light and
+// restores the alpha.
+void setShadowState(bool on)
+{
+    for (int k = 0; k < SHADOW_UNITS; k++)
     {
+        glActiveTexture(SHADOW_UNIT + k);
+        if (!on)
+        {
+            glDisable(GL_TEXTURE_2D);
+            glDisable(GL_TEXTURE_GEN_S);
+            glDisable(GL_TEXTURE_GEN_T);
+            glDisable(GL_TEXTURE_GEN_R);
+            glDisable(GL_TEXTURE_GEN_Q);
+            glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+            glBindTexture(GL_TEXTURE_2D, 0);
+            continue;
+        }
+        bool depth = k % 2 == 0 && k < SHADOW_UNITS - 1;
+        glEnable(GL_TEXTURE_2D);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_PREVIOUS);
+        glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_PREVIOUS);
+        glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_ONE_MINUS_SRC_ALPHA);
+        glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, (depth && k > 0) || k == SHADOW_UNITS - 1 ? GL_MODULATE : GL_REPLACE);
+        if (k == SHADOW_UNITS - 1)
+        {
+            glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_ALPHA, GL_REPLACE);
+            glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_ALPHA, GL_PRIMARY_COLOR);
+            glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_ALPHA, GL_SRC_ALPHA);
+            continue;
+        }
+        GLfloat darkness[] = { 0, 0, 0, shadowDarkness[k / 2] };
+        glTexEnvfv(GL_TEXTURE_ENV, GL_TEXTURE_ENV_COLOR, darkness);
+        glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_ALPHA, GL_MODULATE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_ALPHA, depth ? GL_CONSTANT : GL_PREVIOUS);
+        glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_ALPHA, GL_SRC_ALPHA);
+        glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_ALPHA, GL_TEXTURE);
+        glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_ALPHA, depth ? GL_ONE_MINUS_SRC_ALPHA : GL_SRC_ALPHA);
+
+        // Eye coordinates, which the texture matrix takes on into the light's space
+        static const GLfloat planes[4][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } };
+        static const GLenum coords[4] = { GL_S, GL_T, GL_R, GL_Q };
         glPushMatrix();
-        glTranslatef(0.36, yPos, 4.05);
-        glScalef(0.0001, 0.11, 0.38);
-        drawCube1(0.5, 0.2, 0.2, 0.25, 0.1, 0.1);
+        glLoadIdentity();
+        for (int c = 0; c < 4; c++)
+        {
+            glTexGeni(coords[c], GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR);
+            glTexGenfv(coords[c], GL_EYE_PLANE, planes[c]);
+        }
         glPopMatrix();
+        glEnable(GL_TEXTURE_GEN_S);
+        glEnable(GL_TEXTURE_GEN_T);
+        glEnable(GL_TEXTURE_GEN_R);
+        glEnable(GL_TEXTURE_GEN_Q);
     }
-    
-    // Wardrobe's drawer handles
-    glColor3f(0.3, 0.1, 0);
-    for (float yPos = 1.5; yPos >= 0.3; yPos -= 0.4)
+    glActiveTexture(GL_TEXTURE0);
+}
+
+// Function to point the shadow lookups at a room's maps: from eye space through the room into each light
+void loadShadowMatrices(const Mat4& view, const RoomInstance& room)
+{
+    const LayoutShadows& shadows = layoutShadows[room.layout];
+    Mat4 eyeToRoom = mat4Inverse(mat4Mul(view, room.world));
+    Mat4 bias = mat4Mul(mat4Translate(0.5f, 0.5f, 0.5f), mat4Scale(0.5f, 0.5f, 0.5f));
+
+    // The mask's s steps from 0 to 1 at the light's own plane: behind it the projection mirrors the
+    // depth map, and nothing there may be shadowed
+    Mat4 mask = mat4Identity();
+    mask.m[0] = mask.m[5] = mask.m[10] = 0;
+    mask.m[8] = -1000;
+    mask.m[12] = mask.m[13] = 0.5f;
+    glMatrixMode(GL_TEXTURE);
+    for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
     {
-        glPushMatrix();
-        glTranslatef(0.37, yPos, 4.3);
-        glScalef(0.01, 0.03, 0.2);
-        drawCube1(0.3, 0.1, 0, 0.15, 0.05, 0.0);
-        glPopMatrix();
+        const ShadowMap& map = shadows.maps[i];
+        Mat4 eyeToLight = mat4Mul(map.view, eyeToRoom);
+        glActiveTexture(SHADOW_UNIT + 2 * i);
+        glBindTexture(GL_TEXTURE_2D, map.texture);
+        glLoadMatrixf(mat4Mul(mat4Mul(bias, map.projection), eyeToLight).m);
+        glActiveTexture(SHADOW_UNIT + 2 * i + 1);
+        glBindTexture(GL_TEXTURE_2D, shadowMask);
+        glLoadMatrixf(mat4Mul(mask, eyeToLight).m);
     }
+    // The last unit only needs a complete texture to run its combiner
+    glActiveTexture(SHADOW_UNIT + SHADOW_UNITS - 1);
+    glBindTexture(GL_TEXTURE_2D, shadowMask);
+    glMatrixMode(GL_MODELVIEW);
+    glActiveTexture(GL_TEXTURE0);
 }
 
-// Function to draw the dressing table
-void dressingTable()
+// Function to release every shadow map
+void releaseShadowMaps()
 {
-    // Dressing table main body ************************************************
-    
-    // Dressing table left body
-    glPushMatrix();
-    glTranslatef(5.9, 0, 4.6);
-    glScalef(0.2, 0.2, 0.2);
-    drawCube1(0.545, 0.271, 0.075, 0.2725, 0.1355, 0.0375);
-    glPopMatrix();
-    
-    /* Commented out code for stripes on the left body
-    // Dressing table left body left stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(5.9, 0, 5.2);
-    glScalef(0.01, 0.3, 0.0001);
-    drawCube();
-    glPopMatrix();
-    
-    // Dressing table left body right stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(6.5, 0, 5.2);
-    glScalef(0.01, 0.2, 0.0001);
-    drawCube();
-    glPopMatrix();
-    
-    // Dressing table left body bottom stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(5.9, 0, 5.2);
-    glScalef(0.2, 0.01, 0.0001);
-    drawCube();
-    glPopMatrix();
-    */
+    for (size_t l = 0; l < layoutShadows.size(); l++)
+        for (int i = 0; i < BAKE_LIGHT_COUNT; i++)
+        {
+            gpuDeleteTexture(layoutShadows[l].maps[i].staticDepth);
+            gpuDeleteTexture(layoutShadows[l].maps[i].texture);
+        }
+    layoutShadows.clear();
+    gpuDeleteTexture(shadowMask);
+    gpuDeleteFramebuffer(shadowFramebuffer);
+    gpuDeleteFramebuffer(shadowCopyFramebuffer);
+}
+
+// Scene edits and hot reload ***********************************************
+//
+// Furniture can be rearranged without recompiling. --scene FILE names a text
+// file of edits on top of the generated rooms, one per line, addressed by node
+// name (every layout's node of that name is edited):
+//
+//     lamp position 0.6 0.7 8.95    # move a piece; the position is its anchor in the room
+//     bed color 2 0.6 0.2 0.2       # recolour object 2 of the node (ambient is half the diffuse)
+//     poster hide                   # hide a piece with everything under it
+//     clock hide 3                  # hide a single object
+//
+// The file is polled while the program runs. When it changes, the edits are
+// applied again to the generated scene, every object is compared with what was
+// on screen, and only the batches holding objects that moved, changed colour or
+// were hidden or shown are rebuilt.
+
+static const int SCENE_EDIT_POLL_MS = 250;
+
+const char* sceneEditFile = NULL;
+time_t sceneEditTime = 0;           // Modification time and size of the edits last applied
+off_t sceneEditSize = -1;
+int lastSceneEditPoll = -SCENE_EDIT_POLL_MS;
+std::vector<Mat4> generatedLocals;      // Node transforms as the generator left them
+std::vector<Material> generatedMaterials;
+
+static void hideSubtree(int node)
+{
+    for (size_t i = 0; i < sceneNodes[node].objects.size(); i++)
+        sceneObjects[sceneNodes[node].objects[i]].hidden = true;
+    for (size_t i = 0; i < sceneNodes[node].children.size(); i++)
+        hideSubtree(sceneNodes[node].children[i]);
+}
+
+// Function to apply one line of the edit file; returns false if it is not understood
+static bool applySceneEdit(const char* line)
+{
+    char name[64], command[32];
+    int used = 0;
+    if (sscanf(line, "%63s %31s%n", name, command, &used) < 2)
+        return false;
+    const char* args = line + used;
+
+    bool found = false;
+    for (size_t n = 0; n < sceneNodes.size(); n++)
+    {
+        SceneNode& node = sceneNodes[n];
+        if (strcmp(node.name, name) != 0)
+            continue;
+        found = true;
+        int index;
+        GLfloat x, y, z;
+        if (strcmp(command, "position") == 0 && sscanf(args, "%f %f %f", &x, &y, &z) == 3)
+        {
+            // Moving nodes are placed by the animation every frame, so the edit cannot hold
+            if (node.dynamic)
+                return false;
+            Mat4 local = generatedLocals[n];
+            local.m[12] = x; local.m[13] = y; local.m[14] = z;
+            setNodeTransform((int)n, local);
+        }
+        else if (strcmp(command, "color") == 0 && sscanf(args, "%d %f %f %f", &index, &x, &y, &z) == 4)
+        {
+            if (index < 0 || index >= (int)node.objects.size())
+                return false;
+            Material& m = sceneObjects[node.objects[index]].material;
+            m.dif[0] = x; m.dif[1] = y; m.dif[2] = z;
+            m.amb[0] = x / 2; m.amb[1] = y / 2; m.amb[2] = z / 2;
+        }
+        else if (strcmp(command, "hide") == 0)
+        {
+            if (sscanf(args, "%d", &index) != 1)
+                hideSubtree((int)n);
+            else if (index >= 0 && index < (int)node.objects.size())
+                sceneObjects[node.objects[index]].hidden = true;
+            else
+                return false;
+        }
+        else
+            return false;
+    }
+    return found;
+}
+
+static bool sameObject(const SceneObject& a, const SceneObject& b)
+{
+    return a.hidden == b.hidden && memcmp(&a.world, &b.world, sizeof(Mat4)) == 0
+           && memcmp(&a.material, &b.material, sizeof(Material)) == 0;
+}
+
+// Function to re-apply the edit file and rebuild the batches it changed
+void reloadSceneEdits()
+{
+    TraceSpan span("reloadSceneEdits");
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    if (generatedLocals.size() != sceneNodes.size())
+    {
+        generatedLocals.clear();
+        for (size_t n = 0; n < sceneNodes.size(); n++)
+            generatedLocals.push_back(sceneNodes[n].local);
+        generatedMaterials.clear();
+        for (size_t i = 0; i < sceneObjects.size(); i++)
+            generatedMaterials.push_back(sceneObjects[i].material);
+    }
+    FILE* file = fopen(sceneEditFile, "r");
+    if (file == NULL)
+    {
+        std::cerr << "Cannot read scene edits from " << sceneEditFile << std::endl;
+        return;
+    }
+
+    // Start over from the generated scene, then apply the edits
+    std::vector<SceneObject> before(sceneObjects);
+    for (size_t n = 0; n < sceneNodes.size(); n++)
+        if (!sceneNodes[n].dynamic && memcmp(&sceneNodes[n].local, &generatedLocals[n], sizeof(Mat4)) != 0)
+            setNodeTransform((int)n, generatedLocals[n]);
+    for (size_t i = 0; i < sceneObjects.size(); i++)
+    {
+        sceneObjects[i].material = generatedMaterials[i];
+        sceneObjects[i].hidden = false;
+    }
+    char line[256];
+    for (int lineNumber = 1; fgets(line, sizeof(line), file); lineNumber++)
+    {
+        char* comment = strchr(line, '#');
+        if (comment)
+            *comment = 0;
+        char first[2];
+        if (sscanf(line, "%1s", first) == 1 && !applySceneEdit(line))
+            std::cerr << sceneEditFile << ":" << lineNumber << ": cannot apply edit" << std::endl;
+    }
+    fclose(file);
+    updateTransforms();
+
+    // Rebuild the batches an object left or joined, in every layout
+    int changedObjects = 0, rebuiltBatches = 0;
+    for (size_t l = 0; l < bakedLayouts.size(); l++)
+    {
+        BakedLayout& layout = bakedLayouts[l];
+        std::vector<StaticBatch> dirty;
+        for (size_t i = 0; i < layout.staticObjects.size(); i++)
+        {
+            int index = layout.staticObjects[i];
+            const SceneObject& a = before[index];
+            const SceneObject& b = sceneObjects[index];
+            if (sameObject(a, b))
+                continue;
+            changedObjects++;
+            int group = sceneNodes[b.node].group;
+            if (!a.hidden)
+                batchFor(dirty, a.material, objectFlags(a), group);
+            if (!b.hidden)
+                batchFor(dirty, b.material, objectFlags(b), group);
+        }
+        if (dirty.empty())
+            continue;
+
+        for (size_t d = 0; d < dirty.size(); d++)
+        {
+            fillBatch(batchFor(layout.batches, dirty[d].material, dirty[d].flags, dirty[d].group), layout, NULL);
+            rebuiltBatches++;
+        }
+        for (size_t i = layout.batches.size(); i-- > 0;)
+            if (layout.batches[i].gpu.indexCount == 0)
+            {
+                releaseMesh(layout.batches[i].gpu);
+                layout.batches.erase(layout.batches.begin() + i);
+            }
+        finishLayout(layout);
+        invalidateShadowMaps((int)l);
+        invalidateLightmaps((int)l);
+    }
+    for (size_t i = 0; i < sceneObjects.size(); i++)
+        if (sceneNodes[sceneObjects[i].node].dynamic && !sameObject(before[i], sceneObjects[i]))
+            changedObjects++;
+
+    buildPickingBVH();
+    if (selection.room >= 0 && sceneObjects[selection.object].hidden)
+        selection.room = -1;
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    printf("Scene edits: %d objects changed, %d batches rebuilt in %.2f ms\n", changedObjects, rebuiltBatches, ms);
+}
+
+// Function to reload the edit file when it has been saved since it was last applied
+void pollSceneEdits()
+{
+    int now = glutGet(GLUT_ELAPSED_TIME);
+    if (sceneEditFile == NULL || now - lastSceneEditPoll < SCENE_EDIT_POLL_MS)
+        return;
+    lastSceneEditPoll = now;
+    struct stat info;
+    if (stat(sceneEditFile, &info) != 0 || (info.st_mtime == sceneEditTime && info.st_size == sceneEditSize))
+        return;
+    sceneEditTime = info.st_mtime;
+    sceneEditSize = info.st_size;
+    reloadSceneEdits();
+}
+
+void lightBulb1()
+{
+    // Material properties
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { 0.7, 0.7, 0.7, 1.0 };
+    GLfloat mat_diffuse[] = { 1.000, 0.843, 0.000, 1.0 };
+    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
+    GLfloat high_shininess[] = { 100.0 };
+    GLfloat mat_emission[] = {1.000, 1, 1, 0.0};
     
-    // Dressing table right body
-    glPushMatrix();
-    glTranslatef(7, 0, 4.6);
-    glScalef(0.2, 0.2, 0.2);
-    drawCube1(0.545, 0.271, 0.075, 0.2725, 0.1355, 0.0375);
-    glPopMatrix();
+    glPushMatrix(); // Save current matrix
+    glTranslatef(5, 5, 8); // Translate to light bulb 1 position
+    glScalef(0.2, 0.2, 0.2); // Scale the light bulb
+    glMaterialfv(GL_FRONT, GL_AMBIENT, no_mat); // Set ambient material property
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse); // Set diffuse material property
+    glMaterialfv(GL_FRONT, GL_SPECULAR, no_mat); // Set specular material property
+    glMaterialfv(GL_FRONT, GL_SHININESS, high_shininess); // Set shininess material property
     
-    /* Commented out code for stripes on the right body
-    // Dressing table right body left stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7, 0, 5.2);
-    glScalef(0.01, 0.2, 0.0001);
-    drawCube();
-    glPopMatrix();
+    // Set emission material property based on switch state
+    if (switchOne == true) {
+        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
+    } else {
+        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    }
     
-    // Dressing table right body right stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7.6, 0, 5.2);
-    glScalef(0.01, 0.3, 0.0001);
-    drawCube();
-    glPopMatrix();
+    bulbSphere(); // Draw the light bulb
+    glPopMatrix(); // Restore previous matrix
+}
+
+// The comments explain each step of the function, such as translations, scaling, and drawing. This makes it easier for others to understand the code's purpose and behavior.
+
+
+void lightBulb2()
+{
+    // Material properties
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { 0.7, 0.7, 0.7, 1.0 };
+    GLfloat mat_ambient_color[] = { 0.8, 0.8, 0.2, 1.0 };
+    GLfloat mat_diffuse[] = { 1.000, 0.843, 0.000, 1.0 };
+    GLfloat high_shininess[] = { 100.0 };
+    GLfloat mat_emission[] = {1, 1, 1, 1.0};
     
-    // Dressing table right body bottom stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7, 0, 5.2);
-    glScalef(0.2, 0.01, 0.0001);
-    drawCube();
-    glPopMatrix();
-    */
+    glPushMatrix(); // Save current matrix
+    glTranslatef(0, 5, 8); // Translate to light bulb 2 position
+    glScalef(0.2, 0.2, 0.2); // Scale the light bulb
+    glMaterialfv(GL_FRONT, GL_AMBIENT, no_mat); // Set ambient material property
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse); // Set diffuse material property
+    glMaterialfv(GL_FRONT, GL_SPECULAR, no_mat); // Set specular material property
+    glMaterialfv(GL_FRONT, GL_SHININESS, high_shininess); // Set shininess material property
     
-    // Dressing table upper body
-    glPushMatrix();
-    glTranslatef(5.9, 0.6, 4.6);
-    glScalef(0.57, 0.1, 0.2);
-    drawCube1(0.545, 0.271, 0.075, 0.2725, 0.1355, 0.0375);
-    glPopMatrix();
+    // Set emission material property based on switch state
+    if (switchTwo == true) {
+        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
+    } else {
+        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    }
     
-    // Dressing table upper body bottom stripe
-    glPushMatrix();
-    glTranslatef(5.9, 0.6, 5.2);
-    glScalef(0.57, 0.01, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    bulbSphere(); // Draw the light bulb
+    glPopMatrix(); // Restore previous matrix
+}
+
+void lightBulb3()
+{
+    // Material properties
+    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat mat_ambient[] = { 0.7, 0.7, 0.7, 1.0 };
+    GLfloat mat_ambient_color[] = { 0.8, 0.8, 0.2, 1.0 };
+    GLfloat mat_diffuse[] = { 1.000, 0.843, 0.000, 1.0 };
+    GLfloat high_shininess[] = { 100.0 };
+    GLfloat mat_emission[] = {1, 1, 1, 1.0};
     
-    // Dressing table upper body upper stripe
-    glPushMatrix();
-    glTranslatef(5.9, 0.9, 5.2);
-    glScalef(0.57, 0.01, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    glPushMatrix(); // Save current matrix
+    glTranslatef(0.7, 1.5, 9.0); // Translate to light bulb 3 position
+    glScalef(0.2, 0.2, 0.2); // Scale the light bulb
+    glMaterialfv(GL_FRONT, GL_AMBIENT, no_mat); // Set ambient material property
+    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse); // Set diffuse material property
+    glMaterialfv(GL_FRONT, GL_SPECULAR, no_mat); // Set specular material property
+    glMaterialfv(GL_FRONT, GL_SHININESS, high_shininess); // Set shininess material property
     
-    // Dressing table upper body handle
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(6.5, 0.75, 5.2);
-    glScalef(0.16, 0.02, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    // Set emission material property based on switch state
+    if (switchLamp == true) {
+        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
+    } else {
+        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    }
     
-    // Dressing table left body handle
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(6.4, 0.1, 5.2);
-    glScalef(0.02, 0.13, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    bulbSphere(); // Draw the light bulb
+    glPopMatrix(); // Restore previous matrix
+}
+
+void lightOne()
+{
+    glPushMatrix(); // Save current matrix
+    GLfloat no_light[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat light_ambient[] = {0.5, 0.5, 0.5, 1.0};
+    GLfloat light_diffuse[] = {1.0, 1.0, 1.0, 1.0};
+    GLfloat light_specular[] = {1.0, 1.0, 1.0, 1.0};
+    GLfloat light_position[] = {5.0, 5.0, 8.0, 1.0}; // Set light 1 position
     
-    // Dressing table right body handle
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7.1, 0.1, 5.2);
-    glScalef(0.02, 0.13, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    // glEnable(GL_LIGHT0);
     
-    // Dressing table mirrors ************************************************
+    // Set light properties based on switch state
+    if (amb1 == true) {
+        glLightfv(GL_LIGHT0, GL_AMBIENT, light_ambient);
+    } else {
+        glLightfv(GL_LIGHT0, GL_AMBIENT, no_light);
+    }
     
-    // Dressing table main mirror
-    glPushMatrix();
-    glTranslatef(6.2, 0.9, 4.7);
-    glScalef(0.36, 0.5, 0.0001);
-    drawCube1(0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10);
-    glPopMatrix();
+    if (diff1 == true) {
+        glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
+    } else {
+        glLightfv(GL_LIGHT0, GL_DIFFUSE, no_light);
+    }
     
-    // Dressing table left mirror
-    glPushMatrix();
-    glTranslatef(5.92, 0.9, 4.7);
-    glScalef(0.1, 0.48, 0.0001);
-    drawCube1(0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10);
-    glPopMatrix();
+    if (spec1 == true) {
+        glLightfv(GL_LIGHT0, GL_SPECULAR, light_specular);
+    } else {
+        glLightfv(GL_LIGHT0, GL_SPECULAR, no_light);
+    }
+   
+    glLightfv(GL_LIGHT0, GL_POSITION, light_position); // Set light 1 position
+    glPopMatrix(); // Restore previous matrix
+}
+
+void lightTwo()
+{
+    glPushMatrix(); // Save current matrix
+    GLfloat no_light[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat light_ambient[] = {0.5, 0.5, 0.5, 1.0};
+    GLfloat light_diffuse[] = {1.0, 1.0, 0.9, 1.0};
+    GLfloat light_specular[] = {1.0, 1.0, 1.0, 1.0};
+    GLfloat light_position[] = {0.0, 5.0, 8.0, 1.0}; // Set light 2 position
     
-    // Commented out code for stripes on the left mirror
-    // Dressing table left mirror left stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(5.92, 0.9, 4.71);
-    glScalef(0.019, 0.48, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    // glEnable(GL_LIGHT1);
     
-    // Dressing table left mirror right stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(6.17, 0.9, 4.71);
-    glScalef(0.019, 0.48, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    // Set light properties based on switch state
+    if (amb2 == true) {
+        glLightfv(GL_LIGHT1, GL_AMBIENT, light_ambient);
+    } else {
+        glLightfv(GL_LIGHT1, GL_AMBIENT, no_light);
+    }
     
-    // Dressing table mirror stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(5.92, 0.9, 4.71);
-    glScalef(0.55, 0.019, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    if (diff2 == true) {
+        glLightfv(GL_LIGHT1, GL_DIFFUSE, light_diffuse);
+    } else {
+        glLightfv(GL_LIGHT1, GL_DIFFUSE, no_light);
+    }
     
-    // Dressing table left mirror upper stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(5.92, 2.3, 4.71);
-    glScalef(0.1, 0.019, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    if (spec2 == true) {
+        glLightfv(GL_LIGHT1, GL_SPECULAR, light_specular);
+    } else {
+        glLightfv(GL_LIGHT1, GL_SPECULAR, no_light);
+    }
     
-    // Dressing table right mirror
-    glPushMatrix();
-    glTranslatef(7.25, 0.9, 4.7);
-    glScalef(0.1, 0.48, 0.0001);
-    drawCube1(0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10);
-    glPopMatrix();
+    glLightfv(GL_LIGHT1, GL_POSITION, light_position); // Set light 2 position
+    glPopMatrix(); // Restore previous matrix
+}
+
+void lampLight()
+{
+    glPushMatrix(); // Save current matrix
+    GLfloat no_light[] = { 0.0, 0.0, 0.0, 1.0 };
+    GLfloat light_ambient[] = {0.5, 0.5, 0.5, 1.0};
+    GLfloat light_diffuse[] = {1.0, 1.0, 1.0, 1.0};
+    GLfloat light_specular[] = {1.0, 1.0, 1.0, 1.0};
+    GLfloat light_position[] = {0.7, 1.5, 9.0, 1.0}; // Set lamp light position
     
-    // Dressing table left mirror upper stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7.25, 2.3, 4.71);
-    glScalef(0.1, 0.019, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    // glEnable(GL_LIGHT2);
     
-    // Dressing table right mirror left stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7.25, 0.9, 4.71);
-    glScalef(0.019, 0.48, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    // Set light properties based on switch state
+    if (amb3 == true) {
+        glLightfv(GL_LIGHT2, GL_AMBIENT, light_ambient);
+    } else {
+        glLightfv(GL_LIGHT2, GL_AMBIENT, no_light);
+    }
     
-    // Dressing table right mirror right stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(7.5, 0.9, 4.71);
-    glScalef(0.019, 0.48, 0.0001);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    if (diff3 == true) {
+        glLightfv(GL_LIGHT2, GL_DIFFUSE, light_diffuse);
+    } else {
+        glLightfv(GL_LIGHT2, GL_DIFFUSE, no_light);
+    }
     
-    // Dressing table main mirror polygon part
-    glColor3f(0.690, 0.878, 0.902);
-    glPushMatrix();
-    glTranslatef(6.2, 2.4, 4.7);
-    glScalef(0.18, 0.18, 2);
-    polygon(0.690, 0.878, 0.902, 0.345, 0.439, 0.451, 10);
-    glPopMatrix();
+    if (spec3 == true) {
+        glLightfv(GL_LIGHT2, GL_SPECULAR, light_specular);
+    } else {
+        glLightfv(GL_LIGHT2, GL_SPECULAR, no_light);
+    }
+
+    glLightfv(GL_LIGHT2, GL_POSITION, light_position); // Set lamp light position
     
-    // Dressing table upper round stripe
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(6.2, 2.4, 4.71);
-    glScalef(0.18, 0.18, 1);
-    polygonLine(0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 50);
-    glPopMatrix();
+    GLfloat spot_direction[] = {0.3, -1, -0.8}; // Set spotlight direction
+    glLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, spot_direction);
+    glLightf(GL_LIGHT2, GL_SPOT_CUTOFF, 35.0); // Set spotlight cutoff angle
+    glPopMatrix(); // Restore previous matrix
 }
 
-
-void wallshelf()
+// Anti-aliasing ************************************************************
+//
+// --aa picks how edges are smoothed: off, MSAA with 2 or 4 samples, or FXAA,
+// one post-process pass over the finished frame that blurs only across the
+// edges it finds in the luminance. On software GL every MSAA sample is
+// rasterized, stored and resolved, while FXAA costs one full-screen pass. The
+// window's sample count is fixed when it is created, so 'x' cycles between
+// off, FXAA and the MSAA mode the window was created with.
+
+enum AntiAliasing { AA_OFF, AA_MSAA2, AA_MSAA4, AA_FXAA, AA_MODE_COUNT };
+
+static const char* aaModeNames[AA_MODE_COUNT] = { "off", "msaa2", "msaa4", "fxaa" };
+static const int aaModeSamples[AA_MODE_COUNT] = { 0, 2, 4, 0 };
+
+AntiAliasing aaMode = AA_MSAA4;     // Four samples, as the window always had before --aa
+AntiAliasing windowMsaaMode = AA_OFF;
+GLint windowSamples = 0;            // Samples per pixel the window actually got
+GLuint fxaaProgram = 0, fxaaTexture = 0;
+GLint fxaaTextureWidth = 0, fxaaTextureHeight = 0;
+bool timeAntiAliasing = false;      // Set by the benchmark: time the post pass, waiting for the GPU
+double aaPassMs = 0;
+int aaPassFrames = 0;
+
+static const char* fxaaVertexSource =
+    "void main()\n"
+    "{\n"
+    "    gl_TexCoord[0] = gl_MultiTexCoord0;\n"
+    "    gl_Position = gl_Vertex;\n"
+    "}\n";
+
+// FXAA: find the edge direction from the luminance of the four diagonal neighbours, blend along it, and
+// keep the narrower blend when the wider one overshoots the local contrast range
+static const char* fxaaFragmentSource =
+    "uniform sampler2D frame;\n"
+    "uniform vec2 texel;\n"
+    "const float REDUCE_MIN = 1.0 / 128.0;\n"
+    "const float REDUCE_MUL = 1.0 / 8.0;\n"
+    "const float SPAN_MAX = 8.0;\n"
+    "void main()\n"
+    "{\n"
+    "    vec2 uv = gl_TexCoord[0].xy;\n"
+    "    vec3 luma = vec3(0.299, 0.587, 0.114);\n"
+    "    float nw = dot(texture2D(frame, uv + vec2(-1.0, -1.0) * texel).rgb, luma);\n"
+    "    float ne = dot(texture2D(frame, uv + vec2(1.0, -1.0) * texel).rgb, luma);\n"
+    "    float sw = dot(texture2D(frame, uv + vec2(-1.0, 1.0) * texel).rgb, luma);\n"
+    "    float se = dot(texture2D(frame, uv + vec2(1.0, 1.0) * texel).rgb, luma);\n"
+    "    vec3 rgbM = texture2D(frame, uv).rgb;\n"
+    "    float m = dot(rgbM, luma);\n"
+    "    float lumaMin = min(m, min(min(nw, ne), min(sw, se)));\n"
+    "    float lumaMax = max(m, max(max(nw, ne), max(sw, se)));\n"
+    "    vec2 dir = vec2(-((nw + ne) - (sw + se)), (nw + sw) - (ne + se));\n"
+    "    float reduce = max((nw + ne + sw + se) * 0.25 * REDUCE_MUL, REDUCE_MIN);\n"
+    "    float scale = 1.0 / (min(abs(dir.x), abs(dir.y)) + reduce);\n"
+    "    dir = clamp(dir * scale, vec2(-SPAN_MAX), vec2(SPAN_MAX)) * texel;\n"
+    "    vec3 rgbA = 0.5 * (texture2D(frame, uv + dir * (1.0 / 3.0 - 0.5)).rgb\n"
+    "                     + texture2D(frame, uv + dir * (2.0 / 3.0 - 0.5)).rgb);\n"
+    "    vec3 rgbB = rgbA * 0.5 + 0.25 * (texture2D(frame, uv - dir * 0.5).rgb\n"
+    "                                    + texture2D(frame, uv + dir * 0.5).rgb);\n"
+    "    float lumaB = dot(rgbB, luma);\n"
+    "    gl_FragColor = vec4((lumaB < lumaMin || lumaB > lumaMax) ? rgbA : rgbB, 1.0);\n"
+    "}\n";
+
+// Function to read an --aa value; returns false for an unknown one
+bool parseAntiAliasing(const char* name)
 {
-    // Wall Shelf ******************************************************
-
-    // Wall shelf one
-    glPushMatrix();
-    glTranslatef(1.5, 2.7, 3);
-    glScalef(0.4, 0.03, 0.2);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
-
-    // Wall shelf two
-    glPushMatrix();
-    glTranslatef(1, 2.3, 3);
-    glScalef(0.4, 0.03, 0.2);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
-
-    // Wall shelf three
-    glPushMatrix();
-    glTranslatef(0.5, 1.9, 3);
-    glScalef(0.4, 0.03, 0.2);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
-
-    // Wall shelf four
-    glPushMatrix();
-    glTranslatef(1, 1.5, 3);
-    glScalef(0.4, 0.03, 0.2);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
-
-    // Wall shelf five
-    glPushMatrix();
-    glTranslatef(1.5, 1.1, 3);
-    glScalef(0.4, 0.03, 0.2);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
-    glPopMatrix();
+    for (int i = 0; i < AA_MODE_COUNT; i++)
+        if (strcmp(name, aaModeNames[i]) == 0)
+        {
+            aaMode = (AntiAliasing)i;
+            return true;
+        }
+    return false;
+}
 
-    // Showpiece on the bottom shelf from left 1
-    glPushMatrix();
-    glTranslatef(1.5, 1.2, 3);
-    glScalef(0.04, 0.06, 0.2);
-    drawCube1(0.698, 0.133, 0.133, 0.349, 0.0665, 0.0665);
-    glPopMatrix();
+// Function to choose the window's samples for the mode; returns the display mode flags it needs
+unsigned antiAliasingDisplayMode()
+{
+    if (aaModeSamples[aaMode] == 0)
+        return 0;
+    windowMsaaMode = aaMode;
+#ifdef FREEGLUT
+    glutSetOption(GLUT_MULTISAMPLE, aaModeSamples[aaMode]);
+#endif
+    return GLUT_MULTISAMPLE;
+}
 
-    // Showpiece on the bottom shelf from left 2
-    glPushMatrix();
-    glTranslatef(2, 1.2, 3);
-    glScalef(0.04, 0.06, 0.2);
-    drawCube1(0.729, 0.333, 0.827, 0.3645, 0.1665, 0.4135);
-    glPopMatrix();
+// Function to compile one stage of the FXAA program; returns 0 and prints the log on failure
+static GLuint compileShader(GLenum stage, const char* source)
+{
+    GLuint shader = glCreateShader(stage);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    GLint ok = 0;
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &ok);
+    if (!ok)
+    {
+        char log[1024];
+        glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+        std::cerr << "FXAA shader: " << log << std::endl;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
 
-    // Showpiece on the bottom shelf from left 3 lower portion
-    glPushMatrix();
-    glTranslatef(2.5, 1.2, 3);
-    glScalef(0.04, 0.06, 0.2);
-    drawCube1(0.098, 0.098, 0.439, 0.049, 0.049, 0.2195);
-    glPopMatrix();
+// Function to switch to an anti-aliasing mode; returns false if this window cannot do it
+bool setAntiAliasing(AntiAliasing mode)
+{
+    if (aaModeSamples[mode] > 0 && (mode != windowMsaaMode || windowSamples == 0))
+        return false;
+    if (mode == AA_FXAA && fxaaProgram == 0)
+        return false;
+    aaMode = mode;
+    if (aaModeSamples[mode] > 0)
+        glEnable(GL_MULTISAMPLE);
+    else
+        glDisable(GL_MULTISAMPLE);
+    return true;
+}
 
-    // Showpiece on the bottom shelf from left 3 upper portion
-    glPushMatrix();
-    glTranslatef(2.51, 1.35, 3);
-    glScalef(0.01, 0.05, 0.2);
-    drawCube1(0.529, 0.808, 0.980, 0.2645, 0.404, 0.490);
-    glPopMatrix();
+// Function to set up anti-aliasing once the window exists: check its samples and build the FXAA program
+void setupAntiAliasing()
+{
+    glGetIntegerv(GL_SAMPLES, &windowSamples);
+    GLuint vertex = compileShader(GL_VERTEX_SHADER, fxaaVertexSource);
+    GLuint fragment = compileShader(GL_FRAGMENT_SHADER, fxaaFragmentSource);
+    if (vertex && fragment)
+    {
+        fxaaProgram = gpuCreateProgram("FXAA");
+        glAttachShader(fxaaProgram, vertex);
+        glAttachShader(fxaaProgram, fragment);
+        glLinkProgram(fxaaProgram);
+        GLint ok = 0;
+        glGetProgramiv(fxaaProgram, GL_LINK_STATUS, &ok);
+        if (!ok)
+        {
+            std::cerr << "FXAA program failed to link" << std::endl;
+            gpuDeleteProgram(fxaaProgram);
+        }
+    }
+    // The program keeps what it needs; the shaders go once it is linked
+    if (vertex)
+        glDeleteShader(vertex);
+    if (fragment)
+        glDeleteShader(fragment);
+
+    AntiAliasing wanted = aaMode;
+    if (!setAntiAliasing(wanted))
+    {
+        std::cerr << "Anti-aliasing " << aaModeNames[wanted] << " is not available, turning it off" << std::endl;
+        setAntiAliasing(AA_OFF);
+    }
+    std::cout << "Anti-aliasing: " << aaModeNames[aaMode] << " (window has " << windowSamples << " samples)"
+              << std::endl;
+}
 
-    // Showpiece on the top shelf left 2
-    glColor3f(0.502, 0.502, 0.000);
-    glPushMatrix();
-    glTranslatef(2.5, 2.71, 3);
-    glScalef(0.05, 0.16, 0.01);
-    drawCube1(0.502, 0.502, 0.000, 0.251, 0.251, 0);
-    glPopMatrix();
+// Function to release the FXAA program and frame copy
+void releaseAntiAliasing()
+{
+    gpuDeleteTexture(fxaaTexture);
+    gpuDeleteProgram(fxaaProgram);
+    fxaaTextureWidth = fxaaTextureHeight = 0;
+}
 
-    // Showpiece on the top shelf left 1
-    glPushMatrix();
-    glTranslatef(1.8, 2.71, 3);
-    glScalef(0.16, 0.1, 0.01);
-    drawCube1(0, 0, 0.9, 0, 0, 0.45);
-    glPopMatrix();
+// Function to step 'x' to the next mode this window supports
+void cycleAntiAliasing()
+{
+    for (int i = 1; i < AA_MODE_COUNT; i++)
+        if (setAntiAliasing((AntiAliasing)((aaMode + i) % AA_MODE_COUNT)))
+            break;
+    std::cout << "Anti-aliasing: " << aaModeNames[aaMode] << std::endl;
+}
 
-    // Showpiece on 2nd shelf
-    glColor3f(0.416, 0.353, 0.804);
-    glPushMatrix();
-    glTranslatef(1.3, 2.4, 3);
-    glScalef(0.16, 0.08, 0.01);
-    drawCube1(0.416, 0.353, 0.804, 0.208, 0.1765, 0.402);
-    glPopMatrix();
+// Function to run the FXAA pass: copy the finished back buffer to a texture and redraw it filtered
+static void fxaaPass()
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+    GLint width = viewport[2], height = viewport[3];
+    if (width != fxaaTextureWidth || height != fxaaTextureHeight)
+    {
+        gpuDeleteTexture(fxaaTexture);
+        fxaaTexture = gpuCreateTexture("FXAA frame copy");
+        glBindTexture(GL_TEXTURE_2D, fxaaTexture);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        // Nearest filtering: on software GL it halves the cost of the pass, and the blends
+        // along the edge still average neighbouring pixels
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+        gpuSetBytes(GPU_TEXTURE, fxaaTexture, (size_t)width * height * 3);
+        fxaaTextureWidth = width;
+        fxaaTextureHeight = height;
+    }
+    glBindTexture(GL_TEXTURE_2D, fxaaTexture);
+    glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, viewport[0], viewport[1], width, height);
 
-    // Showpiece on 3rd shelf left 1
-    glPushMatrix();
-    glTranslatef(0.4, 1.9, 3);
-    glScalef(0.05, 0.16, 0.01);
-    drawCube1(0.863, 0.078, 0.235, 0.4315, 0.039, 0.1175);
-    glPopMatrix();
+    glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDepthMask(GL_FALSE);
+    glUseProgram(fxaaProgram);
+    glUniform1i(glGetUniformLocation(fxaaProgram, "frame"), 0);
+    glUniform2f(glGetUniformLocation(fxaaProgram, "texel"), 1.0f / width, 1.0f / height);
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(-1, -1);
+    glTexCoord2f(1, 0); glVertex2f(1, -1);
+    glTexCoord2f(1, 1); glVertex2f(1, 1);
+    glTexCoord2f(0, 1); glVertex2f(-1, 1);
+    glEnd();
+    glUseProgram(0);
+    glPopAttrib();
+}
 
-    // Showpiece on 3rd shelf left 2
-    glPushMatrix();
-    glTranslatef(0.7, 1.9, 3);
-    glScalef(0.05, 0.12, 0.01);
-    drawCube1(0.780, 0.082, 0.522, 0.39, 0.041, 0.261);
-    glPopMatrix();
+// Function to finish the frame's anti-aliasing before the swap; MSAA needs nothing here
+void applyAntiAliasing()
+{
+    if (aaMode != AA_FXAA)
+        return;
+    TraceSpan span("fxaaPass");
+    if (!timeAntiAliasing)
+    {
+        fxaaPass();
+        return;
+    }
+    glFinish();
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    fxaaPass();
+    glFinish();
+    aaPassMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    aaPassFrames++;
+}
 
-    // Showpiece on 3rd shelf left 3
-    glColor3f(0.600, 0.196, 0.800);
-    glPushMatrix();
-    glTranslatef(1, 1.9, 3);
-    glScalef(0.05, 0.09, 0.01);
-    drawCube1(0.6, 0.196, 0.8, 0.3, 0.098, 0.4);
-    glPopMatrix();
+// Dynamic resolution *******************************************************
+//
+// With --budget MS the scene is drawn into an offscreen target and scaled up
+// to the window. The target is allocated at the window's size once, and each
+// frame only its lower-left part, scaled by resolutionScale, is drawn into,
+// so changing the scale costs nothing. After every frame the render time
+// (display() up to the swap, the GL work included) goes into a moving
+// average; above the budget the scale drops, well below it the scale creeps
+// back up. Pixel cost goes with the square of the scale, so each step moves
+// the scale by the square root of budget / average, clamped to keep it smooth.
+// At full scale the frame goes straight to the window, as the upscale is a
+// full-window pass of its own. 'u' turns it on and off.
+
+static const GLfloat MIN_RESOLUTION_SCALE = 0.4f;
+
+bool dynamicResolution = false;
+GLfloat frameBudgetMs = 16.6f;
+GLfloat resolutionScale = 1;
+double averageRenderMs = 0;          // Moving average of the render time; 0 until the first frame
+int windowPixelWidth = 800, windowPixelHeight = 600;   // As fullScreen() last reported
+
+// Offscreen target: textures to draw and upscale from, and multisampled renderbuffers under MSAA
+GLuint sceneFramebuffer = 0, sceneColor = 0, sceneDepth = 0;
+GLuint msaaFramebuffer = 0, msaaColor = 0, msaaDepth = 0;
+int sceneTargetWidth = 0, sceneTargetHeight = 0, sceneTargetSamples = 0;
+int sceneWidth, sceneHeight;         // Part of the target drawn this frame
+bool drawingOffscreen = false;       // This frame is drawn into the target, below full scale
+std::chrono::steady_clock::time_point renderStart;
+double scaleSum = 0;                 // For the benchmark: scales of the frames drawn so far
+int scaleFrames = 0;
+
+// Function to free the offscreen target
+void releaseSceneTargets()
+{
+    gpuDeleteFramebuffer(sceneFramebuffer);
+    gpuDeleteTexture(sceneColor);
+    gpuDeleteTexture(sceneDepth);
+    gpuDeleteFramebuffer(msaaFramebuffer);
+    gpuDeleteRenderbuffer(msaaColor);
+    gpuDeleteRenderbuffer(msaaDepth);
+    sceneTargetWidth = sceneTargetHeight = sceneTargetSamples = 0;
+}
 
-    // Showpiece on 4th shelf
-    glPushMatrix();
-    glTranslatef(1.8, 1.5, 3);
-    glScalef(0.2, 0.1, 0.2);
-    drawpyramid(0.282, 0.239, 0.545, 0.141, 0.1195, 0.2725, 50);
-    glPopMatrix();
+// Function to make a texture of the given format as large as the window for the offscreen target
+static GLuint sceneTexture(const char* label, GLint format, GLenum pixelFormat, GLenum type, size_t bytesPerPixel)
+{
+    GLuint texture = gpuCreateTexture(label);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, windowPixelWidth, windowPixelHeight, 0, pixelFormat, type, NULL);
+    gpuSetBytes(GPU_TEXTURE, texture, (size_t)windowPixelWidth * windowPixelHeight * bytesPerPixel);
+    return texture;
+}
 
-    // Showpiece on 4th shelf
-    glPushMatrix();
-    glTranslatef(1.4, 1.5, 3);
-    glScalef(0.15, 0.1, 0.2);
-    drawpyramid(0.251, 0.878, 0.816, 0.1255, 0.439, 0.408, 50);
-    glPopMatrix();
+// Function to make a multisampled renderbuffer as large as the window
+static GLuint sceneRenderbuffer(const char* label, GLenum format, size_t bytesPerSample, int samples)
+{
+    GLuint renderbuffer = gpuCreateRenderbuffer(label);
+    glBindRenderbuffer(GL_RENDERBUFFER, renderbuffer);
+    glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, format, windowPixelWidth, windowPixelHeight);
+    gpuSetBytes(GPU_RENDERBUFFER, renderbuffer, (size_t)windowPixelWidth * windowPixelHeight * bytesPerSample * samples);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    return renderbuffer;
 }
 
-void Clock()
+// Function to (re)build the offscreen target when the window or the sample count changed
+static void updateSceneTargets()
 {
-    // Clock ************************************************************
+    int samples = aaModeSamples[aaMode] ? windowSamples : 0;
+    if (sceneTargetWidth == windowPixelWidth && sceneTargetHeight == windowPixelHeight && sceneTargetSamples == samples)
+        return;
+    releaseSceneTargets();
+    sceneColor = sceneTexture("scene color", GL_RGB8, GL_RGB, GL_UNSIGNED_BYTE, 3);
+    sceneFramebuffer = gpuCreateFramebuffer("scene target");
+    glBindFramebuffer(GL_FRAMEBUFFER, sceneFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, sceneColor, 0);
+    if (samples > 0)
+    {
+        // Drawn multisampled, then resolved into the color texture
+        msaaFramebuffer = gpuCreateFramebuffer("scene target, multisampled");
+        msaaColor = sceneRenderbuffer("scene color, multisampled", GL_RGB8, 4, samples);
+        msaaDepth = sceneRenderbuffer("scene depth, multisampled", GL_DEPTH_COMPONENT24, 4, samples);
+        glBindFramebuffer(GL_FRAMEBUFFER, msaaFramebuffer);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, msaaColor);
+        glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, msaaDepth);
+    }
+    else
+    {
+        sceneDepth = sceneTexture("scene depth", GL_DEPTH_COMPONENT24, GL_DEPTH_COMPONENT, GL_UNSIGNED_INT, 4);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, sceneDepth, 0);
+    }
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+        std::cerr << "Offscreen target is incomplete, drawing at full resolution" << std::endl;
+        dynamicResolution = false;
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    sceneTargetWidth = windowPixelWidth;
+    sceneTargetHeight = windowPixelHeight;
+    sceneTargetSamples = samples;
+}
 
-    // Clock body
-    glColor3f(0.545, 0.271, 0.075);
-    glPushMatrix();
-    glTranslatef(-0.9, 1.8, 7.87);
-    glScalef(0.08, 0.25, 0.1);
-    drawCube1(0.545, 0.271, 0.075, 0.271, 0.1335, 0.0375, 50);
-    glPopMatrix();
+// Function to point drawing at the scaled part of the offscreen target; does nothing when the feature is off
+void beginSceneTarget()
+{
+    drawingOffscreen = false;
+    if (!dynamicResolution)
+        return;
+    renderStart = std::chrono::steady_clock::now();
+    if (resolutionScale >= 1)
+        return;
+    updateSceneTargets();
+    if (!dynamicResolution)
+        return;
+    drawingOffscreen = true;
+    sceneWidth = std::max(1, (int)lrintf(windowPixelWidth * resolutionScale));
+    sceneHeight = std::max(1, (int)lrintf(windowPixelHeight * resolutionScale));
+    glBindFramebuffer(GL_FRAMEBUFFER, msaaFramebuffer ? msaaFramebuffer : sceneFramebuffer);
+    glViewport(0, 0, sceneWidth, sceneHeight);
+}
 
-    // Clock body white
-    glPushMatrix();
-    glTranslatef(-0.83, 1.9, 7.9);
-    glScalef(0.06, 0.2, 0.08);
-    drawCube1(1.000, 0.894, 0.710, 1.000, 0.894, 0.710);
-    glPopMatrix();
+// Function to scale the drawn part of the target up into the window
+static void upscaleSceneTarget()
+{
+    TraceSpan span("upscale");
+    if (msaaFramebuffer)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, msaaFramebuffer);
+        glBindFramebuffer(GL_DRAW_FRAMEBUFFER, sceneFramebuffer);
+        glBlitFramebuffer(0, 0, sceneWidth, sceneHeight, 0, 0, sceneWidth, sceneHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glViewport(0, 0, windowPixelWidth, windowPixelHeight);
 
-    // Clock hour handle
+    // A textured quad rather than a blit, which a multisampled window would refuse
+    glPushAttrib(GL_ENABLE_BIT | GL_DEPTH_BUFFER_BIT | GL_CURRENT_BIT);
+    glDisable(GL_DEPTH_TEST);
+    glDisable(GL_LIGHTING);
+    glDepthMask(GL_FALSE);
+    glEnable(GL_TEXTURE_2D);
+    glColor3f(1, 1, 1);
+    glMatrixMode(GL_PROJECTION);
     glPushMatrix();
-    glTranslatef(-0.65, 2.18, 8.01);
-    glRotatef(45, 1, 0, 0);
-    glScalef(0.0001, 0.01, 0.04);
-    drawCube1(0, 0, 0, 0, 0, 0);
-    glPopMatrix();
-
-    // Clock minute handle
+    glLoadIdentity();
+    glMatrixMode(GL_MODELVIEW);
     glPushMatrix();
-    glTranslatef(-0.65, 2.18, 8.01);
-    glRotatef(90, 1, 0, 0);
-    glScalef(0.0001, 0.012, 0.08);
-    drawCube1(0, 0, 0, 0, 0, 0);
+    glLoadIdentity();
+    glBindTexture(GL_TEXTURE_2D, sceneColor);
+    GLfloat s = (GLfloat)sceneWidth / sceneTargetWidth, t = (GLfloat)sceneHeight / sceneTargetHeight;
+    glBegin(GL_QUADS);
+    glTexCoord2f(0, 0); glVertex2f(-1, -1);
+    glTexCoord2f(s, 0); glVertex2f(1, -1);
+    glTexCoord2f(s, t); glVertex2f(1, 1);
+    glTexCoord2f(0, t); glVertex2f(-1, 1);
+    glEnd();
     glPopMatrix();
-
-    // Clock pendulum stick
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(-0.7, 2, 8.1);
-    glRotatef(theta, 1, 0, 0);
-    glScalef(0.0001, 0.2, 0.03);
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05);
+    glMatrixMode(GL_PROJECTION);
     glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+}
 
-    // Clock pendulum ball
-    glColor3f(0.2, 0.1, 0.1);
-    glPushMatrix();
-    glTranslatef(-0.72, 1.42, z);
-    glScalef(0.035, 0.035, 0.035);
-    drawSphere(0.2, 0.1, 0.1, 0.1, 0.05, 0.05, 10);
-    glPopMatrix();
+// Function to finish a frame: scale it up into the window if needed, then fit the scale to the time it took
+void endSceneTarget()
+{
+    if (!dynamicResolution)
+        return;
+    if (drawingOffscreen)
+        upscaleSceneTarget();
+
+    // Wait for the GL so the time covers the drawing, not just issuing it
+    glFinish();
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - renderStart).count();
+    averageRenderMs = averageRenderMs == 0 ? ms : averageRenderMs * 0.9 + ms * 0.1;
+    double ratio = frameBudgetMs / averageRenderMs;
+    if (ratio < 0.95 || ratio > 1.1)
+        resolutionScale = std::max(MIN_RESOLUTION_SCALE,
+                                   std::min(1.0f, resolutionScale * (GLfloat)std::max(0.9, std::min(1.05, sqrt(ratio)))));
+    scaleSum += resolutionScale;
+    scaleFrames++;
+}
 
-    // Clock top pyramid
-    glPushMatrix();
-    glTranslatef(-0.9, 2.5, 7.81);
-    glScalef(0.16, 0.1, 0.2);
-    drawpyramid(0.5, 0.2, 0, 0.25, 0.1, 0, 50);
-    glPopMatrix();
+// Function for 'u': switch dynamic resolution on or off
+void toggleDynamicResolution()
+{
+    dynamicResolution = !dynamicResolution;
+    averageRenderMs = 0;
+    std::cout << "Dynamic resolution " << (dynamicResolution ? "on" : "off") << ", budget " << frameBudgetMs << " ms"
+              << std::endl;
 }
 
-void window()
+// Mirror reflections *******************************************************
+//
+// The dressing-table mirrors show the room they hang in. A layout's mirror
+// batches give the plane (the thin side of their bounds, facing into the
+// room), and the room is drawn a second time, mirrored in that plane, into a
+// texture at REFLECTION_SCALE of the window's size. The mirrors then look it
+// up at their own position on screen, blended with their lit colour. Only
+// the nearest room whose mirror is on screen is reflected. The mirrored pass
+// records through the same per-group culling as the main one, against the
+// mirrored frustum with the mirror's plane added, so nothing behind the
+// mirror is recorded, and a clip plane trims what straddles it. The texture
+// is redrawn when the camera has moved or turned more than REFLECTION_MOVE,
+// at most every REFLECTION_MIN_MS, and otherwise every REFLECTION_REFRESH_MS
+// to pick up animation and light switches. In between, the mirrors look up
+// the old texture through the camera it was drawn with, so it stays in
+// place. 'f' or --no-reflections leaves the plain light-blue mirrors.
+
+static const GLfloat REFLECTION_SCALE = 0.5f;
+static const GLfloat REFLECTION_STRENGTH = 0.85f;   // Share of the mirror's colour that is reflection
+static const GLfloat REFLECTION_MOVE = 0.05f;       // Camera move (distance, or turn in radians) that redraws
+static const double REFLECTION_MIN_MS = 33;         // Shortest time between redraws
+static const double REFLECTION_REFRESH_MS = 250;    // Longest a reflection is kept
+
+bool useReflections = true;          // --no-reflections or 'f'
+GLuint reflectionFramebuffer = 0, reflectionColor = 0, reflectionDepth = 0;
+int reflectionWidth = 0, reflectionHeight = 0;
+const RoomInstance* reflectionRoom = NULL;   // Room whose mirror shows the texture this frame, NULL for none
+const RoomInstance* reflectedRoom = NULL;    // Room the texture was last drawn for
+Mat4 reflectionCamera;               // Projection * view the texture was drawn for
+Vec3 reflectionEye, reflectionDir;   // Where the camera was and looked then
+std::chrono::steady_clock::time_point reflectionTime;
+FrameArray<DrawCommand> reflectionCommands;
+long long reflectionRedraws = 0, reflectionFrames = 0;
+
+// Function to free the reflection texture and its target
+void releaseReflection()
 {
-    // Window *******************************************************
+    gpuDeleteFramebuffer(reflectionFramebuffer);
+    gpuDeleteTexture(reflectionColor);
+    gpuDeleteRenderbuffer(reflectionDepth);
+    reflectionWidth = reflectionHeight = 0;
+    reflectedRoom = NULL;
+}
 
-    // Window white open
-    glPushMatrix();
-    glTranslatef(-0.9, 1, 8.9);
-    glScalef(0.0001, .6, .3);
-    drawCube1(1.0, 1.0, 1.0, 0.05, 0.05, 0.05);
-    glPopMatrix();
+// Function to (re)build the reflection target at REFLECTION_SCALE of the window; false if the GL refuses it
+static bool updateReflectionTarget()
+{
+    int width = std::max(1, (int)lrintf(windowPixelWidth * REFLECTION_SCALE));
+    int height = std::max(1, (int)lrintf(windowPixelHeight * REFLECTION_SCALE));
+    if (width == reflectionWidth && height == reflectionHeight)
+        return true;
+    releaseReflection();
+    GLint framebuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    reflectionColor = gpuCreateTexture("reflection color");
+    glBindTexture(GL_TEXTURE_2D, reflectionColor);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+    gpuSetBytes(GPU_TEXTURE, reflectionColor, (size_t)width * height * 3);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    reflectionDepth = gpuCreateRenderbuffer("reflection depth");
+    glBindRenderbuffer(GL_RENDERBUFFER, reflectionDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    gpuSetBytes(GPU_RENDERBUFFER, reflectionDepth, (size_t)width * height * 4);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    reflectionFramebuffer = gpuCreateFramebuffer("reflection target");
+    glBindFramebuffer(GL_FRAMEBUFFER, reflectionFramebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, reflectionColor, 0);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, reflectionDepth);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    if (!complete)
+    {
+        std::cerr << "Reflection target is incomplete, mirrors are drawn without reflections" << std::endl;
+        releaseReflection();
+        useReflections = false;
+        return false;
+    }
+    reflectionWidth = width;
+    reflectionHeight = height;
+    return true;
+}
 
-    // Window right side corner
-    glPushMatrix();
-    glTranslatef(-0.9, 1, 8.9);
-    glScalef(0.04, 0.6, 0.0001);
-    drawCube1(0.8, 0.6, 0.4, 0.4, 0.3, 0.2);
-    glPopMatrix();
+// Function to find a layout's mirror plane in room space: a point on it and the normal into the room;
+// false when the layout has no mirror
+static bool mirrorPlane(const BakedLayout& layout, Vec3& point, Vec3& normal)
+{
+    const Vec3& lo = layout.mirrorLo;
+    const Vec3& hi = layout.mirrorHi;
+    if (lo.x > hi.x)
+        return false;
+    GLfloat size[3] = { hi.x - lo.x, hi.y - lo.y, hi.z - lo.z };
+    int axis = size[0] < size[1] ? (size[0] < size[2] ? 0 : 2) : (size[1] < size[2] ? 1 : 2);
+    GLfloat mirrorMid[3] = { (lo.x + hi.x) / 2, (lo.y + hi.y) / 2, (lo.z + hi.z) / 2 };
+    GLfloat roomMid[3] = { (layout.lo.x + layout.hi.x) / 2, (layout.lo.y + layout.hi.y) / 2,
+                           (layout.lo.z + layout.hi.z) / 2 };
+    GLfloat sign = roomMid[axis] > mirrorMid[axis] ? 1.0f : -1.0f;
+    GLfloat n[3] = { 0, 0, 0 };
+    n[axis] = sign;
+    mirrorMid[axis] = sign > 0 ? (&hi.x)[axis] : (&lo.x)[axis];    // The reflecting face
+    point = vec3(mirrorMid[0], mirrorMid[1], mirrorMid[2]);
+    normal = vec3(n[0], n[1], n[2]);
+    return true;
+}
 
-    // Window left side corner
+// Function to draw a room mirrored in its mirror's plane into the reflection texture
+static void drawReflection(const RoomInstance& room, const Vec3& point, const Vec3& normal, const Mat4& projection,
+                           const Mat4& view)
+{
+    TraceSpan span("reflection");
+    // x' = x - 2 (n.x - d) n in room space, taken into the world
+    GLfloat n[3] = { normal.x, normal.y, normal.z };
+    GLfloat d = vec3Dot(normal, point);
+    Mat4 mirror = mat4Identity();
+    for (int c = 0; c < 3; c++)
+    {
+        for (int r = 0; r < 3; r++)
+            mirror.m[c * 4 + r] -= 2 * n[r] * n[c];
+        mirror.m[12 + c] = 2 * d * n[c];
+    }
+    Mat4 mirroredView = mat4Mul(mat4Mul(view, room.world), mat4Mul(mirror, mat4Inverse(room.world)));
+
+    // The main pass's culling through the mirrored camera, less everything behind the mirror
+    Frustum frustum = frustumFromMatrix(mat4Mul(projection, mirroredView));
+    Vec3 worldNormal = mat4TransformVector(room.world, normal);
+    Vec3 worldPoint = mat4TransformPoint(room.world, point);
+    frustum.planes[frustum.count++] = makePlane(worldNormal.x, worldNormal.y, worldNormal.z,
+                                                -vec3Dot(worldNormal, worldPoint));
+    reflectionCommands.clear();
+    for (int g = 0; g < GROUP_COUNT; g++)
+        recordRoomGroup(reflectionCommands, room, g, mirroredView, frustum, BATCH_MIRROR);
+
+    GLint framebuffer;
+    glGetIntegerv(GL_FRAMEBUFFER_BINDING, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, reflectionFramebuffer);
+    glPushAttrib(GL_ENABLE_BIT | GL_VIEWPORT_BIT | GL_TRANSFORM_BIT);
+    glViewport(0, 0, reflectionWidth, reflectionHeight);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    glMatrixMode(GL_PROJECTION);
     glPushMatrix();
-    glTranslatef(-0.9, 1, 9.8);
-    glScalef(0.04, 0.6, 0.0001);
-    drawCube1(0.8, 0.6, 0.4, 0.4, 0.3, 0.2);
-    glPopMatrix();
-
-    // Window upper side corner
+    glLoadMatrixf(projection.m);
+    glMatrixMode(GL_MODELVIEW);
     glPushMatrix();
-    glTranslatef(-0.7, 2.7, 8.9);
-    glScalef(0.0001, 0.05, 0.4);
-    drawCube1(0.7, 0.6, 0.5, 0.35, 0.3, 0.25);
-    glPopMatrix();
 
-    // Window lower side corner
-    glPushMatrix();
-    glTranslatef(-0.8, 1.02, 8.9);
-    glScalef(0.0001, 0.02, 0.34);
-    drawCube1(0.7, 0.6, 0.5, 0.35, 0.3, 0.25);
-    glPopMatrix();
+    // The plane is given in room space, before the mirroring
+    GLdouble clip[4] = { n[0], n[1], n[2], -d };
+    glLoadMatrixf(mat4Mul(view, mat4Mul(room.world, mirror)).m);
+    glClipPlane(GL_CLIP_PLANE0, clip);
+    glEnable(GL_CLIP_PLANE0);
 
-    // Window vertical bar 1
-    glPushMatrix();
-    glTranslatef(-0.87, 2.1, 8.9);
-    glScalef(0.0001, 0.02, 0.3);
-    drawCube1(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 5);
-    glPopMatrix();
+    // The lights are mirrored with the room; the shadow lookups are left to the main pass
+    glLoadMatrixf(mirroredView.m);
+    glEnable(GL_LIGHTING);
+    lightOne();
+    lightTwo();
+    lampLight();
+    bool shadows = shadowsActive;
+    shadowsActive = false;
+    drawCommands(reflectionCommands, mirroredView);
+    shadowsActive = shadows;
 
-    // Window vertical bar 2
-    glPushMatrix();
-    glTranslatef(-0.87, 1.6, 8.9);
-    glScalef(0.0001, 0.02, 0.3);
-    drawCube1(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 5);
     glPopMatrix();
-
-    // Window horizontal bar
-    glPushMatrix();
-    glTranslatef(-0.87, 1, 9.3);
-    glScalef(0.0001, 0.6, 0.02);
-    drawCube1(0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 5);
+    glMatrixMode(GL_PROJECTION);
     glPopMatrix();
+    glMatrixMode(GL_MODELVIEW);
+    glPopAttrib();
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    reflectionCamera = mat4Mul(projection, view);
+    reflectionRedraws++;
 }
 
+// Function to pick the room to reflect this frame and redraw its reflection when the camera has moved or
+// the reflection is old; runs after the frame is recorded and before it is drawn
+void updateReflection(const Mat4& projection, const Mat4& view, const Vec3& eye, const Vec3& ref)
+{
+    reflectionRoom = NULL;
+    if (!recordReflections)
+        return;
+
+    // The nearest room with its mirror on screen and the camera in front of it
+    const RoomInstance* best = NULL;
+    Vec3 bestPoint = vec3(0, 0, 0), bestNormal = vec3(0, 1, 0);
+    GLfloat bestDistance = 1e30f;
+    for (size_t r = 0; r < visibleRooms.size(); r++)
+    {
+        const RoomInstance& room = rooms[visibleRooms[r]];
+        const BakedLayout& layout = bakedLayouts[room.layout];
+        Vec3 point, normal;
+        if (!mirrorPlane(layout, point, normal))
+            continue;
+        Vec3 offset = vec3(room.world.m[12], room.world.m[13], room.world.m[14]);
+        if (!boxInFrustum(viewFrustum, vec3(layout.mirrorLo.x + offset.x, layout.mirrorLo.y + offset.y,
+                                            layout.mirrorLo.z + offset.z),
+                          vec3(layout.mirrorHi.x + offset.x, layout.mirrorHi.y + offset.y,
+                               layout.mirrorHi.z + offset.z)))
+            continue;
+        Vec3 toEye = vec3Sub(eye, mat4TransformPoint(room.world, point));
+        GLfloat distance = vec3Dot(toEye, toEye);
+        if (vec3Dot(toEye, mat4TransformVector(room.world, normal)) > 0 && distance < bestDistance)
+        {
+            best = &room;
+            bestPoint = point;
+            bestNormal = normal;
+            bestDistance = distance;
+        }
+    }
+    if (best == NULL)
+        return;
+    bool resized = reflectionWidth != std::max(1, (int)lrintf(windowPixelWidth * REFLECTION_SCALE))
+                   || reflectionHeight != std::max(1, (int)lrintf(windowPixelHeight * REFLECTION_SCALE));
+    if (!updateReflectionTarget())
+        return;
+    reflectionRoom = best;
+    reflectionFrames++;
+
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double age = std::chrono::duration<double, std::milli>(now - reflectionTime).count();
+    Vec3 dir = vec3Normalize(vec3Sub(ref, eye));
+    Vec3 moved = vec3Sub(eye, reflectionEye), turned = vec3Sub(dir, reflectionDir);
+    bool cameraMoved = vec3Dot(moved, moved) > REFLECTION_MOVE * REFLECTION_MOVE
+                       || vec3Dot(turned, turned) > REFLECTION_MOVE * REFLECTION_MOVE;
+    if (best != reflectedRoom || resized || (cameraMoved && age >= REFLECTION_MIN_MS) || age >= REFLECTION_REFRESH_MS)
+    {
+        drawReflection(*best, bestPoint, bestNormal, projection, view);
+        reflectedRoom = best;
+        reflectionEye = eye;
+        reflectionDir = dir;
+        reflectionTime = now;
+    }
+}
 
-void sphericalObject()
+// Function to tell whether a room's mirrors show the reflection this frame
+bool reflectionShown(const RoomInstance* room)
 {
-    // Table top part
-    glPushMatrix(); // Save current matrix
-    glTranslatef(5, 0.2, 10); // Translate to table top position
-    glScalef(0.1, 0.02, 0.1); // Scale the table top
-    drawSphere(0.5, 0.2, 0, 0.25, 0.1, 0, 20); // Draw the table top sphere
-    glPopMatrix(); // Restore previous matrix
-    
-    // Table leg
-    glColor3f(0.2, 0.1, 0.1); // Set color for the table leg
-    glPushMatrix(); // Save current matrix
-    glTranslatef(4.98, -0.1, 10); // Translate to table leg position
-    glScalef(0.02, 0.1, 0.02); // Scale the table leg
-    drawCube1(0.2, 0.1, 0.1, 0.1, 0.05, 0.05); // Draw the table leg cube
-    glPopMatrix(); // Restore previous matrix
-    
-    // Base
-    glPushMatrix(); // Save current matrix
-    glTranslatef(5, -0.1, 10); // Translate to base position
-    glScalef(0.05, 0.01, 0.05); // Scale the base
-    drawSphere(0.5, 0.2, 0, 0.25, 0.1, 0, 20); // Draw the base sphere
-    glPopMatrix(); // Restore previous matrix
+    return room != NULL && room == reflectionRoom;
 }
 
-void lightBulb1()
+// Function to switch the reflection lookup on texture unit 0 on or off. Eye-linear planes given under
+// the view make the generated coordinates world positions, which the texture matrix projects through
+// the camera the reflection was drawn for; the reflection is then blended over the lit colour.
+void setReflectionState(bool on, const Mat4& view)
 {
-    // Material properties
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { 0.7, 0.7, 0.7, 1.0 };
-    GLfloat mat_diffuse[] = { 1.000, 0.843, 0.000, 1.0 };
-    GLfloat mat_specular[] = { 1.0, 1.0, 1.0, 1.0 };
-    GLfloat high_shininess[] = { 100.0 };
-    GLfloat mat_emission[] = {1.000, 1, 1, 0.0};
-    
-    glPushMatrix(); // Save current matrix
-    glTranslatef(5, 5, 8); // Translate to light bulb 1 position
-    glScalef(0.2, 0.2, 0.2); // Scale the light bulb
-    glMaterialfv(GL_FRONT, GL_AMBIENT, no_mat); // Set ambient material property
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse); // Set diffuse material property
-    glMaterialfv(GL_FRONT, GL_SPECULAR, no_mat); // Set specular material property
-    glMaterialfv(GL_FRONT, GL_SHININESS, high_shininess); // Set shininess material property
-    
-    // Set emission material property based on switch state
-    if (switchOne == true) {
-        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
-    } else {
-        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    static const GLfloat planes[4][4] = { { 1, 0, 0, 0 }, { 0, 1, 0, 0 }, { 0, 0, 1, 0 }, { 0, 0, 0, 1 } };
+    static const GLenum coords[4] = { GL_S, GL_T, GL_R, GL_Q };
+    static const GLenum gens[4] = { GL_TEXTURE_GEN_S, GL_TEXTURE_GEN_T, GL_TEXTURE_GEN_R, GL_TEXTURE_GEN_Q };
+    glMatrixMode(GL_TEXTURE);
+    if (!on)
+    {
+        for (int c = 0; c < 4; c++)
+            glDisable(gens[c]);
+        glDisable(GL_TEXTURE_2D);
+        glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+        glBindTexture(GL_TEXTURE_2D, atlasTexture);
+        glLoadIdentity();
+        glScalef(1.0f / UV_QUANT_SCALE, 1.0f / UV_QUANT_SCALE, 1);
+        glMatrixMode(GL_MODELVIEW);
+        return;
     }
-    
-    glutSolidSphere(1.0, 16, 16); // Draw the light bulb
-    glPopMatrix(); // Restore previous matrix
+    Mat4 bias = mat4Mul(mat4Translate(0.5f, 0.5f, 0.5f), mat4Scale(0.5f, 0.5f, 0.5f));
+    glLoadMatrixf(mat4Mul(bias, reflectionCamera).m);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadMatrixf(view.m);
+    for (int c = 0; c < 4; c++)
+    {
+        glTexGeni(coords[c], GL_TEXTURE_GEN_MODE, GL_EYE_LINEAR);
+        glTexGenfv(coords[c], GL_EYE_PLANE, planes[c]);
+        glEnable(gens[c]);
+    }
+    GLfloat strength[] = { 0, 0, 0, REFLECTION_STRENGTH };
+    glBindTexture(GL_TEXTURE_2D, reflectionColor);
+    glEnable(GL_TEXTURE_2D);
+    glTexEnvi(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_COMBINE);
+    glTexEnvi(GL_TEXTURE_ENV, GL_COMBINE_RGB, GL_INTERPOLATE);
+    glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE0_RGB, GL_TEXTURE);
+    glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND0_RGB, GL_SRC_COLOR);
+    glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE1_RGB, GL_PRIMARY_COLOR);
+    glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND1_RGB, GL_SRC_COLOR);
+    glTexEnvi(GL_TEXTURE_ENV, GL_SOURCE2_RGB, GL_CONSTANT);
+    glTexEnvi(GL_TEXTURE_ENV, GL_OPERAND2_RGB, GL_SRC_ALPHA);
+    glTexEnvfv(GL_TEXTURE_ENV, GL_TEXTURE_ENV_COLOR, strength);
 }
 
-// The comments explain each step of the function, such as translations, scaling, and drawing. This makes it easier for others to understand the code's purpose and behavior.
+// Input recording and replay ***********************************************
+//
+// With --record FILE every key passed to myKeyboardFunc() and every reshape
+// passed to fullScreen() is written to FILE as a 16-byte record, stamped
+// with the seconds since the start and the frame it arrived before. Each
+// drawn frame adds a record of its own with the animation time it used and a
+// hash of the state it drew (camera, switches, window, animated nodes). With
+// --replay FILE the window's own keys and reshapes are ignored and the log's
+// are fed back at the frames they arrived before; every frame evaluates the
+// animation at its recorded time rather than the clock, and its state hash
+// is checked against the recorded one. The building options and the time
+// of day the wall clock starts at come from the log's header. A replay runs
+// as fast as the frames draw and ends with the benchmark's statistics, so a
+// slow session can be timed again and again. Mouse picks and scene-edit
+// reloads are not part of the log, and a replay does not poll the edit file.
+
+enum InputType { INPUT_KEY, INPUT_RESHAPE, INPUT_FRAME };
+
+struct InputRecord
+{
+    unsigned char type;     // InputType
+    unsigned char key;      // The key of INPUT_KEY
+    unsigned short unused;
+    GLfloat time;           // Seconds since recording began; a frame's animation time for INPUT_FRAME
+    int a, b;               // Cursor or window size; the halves of a frame's state hash for INPUT_FRAME
+};
+
+struct InputLogHeader
+{
+    char magic[8];          // "BEDINPUT"
+    int columns, rows;      // The building the session was recorded in
+    unsigned seed;
+    int clock;              // Time of day the wall clock started at, in seconds
+};
 
+static const char INPUT_LOG_MAGIC[8] = { 'B', 'E', 'D', 'I', 'N', 'P', 'U', 'T' };
 
-void lightBulb2()
+const char* inputRecordFile = NULL;  // --record
+const char* inputReplayFile = NULL;  // --replay
+FILE* inputLog = NULL;               // Open while recording
+std::chrono::steady_clock::time_point inputLogStart;
+std::vector<InputRecord> replayLog;
+size_t replayNext = 0;               // Next record to feed back
+bool replayDispatching = false;      // A replayed event is being handled
+int replayFrameCount = 0, replayFramesDone = 0, replayMismatches = 0;
+
+void myKeyboardFunc(unsigned char key, int x, int y);
+void fullScreen(int w, int h);
+
+// Function to open the log of --record or read the one of --replay; false if it cannot be used
+bool startInputLog()
 {
-    // Material properties
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { 0.7, 0.7, 0.7, 1.0 };
-    GLfloat mat_ambient_color[] = { 0.8, 0.8, 0.2, 1.0 };
-    GLfloat mat_diffuse[] = { 1.000, 0.843, 0.000, 1.0 };
-    GLfloat high_shininess[] = { 100.0 };
-    GLfloat mat_emission[] = {1, 1, 1, 1.0};
-    
-    glPushMatrix(); // Save current matrix
-    glTranslatef(0, 5, 8); // Translate to light bulb 2 position
-    glScalef(0.2, 0.2, 0.2); // Scale the light bulb
-    glMaterialfv(GL_FRONT, GL_AMBIENT, no_mat); // Set ambient material property
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse); // Set diffuse material property
-    glMaterialfv(GL_FRONT, GL_SPECULAR, no_mat); // Set specular material property
-    glMaterialfv(GL_FRONT, GL_SHININESS, high_shininess); // Set shininess material property
-    
-    // Set emission material property based on switch state
-    if (switchTwo == true) {
-        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
-    } else {
-        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    if (inputRecordFile && inputReplayFile)
+    {
+        std::cerr << "--record and --replay cannot be used together" << std::endl;
+        return false;
     }
-    
-    glutSolidSphere(1.0, 16, 16); // Draw the light bulb
-    glPopMatrix(); // Restore previous matrix
-}
+    InputLogHeader header;
+    if (inputRecordFile)
+    {
+        inputLog = fopen(inputRecordFile, "wb");
+        if (inputLog == NULL)
+        {
+            std::cerr << "Cannot write the input log " << inputRecordFile << std::endl;
+            return false;
+        }
+        memcpy(header.magic, INPUT_LOG_MAGIC, sizeof(header.magic));
+        header.columns = buildingColumns;
+        header.rows = buildingRows;
+        header.seed = buildingSeed;
+        header.clock = clockTimeOfDay();
+        fwrite(&header, sizeof(header), 1, inputLog);
+        inputLogStart = std::chrono::steady_clock::now();
+    }
+    if (!inputReplayFile)
+        return true;
 
-void lightBulb3()
-{
-    // Material properties
-    GLfloat no_mat[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat mat_ambient[] = { 0.7, 0.7, 0.7, 1.0 };
-    GLfloat mat_ambient_color[] = { 0.8, 0.8, 0.2, 1.0 };
-    GLfloat mat_diffuse[] = { 1.000, 0.843, 0.000, 1.0 };
-    GLfloat high_shininess[] = { 100.0 };
-    GLfloat mat_emission[] = {1, 1, 1, 1.0};
-    
-    glPushMatrix(); // Save current matrix
-    glTranslatef(0.7, 1.5, 9.0); // Translate to light bulb 3 position
-    glScalef(0.2, 0.2, 0.2); // Scale the light bulb
-    glMaterialfv(GL_FRONT, GL_AMBIENT, no_mat); // Set ambient material property
-    glMaterialfv(GL_FRONT, GL_DIFFUSE, mat_diffuse); // Set diffuse material property
-    glMaterialfv(GL_FRONT, GL_SPECULAR, no_mat); // Set specular material property
-    glMaterialfv(GL_FRONT, GL_SHININESS, high_shininess); // Set shininess material property
-    
-    // Set emission material property based on switch state
-    if (switchLamp == true) {
-        glMaterialfv(GL_FRONT, GL_EMISSION, mat_emission);
-    } else {
-        glMaterialfv(GL_FRONT, GL_EMISSION, no_mat);
+    FILE* file = fopen(inputReplayFile, "rb");
+    if (file == NULL || fread(&header, sizeof(header), 1, file) != 1
+        || memcmp(header.magic, INPUT_LOG_MAGIC, sizeof(header.magic)) != 0)
+    {
+        std::cerr << "Cannot read the input log " << inputReplayFile << std::endl;
+        if (file)
+            fclose(file);
+        return false;
     }
-    
-    glutSolidSphere(1.0, 16, 16); // Draw the light bulb
-    glPopMatrix(); // Restore previous matrix
+    InputRecord record;
+    while (fread(&record, sizeof(record), 1, file) == 1)
+    {
+        replayLog.push_back(record);
+        replayFrameCount += record.type == INPUT_FRAME;
+    }
+    fclose(file);
+    buildingColumns = header.columns;
+    buildingRows = header.rows;
+    buildingSeed = header.seed;
+    clockStartSeconds = header.clock;
+    printf("Replay: %d frames and %d events from %s (%dx%d rooms, seed %u)\n", replayFrameCount,
+           (int)replayLog.size() - replayFrameCount, inputReplayFile, buildingColumns, buildingRows, buildingSeed);
+    if (replayFrameCount < 2)
+    {
+        std::cerr << "The input log holds fewer than two frames" << std::endl;
+        return false;
+    }
+    return true;
 }
 
-void lightOne()
+// Function to tell whether a replay is running
+bool replayingInput()
 {
-    glPushMatrix(); // Save current matrix
-    GLfloat no_light[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat light_ambient[] = {0.5, 0.5, 0.5, 1.0};
-    GLfloat light_diffuse[] = {1.0, 1.0, 1.0, 1.0};
-    GLfloat light_specular[] = {1.0, 1.0, 1.0, 1.0};
-    GLfloat light_position[] = {5.0, 5.0, 8.0, 1.0}; // Set light 1 position
-    
-    // glEnable(GL_LIGHT0);
-    
-    // Set light properties based on switch state
-    if (amb1 == true) {
-        glLightfv(GL_LIGHT0, GL_AMBIENT, light_ambient);
-    } else {
-        glLightfv(GL_LIGHT0, GL_AMBIENT, no_light);
+    return inputReplayFile != NULL;
+}
+
+// Function to pass an input event through the log: recorded while recording; while replaying, only the
+// log's own events are let through (and Escape, to quit)
+bool logInput(InputType type, int key, int a, int b)
+{
+    if (replayingInput())
+        return replayDispatching || (type == INPUT_KEY && key == 27);
+    if (inputLog == NULL)
+        return true;
+    InputRecord record = { (unsigned char)type, (unsigned char)key, 0,
+                           std::chrono::duration<GLfloat>(std::chrono::steady_clock::now() - inputLogStart).count(),
+                           a, b };
+    fwrite(&record, sizeof(record), 1, inputLog);
+    return true;
+}
+
+// Function to feed back the events that arrived before the coming frame and set its animation time;
+// runs at the start of display()
+void replayInputFrame()
+{
+    if (!replayingInput())
+        return;
+    replayDispatching = true;
+    for (; replayNext < replayLog.size() && replayLog[replayNext].type != INPUT_FRAME; replayNext++)
+    {
+        const InputRecord& r = replayLog[replayNext];
+        if (r.type == INPUT_KEY)
+            myKeyboardFunc(r.key, r.a, r.b);
+        else if (r.type == INPUT_RESHAPE)
+        {
+            fullScreen(r.a, r.b);
+            glutReshapeWindow(r.a, r.b);    // Its own reshape is ignored; the window just follows
+        }
     }
-    
-    if (diff1 == true) {
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, light_diffuse);
-    } else {
-        glLightfv(GL_LIGHT0, GL_DIFFUSE, no_light);
+    replayDispatching = false;
+    if (replayNext < replayLog.size())
+        fixedAnimationTime = replayLog[replayNext].time;
+}
+
+// Function to hash what a frame draws, short of the GL: the camera, the switches, the window and the
+// animated nodes
+static unsigned long long frameStateHash()
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    double camera[] = { eyeX, eyeY, eyeZ, refX, refY, refZ };
+    GLboolean switches[] = { switchOne, switchTwo, switchLamp, amb1, diff1, spec1, amb2, diff2, spec2,
+                             amb3, diff3, spec3, useBakedGeometry, usePortals, useLightmaps, useShadows,
+                             useReflections, dynamicResolution };
+    int window[] = { windowPixelWidth, windowPixelHeight, (int)aaMode };
+    hashBytes(hash, camera, sizeof(camera));
+    hashBytes(hash, switches, sizeof(switches));
+    hashBytes(hash, window, sizeof(window));
+    hashBytes(hash, &frameAnimationTime, sizeof(frameAnimationTime));
+    for (size_t i = 0; i < rotationChannels.node.size(); i++)
+        hashBytes(hash, sceneNodes[rotationChannels.node[i]].world.m, sizeof(Mat4));
+    for (size_t i = 0; i < translationChannels.node.size(); i++)
+        hashBytes(hash, sceneNodes[translationChannels.node[i]].world.m, sizeof(Mat4));
+    return hash;
+}
+
+// Function to log a frame once its animation is posed: recorded while recording, checked while replaying
+void logFrame()
+{
+    if (inputLog == NULL && !replayingInput())
+        return;
+    unsigned long long hash = frameStateHash();
+    InputRecord record = { INPUT_FRAME, 0, 0, frameAnimationTime, (int)(unsigned)hash, (int)(unsigned)(hash >> 32) };
+    if (inputLog)
+    {
+        fwrite(&record, sizeof(record), 1, inputLog);
+        return;
     }
-    
-    if (spec1 == true) {
-        glLightfv(GL_LIGHT0, GL_SPECULAR, light_specular);
-    } else {
-        glLightfv(GL_LIGHT0, GL_SPECULAR, no_light);
+    if (replayNext >= replayLog.size())
+        return;
+    const InputRecord& expected = replayLog[replayNext++];
+    if (expected.a != record.a || expected.b != record.b)
+    {
+        if (replayMismatches == 0)
+            printf("Replay: frame %d does not match the recording\n", replayFramesDone);
+        replayMismatches++;
     }
-   
-    glLightfv(GL_LIGHT0, GL_POSITION, light_position); // Set light 1 position
-    glPopMatrix(); // Restore previous matrix
+    replayFramesDone++;
 }
 
-void lightTwo()
+// Function to report how the replay went, for the benchmark's statistics
+void printReplayStats()
 {
-    glPushMatrix(); // Save current matrix
-    GLfloat no_light[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat light_ambient[] = {0.5, 0.5, 0.5, 1.0};
-    GLfloat light_diffuse[] = {1.0, 1.0, 0.9, 1.0};
-    GLfloat light_specular[] = {1.0, 1.0, 1.0, 1.0};
-    GLfloat light_position[] = {0.0, 5.0, 8.0, 1.0}; // Set light 2 position
-    
-    // glEnable(GL_LIGHT1);
-    
-    // Set light properties based on switch state
-    if (amb2 == true) {
-        glLightfv(GL_LIGHT1, GL_AMBIENT, light_ambient);
-    } else {
-        glLightfv(GL_LIGHT1, GL_AMBIENT, no_light);
+    if (replayingInput())
+        printf("Replay: %d of %d frames replayed, %d differed from the recording\n", replayFramesDone,
+               replayFrameCount, replayMismatches);
+}
+
+// Render server ************************************************************
+//
+// With --serve PATH the program draws images for other processes instead of
+// opening a window. The socket, the request batches and the image cache are
+// in render_server.cpp and the PNG encoder in png_writer.cpp; this part gives
+// them a GL context and draws what they ask for. The context comes from EGL
+// on a pbuffer, so neither GLUT nor a display is needed and the server runs
+// on machines without a GPU, where Mesa rasterizes in software. The images are
+// drawn into a framebuffer object sized to the request, which is only resized
+// when the size changes (the server hands over requests sorted by size), and
+// their PNG encoding runs on the job system.
+
+static const int SERVER_WAIT_MS = 10;   // Longest wait on the sockets with nothing to draw
+
+const char* serverSocketPath = NULL;    // --serve
+GLuint serverFramebuffer = 0, serverColor = 0, serverDepth = 0;
+int serverWidth = 0, serverHeight = 0;
+
+void drawScene(GLfloat aspect);
+void startRenderer();
+
+// Function to make a GL context without a window or a display: on Mesa's surfaceless platform where
+// EGL has it, else on EGL's default display
+static bool createHeadlessContext()
+{
+#ifdef __APPLE_CC__
+    std::cerr << "Render server: needs EGL, which this platform does not have" << std::endl;
+    return false;
+#else
+    EGLDisplay display = EGL_NO_DISPLAY;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display != EGL_NO_DISPLAY && !eglInitialize(display, NULL, NULL))
+        display = EGL_NO_DISPLAY;
+#endif
+    if (display == EGL_NO_DISPLAY)
+    {
+        display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+        if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL))
+        {
+            std::cerr << "Render server: no EGL display" << std::endl;
+            return false;
+        }
     }
-    
-    if (diff2 == true) {
-        glLightfv(GL_LIGHT1, GL_DIFFUSE, light_diffuse);
-    } else {
-        glLightfv(GL_LIGHT1, GL_DIFFUSE, no_light);
+
+    // The images go to a framebuffer object, so the pbuffer is only there to make the context current
+    EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+                                  EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+    EGLint pbufferAttributes[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+    EGLConfig config;
+    EGLint configs = 0;
+    if (!eglBindAPI(EGL_OPENGL_API) || !eglChooseConfig(display, configAttributes, &config, 1, &configs) || configs == 0)
+    {
+        std::cerr << "Render server: no EGL configuration for desktop GL" << std::endl;
+        return false;
     }
-    
-    if (spec2 == true) {
-        glLightfv(GL_LIGHT1, GL_SPECULAR, light_specular);
-    } else {
-        glLightfv(GL_LIGHT1, GL_SPECULAR, no_light);
+    EGLSurface surface = eglCreatePbufferSurface(display, config, pbufferAttributes);
+    EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+    if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context))
+    {
+        std::cerr << "Render server: cannot make an EGL context (0x" << std::hex << eglGetError() << std::dec << ")"
+                  << std::endl;
+        return false;
     }
-    
-    glLightfv(GL_LIGHT1, GL_POSITION, light_position); // Set light 2 position
-    glPopMatrix(); // Restore previous matrix
+    std::cout << "Render server: " << glGetString(GL_RENDERER) << ", no display" << std::endl;
+    return true;
+#endif
 }
 
-void lampLight()
+// Function to hash everything a requested image depends on, the options the server runs with included
+static unsigned long long renderRequestKey(const RenderRequest& r)
 {
-    glPushMatrix(); // Save current matrix
-    GLfloat no_light[] = { 0.0, 0.0, 0.0, 1.0 };
-    GLfloat light_ambient[] = {0.5, 0.5, 0.5, 1.0};
-    GLfloat light_diffuse[] = {1.0, 1.0, 1.0, 1.0};
-    GLfloat light_specular[] = {1.0, 1.0, 1.0, 1.0};
-    GLfloat light_position[] = {0.7, 1.5, 9.0, 1.0}; // Set lamp light position
-    
-    // glEnable(GL_LIGHT2);
-    
-    // Set light properties based on switch state
-    if (amb3 == true) {
-        glLightfv(GL_LIGHT2, GL_AMBIENT, light_ambient);
-    } else {
-        glLightfv(GL_LIGHT2, GL_AMBIENT, no_light);
+    GLboolean options[] = { useBakedGeometry, usePortals, useLightmaps, useShadows, useReflections };
+    unsigned long long key = 14695981039346656037ULL;
+    hashBytes(key, r.eye, sizeof(r.eye));
+    hashBytes(key, r.ref, sizeof(r.ref));
+    hashBytes(key, &r.switches, sizeof(r.switches));
+    hashBytes(key, &r.time, sizeof(r.time));
+    hashBytes(key, &r.width, sizeof(r.width));
+    hashBytes(key, &r.height, sizeof(r.height));
+    hashBytes(key, options, sizeof(options));
+    return key;
+}
+
+// Function to size the offscreen target for the next image; false if the GL refuses it
+static bool serverTarget(int width, int height)
+{
+    if (width == serverWidth && height == serverHeight)
+        return true;
+    releaseServerTarget();
+    serverColor = gpuCreateRenderbuffer("server color");
+    glBindRenderbuffer(GL_RENDERBUFFER, serverColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGB8, width, height);
+    gpuSetBytes(GPU_RENDERBUFFER, serverColor, (size_t)width * height * 4);
+    serverDepth = gpuCreateRenderbuffer("server depth");
+    glBindRenderbuffer(GL_RENDERBUFFER, serverDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+    gpuSetBytes(GPU_RENDERBUFFER, serverDepth, (size_t)width * height * 4);
+    glBindRenderbuffer(GL_RENDERBUFFER, 0);
+    serverFramebuffer = gpuCreateFramebuffer("server target");
+    glBindFramebuffer(GL_FRAMEBUFFER, serverFramebuffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, serverColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, serverDepth);
+    bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    if (!complete)
+    {
+        releaseServerTarget();
+        return false;
     }
-    
-    if (diff3 == true) {
-        glLightfv(GL_LIGHT2, GL_DIFFUSE, light_diffuse);
-    } else {
-        glLightfv(GL_LIGHT2, GL_DIFFUSE, no_light);
+    serverWidth = width;
+    serverHeight = height;
+    return true;
+}
+
+// Function to free the server's offscreen target
+void releaseServerTarget()
+{
+    gpuDeleteFramebuffer(serverFramebuffer);
+    gpuDeleteRenderbuffer(serverColor);
+    gpuDeleteRenderbuffer(serverDepth);
+    serverWidth = serverHeight = 0;
+}
+
+// Function to set the light switches of a request, as the number keys would
+static void applyLightSwitches(unsigned mask)
+{
+    GLboolean* switches[] = { &switchOne, &switchTwo, &switchLamp, &amb1, &diff1, &spec1,
+                              &amb2, &diff2, &spec2, &amb3, &diff3, &spec3 };
+    for (int i = 0; i < 12; i++)
+        *switches[i] = (mask >> i) & 1;
+    GLenum lights[] = { GL_LIGHT0, GL_LIGHT1, GL_LIGHT2 };
+    for (int i = 0; i < 3; i++)
+    {
+        if (*switches[i])
+            glEnable(lights[i]);
+        else
+            glDisable(lights[i]);
     }
-    
-    if (spec3 == true) {
-        glLightfv(GL_LIGHT2, GL_SPECULAR, light_specular);
-    } else {
-        glLightfv(GL_LIGHT2, GL_SPECULAR, no_light);
+}
+
+// Function to draw one request into the offscreen target and read it back
+static bool renderForServer(const RenderRequest& r, std::vector<unsigned char>& pixels)
+{
+    TraceSpan span("serverRender");
+    if (!serverTarget(r.width, r.height))
+        return false;
+    eyeX = r.eye[0]; eyeY = r.eye[1]; eyeZ = r.eye[2];
+    refX = r.ref[0]; refY = r.ref[1]; refZ = r.ref[2];
+    applyLightSwitches(r.switches);
+    fixedAnimationTime = r.time;
+    reflectedRoom = NULL;   // Each camera needs its own reflection
+    glBindFramebuffer(GL_FRAMEBUFFER, serverFramebuffer);
+    glViewport(0, 0, r.width, r.height);
+    windowPixelWidth = r.width;
+    windowPixelHeight = r.height;
+    drawScene((GLfloat)r.width / r.height);
+    pixels.resize((size_t)r.width * r.height * 3);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, r.width, r.height, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    frameArenaNextFrame();
+    return true;
+}
+
+// Function to run the server's encoding on the job system
+static void runServerJobs(void (*run)(int), int count)
+{
+    for (int i = 0; i < count; i++)
+        jobSubmit(jobCreate(run, i));
+    jobWaitAll();
+}
+
+// Function to run --serve until SIGINT or SIGTERM; returns the exit status
+int runRenderServer()
+{
+    if (!createHeadlessContext())
+        return 1;
+    headlessContext = true;
+    startRenderer();
+    RenderHooks hooks = { renderRequestKey, renderForServer, runServerJobs };
+    if (!startRenderServer(serverSocketPath, hooks))
+        return 1;
+    while (serveRenderRequests(SERVER_WAIT_MS))
+        ;
+    stopRenderServer();
+    std::cout << "Render server: stopped" << std::endl;
+    return 0;
+}
+
+// Command line and benchmark **********************************************
+//
+// --rooms NxM builds the procedural building, --seed picks its variations and
+// --bench F renders F frames, prints frame-time statistics and exits. The
+// building with the benchmark is the standard workload for the culling,
+// batching and memory work.
+
+int benchFrames = 0;                 // Frames left to time; 0 when not benchmarking
+std::vector<double> benchFrameMs;
+size_t benchVisibleRooms = 0;        // Sum over the timed frames
+size_t benchHeapStart = 0;           // heapAllocations when timing started
+std::chrono::steady_clock::time_point benchLastFrame;
+
+// Function to read the options GLUT left in argv; returns false on a malformed one
+bool parseArguments(int argc, char **argv)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--rooms") == 0 && i + 1 < argc)
+        {
+            int columns = 0, rows = 0;
+            if (sscanf(argv[++i], "%dx%d", &columns, &rows) != 2 || columns < 1 || rows < 1
+                || columns * rows > MAX_ROOMS)
+            {
+                std::cerr << "--rooms expects NxM with at most " << MAX_ROOMS << " rooms" << std::endl;
+                return false;
+            }
+            buildingColumns = columns;
+            buildingRows = rows;
+        }
+        else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+            buildingSeed = (unsigned)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--bench") == 0 && i + 1 < argc)
+            benchFrames = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--no-portals") == 0)
+            usePortals = false;
+        else if (strcmp(argv[i], "--scene") == 0 && i + 1 < argc)
+            sceneEditFile = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+            jobThreadCount = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+            traceFile = argv[++i];
+        else if (strcmp(argv[i], "--budget") == 0 && i + 1 < argc)
+        {
+            frameBudgetMs = (GLfloat)atof(argv[++i]);
+            if (frameBudgetMs <= 0)
+            {
+                std::cerr << "--budget expects a frame time in milliseconds" << std::endl;
+                return false;
+            }
+            dynamicResolution = true;
+        }
+        else if (strcmp(argv[i], "--lightmaps") == 0 && i + 1 < argc)
+            lightmapFile = argv[++i];
+        else if (strcmp(argv[i], "--bake-lightmaps") == 0 && i + 1 < argc)
+            lightmapBakeFile = argv[++i];
+        else if (strcmp(argv[i], "--shadows") == 0)
+            useShadows = true;
+        else if (strcmp(argv[i], "--no-reflections") == 0)
+            useReflections = false;
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            inputRecordFile = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            inputReplayFile = argv[++i];
+        else if (strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+            serverSocketPath = argv[++i];
+        else if (strcmp(argv[i], "--aa") == 0 && i + 1 < argc)
+        {
+            if (!parseAntiAliasing(argv[++i]))
+            {
+                std::cerr << "--aa expects off, msaa2, msaa4 or fxaa" << std::endl;
+                return false;
+            }
+        }
+        else
+        {
+            std::cerr << "Unknown option " << argv[i] << std::endl;
+            std::cerr << "Usage: " << argv[0] << " [--rooms NxM] [--seed S] [--bench FRAMES] [--no-portals] [--scene FILE] [--threads N] [--trace FILE] [--aa off|msaa2|msaa4|fxaa] [--budget MS] [--lightmaps FILE] [--bake-lightmaps FILE] [--shadows] [--no-reflections] [--record FILE] [--replay FILE] [--serve PATH]" << std::endl;
+            return false;
+        }
     }
+    if (!startInputLog())
+        return false;
+    if (replayingInput())
+        benchFrames = replayFrameCount - 1;    // Time the whole replay; the first frame only starts the clock
+    return true;
+}
 
-    glLightfv(GL_LIGHT2, GL_POSITION, light_position); // Set lamp light position
-    
-    GLfloat spot_direction[] = {0.3, -1, -0.8}; // Set spotlight direction
-    glLightfv(GL_LIGHT2, GL_SPOT_DIRECTION, spot_direction);
-    glLightf(GL_LIGHT2, GL_SPOT_CUTOFF, 35.0); // Set spotlight cutoff angle
-    glPopMatrix(); // Restore previous matrix
+// Function to time one frame of the benchmark; prints the statistics after the last one
+void benchmarkFrame()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    if (benchLastFrame != std::chrono::steady_clock::time_point())
+    {
+        benchFrameMs.push_back(std::chrono::duration<double, std::milli>(now - benchLastFrame).count());
+        benchVisibleRooms += visibleRooms.size();
+    }
+    else
+    {
+        // Reserve the samples first so the timed frames allocate nothing of the benchmark's own
+        benchFrameMs.reserve(benchFrames);
+        benchHeapStart = heapAllocations;
+        timeAntiAliasing = true;
+    }
+    benchLastFrame = now;
+    if ((int)benchFrameMs.size() < benchFrames)
+        return;
+
+    size_t allocations = heapAllocations - benchHeapStart;
+    std::vector<double> sorted(benchFrameMs);
+    std::sort(sorted.begin(), sorted.end());
+    double total = 0;
+    for (size_t i = 0; i < sorted.size(); i++)
+        total += sorted[i];
+    printSceneStats();
+    printf("Benchmark: %d frames, mean %.3f ms, median %.3f ms, p95 %.3f ms, min %.3f ms, max %.3f ms\n",
+           (int)sorted.size(), total / sorted.size(), sorted[sorted.size() / 2],
+           sorted[std::min(sorted.size() - 1, sorted.size() * 95 / 100)], sorted.front(), sorted.back());
+    printf("Visible rooms: %.1f per frame (portal culling %s)\n", (double)benchVisibleRooms / sorted.size(),
+           usePortals ? "on" : "off");
+    printf("Heap allocations: %d during timed frames; frame arena peak %.1f KB of %.1f KB\n", (int)allocations,
+           std::max(frameArenas[0].peak, frameArenas[1].peak) / 1024.0,
+           std::max(frameArenas[0].capacity, frameArenas[1].capacity) / 1024.0);
+    printf("Anti-aliasing: %s, %d samples per pixel", aaModeNames[aaMode], aaModeSamples[aaMode] ? (int)windowSamples : 1);
+    if (aaPassFrames > 0)
+        printf(", post pass %.3f ms per frame\n", aaPassMs / aaPassFrames);
+    else
+        printf(" (its cost is in the frame times; compare with --aa off)\n");
+    if (useShadows)
+        printf("Shadow maps: %lld static passes, %lld refreshed for moving objects, %.2f per frame\n",
+               staticShadowRenders, shadowCopies, (double)shadowCopies / sorted.size());
+    if (useReflections)
+        printf("Reflections: redrawn %lld times in %lld frames with a mirror on screen\n", reflectionRedraws,
+               reflectionFrames);
+    if (dynamicResolution && scaleFrames > 0)
+        printf("Dynamic resolution: budget %.1f ms, render time %.2f ms, scale %.2f on average, %.2f at the end\n",
+               frameBudgetMs, averageRenderMs, scaleSum / scaleFrames, resolutionScale);
+    printReplayStats();
+    printGpuResources();
+    exit(0);
 }
 
+// Frame task graph *********************************************************
+//
+// Everything a frame computes before it touches the GL runs as jobs:
+//
+//     animation -> transforms --+--> record group 0..N --> sort
+//     visibility ---------------+
+//
+// Visibility only needs the camera, so it overlaps the animation; recording
+// needs both. The GLUT thread runs jobs too while it waits for the graph.
 
+void animateScene(int);
+
+static void updateTransformsJob(int)
+{
+    TraceSpan span("updateTransforms");
+    updateTransforms();
+}
 
+static void visibilityJob(int)
+{
+    TraceSpan span("computeVisibleRooms");
+    computeVisibleRooms(frameProjection, frameView, vec3(eyeX, eyeY, eyeZ));
+}
 
-void display(void)
+// Function to run the frame's jobs; recording and sorting are skipped for the immediate-mode path
+void runFrameJobs(bool record)
+{
+    Job* animation = jobCreate(animateScene, 0);
+    Job* transforms = jobCreate(updateTransformsJob, 0);
+    Job* visibility = jobCreate(visibilityJob, 0);
+    jobDependsOn(transforms, animation);
+    Job* sort = NULL;
+    Job* groups[GROUP_COUNT];
+    if (record)
+    {
+        recordView = frameView;
+        sort = jobCreate(sortCommands, 0);
+        for (int g = 0; g < GROUP_COUNT; g++)
+        {
+            groups[g] = jobCreate(recordGroup, g);
+            jobDependsOn(groups[g], transforms);
+            jobDependsOn(groups[g], visibility);
+            jobDependsOn(sort, groups[g]);
+        }
+    }
+
+    jobSubmit(animation);
+    jobSubmit(transforms);
+    jobSubmit(visibility);
+    if (record)
+    {
+        for (int g = 0; g < GROUP_COUNT; g++)
+            jobSubmit(groups[g]);
+        jobSubmit(sort);
+    }
+    jobWaitAll();
+}
+
+// Function to draw the room from the camera into whatever target is bound, for its aspect ratio
+void drawScene(GLfloat aspect)
 {
     glClear(GL_COLOR_BUFFER_BIT|GL_DEPTH_BUFFER_BIT);
 
     glMatrixMode( GL_PROJECTION );
-    glLoadIdentity();
-    gluPerspective(60,1,1,100);
+    Mat4 projection = mat4Perspective(60,aspect,1,100);
+    glLoadMatrixf(projection.m);
 
     glMatrixMode( GL_MODELVIEW );
-    glLoadIdentity();
-    gluLookAt(eyeX,eyeY,eyeZ,  refX,refY,refZ,  0,1,0); //7,2,15, 0,0,0, 0,1,0
+    Mat4 view = mat4LookAt(eyeX,eyeY,eyeZ,  refX,refY,refZ,  0,1,0); //7,2,15, 0,0,0, 0,1,0
+    glLoadMatrixf(view.m);
+
+    // Animate, find the visible rooms and record their draw commands on the job system
+    frameProjection = projection;
+    frameView = view;
+    recordLightmaps = useLightmaps;
+    recordShadows = useShadows && useBakedGeometry;
+    recordReflections = useReflections && useBakedGeometry;
+    {
+        TraceSpan span("runFrameJobs");
+        runFrameJobs(useBakedGeometry);
+    }
     
+    relightLightmaps();
+    updateShadowMaps();
+
+    // One texture bind covers every textured surface in the room
+    glBindTexture(GL_TEXTURE_2D, atlasTexture);
+    updateReflection(projection, view, vec3(eyeX, eyeY, eyeZ), vec3(refX, refY, refZ));
+
     glEnable(GL_LIGHTING);
-    lightOne();
-    lightTwo();
-    lampLight();
-    room();
-    bed();
-    bedsideDrawer();
-    lamp();
-    LinkinParkPoster();
-    wallshelf();
-    wardrobe();
-    cupboard();
-    dressingTable();
-    Clock();
-    window();
-    sphericalObject();
-    lightBulb1();
-    lightBulb2();
-    //lightBulb3();
+    {
+        TraceSpan span("lights");
+        lightOne();
+        lightTwo();
+        lampLight();
+    }
+    if (useBakedGeometry)
+        drawBakedScene(view);
+    else
+        drawImmediateScene(view);
+    {
+        TraceSpan span("lightBulbs");
+        lightBulb1();
+        lightBulb2();
+        //lightBulb3();
+    }
     glDisable(GL_LIGHTING);
+    drawSelection(view);
+}
+
+void display(void)
+{
+    TraceSpan frameSpan("display");
+    replayInputFrame();
+    beginSceneTarget();
+    drawScene(1);   // The window has always been drawn square and stretched to its shape
+    logFrame();
     
-    glFlush();
-    glutSwapBuffers();
+    applyAntiAliasing();
+    endSceneTarget();
+    {
+        TraceSpan span("glutSwapBuffers");
+        glFlush();
+        glutSwapBuffers();
+    }
+    frameArenaNextFrame();
+    checkGpuGrowth();
+
+    if (benchFrames > 0)
+        benchmarkFrame();
 }
 
 void myKeyboardFunc( unsigned char key, int x, int y )
 {
+    TraceSpan span("myKeyboardFunc");
+    if (!logInput(INPUT_KEY, key, x, y))
+        return;
     switch ( key )
     {
         case 'w': // move eye point upwards along Y axis
@@ -1569,6 +7743,30 @@ void myKeyboardFunc( unsigned char key, int x, int y )
         case't':
             if(spec3 == false) {spec3=true; break;}
             else{spec3=false; break;}
+        case 'v': // switch between baked meshes and the immediate-mode reference path
+            useBakedGeometry = !useBakedGeometry;
+            break;
+        case 'p': // switch portal culling on/off
+            usePortals = !usePortals;
+            break;
+        case 'g': // print the live GPU objects and memory
+            printGpuResources();
+            break;
+        case 'x': // cycle the anti-aliasing modes
+            cycleAntiAliasing();
+            break;
+        case 'u': // switch dynamic resolution on/off
+            toggleDynamicResolution();
+            break;
+        case 'h': // switch the lightmaps on/off
+            useLightmaps = !useLightmaps;
+            break;
+        case 'z': // switch the shadows on/off
+            useShadows = !useShadows;
+            break;
+        case 'f': // switch the mirror reflections on/off
+            useReflections = !useReflections;
+            break;
         case 27:    // Escape key
             exit(1);
     }
@@ -1577,61 +7775,19 @@ void myKeyboardFunc( unsigned char key, int x, int y )
 }
 
 
+// Function to pose everything that moves for this frame (the animation job of the frame graph)
+void animateScene(int)
+{
+    TraceSpan span("animateScene");
+    evaluateAnimation();
+}
+
 void animate()
 {
-    if(redFlag == true)
-    {
-        theta+=2;
-        z-=0.02; //0.016667;
-        if(theta >= 196 && theta <= 210)
-        {
-            y = 1.44;
-        }
-        else if(theta >= 180 && theta <= 194)
-        {
-            y = 1.42;
-        }
-        else if(theta >= 180 && theta <= 194)
-        {
-            y = 1.4;
-        }
-        else if(theta >= 164 && theta <= 178)
-        {
-            y = 1.42;
-        }
-        
-        if(theta == 210)
-        {
-            redFlag = false;
-        }
-    }
-    else if(redFlag == false)
-    {
-        theta-=2;
-        z+=0.02;//0.016667;
-        
-        if(theta >= 196 && theta <= 210)
-        {
-            y = 1.44;
-        }
-        else if(theta >= 180 && theta <= 194)
-        {
-            y = 1.42;
-        }
-        else if(theta >= 180 && theta <= 194)
-        {
-            y = 1.4;
-        }
-        else if(theta >= 164 && theta <= 178)
-        {
-            y = 1.42;
-        }
-        
-        if(theta == 150)
-        {
-            redFlag = true;
-        }
-    }
+    TraceSpan span("animate");
+    // Pick up furniture edits saved since the last poll; a replay keeps to the scene it started with
+    if (!replayingInput())
+        pollSceneEdits();
     
     glutPostRedisplay();
 
@@ -1639,6 +7795,8 @@ void animate()
 
 void fullScreen(int w, int h)
 {
+    if (!logInput(INPUT_RESHAPE, 0, w, h))
+        return;
     //Prevent a divide by zero, when window is too short;you cant make a window of zero width.
     if (h == 0)
         h = 1;
@@ -1649,15 +7807,54 @@ void fullScreen(int w, int h)
     glLoadIdentity();                              //Reset Matrix
 
     glViewport(0, 0, w, h);                        //Set the viewport to be the entire window
+    windowPixelWidth = w;                          //Size the offscreen target for dynamic resolution
+    windowPixelHeight = h;
     gluPerspective(60, ratio, 1, 500);             //Set the correct perspective.
     //glFrustum(-2.5,2.5,-2.5,2.5, ratio, 200);
     glMatrixMode(GL_MODELVIEW);                    //Get Back to the Modelview
 }
 
 
+// Function to set up the GL state and build everything there is to draw; needs a current context
+void startRenderer()
+{
+    glShadeModel( GL_SMOOTH );
+    glEnable( GL_DEPTH_TEST );
+    glEnable(GL_NORMALIZE);
+
+    // Texture state needs a current context, so it is set up after the window exists
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
+    if (traceFile)
+        startTracing();
+    startJobThreads();
+    buildTextureAtlas();
+    buildShapeMeshes();
+    uploadShapeMeshes();
+    buildScene();
+    bakeStaticGeometry();
+    if (lightmapFile)
+        loadLightmaps();
+    buildPickingBVH();
+    atexit(shutdownGpuResources);
+    printSceneStats();
+}
+
 int main (int argc, char **argv)
 {
+    // The lightmap baker and the render server run on machines without a display, so they start before
+    // GLUT does
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--bake-lightmaps") == 0)
+            return parseArguments(argc, argv) && lightmapBakeFile ? bakeLightmapsOffline() : 1;
+        if (strcmp(argv[i], "--serve") == 0)
+            return parseArguments(argc, argv) && serverSocketPath ? runRenderServer() : 1;
+    }
+
     glutInit(&argc, argv);
+    if (!parseArguments(argc, argv))
+        return 1;
     
     std::cout<<"To move Eye point:"<< std::endl;
     std::cout<<"w: up"<<std::endl;
@@ -1696,30 +7893,44 @@ int main (int argc, char **argv)
     std::cout<<"r: to turn on/off diffusion lamp light      "<<std::endl;
     std::cout<<"t: to turn on/off specular lamp light      "<<std::endl;
     std::cout<<"      "<<std::endl;
+    std::cout<<"v: switch between baked meshes and immediate mode      "<<std::endl;
+    std::cout<<"p: switch portal culling between rooms on/off      "<<std::endl;
+    std::cout<<"g: print GPU objects and memory in use      "<<std::endl;
+    std::cout<<"x: cycle anti-aliasing (off, FXAA, the MSAA of --aa)      "<<std::endl;
+    std::cout<<"u: switch dynamic resolution on/off      "<<std::endl;
+    std::cout<<"h: switch the lightmaps of --lightmaps on/off      "<<std::endl;
+    std::cout<<"z: switch the shadows of the bulbs and the lamp on/off      "<<std::endl;
+    std::cout<<"f: switch the reflections in the dressing-table mirrors on/off      "<<std::endl;
+    std::cout<<"left click: pick the object under the cursor      "<<std::endl;
+    std::cout<<"      "<<std::endl;
+    std::cout<<"Options: --rooms NxM (building of rooms), --seed S, --bench FRAMES, --no-portals, --scene FILE (edits, reloaded on save),"<<std::endl;
+    std::cout<<"         --threads N (worker threads of the job system), --trace FILE (frame timeline for chrome://tracing, written at exit),"<<std::endl;
+    std::cout<<"         --aa off|msaa2|msaa4|fxaa (anti-aliasing, msaa4 by default),"<<std::endl;
+    std::cout<<"         --budget MS (lower the resolution to keep frames within MS milliseconds),"<<std::endl;
+    std::cout<<"         --lightmaps FILE (static lighting from FILE, baked and saved first if needed),"<<std::endl;
+    std::cout<<"         --bake-lightmaps FILE (bake the lightmaps without a window, write FILE and exit),"<<std::endl;
+    std::cout<<"         --shadows (shadow maps for the bulbs and the lamp, also 'z'),"<<std::endl;
+    std::cout<<"         --no-reflections (plain dressing-table mirrors, also 'f'),"<<std::endl;
+    std::cout<<"         --record FILE (log the keys and window sizes), --replay FILE (play a log back and time it),"<<std::endl;
+    std::cout<<"         --serve PATH (no window: render images for clients of the local socket PATH)"<<std::endl;
+    std::cout<<"      "<<std::endl;
     std::cout<<"____________________"<<std::endl;
     std::cout<<"      "<<std::endl;
     std::cout<<"      "<<std::endl;
 
-    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexEnvf(GL_TEXTURE_ENV, GL_TEXTURE_ENV_MODE, GL_MODULATE);
-    
-    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | GLUT_MULTISAMPLE);
+    glutInitDisplayMode(GLUT_DOUBLE | GLUT_RGB | GLUT_DEPTH | antiAliasingDisplayMode());
 
     glutInitWindowPosition(100,100);
     glutInitWindowSize(windowHeight, windowWidth);
     glutCreateWindow("1607063 Bedroom");
 
-    glShadeModel( GL_SMOOTH );
-    glEnable( GL_DEPTH_TEST );
-    glEnable(GL_NORMALIZE);
+    startRenderer();
+    setupAntiAliasing();
  
     glutReshapeFunc(fullScreen);
     glutDisplayFunc(display);
     glutKeyboardFunc(myKeyboardFunc);
+    glutMouseFunc(mousePick);
     glutIdleFunc(animate);
     glutMainLoop();
 
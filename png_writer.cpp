@@ -0,0 +1,123 @@
+/**
+ * @file png_writer.cpp
+ * @brief PNG encoding of rendered frames for the render server.
+ *
+ * Frames are written as 8-bit RGB with no row filter and compressed by zlib at
+ * its fastest level: the rooms are mostly flat colour, which deflate's matches
+ * take care of without the filters, and encoding has to keep up with drawing.
+ */
+
+#include "png_writer.h"
+#include <zlib.h> // Deflate and CRC-32 of the PNG chunks
+#include <string.h> // memcpy, memcmp
+
+static const unsigned char PNG_SIGNATURE[8] = { 137, 'P', 'N', 'G', 13, 10, 26, 10 };
+
+static void putBigEndian(std::vector<unsigned char>& out, unsigned long v)
+{
+    for (int s = 24; s >= 0; s -= 8)
+        out.push_back((unsigned char)(v >> s));
+}
+
+static unsigned long getBigEndian(const unsigned char* p)
+{
+    return (unsigned long)p[0] << 24 | (unsigned long)p[1] << 16 | (unsigned long)p[2] << 8 | p[3];
+}
+
+// Function to append a chunk: its length, its type and data, and the CRC-32 of those
+static void pngChunk(std::vector<unsigned char>& out, const char* type, const unsigned char* data, size_t size)
+{
+    putBigEndian(out, (unsigned long)size);
+    size_t start = out.size();
+    out.insert(out.end(), type, type + 4);
+    if (size)
+        out.insert(out.end(), data, data + size);
+    putBigEndian(out, crc32(0, &out[start], (uInt)(out.size() - start)));
+}
+
+void encodePng(const unsigned char* pixels, int width, int height, std::vector<unsigned char>& png)
+{
+    // Top row first, each behind its filter byte (0, none)
+    size_t stride = (size_t)width * 3;
+    std::vector<unsigned char> raw((stride + 1) * height);
+    for (int y = 0; y < height; y++)
+    {
+        raw[y * (stride + 1)] = 0;
+        memcpy(&raw[y * (stride + 1) + 1], &pixels[(height - 1 - y) * stride], stride);
+    }
+    uLongf size = compressBound((uLong)raw.size());
+    std::vector<unsigned char> data(size);
+    compress2(&data[0], &size, &raw[0], (uLong)raw.size(), Z_BEST_SPEED);
+
+    unsigned char header[13];
+    std::vector<unsigned char> dimensions;
+    putBigEndian(dimensions, width);
+    putBigEndian(dimensions, height);
+    memcpy(header, &dimensions[0], 8);
+    header[8] = 8;      // Bits per channel
+    header[9] = 2;      // RGB
+    header[10] = header[11] = header[12] = 0;    // Deflate, adaptive filters, no interlace
+
+    png.assign(PNG_SIGNATURE, PNG_SIGNATURE + 8);
+    pngChunk(png, "IHDR", header, sizeof(header));
+    pngChunk(png, "IDAT", &data[0], size);
+    pngChunk(png, "IEND", NULL, 0);
+}
+
+bool checkPngEncoder()
+{
+    // Flat runs of every length deflate matches, a gradient and a few texels of noise, on an odd width
+    const int width = 301, height = 37;
+    std::vector<unsigned char> pixels(width * height * 3);
+    unsigned noise = 12345;
+    for (int y = 0; y < height; y++)
+        for (int x = 0; x < width; x++)
+        {
+            unsigned char* p = &pixels[(y * width + x) * 3];
+            noise = noise * 1103515245 + 12345;
+            p[0] = (unsigned char)(x < y * 8 ? 200 : x);
+            p[1] = (unsigned char)(y * 7);
+            p[2] = (unsigned char)(x % 97 == 0 ? noise >> 16 : 64);
+        }
+    std::vector<unsigned char> png;
+    encodePng(&pixels[0], width, height, png);
+
+    if (png.size() < 8 || memcmp(&png[0], PNG_SIGNATURE, 8) != 0)
+        return false;
+    std::vector<unsigned char> data;
+    int decodedWidth = 0, decodedHeight = 0;
+    bool ended = false;
+    for (size_t p = 8; p + 12 <= png.size() && !ended; )
+    {
+        unsigned long length = getBigEndian(&png[p]);
+        if (p + 12 + length > png.size()
+            || crc32(0, &png[p + 4], (uInt)(length + 4)) != getBigEndian(&png[p + 8 + length]))
+            return false;
+        const unsigned char* chunk = &png[p + 8];
+        if (memcmp(&png[p + 4], "IHDR", 4) == 0)
+        {
+            decodedWidth = (int)getBigEndian(chunk);
+            decodedHeight = (int)getBigEndian(chunk + 4);
+            if (chunk[8] != 8 || chunk[9] != 2)
+                return false;
+        }
+        else if (memcmp(&png[p + 4], "IDAT", 4) == 0)
+            data.insert(data.end(), chunk, chunk + length);
+        else if (memcmp(&png[p + 4], "IEND", 4) == 0)
+            ended = true;
+        p += 12 + length;
+    }
+    if (!ended || decodedWidth != width || decodedHeight != height || data.empty())
+        return false;
+
+    size_t stride = (size_t)width * 3;
+    uLongf size = (uLongf)((stride + 1) * height);
+    std::vector<unsigned char> raw(size);
+    if (uncompress(&raw[0], &size, &data[0], (uLong)data.size()) != Z_OK || size != raw.size())
+        return false;
+    for (int y = 0; y < height; y++)
+        if (raw[y * (stride + 1)] != 0
+            || memcmp(&raw[y * (stride + 1) + 1], &pixels[(height - 1 - y) * stride], stride) != 0)
+            return false;
+    return true;
+}
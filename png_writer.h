@@ -0,0 +1,17 @@
+/**
+ * @file png_writer.h
+ * @brief PNG encoding of rendered frames for the render server.
+ */
+
+#ifndef PNG_WRITER_H
+#define PNG_WRITER_H
+
+#include <vector>
+
+// Function to encode 8-bit RGB rows stored bottom-up, as glReadPixels returns them, as a PNG
+void encodePng(const unsigned char* pixels, int width, int height, std::vector<unsigned char>& png);
+
+// Function to check the encoder by decoding an image it wrote; false if a chunk or a pixel does not come back
+bool checkPngEncoder();
+
+#endif
@@ -0,0 +1,380 @@
+/**
+ * @file render_server.cpp
+ * @brief Local socket server that answers render requests with PNG images.
+ *
+ * A client connects to the Unix socket and sends lines of the form
+ *
+ *     render EYE_X EYE_Y EYE_Z REF_X REF_Y REF_Z SWITCHES TIME WIDTH HEIGHT
+ *
+ * where SWITCHES is a hex mask of the light switches (bit 0 light one, 1 light
+ * two, 2 the lamp, then the ambient, diffuse and specular terms of light one,
+ * light two and the lamp in bits 3 to 11) and TIME is the animation time in
+ * seconds. Each gets back "image BYTES" and a PNG of that many bytes, or
+ * "error MESSAGE", in the order they were sent.
+ *
+ * The requests that have arrived are taken up together, up to SERVER_BATCH at
+ * a time, round robin over the clients. Those asking for an image drawn before
+ * come out of an LRU cache keyed by the whole render state, and repeats within
+ * a batch are drawn once. The rest are sorted so that requests sharing a size,
+ * switches and time are drawn back to back, which lets the program keep its
+ * target, its relit lightmaps and its posed animation between them. The images
+ * are drawn one after another, as a GL context belongs to one thread, and then
+ * encoded in parallel.
+ */
+
+#include "render_server.h"
+#include "png_writer.h"
+#include <sys/socket.h> // Local socket
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+
+static const int SERVER_BATCH = 16;          // Most requests taken up at a time
+static const int SERVER_MAX_SIZE = 2048;     // Largest image side served
+static const int SERVER_LINE_BYTES = 256;    // Longest request line
+static const int RENDER_CACHE_SIZE = 64;     // Images kept for repeated requests
+static const double SERVER_REPORT_SECONDS = 5;
+
+// A request taken up in the current batch
+struct PendingRequest
+{
+    RenderRequest request;
+    int client;                 // Index into serverClients
+    unsigned long long key;
+    const char* error;          // Why the request was refused, NULL for none
+    int render;                 // Index into serverRenders, -1 when served from the cache
+};
+
+struct ServerRender
+{
+    int width, height;
+    bool drawn;
+    std::vector<unsigned char> pixels, png;
+};
+
+struct RenderCacheEntry
+{
+    unsigned long long key;
+    std::vector<unsigned char> png;
+    unsigned lastUse;           // 0 for an empty entry
+};
+
+struct ServerClient
+{
+    int fd;
+    std::string input, output;
+    bool closing;               // The client hung up; dropped once its output is written
+};
+
+static RenderHooks serverHooks;
+static const char* serverPath = NULL;
+static int serverSocket = -1;
+static std::vector<ServerClient> serverClients;
+static std::vector<ServerRender> serverRenders;
+static RenderCacheEntry renderCache[RENDER_CACHE_SIZE];
+static unsigned renderCacheClock = 0;
+static volatile sig_atomic_t serverStopSignal = 0;
+
+// Counts since the last report
+static long long serverRequests = 0, serverCacheHits = 0, serverBatches = 0, serverRenderCount = 0;
+static double serverRenderMs = 0, serverEncodeMs = 0;
+static std::chrono::steady_clock::time_point serverReportTime;
+
+static void stopSignal(int)
+{
+    serverStopSignal = 1;
+}
+
+// Function to find a cached image; NULL if there is none
+static const std::vector<unsigned char>* cachedRender(unsigned long long key)
+{
+    for (int i = 0; i < RENDER_CACHE_SIZE; i++)
+        if (renderCache[i].lastUse && renderCache[i].key == key)
+        {
+            renderCache[i].lastUse = ++renderCacheClock;
+            return &renderCache[i].png;
+        }
+    return NULL;
+}
+
+// Function to keep an image in place of the least recently used one
+static void cacheRender(unsigned long long key, const std::vector<unsigned char>& png)
+{
+    int slot = 0;
+    for (int i = 1; i < RENDER_CACHE_SIZE; i++)
+        if (renderCache[i].lastUse < renderCache[slot].lastUse)
+            slot = i;
+    renderCache[slot].key = key;
+    renderCache[slot].png = png;
+    renderCache[slot].lastUse = ++renderCacheClock;
+}
+
+// Function to read a request line; sets error when it is malformed
+static PendingRequest parseRequest(const std::string& line, int client)
+{
+    PendingRequest p;
+    memset(&p, 0, sizeof(p));
+    p.client = client;
+    p.render = -1;
+    RenderRequest& r = p.request;
+    char verb[16];
+    if (sscanf(line.c_str(), "%15s %lf %lf %lf %lf %lf %lf %x %f %d %d", verb, &r.eye[0], &r.eye[1], &r.eye[2],
+               &r.ref[0], &r.ref[1], &r.ref[2], &r.switches, &r.time, &r.width, &r.height) != 11
+        || strcmp(verb, "render") != 0)
+        p.error = "expected: render EYE_X EYE_Y EYE_Z REF_X REF_Y REF_Z SWITCHES TIME WIDTH HEIGHT";
+    else if (r.width < 1 || r.height < 1 || r.width > SERVER_MAX_SIZE || r.height > SERVER_MAX_SIZE)
+        p.error = "size out of range";
+    else if (!(r.time >= 0))
+        p.error = "time out of range";
+    else
+        p.key = serverHooks.key(r);
+    return p;
+}
+
+// Function to encode one drawn image of the batch (run in parallel)
+static void encodeRender(int index)
+{
+    ServerRender& r = serverRenders[index];
+    if (r.drawn)
+        encodePng(&r.pixels[0], r.width, r.height, r.png);
+    std::vector<unsigned char>().swap(r.pixels);
+}
+
+// Function to serve a batch of requests: from the cache where possible, else drawn in state order and
+// encoded in parallel; appends every reply to its client's output in the order the requests came
+static void serveBatch(std::vector<PendingRequest>& requests)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    serverRenders.clear();
+    std::vector<int> order;
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        PendingRequest& p = requests[i];
+        if (p.error || cachedRender(p.key))
+            continue;
+        // A request repeated within the batch shares the first one's image
+        for (size_t j = 0; j < i && p.render < 0; j++)
+            if (!requests[j].error && requests[j].key == p.key)
+                p.render = requests[j].render;
+        if (p.render >= 0)
+            continue;
+        p.render = (int)serverRenders.size();
+        serverRenders.push_back(ServerRender());
+        order.push_back((int)i);
+    }
+    std::stable_sort(order.begin(), order.end(), [&requests](int a, int b)
+    {
+        const RenderRequest& x = requests[a].request;
+        const RenderRequest& y = requests[b].request;
+        if (x.width != y.width || x.height != y.height)
+            return x.width != y.width ? x.width < y.width : x.height < y.height;
+        return x.switches != y.switches ? x.switches < y.switches : x.time < y.time;
+    });
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        const RenderRequest& r = requests[order[i]].request;
+        const RenderRequest* previous = i > 0 ? &requests[order[i - 1]].request : NULL;
+        if (!previous || previous->width != r.width || previous->height != r.height
+            || previous->switches != r.switches || previous->time != r.time)
+            serverBatches++;
+        ServerRender& out = serverRenders[requests[order[i]].render];
+        out.width = r.width;
+        out.height = r.height;
+        out.drawn = serverHooks.render(r, out.pixels);
+    }
+    std::chrono::steady_clock::time_point drawn = std::chrono::steady_clock::now();
+    if (!serverRenders.empty())
+        serverHooks.parallel(encodeRender, (int)serverRenders.size());
+    serverRenderCount += order.size();
+    serverRenderMs += std::chrono::duration<double, std::milli>(drawn - start).count();
+    serverEncodeMs += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - drawn).count();
+
+    for (size_t i = 0; i < requests.size(); i++)
+    {
+        PendingRequest& p = requests[i];
+        ServerClient& client = serverClients[p.client];
+        if (!p.error && p.render >= 0 && !serverRenders[p.render].drawn)
+            p.error = "cannot draw an image of that size";
+        if (p.error)
+        {
+            client.output += std::string("error ") + p.error + "\n";
+            continue;
+        }
+        const std::vector<unsigned char>* png = p.render >= 0 ? &serverRenders[p.render].png : cachedRender(p.key);
+        if (p.render < 0)
+            serverCacheHits++;
+        char header[32];
+        snprintf(header, sizeof(header), "image %d\n", (int)png->size());
+        client.output += header;
+        client.output.append((const char*)&(*png)[0], png->size());
+        if (p.render >= 0 && cachedRender(p.key) == NULL)
+            cacheRender(p.key, *png);
+    }
+    serverRequests += requests.size();
+}
+
+bool startRenderServer(const char* path, const RenderHooks& hooks)
+{
+    if (!checkPngEncoder())
+    {
+        std::cerr << "Render server: the PNG encoder does not decode back" << std::endl;
+        return false;
+    }
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        std::cerr << "Render server: socket path too long: " << path << std::endl;
+        return false;
+    }
+    strcpy(address.sun_path, path);
+    unlink(path);
+    serverSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (serverSocket < 0 || bind(serverSocket, (sockaddr*)&address, sizeof(address)) != 0
+        || listen(serverSocket, 64) != 0)
+    {
+        std::cerr << "Render server: cannot listen on " << path << ": " << strerror(errno) << std::endl;
+        if (serverSocket >= 0)
+            close(serverSocket);
+        serverSocket = -1;
+        return false;
+    }
+    fcntl(serverSocket, F_SETFL, O_NONBLOCK);
+    signal(SIGPIPE, SIG_IGN);   // A client that hangs up mid-reply is dropped, not fatal
+    signal(SIGINT, stopSignal);
+    signal(SIGTERM, stopSignal);
+    serverHooks = hooks;
+    serverPath = path;
+    serverReportTime = std::chrono::steady_clock::now();
+    std::cout << "Render server: listening on " << path << std::endl;
+    return true;
+}
+
+void stopRenderServer()
+{
+    for (size_t i = 0; i < serverClients.size(); i++)
+        close(serverClients[i].fd);
+    serverClients.clear();
+    if (serverSocket >= 0)
+    {
+        close(serverSocket);
+        unlink(serverPath);
+        serverSocket = -1;
+    }
+}
+
+// Function to print what the server has done since the last report, every few seconds
+static void reportServer()
+{
+    std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(now - serverReportTime).count();
+    if (seconds < SERVER_REPORT_SECONDS || serverRequests == 0)
+        return;
+    printf("Render server: %.1f requests/s, %lld from the cache, %lld drawn in %lld batches, %.2f ms to draw "
+           "and %.2f ms to encode each\n", serverRequests / seconds, serverCacheHits, serverRenderCount,
+           serverBatches, serverRenderCount ? serverRenderMs / serverRenderCount : 0.0,
+           serverRenderCount ? serverEncodeMs / serverRenderCount : 0.0);
+    fflush(stdout);
+    serverRequests = serverCacheHits = serverRenderCount = serverBatches = 0;
+    serverRenderMs = serverEncodeMs = 0;
+    serverReportTime = now;
+}
+
+bool serveRenderRequests(int waitMs)
+{
+    if (serverStopSignal)
+        return false;
+    std::vector<pollfd> fds(serverClients.size() + 1);
+    fds[0].fd = serverSocket;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < serverClients.size(); i++)
+    {
+        fds[i + 1].fd = serverClients[i].fd;
+        fds[i + 1].events = POLLIN | (serverClients[i].output.empty() ? 0 : POLLOUT);
+    }
+    bool pending = false;
+    for (size_t i = 0; i < serverClients.size() && !pending; i++)
+        pending = serverClients[i].input.find('\n') != std::string::npos;
+    poll(&fds[0], fds.size(), pending ? 0 : waitMs);
+
+    for (int fd; (fd = accept(serverSocket, NULL, NULL)) >= 0;)
+    {
+        fcntl(fd, F_SETFL, O_NONBLOCK);
+        ServerClient client = { fd, std::string(), std::string(), false };
+        serverClients.push_back(client);
+    }
+    char buffer[4096];
+    for (size_t i = 0; i < serverClients.size(); i++)
+    {
+        ServerClient& client = serverClients[i];
+        ssize_t n;
+        while ((n = read(client.fd, buffer, sizeof(buffer))) > 0)
+            client.input.append(buffer, n);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+            client.closing = true;
+    }
+
+    // Take up to SERVER_BATCH complete lines, round robin over the clients
+    std::vector<PendingRequest> requests;
+    for (bool more = true; more && (int)requests.size() < SERVER_BATCH;)
+    {
+        more = false;
+        for (size_t i = 0; i < serverClients.size() && (int)requests.size() < SERVER_BATCH; i++)
+        {
+            ServerClient& client = serverClients[i];
+            size_t end = client.input.find('\n');
+            if (end == std::string::npos)
+            {
+                if (client.input.size() > (size_t)SERVER_LINE_BYTES)
+                {
+                    client.output += "error request line too long\n";
+                    client.input.clear();
+                    client.closing = true;
+                }
+                continue;
+            }
+            requests.push_back(parseRequest(client.input.substr(0, end), (int)i));
+            client.input.erase(0, end + 1);
+            more = true;
+        }
+    }
+    if (!requests.empty())
+        serveBatch(requests);
+
+    for (size_t i = serverClients.size(); i-- > 0;)
+    {
+        ServerClient& client = serverClients[i];
+        while (!client.output.empty())
+        {
+            ssize_t n = write(client.fd, client.output.data(), client.output.size());
+            if (n <= 0)
+            {
+                if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+                {
+                    client.closing = true;
+                    client.output.clear();
+                }
+                break;
+            }
+            client.output.erase(0, n);
+        }
+        if (client.closing && client.output.empty() && client.input.find('\n') == std::string::npos)
+        {
+            close(client.fd);
+            serverClients.erase(serverClients.begin() + i);
+        }
+    }
+    reportServer();
+    return true;
+}
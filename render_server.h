@@ -0,0 +1,44 @@
+/**
+ * @file render_server.h
+ * @brief Local socket server that answers render requests with PNG images.
+ *
+ * The server knows nothing of the scene: the program that links it draws the
+ * images through the hooks it is started with.
+ */
+
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include <vector>
+
+// One image asked of the server
+struct RenderRequest
+{
+    double eye[3], ref[3];      // Camera eye and reference point
+    unsigned switches;          // Light switches, as a bit mask
+    float time;                 // Animation time in seconds
+    int width, height;
+};
+
+// What the program does for the server; every hook runs on the thread that calls serveRenderRequests
+struct RenderHooks
+{
+    // Hash of everything the image depends on, the program's own options included
+    unsigned long long (*key)(const RenderRequest& request);
+    // Draw the image and read it back as bottom-up RGB rows; false if it cannot be drawn
+    bool (*render)(const RenderRequest& request, std::vector<unsigned char>& pixels);
+    // Run run(0) to run(count - 1), in parallel where the program can, and return once all are done
+    void (*parallel)(void (*run)(int index), int count);
+};
+
+// Function to listen on a Unix socket at path; false if it cannot
+bool startRenderServer(const char* path, const RenderHooks& hooks);
+
+// Function to accept clients, serve a batch of their requests and write the replies, waiting up to
+// waitMs for the sockets when there is nothing to do; false once SIGINT or SIGTERM asked the server to stop
+bool serveRenderRequests(int waitMs);
+
+// Function to close the socket and every client
+void stopRenderServer();
+
+#endif